@@ -33,6 +33,10 @@
 #include <errno.h>
 #include <stdarg.h>
 
+#if HAVE_X86_SIMD
+  #include <immintrin.h>
+#endif
+
 #ifndef WIN32
   /* for inet_aton() IP validation
   */
@@ -738,25 +742,106 @@ append_msg_to_buf(char *buf, size_t buf_size, const char* msg, ...)
     return bytes_written;
 }
 
-/* Determine if a buffer contains only characters from the base64
- * encoding set
+#define IS_B64_CHAR(c) (((c) >= 'A' && (c) <= 'Z') || ((c) >= 'a' && (c) <= 'z') \
+        || ((c) >= '0' && (c) <= '9') || (c) == '+' || (c) == '/' || (c) == '=')
+
+#if HAVE_X86_SIMD
+
+/* Lanes of x that are in [lo, hi] (the base64 alphabet is all below 0x80,
+ * so signed compares are fine)
 */
-int
-is_base64(const unsigned char * const buf, const unsigned short int len)
+#define B64_RANGE128(x, lo, hi) \
+    _mm_and_si128(_mm_cmpgt_epi8((x), _mm_set1_epi8((lo)-1)), \
+        _mm_cmpgt_epi8(_mm_set1_epi8((hi)+1), (x)))
+#define B64_RANGE256(x, lo, hi) \
+    _mm256_and_si256(_mm256_cmpgt_epi8((x), _mm256_set1_epi8((lo)-1)), \
+        _mm256_cmpgt_epi8(_mm256_set1_epi8((hi)+1), (x)))
+
+/* Return the number of leading bytes (in whole 16-byte chunks) that are
+ * known to be base64
+*/
+static __attribute__((target("sse2"))) int
+b64_valid_prefix_sse2(const unsigned char * const buf, const int len)
 {
-    unsigned short int  i;
-    int                 rv = 1;
+    __m128i     x, ok;
+    int         i;
 
-    for(i=0; i<len; i++)
+    for(i=0; i+16 <= len; i+=16)
     {
-        if(!(isalnum(buf[i]) || buf[i] == '/' || buf[i] == '+' || buf[i] == '='))
-        {
-            rv = 0;
+        x  = _mm_loadu_si128((const __m128i *)(buf+i));
+        ok = _mm_or_si128(
+            _mm_or_si128(B64_RANGE128(x, 'A', 'Z'),
+                B64_RANGE128(x, 'a', 'z')),
+            _mm_or_si128(B64_RANGE128(x, '0', '9'),
+                _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('+')),
+                    _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('/')),
+                        _mm_cmpeq_epi8(x, _mm_set1_epi8('='))))));
+        if(_mm_movemask_epi8(ok) != 0xffff)
             break;
-        }
     }
+    return i;
+}
+
+static __attribute__((target("avx2"))) int
+b64_valid_prefix_avx2(const unsigned char * const buf, const int len)
+{
+    __m256i     x, ok;
+    int         i;
+
+    for(i=0; i+32 <= len; i+=32)
+    {
+        x  = _mm256_loadu_si256((const __m256i *)(buf+i));
+        ok = _mm256_or_si256(
+            _mm256_or_si256(B64_RANGE256(x, 'A', 'Z'), B64_RANGE256(x, 'a', 'z')),
+            _mm256_or_si256(B64_RANGE256(x, '0', '9'),
+                _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('+')),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('/')),
+                        _mm256_cmpeq_epi8(x, _mm256_set1_epi8('='))))));
+        if(_mm256_movemask_epi8(ok) != -1)
+            break;
+    }
+    return i + b64_valid_prefix_sse2(buf+i, len-i);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+/* Check the length of a buffer against [min_len, max_len] and make sure
+ * that it only contains characters from the base64 encoding set (in one
+ * pass over the data, with SSE2/AVX2 where the CPU has it).
+*/
+int
+check_base64(const unsigned char * const buf, const int len,
+        const int min_len, const int max_len)
+{
+    int     i = 0;
+
+    if(len < min_len || len > max_len)
+        return B64_CHECK_BAD_LEN;
+
+#if HAVE_X86_SIMD
+    if(len >= 16)
+    {
+        if(__builtin_cpu_supports("avx2"))
+            i = b64_valid_prefix_avx2(buf, len);
+        else if(__builtin_cpu_supports("sse2"))
+            i = b64_valid_prefix_sse2(buf, len);
+    }
+#endif
 
-    return rv;
+    for(; i<len; i++)
+        if(! IS_B64_CHAR(buf[i]))
+            return B64_CHECK_BAD_CHAR;
+
+    return B64_CHECK_OK;
+}
+
+/* Determine if a buffer contains only characters from the base64
+ * encoding set
+*/
+int
+is_base64(const unsigned char * const buf, const unsigned short int len)
+{
+    return check_base64(buf, len, 0, len) == B64_CHECK_OK;
 }
 
 /**
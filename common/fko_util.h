@@ -33,6 +33,12 @@
 
 #include "fko.h"
 
+/* check_base64() return values
+*/
+#define B64_CHECK_OK        0
+#define B64_CHECK_BAD_LEN   1
+#define B64_CHECK_BAD_CHAR  2
+
 /* Function prototypes
 */
 int     is_valid_encoded_sdp_id_len(const int len);
@@ -40,6 +46,8 @@ int     is_valid_encoded_msg_len(const int len);
 int     is_valid_pt_msg_len(const int len);
 int     is_valid_ipv4_addr(const char * const ip_str);
 int     is_base64(const unsigned char * const buf, const unsigned short int len);
+int     check_base64(const unsigned char * const buf, const int len,
+            const int min_len, const int max_len);
 int     enc_mode_strtoint(const char *enc_mode_str);
 short   enc_mode_inttostr(int enc_mode, char* enc_mode_str, size_t enc_mode_size);
 int     strtol_wrapper(const char * const str, const int min,
@@ -36,6 +36,16 @@
 #include "base64.h"
 #include "fko_common.h"
 
+#if HAVE_X86_SIMD && ! AFL_FUZZING
+  #include <immintrin.h>
+#endif
+
+#ifdef HAVE_C_UNIT_TESTS
+  #include "cunit_common.h"
+  #include "fko_util.h"
+DECLARE_TEST_SUITE(base64, "base64 test suite");
+#endif
+
 #if !AFL_FUZZING
 static unsigned char map2[] =
 {
@@ -52,10 +62,155 @@ static unsigned char map2[] =
 };
 #endif
 
+#if HAVE_X86_SIMD && ! AFL_FUZZING
+
+/* Lanes of x that are in [lo, hi] (the base64 alphabet is all below 0x80,
+ * so signed compares are fine)
+*/
+#define B64_RANGE128(x, lo, hi) \
+    _mm_and_si128(_mm_cmpgt_epi8((x), _mm_set1_epi8((lo)-1)), \
+        _mm_cmpgt_epi8(_mm_set1_epi8((hi)+1), (x)))
+#define B64_RANGE256(x, lo, hi) \
+    _mm256_and_si256(_mm256_cmpgt_epi8((x), _mm256_set1_epi8((lo)-1)), \
+        _mm256_cmpgt_epi8(_mm256_set1_epi8((hi)+1), (x)))
+
+/* Translate base64 characters to their 6-bit values.  The result has the
+ * value added to each valid character, and *valid gets 0xff in the lanes
+ * that hold one of A-Z, a-z, 0-9, '+' or '/'.
+*/
+static inline __attribute__((target("ssse3"))) __m128i
+b64_translate16(const __m128i src, __m128i *valid)
+{
+    const __m128i upper = B64_RANGE128(src, 'A', 'Z');
+    const __m128i lower = B64_RANGE128(src, 'a', 'z');
+    const __m128i digit = B64_RANGE128(src, '0', '9');
+    const __m128i plus  = _mm_cmpeq_epi8(src, _mm_set1_epi8('+'));
+    const __m128i slash = _mm_cmpeq_epi8(src, _mm_set1_epi8('/'));
+    __m128i shift;
+
+    shift = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-65)),
+            _mm_and_si128(lower, _mm_set1_epi8(-71))),
+        _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(4)),
+            _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(19)),
+                _mm_and_si128(slash, _mm_set1_epi8(16)))));
+
+    *valid = _mm_or_si128(_mm_or_si128(upper, lower),
+        _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+
+    return _mm_add_epi8(src, shift);
+}
+
+/* Pack each group of four 6-bit values into three bytes.  The bytes end
+ * up in the low 12 bytes of each 16-byte lane.
+*/
+static inline __attribute__((target("ssse3"))) __m128i
+b64_pack16(const __m128i v)
+{
+    __m128i merged;
+
+    merged = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+    merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(merged,
+        _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+/* Decode 16 characters at a time.  Returns the number of characters
+ * decoded; decoding stops before the first chunk that holds anything
+ * outside of the alphabet (including the '=' padding), and the scalar
+ * loop in b64_decode() takes it from there.
+*/
+static __attribute__((target("ssse3"))) int
+b64_decode_ssse3(const char *in, const int len, unsigned char *out)
+{
+    __m128i         v, valid;
+    unsigned char   tmp[16];
+    int             i;
+
+    for(i=0; i+16 <= len; i+=16)
+    {
+        v = b64_translate16(_mm_loadu_si128((const __m128i *)(in+i)), &valid);
+        if(_mm_movemask_epi8(valid) != 0xffff)
+            break;
+        _mm_storeu_si128((__m128i *)tmp, b64_pack16(v));
+        memcpy(out, tmp, 12);
+        out += 12;
+    }
+    return i;
+}
+
+static __attribute__((target("avx2"))) int
+b64_decode_avx2(const char *in, const int len, unsigned char *out)
+{
+    const __m256i   shuf = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    __m256i         src, shift, valid, upper, lower, digit, plus, slash;
+    unsigned char   tmp[32];
+    int             i;
+
+    for(i=0; i+32 <= len; i+=32)
+    {
+        src   = _mm256_loadu_si256((const __m256i *)(in+i));
+        upper = B64_RANGE256(src, 'A', 'Z');
+        lower = B64_RANGE256(src, 'a', 'z');
+        digit = B64_RANGE256(src, '0', '9');
+        plus  = _mm256_cmpeq_epi8(src, _mm256_set1_epi8('+'));
+        slash = _mm256_cmpeq_epi8(src, _mm256_set1_epi8('/'));
+
+        valid = _mm256_or_si256(_mm256_or_si256(upper, lower),
+            _mm256_or_si256(digit, _mm256_or_si256(plus, slash)));
+        if(_mm256_movemask_epi8(valid) != -1)
+            break;
+
+        shift = _mm256_or_si256(
+            _mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8(-65)),
+                _mm256_and_si256(lower, _mm256_set1_epi8(-71))),
+            _mm256_or_si256(_mm256_and_si256(digit, _mm256_set1_epi8(4)),
+                _mm256_or_si256(_mm256_and_si256(plus, _mm256_set1_epi8(19)),
+                    _mm256_and_si256(slash, _mm256_set1_epi8(16)))));
+
+        src = _mm256_add_epi8(src, shift);
+        src = _mm256_maddubs_epi16(src, _mm256_set1_epi32(0x01400140));
+        src = _mm256_madd_epi16(src, _mm256_set1_epi32(0x00011000));
+        src = _mm256_shuffle_epi8(src, shuf);
+
+        /* Close the gap between the 12 bytes of each lane
+        */
+        src = _mm256_permutevar8x32_epi32(src, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256((__m256i *)tmp, src);
+        memcpy(out, tmp, 24);
+        out += 24;
+    }
+
+    /* The 16-byte loop picks up a last half chunk
+    */
+    i += b64_decode_ssse3(in+i, len-i, out);
+
+    return i;
+}
+
+static int
+b64_decode_simd(const char *in, unsigned char *out)
+{
+    int len = strlen(in);
+
+    if(len < 16)
+        return 0;
+
+    if(__builtin_cpu_supports("avx2"))
+        return b64_decode_avx2(in, len, out);
+    if(__builtin_cpu_supports("ssse3"))
+        return b64_decode_ssse3(in, len, out);
+    return 0;
+}
+
+#endif /* HAVE_X86_SIMD && ! AFL_FUZZING */
+
 int
 b64_decode(const char *in, unsigned char *out)
 {
-    int i;
+    int i = 0;
     unsigned char *dst = out;
 #if ! AFL_FUZZING
     int v;
@@ -68,8 +223,15 @@ b64_decode(const char *in, unsigned char *out)
     for (i = 0; in[i]; i++)
         *dst++ = in[i];
 #else
+#if HAVE_X86_SIMD
+    /* Whole chunks of plain base64 are decoded with SSSE3/AVX2 first,
+     * which always ends on a four character boundary.
+    */
+    i = b64_decode_simd(in, out);
+    dst += i / 4 * 3;
+#endif
     v = 0;
-    for (i = 0; in[i] && in[i] != '='; i++) {
+    for (; in[i] && in[i] != '='; i++) {
         unsigned int index= in[i]-43;
 
         if (index>=(sizeof(map2)/sizeof(map2[0])) || map2[index] == 0xff)
@@ -136,4 +298,109 @@ strip_b64_eq(char *data)
         *ndx = '\0';
 }
 
+#ifdef HAVE_C_UNIT_TESTS
+
+/* The original scalar decoder
+*/
+static int
+b64_decode_ref(const char *in, unsigned char *out)
+{
+    int i, v = 0;
+    unsigned char *dst = out;
+
+    for (i = 0; in[i] && in[i] != '='; i++) {
+        unsigned int index= in[i]-43;
+
+        if (index>=(sizeof(map2)/sizeof(map2[0])) || map2[index] == 0xff)
+            return(-1);
+
+        v = (v << 6) + map2[index];
+
+        if (i & 3)
+            *dst++ = v >> (6 - 2 * (i & 3));
+    }
+    *dst = '\0';
+
+    return(dst - out);
+}
+
+#define UT_B64_MAX  200
+
+static const char ut_b64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Every length up to UT_B64_MAX, with the vector chunks ending at each
+ * possible place, plus a bad character or '=' at every position of the
+ * longest string.
+*/
+DECLARE_UTEST(decode_matches_scalar, "decoding matches the scalar code")
+{
+    char            in[UT_B64_MAX+1];
+    unsigned char   out[UT_B64_MAX+1], ref[UT_B64_MAX+1];
+    int             len, i, res;
+    unsigned int    seed = 1;
+
+    for(len=0; len <= UT_B64_MAX; len++)
+    {
+        for(i=0; i < len; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            in[i] = ut_b64_chars[(seed >> 16) % 64];
+        }
+        in[len] = '\0';
+
+        memset(out, 0xaa, sizeof(out));
+        memset(ref, 0xaa, sizeof(ref));
+        res = b64_decode(in, out);
+        CU_ASSERT(res == b64_decode_ref(in, ref));
+        CU_ASSERT(memcmp(out, ref, sizeof(out)) == 0);
+    }
+
+    for(i=0; i < UT_B64_MAX; i++)
+    {
+        in[i] = i & 1 ? '=' : '*';
+        res = b64_decode(in, out);
+        CU_ASSERT(res == b64_decode_ref(in, ref));
+        CU_ASSERT(res < 0 || memcmp(out, ref, res+1) == 0);
+
+        in[i] = (char)0xc1;
+        CU_ASSERT(b64_decode(in, out) == -1);
+
+        in[i] = ut_b64_chars[i % 64];
+    }
+}
+
+DECLARE_UTEST(check_base64, "check_base64() length and character checks")
+{
+    unsigned char   buf[UT_B64_MAX];
+    int             i;
+
+    for(i=0; i < UT_B64_MAX; i++)
+        buf[i] = (i % 7) == 0 ? '=' : ut_b64_chars[i % 64];
+
+    CU_ASSERT(check_base64(buf, UT_B64_MAX, 10, UT_B64_MAX) == B64_CHECK_OK);
+    CU_ASSERT(check_base64(buf, UT_B64_MAX, 10, UT_B64_MAX-1) == B64_CHECK_BAD_LEN);
+    CU_ASSERT(check_base64(buf, 9, 10, UT_B64_MAX) == B64_CHECK_BAD_LEN);
+    CU_ASSERT(is_base64(buf, UT_B64_MAX) == 1);
+
+    for(i=0; i < UT_B64_MAX; i++)
+    {
+        buf[i] = (i & 1) ? '-' : 0xe9;
+        CU_ASSERT(check_base64(buf, UT_B64_MAX, 0, UT_B64_MAX) == B64_CHECK_BAD_CHAR);
+        CU_ASSERT(check_base64(buf, i, 0, UT_B64_MAX) == B64_CHECK_OK);
+        CU_ASSERT(is_base64(buf, i+1) == 0);
+        buf[i] = ut_b64_chars[i % 64];
+    }
+}
+
+int register_ts_base64(void)
+{
+    ts_init(&TEST_SUITE(base64), TEST_SUITE_DESCR(base64), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(base64), UTEST_FCT(decode_matches_scalar), UTEST_DESCR(decode_matches_scalar));
+    ts_add_utest(&TEST_SUITE(base64), UTEST_FCT(check_base64), UTEST_DESCR(check_base64));
+
+    return register_ts(&TEST_SUITE(base64));
+}
+#endif /* HAVE_C_UNIT_TESTS */
+
 /***EOF***/
@@ -43,6 +43,8 @@
 #include "cipher_funcs.h"
 #include "digest.h"
 
+#include <pthread.h>
+
 #ifndef WIN32
   #ifndef RAND_FILE
     #define RAND_FILE "/dev/urandom"
@@ -111,20 +113,34 @@ get_random_data(unsigned char *data, const size_t len)
 
 /*** These are Rijndael-specific functions ***/
 
-/* Rijndael function to generate initial salt and initialization vector
- * (iv).  This is is done to be compatible with the data produced via OpenSSL
+/* Derived keys kept by rij_decrypt_enc_key().  Entries are looked up by
+ * the (padded) password and the salt from the SPA packet, and the least
+ * recently used one is replaced on a miss.
 */
-static void
-rij_salt_and_iv(RIJNDAEL_context *ctx, const char *key,
-        const int key_len, const unsigned char *data, const int mode_flag)
-{
-    char            pw_buf[RIJNDAEL_MAX_KEYSIZE] = {0};
-    unsigned char   tmp_buf[MD5_DIGEST_LEN+RIJNDAEL_MAX_KEYSIZE+RIJNDAEL_BLOCKSIZE] = {0};
-    unsigned char   kiv_buf[RIJNDAEL_MAX_KEYSIZE+RIJNDAEL_BLOCKSIZE] = {0}; /* Key and IV buffer */
-    unsigned char   md5_buf[MD5_DIGEST_LEN] = {0}; /* Buffer for computed md5 hash */
+#define RIJ_KEY_CACHE_SIZE  64
 
-    int             final_key_len = 0;
-    size_t          kiv_len = 0;
+typedef struct rij_key_cache_ent {
+    unsigned long       last_used;      /* zero for a free entry */
+    uint64_t            fpr;
+    char                pw[RIJNDAEL_MAX_KEYSIZE];
+    int                 pw_len;
+    RIJNDAEL_context    ctx;
+} rij_key_cache_ent_t;
+
+static rij_key_cache_ent_t  rij_key_cache[RIJ_KEY_CACHE_SIZE];
+static unsigned long        rij_key_cache_clock;
+static unsigned long        rij_key_cache_hits;
+static unsigned long        rij_key_cache_misses;
+static pthread_mutex_t      rij_key_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Pad the password the way the encryption mode requires and return the
+ * resulting length.
+*/
+static int
+rij_pad_key(char *pw_buf, const char *key, const int key_len,
+        const int mode_flag)
+{
+    memcpy(pw_buf, key, key_len);
 
     if(mode_flag == FKO_ENC_MODE_CBC_LEGACY_IV)
     {
@@ -138,42 +154,25 @@ rij_salt_and_iv(RIJNDAEL_context *ctx, const char *key,
         */
         if(key_len < RIJNDAEL_MIN_KEYSIZE)
         {
-            memcpy(pw_buf, key, key_len);
             memset(pw_buf+key_len, '0', RIJNDAEL_MIN_KEYSIZE - key_len);
-            final_key_len = RIJNDAEL_MIN_KEYSIZE;
-        }
-        else
-        {
-            memcpy(pw_buf, key, key_len);
-            final_key_len = key_len;
+            return RIJNDAEL_MIN_KEYSIZE;
         }
     }
-    else
-    {
-        memcpy(pw_buf, key, key_len);
-        final_key_len = key_len;
-    }
+    return key_len;
+}
 
-    /* If we are decrypting, data will contain the salt. Otherwise,
-     * for encryption, we generate a random salt.
-    */
-    if(data != NULL)
-    {
-        /* Pull the salt from the data
-        */
-        memcpy(ctx->salt, (data+SALT_LEN), SALT_LEN);
-    }
-    else
-    {
-        /* Generate a random 8-byte salt.
-        */
-        get_random_data(ctx->salt, SALT_LEN);
-    }
+/* Generate the key and initialization vector from the password and the
+ * salt in ctx.  This is done to be compatible with the data produced via
+ * OpenSSL (again it is the perl Crypt::CBC way, with a touch of fwknop).
+*/
+static void
+rij_kdf(RIJNDAEL_context *ctx, const char *pw_buf, const int final_key_len)
+{
+    unsigned char   tmp_buf[MD5_DIGEST_LEN+RIJNDAEL_MAX_KEYSIZE+RIJNDAEL_BLOCKSIZE] = {0};
+    unsigned char   kiv_buf[RIJNDAEL_MAX_KEYSIZE+RIJNDAEL_BLOCKSIZE] = {0}; /* Key and IV buffer */
+    unsigned char   md5_buf[MD5_DIGEST_LEN] = {0}; /* Buffer for computed md5 hash */
+    size_t          kiv_len = 0;
 
-    /* Now generate the key and initialization vector.
-     * (again it is the perl Crypt::CBC way, with a touch of
-     * fwknop).
-    */
     memcpy(tmp_buf+MD5_DIGEST_LEN, pw_buf, final_key_len);
     memcpy(tmp_buf+MD5_DIGEST_LEN+final_key_len, ctx->salt, SALT_LEN);
 
@@ -193,33 +192,75 @@ rij_salt_and_iv(RIJNDAEL_context *ctx, const char *key,
 
     memcpy(ctx->key, kiv_buf, RIJNDAEL_MAX_KEYSIZE);
     memcpy(ctx->iv,  kiv_buf+RIJNDAEL_MAX_KEYSIZE, RIJNDAEL_BLOCKSIZE);
+
+    zero_buf((char *)tmp_buf, sizeof(tmp_buf));
+    zero_buf((char *)kiv_buf, sizeof(kiv_buf));
 }
 
-/* Initialization entry point.
+/* Rijndael function to generate initial salt and initialization vector
+ * (iv).  This is is done to be compatible with the data produced via OpenSSL
 */
 static void
-rijndael_init(RIJNDAEL_context *ctx, const char *key,
-    const int key_len, const unsigned char *data,
-    int encryption_mode)
+rij_salt_and_iv(RIJNDAEL_context *ctx, const char *key,
+        const int key_len, const unsigned char *data, const int mode_flag)
 {
+    char            pw_buf[RIJNDAEL_MAX_KEYSIZE] = {0};
+    int             final_key_len = 0;
+
+    final_key_len = rij_pad_key(pw_buf, key, key_len, mode_flag);
 
+    /* If we are decrypting, data will contain the salt. Otherwise,
+     * for encryption, we generate a random salt.
+    */
+    if(data != NULL)
+    {
+        /* Pull the salt from the data
+        */
+        memcpy(ctx->salt, (data+SALT_LEN), SALT_LEN);
+    }
+    else
+    {
+        /* Generate a random 8-byte salt.
+        */
+        get_random_data(ctx->salt, SALT_LEN);
+    }
+
+    rij_kdf(ctx, pw_buf, final_key_len);
+
+    zero_buf(pw_buf, sizeof(pw_buf));
+}
+
+static int
+rij_mode(const int encryption_mode)
+{
     /* The default is Rijndael in CBC mode
     */
     if(encryption_mode == FKO_ENC_MODE_CBC
             || encryption_mode == FKO_ENC_MODE_CBC_LEGACY_IV)
-        ctx->mode = MODE_CBC;
+        return MODE_CBC;
     else if(encryption_mode == FKO_ENC_MODE_CTR)
-        ctx->mode = MODE_CTR;
+        return MODE_CTR;
     else if(encryption_mode == FKO_ENC_MODE_PCBC)
-        ctx->mode = MODE_PCBC;
+        return MODE_PCBC;
     else if(encryption_mode == FKO_ENC_MODE_OFB)
-        ctx->mode = MODE_OFB;
+        return MODE_OFB;
     else if(encryption_mode == FKO_ENC_MODE_CFB)
-        ctx->mode = MODE_CFB;
+        return MODE_CFB;
     else if(encryption_mode == FKO_ENC_MODE_ECB)
-        ctx->mode = MODE_ECB;
-    else  /* shouldn't get this far */
-        ctx->mode = encryption_mode;
+        return MODE_ECB;
+
+    /* shouldn't get this far */
+    return encryption_mode;
+}
+
+/* Initialization entry point.
+*/
+static void
+rijndael_init(RIJNDAEL_context *ctx, const char *key,
+    const int key_len, const unsigned char *data,
+    int encryption_mode)
+{
+    ctx->mode = rij_mode(encryption_mode);
 
     /* Generate the salt and initialization vector.
     */
@@ -269,30 +310,23 @@ rij_encrypt(unsigned char *in, size_t in_len,
     return(ondx - out);
 }
 
-/* Decrypt the given data.
+/* Decrypt the data with an initialized context and strip the padding.
 */
-size_t
-rij_decrypt(unsigned char *in, size_t in_len,
-    const char *key, const int key_len,
-    unsigned char *out, int encryption_mode)
+static size_t
+rij_decrypt_ctx(RIJNDAEL_context *ctx, unsigned char *in, size_t in_len,
+    unsigned char *out)
 {
-    RIJNDAEL_context    ctx;
     int                 i, pad_val, pad_err = 0;
     unsigned char      *pad_s;
     unsigned char      *ondx = out;
 
-    if(in == NULL || key == NULL || out == NULL)
-        return 0;
-
-    rijndael_init(&ctx, key, key_len, in, encryption_mode);
-
     /* Remove the first block since it contains the salt (it was consumed
      * by the rijndael_init() function above).
     */
     in_len -= RIJNDAEL_BLOCKSIZE;
     memmove(in, in+RIJNDAEL_BLOCKSIZE, in_len);
 
-    block_decrypt(&ctx, in, in_len, out, ctx.iv);
+    block_decrypt(ctx, in, in_len, out, ctx->iv);
 
     ondx += in_len;
 
@@ -316,13 +350,185 @@ rij_decrypt(unsigned char *in, size_t in_len,
 
     *ondx = '\0';
 
-    zero_buf((char *)ctx.key, RIJNDAEL_MAX_KEYSIZE);
-    zero_buf((char *)ctx.iv, RIJNDAEL_BLOCKSIZE);
-    zero_buf((char *)ctx.salt, SALT_LEN);
+    zero_buf((char *)ctx->key, RIJNDAEL_MAX_KEYSIZE);
+    zero_buf((char *)ctx->iv, RIJNDAEL_BLOCKSIZE);
+    zero_buf((char *)ctx->salt, SALT_LEN);
 
     return(ondx - out);
 }
 
+/* Decrypt the given data.
+*/
+size_t
+rij_decrypt(unsigned char *in, size_t in_len,
+    const char *key, const int key_len,
+    unsigned char *out, int encryption_mode)
+{
+    RIJNDAEL_context    ctx;
+
+    if(in == NULL || key == NULL || out == NULL)
+        return 0;
+
+    rijndael_init(&ctx, key, key_len, in, encryption_mode);
+
+    return(rij_decrypt_ctx(&ctx, in, in_len, out));
+}
+
+/* Fill in the prepared key: the password padded for the encryption mode
+ * and a fingerprint of it for the key cache.
+*/
+void
+rij_enc_key_init(struct fko_enc_key *enc_key, const char *key,
+    const int key_len, const int encryption_mode)
+{
+    int     i;
+
+    memset(enc_key, 0x0, sizeof(*enc_key));
+
+    memcpy(enc_key->key, key, key_len);
+    enc_key->key_len         = key_len;
+    enc_key->encryption_mode = encryption_mode;
+    enc_key->pw_len = rij_pad_key(enc_key->pw, key, key_len, encryption_mode);
+
+    /* FNV-1a
+    */
+    enc_key->fpr = 14695981039346656037ULL;
+    for(i=0; i < enc_key->pw_len; i++)
+    {
+        enc_key->fpr ^= (unsigned char)enc_key->pw[i];
+        enc_key->fpr *= 1099511628211ULL;
+    }
+    return;
+}
+
+/* Look for the derived key and key schedule for this password and salt
+*/
+static int
+rij_key_cache_get(const struct fko_enc_key *enc_key, RIJNDAEL_context *ctx)
+{
+    rij_key_cache_ent_t    *ent;
+    int                     i, found = 0;
+
+    pthread_mutex_lock(&rij_key_cache_mutex);
+
+    for(i=0; i < RIJ_KEY_CACHE_SIZE; i++)
+    {
+        ent = &rij_key_cache[i];
+        if(ent->last_used == 0 || ent->fpr != enc_key->fpr
+                || memcmp(ent->ctx.salt, ctx->salt, SALT_LEN) != 0
+                || ent->pw_len != enc_key->pw_len
+                || memcmp(ent->pw, enc_key->pw, enc_key->pw_len) != 0)
+            continue;
+
+        memcpy(ctx->keys, ent->ctx.keys, sizeof(ctx->keys));
+        memcpy(ctx->ikeys, ent->ctx.ikeys, sizeof(ctx->ikeys));
+        memcpy(ctx->key, ent->ctx.key, RIJNDAEL_MAX_KEYSIZE);
+        memcpy(ctx->iv, ent->ctx.iv, RIJNDAEL_BLOCKSIZE);
+        ctx->nrounds   = ent->ctx.nrounds;
+        ent->last_used = ++rij_key_cache_clock;
+        rij_key_cache_hits++;
+        found = 1;
+        break;
+    }
+
+    if(! found)
+        rij_key_cache_misses++;
+
+    pthread_mutex_unlock(&rij_key_cache_mutex);
+
+    return found;
+}
+
+static void
+rij_key_cache_put(const struct fko_enc_key *enc_key,
+    const RIJNDAEL_context *ctx)
+{
+    rij_key_cache_ent_t    *ent = &rij_key_cache[0];
+    int                     i;
+
+    pthread_mutex_lock(&rij_key_cache_mutex);
+
+    for(i=1; i < RIJ_KEY_CACHE_SIZE && ent->last_used != 0; i++)
+        if(rij_key_cache[i].last_used < ent->last_used)
+            ent = &rij_key_cache[i];
+
+    ent->fpr    = enc_key->fpr;
+    ent->pw_len = enc_key->pw_len;
+    memcpy(ent->pw, enc_key->pw, sizeof(ent->pw));
+    memcpy(&ent->ctx, ctx, sizeof(ent->ctx));
+    ent->last_used = ++rij_key_cache_clock;
+
+    pthread_mutex_unlock(&rij_key_cache_mutex);
+    return;
+}
+
+/* Drop the cached keys derived from this password (when a key is
+ * destroyed).
+*/
+void
+rij_key_cache_purge(const struct fko_enc_key *enc_key)
+{
+    int     i;
+
+    pthread_mutex_lock(&rij_key_cache_mutex);
+
+    for(i=0; i < RIJ_KEY_CACHE_SIZE; i++)
+        if(rij_key_cache[i].last_used != 0
+                && rij_key_cache[i].fpr == enc_key->fpr
+                && rij_key_cache[i].pw_len == enc_key->pw_len
+                && memcmp(rij_key_cache[i].pw, enc_key->pw, enc_key->pw_len) == 0)
+            zero_buf((char *)&rij_key_cache[i], sizeof(rij_key_cache_ent_t));
+
+    pthread_mutex_unlock(&rij_key_cache_mutex);
+    return;
+}
+
+void
+rij_key_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+    pthread_mutex_lock(&rij_key_cache_mutex);
+    *hits   = rij_key_cache_hits;
+    *misses = rij_key_cache_misses;
+    pthread_mutex_unlock(&rij_key_cache_mutex);
+    return;
+}
+
+/* Decrypt the given data with a prepared key.  The derived key and the
+ * key schedule come from the key cache when the same password and salt
+ * have been seen recently (such as when several access stanzas share a
+ * key and are tried in turn for one SPA packet).
+*/
+size_t
+rij_decrypt_enc_key(unsigned char *in, size_t in_len,
+    const struct fko_enc_key *enc_key, unsigned char *out,
+    int encryption_mode)
+{
+    RIJNDAEL_context    ctx;
+
+    if(in == NULL || enc_key == NULL || out == NULL)
+        return 0;
+
+    /* The password was padded for the mode of the key
+    */
+    if((encryption_mode == FKO_ENC_MODE_CBC_LEGACY_IV)
+            != (enc_key->encryption_mode == FKO_ENC_MODE_CBC_LEGACY_IV))
+        return(rij_decrypt(in, in_len, enc_key->key, enc_key->key_len,
+                    out, encryption_mode));
+
+    memcpy(ctx.salt, (in+SALT_LEN), SALT_LEN);
+
+    if(! rij_key_cache_get(enc_key, &ctx))
+    {
+        rij_kdf(&ctx, enc_key->pw, enc_key->pw_len);
+        rijndael_setup(&ctx, RIJNDAEL_MAX_KEYSIZE, ctx.key);
+        rij_key_cache_put(enc_key, &ctx);
+    }
+
+    ctx.mode = rij_mode(encryption_mode);
+
+    return(rij_decrypt_ctx(&ctx, in, in_len, out));
+}
+
 /* See if we need to add the "Salted__" string to the front of the
  * encrypted data.
 */
@@ -348,7 +554,7 @@ add_salted_str(fko_ctx_t ctx)
     {
         /* We need to realloc space for the salt.
         */
-        tbuf = realloc(ctx->encrypted_msg, ctx->encrypted_msg_len
+        tbuf = ctx_realloc(ctx, ctx->encrypted_msg, ctx->encrypted_msg_len
                     + B64_RIJNDAEL_SALT_STR_LEN+1);
         if(tbuf == NULL)
             return(FKO_ERROR_MEMORY_ALLOCATION);
@@ -391,7 +597,7 @@ add_gpg_prefix(fko_ctx_t ctx)
     {
         /* We need to realloc space for the prefix.
         */
-        tbuf = realloc(ctx->encrypted_msg, ctx->encrypted_msg_len
+        tbuf = ctx_realloc(ctx, ctx->encrypted_msg, ctx->encrypted_msg_len
                     + B64_GPG_PREFIX_STR_LEN+1);
         if(tbuf == NULL)
             return(FKO_ERROR_MEMORY_ALLOCATION);
@@ -40,6 +40,17 @@
 */
 #define PREDICT_ENCSIZE(x) (1+(x>>4)+(x&0xf?1:0))<<4
 
+/* A Rijndael key prepared by fko_new_enc_key()
+*/
+struct fko_enc_key {
+    char        key[RIJNDAEL_MAX_KEYSIZE];
+    int         key_len;
+    int         encryption_mode;
+    char        pw[RIJNDAEL_MAX_KEYSIZE];   /* padded for encryption_mode */
+    int         pw_len;
+    uint64_t    fpr;
+};
+
 void get_random_data(unsigned char *data, const size_t len);
 size_t rij_encrypt(unsigned char *in, size_t len,
     const char *key, const int key_len,
@@ -47,6 +58,13 @@ size_t rij_encrypt(unsigned char *in, size_t len,
 size_t rij_decrypt(unsigned char *in, size_t len,
     const char *key, const int key_len,
     unsigned char *out, int encryption_mode);
+void rij_enc_key_init(struct fko_enc_key *enc_key, const char *key,
+    const int key_len, const int encryption_mode);
+size_t rij_decrypt_enc_key(unsigned char *in, size_t in_len,
+    const struct fko_enc_key *enc_key, unsigned char *out,
+    int encryption_mode);
+void rij_key_cache_purge(const struct fko_enc_key *enc_key);
+void rij_key_cache_stats(unsigned long *hits, unsigned long *misses);
 int add_salted_str(fko_ctx_t ctx);
 int add_gpg_prefix(fko_ctx_t ctx);
 
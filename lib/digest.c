@@ -27,6 +27,7 @@
 
 #include "fko_common.h"
 #include "digest.h"
+#include "sha2_accel.h"
 #include "base64.h"
 
 /* Compute MD5 hash on in and store result in out.
@@ -154,4 +155,92 @@ sha512_base64(char *out, unsigned char *in, size_t size)
     strip_b64_eq(out);
 }
 
+/* The base64 batch functions hash this many messages at a time into
+ * local buffers.
+*/
+#define MULTI_CHUNK 8
+
+static void
+sha2_base64_multi(char **out, unsigned char **in, const size_t *size,
+        const int count, const int digest_len)
+{
+    uint8_t     md[MULTI_CHUNK][SHA512_DIGEST_LEN];
+    uint8_t    *mdp[MULTI_CHUNK];
+    int         i, j, n;
+
+    for(j=0; j < MULTI_CHUNK; j++)
+        mdp[j] = md[j];
+
+    for(i=0; i < count; i+=n)
+    {
+        n = count-i < MULTI_CHUNK ? count-i : MULTI_CHUNK;
+
+        if(digest_len == SHA256_DIGEST_LEN)
+            sha256_mb(mdp, (const uint8_t * const *)(in+i), size+i, n);
+        else
+            sha512_mb(mdp, (const uint8_t * const *)(in+i), size+i, n,
+                    digest_len);
+
+        for(j=0; j < n; j++)
+        {
+            b64_encode(md[j], out[i+j], digest_len);
+            strip_b64_eq(out[i+j]);
+        }
+    }
+}
+
+/* Compute the SHA256 hashes of count messages.
+*/
+void
+sha256_multi(unsigned char **out, unsigned char **in, const size_t *size,
+        const int count)
+{
+    sha256_mb(out, (const uint8_t * const *)in, size, count);
+}
+
+/* Compute the SHA256 hashes of count messages as base64 strings.
+*/
+void
+sha256_base64_multi(char **out, unsigned char **in, const size_t *size,
+        const int count)
+{
+    sha2_base64_multi(out, in, size, count, SHA256_DIGEST_LEN);
+}
+
+/* Compute the SHA384 hashes of count messages.
+*/
+void
+sha384_multi(unsigned char **out, unsigned char **in, const size_t *size,
+        const int count)
+{
+    sha512_mb(out, (const uint8_t * const *)in, size, count, SHA384_DIGEST_LEN);
+}
+
+/* Compute the SHA384 hashes of count messages as base64 strings.
+*/
+void
+sha384_base64_multi(char **out, unsigned char **in, const size_t *size,
+        const int count)
+{
+    sha2_base64_multi(out, in, size, count, SHA384_DIGEST_LEN);
+}
+
+/* Compute the SHA512 hashes of count messages.
+*/
+void
+sha512_multi(unsigned char **out, unsigned char **in, const size_t *size,
+        const int count)
+{
+    sha512_mb(out, (const uint8_t * const *)in, size, count, SHA512_DIGEST_LEN);
+}
+
+/* Compute the SHA512 hashes of count messages as base64 strings.
+*/
+void
+sha512_base64_multi(char **out, unsigned char **in, const size_t *size,
+        const int count)
+{
+    sha2_base64_multi(out, in, size, count, SHA512_DIGEST_LEN);
+}
+
 /***EOF***/
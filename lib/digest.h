@@ -50,6 +50,23 @@ void sha384_base64(char* out, unsigned char* in, size_t size);
 void sha512(unsigned char* out, unsigned char* in, size_t size);
 void sha512_base64(char* out, unsigned char* in, size_t size);
 
+/* Batch versions: hash count messages in one call, out[i] receiving the
+ * digest of the size[i] bytes at in[i].  With AVX2 several messages are
+ * hashed at once.
+*/
+void sha256_multi(unsigned char** out, unsigned char** in, const size_t* size,
+        const int count);
+void sha256_base64_multi(char** out, unsigned char** in, const size_t* size,
+        const int count);
+void sha384_multi(unsigned char** out, unsigned char** in, const size_t* size,
+        const int count);
+void sha384_base64_multi(char** out, unsigned char** in, const size_t* size,
+        const int count);
+void sha512_multi(unsigned char** out, unsigned char** in, const size_t* size,
+        const int count);
+void sha512_base64_multi(char** out, unsigned char** in, const size_t* size,
+        const int count);
+
 #endif /* DIGEST_H */
 
 /***EOF***/
@@ -324,6 +324,25 @@ typedef enum {
 struct fko_context;
 typedef struct fko_context *fko_ctx_t;
 
+/* An HMAC key with its key pads already hashed, for verifying many SPA
+ * packets with the same key.  This is an opaque pointer.
+*/
+struct fko_hmac_key;
+typedef struct fko_hmac_key *fko_hmac_key_t;
+
+/* A Rijndael key prepared for decrypting many SPA packets, whose derived
+ * keys and key schedules can be cached.  This is an opaque pointer.
+*/
+struct fko_enc_key;
+typedef struct fko_enc_key *fko_enc_key_t;
+
+/* A reusable slab that holds a context and all of its buffers, so that SPA
+ * data can be decoded without going to the heap for every packet.  An arena
+ * holds one context at a time.  This is an opaque pointer.
+*/
+struct fko_arena;
+typedef struct fko_arena *fko_arena_t;
+
 /* Function pointer for SPA packet field parsing
  */
 typedef int (*field_parser_ptr_t)(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx);
@@ -353,6 +372,18 @@ DLL_API int fko_new_with_data(fko_ctx_t *ctx, const char * const enc_msg,
     const char * const dec_key, const int dec_key_len, int encryption_mode,
     const char * const hmac_key, const int hmac_key_len, const int hmac_type,
     const uint32_t sdp_id);
+DLL_API int fko_new_with_data_hmac_key(fko_ctx_t *ctx,
+    const char * const enc_msg, const char * const dec_key,
+    const int dec_key_len, int encryption_mode,
+    const fko_hmac_key_t hmac_key, const uint32_t sdp_id);
+DLL_API int fko_new_with_data_keys(fko_ctx_t *ctx, const char * const enc_msg,
+    const fko_enc_key_t enc_key, const fko_hmac_key_t hmac_key,
+    const uint32_t sdp_id);
+DLL_API int fko_new_with_data_arena(fko_ctx_t *ctx, const char * const enc_msg,
+    const fko_enc_key_t enc_key, const fko_hmac_key_t hmac_key,
+    const uint32_t sdp_id, fko_arena_t arena);
+DLL_API int fko_new_arena(fko_arena_t *arena, const size_t size);
+DLL_API int fko_destroy_arena(fko_arena_t arena);
 DLL_API int fko_destroy(fko_ctx_t ctx);
 DLL_API int fko_spa_data_final(fko_ctx_t ctx, const char * const enc_key,
     const int enc_key_len, const char * const hmac_key, const int hmac_key_len);
@@ -401,8 +432,18 @@ DLL_API int fko_encrypt_spa_data(fko_ctx_t ctx, const char * const enc_key,
     const int enc_key_len);
 DLL_API int fko_decrypt_spa_data(fko_ctx_t ctx, const char * const dec_key,
     const int dec_key_len);
+DLL_API int fko_decrypt_spa_data_enc_key(fko_ctx_t ctx,
+    const fko_enc_key_t enc_key);
+DLL_API int fko_new_enc_key(fko_enc_key_t *r_enc_key,
+    const char * const enc_key, const int enc_key_len,
+    const int encryption_mode);
+DLL_API int fko_destroy_enc_key(fko_enc_key_t enc_key);
 DLL_API int fko_verify_hmac(fko_ctx_t ctx, const char * const hmac_key,
     const int hmac_key_len);
+DLL_API int fko_verify_hmac_key(fko_ctx_t ctx, const fko_hmac_key_t hmac_key);
+DLL_API int fko_new_hmac_key(fko_hmac_key_t *r_hmac_key,
+    const char * const hmac_key, const int hmac_key_len, const int hmac_type);
+DLL_API int fko_destroy_hmac_key(fko_hmac_key_t hmac_key);
 DLL_API int fko_set_spa_hmac(fko_ctx_t ctx, const char * const hmac_key,
     const int hmac_key_len);
 DLL_API int fko_get_spa_hmac(fko_ctx_t ctx, char **enc_data);
@@ -428,6 +469,8 @@ DLL_API int fko_get_raw_spa_digest_type(fko_ctx_t ctx, short *raw_spa_digest_typ
 DLL_API int fko_get_spa_hmac_type(fko_ctx_t ctx, short *spa_hmac_type);
 DLL_API int fko_get_spa_digest(fko_ctx_t ctx, char **spa_digest);
 DLL_API int fko_get_raw_spa_digest(fko_ctx_t ctx, char **raw_spa_digest);
+DLL_API int fko_get_raw_spa_digests(char * const *spa_data, const int count,
+    const short digest_type, char **digests, const size_t digest_size);
 DLL_API int fko_get_spa_encryption_type(fko_ctx_t ctx, short *spa_enc_type);
 DLL_API int fko_get_spa_encryption_mode(fko_ctx_t ctx, int *spa_enc_mode);
 DLL_API int fko_get_spa_data(fko_ctx_t ctx, char **spa_data);
@@ -474,6 +517,12 @@ DLL_API int fko_gpg_signature_fpr_match(fko_ctx_t ctx, const char * const fpr,
 
 #ifdef HAVE_C_UNIT_TESTS
 int register_ts_fko_decode(void);
+int register_ts_fko_hmac(void);
+int register_ts_fko_encryption(void);
+int register_ts_rijndael_accel(void);
+int register_ts_base64(void);
+int register_ts_fko_arena(void);
+int register_ts_sha2_accel(void);
 #endif
 
 #endif /* FKO_H */
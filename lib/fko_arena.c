@@ -0,0 +1,547 @@
+/*
+ *****************************************************************************
+ *
+ * File:    fko_arena.c
+ *
+ * Purpose: Reusable slab for the buffers of an SPA decoding context.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fko_common.h"
+#include "fko.h"
+#include "fko_arena.h"
+
+#ifdef HAVE_C_UNIT_TESTS
+  #include "cunit_common.h"
+  #include "rijndael_accel.h"
+DECLARE_TEST_SUITE(fko_arena, "FKO arena test suite");
+#endif
+
+/* The arena is a stack: blocks are handed out from the bottom of the slab
+ * and freeing the newest block gives its space back.  Freeing any other
+ * block only marks it, and its space comes back once everything above it
+ * has been freed too.  The whole slab is wiped when the context that owns
+ * it is destroyed, so it holds nothing from one SPA packet when the next
+ * one is decoded.  Unused slab space is always zero, which is what lets
+ * ctx_calloc() hand it out without clearing it.
+*/
+struct fko_arena {
+    unsigned char  *base;
+    size_t          size;
+    size_t          used;   /* Bytes handed out, headers included */
+    size_t          top;    /* Header offset of the newest block */
+    int             in_use; /* A context lives in the arena */
+};
+
+/* Header in front of every block
+*/
+typedef struct arena_blk {
+    size_t          len;    /* Usable length, low bit set once freed */
+    size_t          prev;   /* Header offset of the block below */
+} arena_blk_t;
+
+#define ARENA_ALIGN         16
+#define ARENA_ROUND(n)      (((n) + (ARENA_ALIGN-1)) & ~((size_t)ARENA_ALIGN-1))
+#define ARENA_HDR_SIZE      ARENA_ROUND(sizeof(arena_blk_t))
+#define ARENA_NONE          ((size_t)-1)
+#define BLK_FREED           ((size_t)1)
+
+#define ARENA_BLK(a, p)     ((arena_blk_t *)((unsigned char *)(p) - ARENA_HDR_SIZE))
+#define ARENA_OFF(a, b)     ((size_t)((unsigned char *)(b) - (a)->base))
+
+static int
+arena_owns(const fko_arena_t arena, const void *ptr)
+{
+    return(arena != NULL
+        && (const unsigned char *)ptr >= arena->base
+        && (const unsigned char *)ptr < arena->base + arena->size);
+}
+
+static void *
+arena_alloc(fko_arena_t arena, size_t len)
+{
+    arena_blk_t    *blk;
+    size_t          need;
+
+    if(len == 0)
+        len = 1;
+
+    if(len > arena->size)
+        return(NULL);
+
+    need = ARENA_HDR_SIZE + ARENA_ROUND(len);
+    if(need > arena->size - arena->used)
+        return(NULL);
+
+    blk = (arena_blk_t *)(arena->base + arena->used);
+    blk->len  = ARENA_ROUND(len);
+    blk->prev = arena->top;
+
+    arena->top   = arena->used;
+    arena->used += need;
+
+    return((unsigned char *)blk + ARENA_HDR_SIZE);
+}
+
+/* Mark a block free, then give back (and wipe) every freed block at the
+ * top of the stack.
+*/
+static void
+arena_free(fko_arena_t arena, void *ptr)
+{
+    arena_blk_t    *blk = ARENA_BLK(arena, ptr);
+
+    blk->len |= BLK_FREED;
+
+    while(arena->top != ARENA_NONE)
+    {
+        blk = (arena_blk_t *)(arena->base + arena->top);
+        if(! (blk->len & BLK_FREED))
+            break;
+
+        arena->used = arena->top;
+        arena->top  = blk->prev;
+        memset(blk, 0x0, ARENA_HDR_SIZE + (blk->len & ~BLK_FREED));
+    }
+    return;
+}
+
+/* Grow the newest block in place.  The space above it is already zero.
+*/
+static void *
+arena_grow(fko_arena_t arena, void *ptr, size_t len)
+{
+    arena_blk_t    *blk = ARENA_BLK(arena, ptr);
+    size_t          cur = blk->len & ~BLK_FREED;
+
+    len = ARENA_ROUND(len);
+    if(len <= cur)
+        return(ptr);
+
+    if(ARENA_OFF(arena, blk) != arena->top
+            || len > arena->size - arena->top - ARENA_HDR_SIZE)
+        return(NULL);
+
+    arena->used += len - cur;
+    blk->len     = len;
+
+    return(ptr);
+}
+
+/* Hand out the context structure itself.  An arena holds one context at a
+ * time; NULL means it is busy (or too small) and the caller should use the
+ * heap instead.
+*/
+void *
+arena_ctx_alloc(fko_arena_t arena)
+{
+    void   *ctx;
+
+    if(arena == NULL || arena->in_use)
+        return(NULL);
+
+    if((ctx = arena_alloc(arena, sizeof(struct fko_context))) != NULL)
+        arena->in_use = 1;
+
+    return(ctx);
+}
+
+/* Wipe everything the context carved out of the arena and make the slab
+ * available to the next one.
+*/
+void
+arena_ctx_release(fko_arena_t arena)
+{
+    memset(arena->base, 0x0, arena->used);
+    arena->used   = 0;
+    arena->top    = ARENA_NONE;
+    arena->in_use = 0;
+    return;
+}
+
+void *
+ctx_calloc(fko_ctx_t ctx, size_t nmemb, size_t size)
+{
+    void   *ptr;
+
+    if(size != 0 && nmemb > (size_t)-1 / size)
+        return(NULL);
+
+    if(ctx != NULL && ctx->arena != NULL)
+        if((ptr = arena_alloc(ctx->arena, nmemb * size)) != NULL)
+            return(ptr);
+
+    return(calloc(nmemb, size));
+}
+
+void *
+ctx_realloc(fko_ctx_t ctx, void *ptr, size_t size)
+{
+    void   *new_ptr;
+    size_t  cur;
+
+    if(ptr == NULL)
+        return(ctx_calloc(ctx, 1, size));
+
+    if(ctx == NULL || ! arena_owns(ctx->arena, ptr))
+        return(realloc(ptr, size));
+
+    if((new_ptr = arena_grow(ctx->arena, ptr, size)) != NULL)
+        return(new_ptr);
+
+    if((new_ptr = ctx_calloc(ctx, 1, size)) == NULL)
+        return(NULL);
+
+    cur = ARENA_BLK(ctx->arena, ptr)->len & ~BLK_FREED;
+    memcpy(new_ptr, ptr, cur < size ? cur : size);
+    memset(ptr, 0x0, cur);
+    arena_free(ctx->arena, ptr);
+
+    return(new_ptr);
+}
+
+char *
+ctx_strdup(fko_ctx_t ctx, const char *s)
+{
+    return(ctx_strndup(ctx, s, strlen(s)));
+}
+
+char *
+ctx_strndup(fko_ctx_t ctx, const char *s, size_t n)
+{
+    char   *dup;
+    size_t  len = strnlen(s, n);
+
+    if((dup = ctx_calloc(ctx, 1, len+1)) == NULL)
+        return(NULL);
+
+    memcpy(dup, s, len);
+    return(dup);
+}
+
+void
+ctx_free(fko_ctx_t ctx, void *ptr)
+{
+    if(ptr == NULL)
+        return;
+
+    if(ctx != NULL && arena_owns(ctx->arena, ptr))
+        arena_free(ctx->arena, ptr);
+    else
+        free(ptr);
+    return;
+}
+
+/* zero_free() for context buffers
+*/
+int
+ctx_zero_free(fko_ctx_t ctx, char *buf, int len)
+{
+    int res = FKO_SUCCESS;
+
+    if(buf == NULL)
+        return res;
+
+    if(ctx == NULL || ! arena_owns(ctx->arena, buf))
+        return zero_free(buf, len);
+
+    if(len != 0)
+        res = zero_buf(buf, len);
+
+    arena_free(ctx->arena, buf);
+
+#if HAVE_LIBFIU
+    fiu_return_on("zero_free_err", FKO_ERROR_ZERO_OUT_DATA);
+#endif
+
+    return res;
+}
+
+/* Create an arena with a slab of size bytes (FKO_DEFAULT_ARENA_SIZE if
+ * size is 0) for use with fko_new_with_data_arena().
+*/
+int
+fko_new_arena(fko_arena_t *r_arena, const size_t size)
+{
+    fko_arena_t arena = NULL;
+    size_t      slab_size = size ? size : FKO_DEFAULT_ARENA_SIZE;
+
+    if(r_arena == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    if(slab_size < ARENA_HDR_SIZE + ARENA_ROUND(sizeof(struct fko_context)))
+        return(FKO_ERROR_INVALID_DATA);
+
+    arena = calloc(1, sizeof *arena);
+    if(arena == NULL)
+        return(FKO_ERROR_MEMORY_ALLOCATION);
+
+    arena->base = calloc(1, slab_size);
+    if(arena->base == NULL)
+    {
+        free(arena);
+        return(FKO_ERROR_MEMORY_ALLOCATION);
+    }
+
+    arena->size = slab_size;
+    arena->top  = ARENA_NONE;
+
+    *r_arena = arena;
+
+    return(FKO_SUCCESS);
+}
+
+/* Free an arena.  Any context created from it must have been destroyed
+ * first.
+*/
+int
+fko_destroy_arena(fko_arena_t arena)
+{
+    if(arena == NULL)
+        return(FKO_SUCCESS);
+
+    if(arena->in_use)
+        return(FKO_ERROR_INVALID_DATA);
+
+    memset(arena->base, 0x0, arena->size);
+    free(arena->base);
+    free(arena);
+
+    return(FKO_SUCCESS);
+}
+
+#ifdef HAVE_C_UNIT_TESTS /* LCOV_EXCL_START */
+
+#define ARENA_TEST_ENC_KEY      "arenakey1234"
+#define ARENA_TEST_HMAC_KEY     "arenahmac1234"
+#define ARENA_TEST_PACKETS      16
+#define ARENA_TEST_SDP_ID       12345
+
+/* Set by the malloc() wrappers in fko_utests.c, where they are available
+*/
+extern unsigned long utest_malloc_calls __attribute__((weak));
+extern int utest_malloc_counting __attribute__((weak));
+
+static int
+make_spa_data(char *spa_data, const size_t len)
+{
+    fko_ctx_t   ctx = NULL;
+    char       *data = NULL;
+    int         res;
+
+    if((res = fko_new(&ctx)) != FKO_SUCCESS)
+        return res;
+
+    res = fko_set_sdp_id(ctx, ARENA_TEST_SDP_ID);
+    if(res == FKO_SUCCESS)
+        res = fko_set_spa_message(ctx, "192.0.2.1,tcp/22");
+    if(res == FKO_SUCCESS)
+        res = fko_set_spa_hmac_type(ctx, FKO_HMAC_SHA256);
+    if(res == FKO_SUCCESS)
+        res = fko_spa_data_final(ctx, ARENA_TEST_ENC_KEY,
+                strlen(ARENA_TEST_ENC_KEY), ARENA_TEST_HMAC_KEY,
+                strlen(ARENA_TEST_HMAC_KEY));
+    if(res == FKO_SUCCESS)
+        res = fko_get_spa_data(ctx, &data);
+    if(res == FKO_SUCCESS)
+        strlcpy(spa_data, data, len);
+
+    fko_destroy(ctx);
+    return res;
+}
+
+/* Decode a packet and read back the fields fwknopd looks at
+*/
+static int
+arena_decode(const char *spa_data, fko_enc_key_t enc_key,
+        fko_hmac_key_t hmac_key, fko_arena_t arena, char *msg, size_t len)
+{
+    fko_ctx_t   ctx = NULL;
+    char       *str = NULL;
+    short       msg_type;
+    uint32_t    sdp_id;
+    int         res;
+
+    if(arena != NULL)
+        res = fko_new_with_data_arena(&ctx, spa_data, enc_key, hmac_key,
+                ARENA_TEST_SDP_ID, arena);
+    else
+        res = fko_new_with_data_keys(&ctx, spa_data, enc_key, hmac_key,
+                ARENA_TEST_SDP_ID);
+    if(res != FKO_SUCCESS)
+        return res;
+
+    res = fko_get_spa_message_type(ctx, &msg_type);
+    if(res == FKO_SUCCESS)
+        res = fko_get_sdp_id(ctx, &sdp_id);
+    if(res == FKO_SUCCESS)
+        res = fko_get_spa_message(ctx, &str);
+    if(res == FKO_SUCCESS)
+        strlcpy(msg, str, len);
+
+    fko_destroy(ctx);
+    return res;
+}
+
+DECLARE_UTEST(arena_decode_matches_heap, "arena and heap contexts decode the same")
+{
+    fko_enc_key_t   enc_key = NULL;
+    fko_hmac_key_t  hmac_key = NULL;
+    fko_arena_t     arena = NULL;
+    fko_ctx_t       ctx = NULL, ctx2 = NULL;
+    char            spa_data[MAX_SPA_ENCODED_MSG_SIZE];
+    char            heap_msg[MAX_SPA_MESSAGE_SIZE], arena_msg[MAX_SPA_MESSAGE_SIZE];
+    char           *digest = NULL;
+    int             i;
+
+    CU_ASSERT(make_spa_data(spa_data, sizeof(spa_data)) == FKO_SUCCESS);
+    CU_ASSERT(fko_new_enc_key(&enc_key, ARENA_TEST_ENC_KEY,
+            strlen(ARENA_TEST_ENC_KEY), FKO_ENC_MODE_CBC) == FKO_SUCCESS);
+    CU_ASSERT(fko_new_hmac_key(&hmac_key, ARENA_TEST_HMAC_KEY,
+            strlen(ARENA_TEST_HMAC_KEY), FKO_HMAC_SHA256) == FKO_SUCCESS);
+
+    /* A slab too small for even the context is refused
+    */
+    CU_ASSERT(fko_new_arena(&arena, 16) == FKO_ERROR_INVALID_DATA);
+    CU_ASSERT(fko_new_arena(&arena, 0) == FKO_SUCCESS);
+
+    CU_ASSERT(arena_decode(spa_data, enc_key, hmac_key, NULL,
+            heap_msg, sizeof(heap_msg)) == FKO_SUCCESS);
+    for(i=0; i < ARENA_TEST_PACKETS; i++)
+    {
+        memset(arena_msg, 0x0, sizeof(arena_msg));
+        CU_ASSERT(arena_decode(spa_data, enc_key, hmac_key, arena,
+                arena_msg, sizeof(arena_msg)) == FKO_SUCCESS);
+        CU_ASSERT(strcmp(heap_msg, arena_msg) == 0);
+        CU_ASSERT(arena->used == 0 && arena->in_use == 0);
+    }
+
+    /* Everything is wiped once the context is gone
+    */
+    for(i=0; i < (int)arena->size; i++)
+        if(arena->base[i] != 0x0)
+            break;
+    CU_ASSERT(i == (int)arena->size);
+
+    /* A bad HMAC is rejected and leaves the arena free
+    */
+    spa_data[strlen(spa_data)-1] ^= 0x01;
+    CU_ASSERT(fko_new_with_data_arena(&ctx, spa_data, enc_key, hmac_key,
+            ARENA_TEST_SDP_ID, arena) != FKO_SUCCESS);
+    CU_ASSERT(arena->used == 0 && arena->in_use == 0);
+    spa_data[strlen(spa_data)-1] ^= 0x01;
+
+    /* Without a key only the raw digest is available, and a second
+     * context while the arena is busy comes from the heap
+    */
+    CU_ASSERT(fko_new_with_data_arena(&ctx, spa_data, NULL, NULL,
+            0, arena) == FKO_SUCCESS);
+    CU_ASSERT(ctx->arena == arena);
+    CU_ASSERT(fko_set_raw_spa_digest_type(ctx, FKO_DEFAULT_DIGEST) == FKO_SUCCESS);
+    CU_ASSERT(fko_set_raw_spa_digest(ctx) == FKO_SUCCESS);
+    CU_ASSERT(fko_get_raw_spa_digest(ctx, &digest) == FKO_SUCCESS);
+    CU_ASSERT(arena_owns(arena, digest));
+
+    CU_ASSERT(fko_new_with_data_arena(&ctx2, spa_data, enc_key, hmac_key,
+            ARENA_TEST_SDP_ID, arena) == FKO_SUCCESS);
+    CU_ASSERT(ctx2 != NULL && ctx2->arena == NULL);
+    CU_ASSERT(fko_destroy_arena(arena) == FKO_ERROR_INVALID_DATA);
+    fko_destroy(ctx2);
+    fko_destroy(ctx);
+    CU_ASSERT(arena->used == 0 && arena->in_use == 0);
+
+    CU_ASSERT(fko_destroy_arena(arena) == FKO_SUCCESS);
+    fko_destroy_enc_key(enc_key);
+    fko_destroy_hmac_key(hmac_key);
+}
+
+DECLARE_UTEST(arena_no_malloc, "arena contexts decode without calling malloc()")
+{
+    fko_enc_key_t   enc_key = NULL;
+    fko_hmac_key_t  hmac_key = NULL;
+    fko_arena_t     arena = NULL;
+    char            spa_data[ARENA_TEST_PACKETS][MAX_SPA_ENCODED_MSG_SIZE];
+    char            msg[MAX_SPA_MESSAGE_SIZE];
+    unsigned long   heap_calls, arena_calls;
+    int             i, backend;
+
+    /* Nothing to count with if the wrappers are not linked in
+    */
+    if(&utest_malloc_calls == NULL || &utest_malloc_counting == NULL)
+        return;
+
+    for(i=0; i < ARENA_TEST_PACKETS; i++)
+        CU_ASSERT(make_spa_data(spa_data[i], sizeof(spa_data[i])) == FKO_SUCCESS);
+    CU_ASSERT(fko_new_enc_key(&enc_key, ARENA_TEST_ENC_KEY,
+            strlen(ARENA_TEST_ENC_KEY), FKO_ENC_MODE_CBC) == FKO_SUCCESS);
+    CU_ASSERT(fko_new_hmac_key(&hmac_key, ARENA_TEST_HMAC_KEY,
+            strlen(ARENA_TEST_HMAC_KEY), FKO_HMAC_SHA256) == FKO_SUCCESS);
+    CU_ASSERT(fko_new_arena(&arena, 0) == FKO_SUCCESS);
+
+    /* The OpenSSL backend allocates its own cipher contexts
+    */
+    backend = rijndael_backend();
+    if(backend == RIJ_BACKEND_OPENSSL)
+        rijndael_set_backend(RIJ_BACKEND_BUILTIN);
+
+    /* Warm up anything that is set up on first use
+    */
+    CU_ASSERT(arena_decode(spa_data[0], enc_key, hmac_key, arena,
+            msg, sizeof(msg)) == FKO_SUCCESS);
+
+    utest_malloc_calls    = 0;
+    utest_malloc_counting = 1;
+    for(i=0; i < ARENA_TEST_PACKETS; i++)
+        CU_ASSERT(arena_decode(spa_data[i], enc_key, hmac_key, NULL,
+                msg, sizeof(msg)) == FKO_SUCCESS);
+    heap_calls = utest_malloc_calls;
+
+    utest_malloc_calls = 0;
+    for(i=0; i < ARENA_TEST_PACKETS; i++)
+        CU_ASSERT(arena_decode(spa_data[i], enc_key, hmac_key, arena,
+                msg, sizeof(msg)) == FKO_SUCCESS);
+    arena_calls = utest_malloc_calls;
+    utest_malloc_counting = 0;
+
+    CU_ASSERT(heap_calls > 0);
+    CU_ASSERT(arena_calls == 0);
+
+    rijndael_set_backend(backend);
+    CU_ASSERT(fko_destroy_arena(arena) == FKO_SUCCESS);
+    fko_destroy_enc_key(enc_key);
+    fko_destroy_hmac_key(hmac_key);
+}
+
+int register_ts_fko_arena(void)
+{
+    ts_init(&TEST_SUITE(fko_arena), TEST_SUITE_DESCR(fko_arena), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(fko_arena), UTEST_FCT(arena_decode_matches_heap), UTEST_DESCR(arena_decode_matches_heap));
+    ts_add_utest(&TEST_SUITE(fko_arena), UTEST_FCT(arena_no_malloc), UTEST_DESCR(arena_no_malloc));
+
+    return register_ts(&TEST_SUITE(fko_arena));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */ /* LCOV_EXCL_STOP */
+
+/***EOF***/
@@ -0,0 +1,62 @@
+/*
+ *****************************************************************************
+ *
+ * File:    fko_arena.h
+ *
+ * Purpose: Header for the per-packet context arena in fko_arena.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef FKO_ARENA_H
+#define FKO_ARENA_H 1
+
+#include "fko_common.h"
+
+/* Slab size used when fko_new_arena() is asked for size 0.  This is
+ * enough for every buffer a context needs while decoding the largest SPA
+ * packet.
+*/
+#define FKO_DEFAULT_ARENA_SIZE  16384
+
+/* Context creation and teardown from an arena.
+*/
+void   *arena_ctx_alloc(fko_arena_t arena);
+void    arena_ctx_release(fko_arena_t arena);
+
+/* Allocation functions for the buffers hanging off a context.  With an
+ * arena-backed context these carve the buffers out of the arena slab
+ * (falling back to the heap only if the slab is full), otherwise they are
+ * the plain libc calls.  ctx_free() and ctx_zero_free() accept either kind
+ * of pointer, so every free of a context buffer must go through them.
+*/
+void   *ctx_calloc(fko_ctx_t ctx, size_t nmemb, size_t size);
+void   *ctx_realloc(fko_ctx_t ctx, void *ptr, size_t size);
+char   *ctx_strdup(fko_ctx_t ctx, const char *s);
+char   *ctx_strndup(fko_ctx_t ctx, const char *s, size_t n);
+void    ctx_free(fko_ctx_t ctx, void *ptr);
+int     ctx_zero_free(fko_ctx_t ctx, char *buf, int len);
+
+#endif /* FKO_ARENA_H */
+
+/***EOF***/
@@ -158,6 +158,7 @@
 #include "fko_context.h"
 #include "fko_message.h"
 #include "fko_user.h"
+#include "fko_arena.h"
 
 /* Try to cover for those that do not have bzero.
 */
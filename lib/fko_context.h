@@ -104,6 +104,9 @@ struct fko_context {
     unsigned int    state;
     unsigned char   initval;
 
+    /* Arena the context and its buffers live in (NULL for the heap) */
+    fko_arena_t     arena;
+
 #if HAVE_LIBGPGME
     /* For gpgme support */
     char           *gpg_exe;
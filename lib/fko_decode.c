@@ -175,9 +175,9 @@ parse_msg(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx)
     strlcpy(tbuf, *ndx, *t_size+1);
 
     if(ctx->message != NULL)
-        free(ctx->message);
+        ctx_free(ctx, ctx->message);
 
-    ctx->message = calloc(1, *t_size+1); /* Yes, more than we need */
+    ctx->message = ctx_calloc(ctx, 1, *t_size+1); /* Yes, more than we need */
 
     if(ctx->message == NULL)
         return(FKO_ERROR_MEMORY_ALLOCATION);
@@ -234,9 +234,9 @@ parse_nat_msg(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx)
         strlcpy(tbuf, *ndx, *t_size+1);
 
         if(ctx->nat_access != NULL)
-            free(ctx->nat_access);
+            ctx_free(ctx, ctx->nat_access);
 
-        ctx->nat_access = calloc(1, *t_size+1); /* Yes, more than we need */
+        ctx->nat_access = ctx_calloc(ctx, 1, *t_size+1); /* Yes, more than we need */
         if(ctx->nat_access == NULL)
             return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -284,9 +284,9 @@ parse_server_auth(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx)
             strlcpy(tbuf, *ndx, *t_size+1);
 
             if(ctx->server_auth != NULL)
-                free(ctx->server_auth);
+                ctx_free(ctx, ctx->server_auth);
 
-            ctx->server_auth = calloc(1, *t_size+1); /* Yes, more than we need */
+            ctx->server_auth = ctx_calloc(ctx, 1, *t_size+1); /* Yes, more than we need */
             if(ctx->server_auth == NULL)
                 return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -301,9 +301,9 @@ parse_server_auth(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx)
         strlcpy(tbuf, *ndx, *t_size+1);
 
         if(ctx->server_auth != NULL)
-            free(ctx->server_auth);
+            ctx_free(ctx, ctx->server_auth);
 
-        ctx->server_auth = calloc(1, *t_size+1); /* Yes, more than we need */
+        ctx->server_auth = ctx_calloc(ctx, 1, *t_size+1); /* Yes, more than we need */
         if(ctx->server_auth == NULL)
             return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -413,9 +413,9 @@ parse_version(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx)
         return(FKO_ERROR_INVALID_DATA_DECODE_VERSION_TOOBIG);
 
     if(ctx->version != NULL)
-        free(ctx->version);
+        ctx_free(ctx, ctx->version);
 
-    ctx->version = calloc(1, *t_size+1);
+    ctx->version = ctx_calloc(ctx, 1, *t_size+1);
     if(ctx->version == NULL)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -460,9 +460,9 @@ parse_username(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx)
     strlcpy(tbuf, *ndx, *t_size+1);
 
     if(ctx->username != NULL)
-        free(ctx->username);
+        ctx_free(ctx, ctx->username);
 
-    ctx->username = calloc(1, *t_size+1); /* Yes, more than we need */
+    ctx->username = ctx_calloc(ctx, 1, *t_size+1); /* Yes, more than we need */
     if(ctx->username == NULL)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -484,9 +484,9 @@ parse_rand_val(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx)
         return(FKO_ERROR_INVALID_DATA_DECODE_RAND_MISSING);
 
     if(ctx->rand_val != NULL)
-        free(ctx->rand_val);
+        ctx_free(ctx, ctx->rand_val);
 
-    ctx->rand_val = calloc(1, FKO_RAND_VAL_SIZE+1);
+    ctx->rand_val = ctx_calloc(ctx, 1, FKO_RAND_VAL_SIZE+1);
     if(ctx->rand_val == NULL)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -505,41 +505,43 @@ fko_decode_spa_data(fko_ctx_t ctx)
 {
     char       *tbuf, *ndx;
     int         t_size, i, res, num_field_parsers=0;
-    field_parser_ptr_t *field_parser = NULL;
+    const field_parser_ptr_t *field_parser = NULL;
 
     /* Array of function pointers to SPA field parsing functions
     */
+    static const field_parser_ptr_t legacy_field_parser[FIELD_PARSERS] = {
+        parse_rand_val,         /* Extract random value */
+        parse_username,         /* Extract username */
+        parse_timestamp,        /* Client timestamp */
+        parse_version,          /* SPA version */
+        parse_msg_type,         /* SPA msg type */
+        parse_msg,              /* SPA msg string */
+        parse_nat_msg,          /* SPA NAT msg string */
+        parse_server_auth,      /* optional server authentication method */
+        parse_client_timeout    /* client defined timeout */
+    };
+    static const field_parser_ptr_t sdp_field_parser[SDP_FIELD_PARSERS] = {
+        parse_rand_val,         /* Extract random value */
+        parse_timestamp,        /* Client timestamp */
+        parse_msg_type,         /* SPA msg type */
+        parse_msg,              /* SPA msg string */
+        parse_nat_msg,          /* SPA NAT msg string */
+        parse_server_auth       /* optional server authentication method */
+    };
+
     if(ctx->disable_sdp_mode)
     {
         num_field_parsers = FIELD_PARSERS;
-        field_parser = calloc(num_field_parsers, sizeof(field_parser_ptr_t));
-
-        field_parser[0]    = parse_rand_val;       /* Extract random value */
-        field_parser[1]    = parse_username;       /* Extract username */
-        field_parser[2]    = parse_timestamp;      /* Client timestamp */
-        field_parser[3]    = parse_version;        /* SPA version */
-        field_parser[4]    = parse_msg_type;       /* SPA msg type */
-        field_parser[5]    = parse_msg;            /* SPA msg string */
-        field_parser[6]    = parse_nat_msg;        /* SPA NAT msg string */
-        field_parser[7]    = parse_server_auth;    /* optional server authentication method */
-        field_parser[8]    = parse_client_timeout; /* client defined timeout */
+        field_parser = legacy_field_parser;
     }
     else
     {
         num_field_parsers = SDP_FIELD_PARSERS;
-        field_parser = calloc(num_field_parsers, sizeof(field_parser_ptr_t));
-
-        field_parser[0]    = parse_rand_val;       /* Extract random value */
-        field_parser[1]    = parse_timestamp;      /* Client timestamp */
-        field_parser[2]    = parse_msg_type;       /* SPA msg type */
-        field_parser[3]    = parse_msg;            /* SPA msg string */
-        field_parser[4]    = parse_nat_msg;        /* SPA NAT msg string */
-        field_parser[5]    = parse_server_auth;    /* optional server authentication method */
-
+        field_parser = sdp_field_parser;
     }
+
     if (! is_valid_encoded_msg_len(ctx->encoded_msg_len))
     {
-        free(field_parser);
         return(FKO_ERROR_INVALID_DATA_DECODE_MSGLEN_VALIDFAIL);
     }
 
@@ -549,7 +551,6 @@ fko_decode_spa_data(fko_ctx_t ctx)
     {
         if(isprint(ctx->encoded_msg[i]) == 0)
         {
-            free(field_parser);
             return(FKO_ERROR_INVALID_DATA_DECODE_NON_ASCII);
         }
     }
@@ -563,7 +564,6 @@ fko_decode_spa_data(fko_ctx_t ctx)
     {
         if (num_fields(ndx) < MIN_SPA_FIELDS)
         {
-            free(field_parser);
             return(FKO_ERROR_INVALID_DATA_DECODE_LT_MIN_FIELDS);
         }
     }
@@ -571,7 +571,6 @@ fko_decode_spa_data(fko_ctx_t ctx)
     {
         if (num_fields(ndx) < MIN_SDP_SPA_FIELDS)
         {
-            free(field_parser);
             return(FKO_ERROR_INVALID_DATA_DECODE_LT_MIN_FIELDS);
         }
     }
@@ -585,21 +584,19 @@ fko_decode_spa_data(fko_ctx_t ctx)
     res = is_valid_digest_len(t_size, ctx);
     if(res != FKO_SUCCESS)
     {
-        free(field_parser);
         return res;
     }
 
     if(ctx->digest != NULL)
-        free(ctx->digest);
+        ctx_free(ctx, ctx->digest);
 
     /* Copy the digest into the context and terminate the encoded data
      * at that point so the original digest is not part of the
      * encoded string.
     */
-    ctx->digest = strdup(ndx);
+    ctx->digest = ctx_strdup(ctx, ndx);
     if(ctx->digest == NULL)
     {
-        free(field_parser);
         return(FKO_ERROR_MEMORY_ALLOCATION);
     }
 
@@ -612,10 +609,9 @@ fko_decode_spa_data(fko_ctx_t ctx)
     /* Make a tmp bucket for processing base64 encoded data and
      * other general use.
     */
-    tbuf = calloc(1, FKO_ENCODE_TMP_BUF_SIZE);
+    tbuf = ctx_calloc(ctx, 1, FKO_ENCODE_TMP_BUF_SIZE);
     if(tbuf == NULL)
     {
-        free(field_parser);
         return(FKO_ERROR_MEMORY_ALLOCATION);
     }
 
@@ -624,8 +620,7 @@ fko_decode_spa_data(fko_ctx_t ctx)
     res = verify_digest(tbuf, t_size, ctx);
     if(res != FKO_SUCCESS)
     {
-        free(field_parser);
-        free(tbuf);
+        ctx_free(ctx, tbuf);
         return(FKO_ERROR_DIGEST_VERIFICATION_FAILED);
     }
 
@@ -639,19 +634,14 @@ fko_decode_spa_data(fko_ctx_t ctx)
         res = (*field_parser[i])(tbuf, &ndx, &t_size, ctx);
         if(res != FKO_SUCCESS)
         {
-            free(field_parser);
-            free(tbuf);
+            ctx_free(ctx, tbuf);
             return res;
         }
     }
 
     /* Done with the tmp buffer.
     */
-    free(tbuf);
-
-    /* Done with field_parser
-     */
-    free(field_parser);
+    ctx_free(ctx, tbuf);
 
     /* Call the context initialized.
     */
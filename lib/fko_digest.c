@@ -121,7 +121,8 @@ fko_get_raw_spa_digest_type(fko_ctx_t ctx, short *raw_digest_type)
 }
 
 static int
-set_digest(char *data, char **digest, short digest_type, int *digest_len)
+set_digest(fko_ctx_t ctx, char *data, char **digest, short digest_type,
+        int *digest_len)
 {
     char    *md = NULL;
     int     data_len;
@@ -144,7 +145,7 @@ set_digest(char *data, char **digest, short digest_type, int *digest_len)
     switch(digest_type)
     {
         case FKO_DIGEST_MD5:
-            md = calloc(1, MD_HEX_SIZE(MD5_DIGEST_LEN)+1);
+            md = ctx_calloc(ctx, 1, MD_HEX_SIZE(MD5_DIGEST_LEN)+1);
             if(md == NULL)
                 return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -154,7 +155,7 @@ set_digest(char *data, char **digest, short digest_type, int *digest_len)
             break;
 
         case FKO_DIGEST_SHA1:
-            md = calloc(1, MD_HEX_SIZE(SHA1_DIGEST_LEN)+1);
+            md = ctx_calloc(ctx, 1, MD_HEX_SIZE(SHA1_DIGEST_LEN)+1);
             if(md == NULL)
                 return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -164,7 +165,7 @@ set_digest(char *data, char **digest, short digest_type, int *digest_len)
             break;
 
         case FKO_DIGEST_SHA256:
-            md = calloc(1, MD_HEX_SIZE(SHA256_DIGEST_LEN)+1);
+            md = ctx_calloc(ctx, 1, MD_HEX_SIZE(SHA256_DIGEST_LEN)+1);
             if(md == NULL)
                 return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -174,7 +175,7 @@ set_digest(char *data, char **digest, short digest_type, int *digest_len)
             break;
 
         case FKO_DIGEST_SHA384:
-            md = calloc(1, MD_HEX_SIZE(SHA384_DIGEST_LEN)+1);
+            md = ctx_calloc(ctx, 1, MD_HEX_SIZE(SHA384_DIGEST_LEN)+1);
             if(md == NULL)
                 return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -184,7 +185,7 @@ set_digest(char *data, char **digest, short digest_type, int *digest_len)
             break;
 
         case FKO_DIGEST_SHA512:
-            md = calloc(1, MD_HEX_SIZE(SHA512_DIGEST_LEN)+1);
+            md = ctx_calloc(ctx, 1, MD_HEX_SIZE(SHA512_DIGEST_LEN)+1);
             if(md == NULL)
                 return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -201,7 +202,7 @@ set_digest(char *data, char **digest, short digest_type, int *digest_len)
      * do not want to be leaking memory.
     */
     if(*digest != NULL)
-        free(*digest);
+        ctx_free(ctx, *digest);
 
     *digest = md;
 
@@ -228,7 +229,7 @@ fko_set_spa_digest(fko_ctx_t ctx)
     fiu_return_on("fko_set_spa_digest_encoded", FKO_ERROR_MISSING_ENCODED_DATA);
 #endif
 
-    return set_digest(ctx->encoded_msg, &ctx->digest,
+    return set_digest(ctx, ctx->encoded_msg, &ctx->digest,
         ctx->digest_type, &ctx->digest_len);
 }
 
@@ -252,7 +253,7 @@ fko_set_raw_spa_digest(fko_ctx_t ctx)
     fiu_return_on("fko_set_raw_spa_digest_val", FKO_ERROR_MISSING_ENCODED_DATA);
 #endif
 
-    return set_digest(ctx->encrypted_msg, &ctx->raw_digest,
+    return set_digest(ctx, ctx->encrypted_msg, &ctx->raw_digest,
         ctx->raw_digest_type, &ctx->raw_digest_len);
 }
 
@@ -294,4 +295,109 @@ fko_get_raw_spa_digest(fko_ctx_t ctx, char **md)
     return(FKO_SUCCESS);
 }
 
+/* Packets hashed together by fko_get_raw_spa_digests()
+*/
+#define RAW_DIGEST_BATCH    16
+
+static void
+raw_digest_batch(char **out, unsigned char **in, const size_t *len,
+        const int count, const short digest_type)
+{
+    int i;
+
+    switch(digest_type)
+    {
+        case FKO_DIGEST_MD5:
+            for(i=0; i < count; i++)
+                md5_base64(out[i], in[i], len[i]);
+            break;
+        case FKO_DIGEST_SHA1:
+            for(i=0; i < count; i++)
+                sha1_base64(out[i], in[i], len[i]);
+            break;
+        case FKO_DIGEST_SHA256:
+            sha256_base64_multi(out, in, len, count);
+            break;
+        case FKO_DIGEST_SHA384:
+            sha384_base64_multi(out, in, len, count);
+            break;
+        case FKO_DIGEST_SHA512:
+            sha512_base64_multi(out, in, len, count);
+            break;
+    }
+}
+
+/* Compute the raw SPA digests (see fko_set_raw_spa_digest()) of count
+ * packets in one call, without setting up a context for each of them.
+ * SHA-2 digests of several packets are computed side by side where the
+ * CPU allows it.  digests[i] receives the digest of spa_data[i] as a
+ * string, or an empty string if spa_data[i] is not a valid length for
+ * SPA data.  Each digests[i] buffer must hold digest_size bytes, which
+ * must be more than twice the binary digest length.
+*/
+int
+fko_get_raw_spa_digests(char * const *spa_data, const int count,
+        const short digest_type, char **digests, const size_t digest_size)
+{
+    unsigned char  *in[RAW_DIGEST_BATCH];
+    char           *out[RAW_DIGEST_BATCH];
+    size_t          len[RAW_DIGEST_BATCH];
+    int             digest_len, data_len, i, n = 0;
+
+    if(spa_data == NULL || digests == NULL || count < 0)
+        return(FKO_ERROR_INVALID_DATA);
+
+    switch(digest_type)
+    {
+        case FKO_DIGEST_MD5:
+            digest_len = MD5_DIGEST_LEN;
+            break;
+        case FKO_DIGEST_SHA1:
+            digest_len = SHA1_DIGEST_LEN;
+            break;
+        case FKO_DIGEST_SHA256:
+            digest_len = SHA256_DIGEST_LEN;
+            break;
+        case FKO_DIGEST_SHA384:
+            digest_len = SHA384_DIGEST_LEN;
+            break;
+        case FKO_DIGEST_SHA512:
+            digest_len = SHA512_DIGEST_LEN;
+            break;
+        default:
+            return(FKO_ERROR_INVALID_DATA_ENCODE_DIGEST_VALIDFAIL);
+    }
+
+    if(digest_size <= MD_HEX_SIZE((size_t)digest_len))
+        return(FKO_ERROR_INVALID_DATA);
+
+    for(i=0; i < count; i++)
+    {
+        if(spa_data[i] == NULL || digests[i] == NULL)
+            return(FKO_ERROR_INVALID_DATA);
+
+        digests[i][0] = '\0';
+
+        data_len = strnlen(spa_data[i], MAX_SPA_ENCODED_MSG_SIZE);
+        if(! is_valid_encoded_msg_len(data_len))
+            continue;
+
+        in[n]  = (unsigned char *)spa_data[i];
+        out[n] = digests[i];
+        len[n] = data_len;
+        n++;
+
+        if(n == RAW_DIGEST_BATCH)
+        {
+            raw_digest_batch(out, in, len, n, digest_type);
+            n = 0;
+        }
+    }
+
+    if(n > 0)
+        raw_digest_batch(out, in, len, n, digest_type);
+
+    return(FKO_SUCCESS);
+}
+
 /***EOF***/
@@ -117,7 +117,10 @@ fko_set_encoded_sdp_id(fko_ctx_t ctx, char *encoded_sdp_id)
     fiu_return_on("fko_set_encoded_sdp_id_val", FKO_ERROR_INVALID_DATA);
 #endif
 
-    ctx->encoded_sdp_id = strndup(encoded_sdp_id, B64_SDP_ID_STR_LEN);
+    if(ctx->encoded_sdp_id != NULL)
+        ctx_free(ctx, ctx->encoded_sdp_id);
+
+    ctx->encoded_sdp_id = ctx_strndup(ctx, encoded_sdp_id, B64_SDP_ID_STR_LEN);
     if(ctx->encoded_sdp_id == NULL)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -212,11 +215,11 @@ fko_encode_sdp_spa_data(fko_ctx_t ctx)
      * be freed before re-assignment.
     */
     if(ctx->encoded_sdp_id != NULL)
-        free(ctx->encoded_sdp_id);
+        ctx_free(ctx, ctx->encoded_sdp_id);
 
     /* Copy our encoded data into the context.
     */
-    ctx->encoded_sdp_id = strdup(tbuf_sdp_id);
+    ctx->encoded_sdp_id = ctx_strdup(ctx, tbuf_sdp_id);
     free(tbuf_sdp_id);
 
     if(ctx->encoded_sdp_id == NULL)
@@ -287,11 +290,11 @@ fko_encode_sdp_spa_data(fko_ctx_t ctx)
      * be freed before re-assignment.
     */
     if(ctx->encoded_msg != NULL)
-        free(ctx->encoded_msg);
+        ctx_free(ctx, ctx->encoded_msg);
 
     /* Copy our encoded data into the context.
     */
-    ctx->encoded_msg = strdup(tbuf);
+    ctx->encoded_msg = ctx_strdup(ctx, tbuf);
     free(tbuf);
 
     if(ctx->encoded_msg == NULL)
@@ -454,11 +457,11 @@ fko_encode_spa_data(fko_ctx_t ctx)
      * be freed before re-assignment.
     */
     if(ctx->encoded_msg != NULL)
-        free(ctx->encoded_msg);
+        ctx_free(ctx, ctx->encoded_msg);
 
     /* Copy our encoded data into the context.
     */
-    ctx->encoded_msg = strdup(tbuf);
+    ctx->encoded_msg = ctx_strdup(ctx, tbuf);
     free(tbuf);
 
     if(ctx->encoded_msg == NULL)
@@ -519,7 +522,7 @@ fko_set_encoded_data(fko_ctx_t ctx,
     if(encoded_msg == NULL)
         return(FKO_ERROR_INVALID_DATA);
 
-    ctx->encoded_msg = strdup(encoded_msg);
+    ctx->encoded_msg = ctx_strdup(ctx, encoded_msg);
 
     ctx->state |= FKO_DATA_MODIFIED;
 
@@ -552,9 +555,9 @@ fko_set_encoded_data(fko_ctx_t ctx,
         mlen = snprintf(tbuf, mlen, "%s:%s", ctx->encoded_msg, ctx->digest);
 
         if(ctx->encoded_msg != NULL)
-            free(ctx->encoded_msg);
+            ctx_free(ctx, ctx->encoded_msg);
 
-        ctx->encoded_msg = strdup(tbuf);
+        ctx->encoded_msg = ctx_strdup(ctx, tbuf);
         free(tbuf);
 
         if(ctx->encoded_msg == NULL)
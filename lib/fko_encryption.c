@@ -35,6 +35,10 @@
 #include "digest.h"
 #include "dbg.h"
 
+#ifdef HAVE_C_UNIT_TESTS
+DECLARE_TEST_SUITE(fko_encryption, "FKO encryption test suite");
+#endif
+
 #if HAVE_LIBGPGME
   #include "gpgme_funcs.h"
   #if HAVE_SYS_STAT_H
@@ -133,10 +137,10 @@ _rijndael_encrypt(fko_ctx_t ctx, const char *enc_key, const int enc_key_len)
     debug("_rijndael_encrypt() : encrypted msg after encoding: \n\t%s;", b64ciphertext);
 
     if(ctx->encrypted_msg != NULL)
-        zero_free_rv = zero_free(ctx->encrypted_msg,
+        zero_free_rv = ctx_zero_free(ctx, ctx->encrypted_msg,
                 strnlen(ctx->encrypted_msg, MAX_SPA_ENCODED_MSG_SIZE));
 
-    ctx->encrypted_msg = strdup(b64ciphertext);
+    ctx->encrypted_msg = ctx_strdup(ctx, b64ciphertext);
 
     /* Clean-up
     */
@@ -165,7 +169,8 @@ _rijndael_encrypt(fko_ctx_t ctx, const char *enc_key, const int enc_key_len)
 */
 static int
 _rijndael_decrypt(fko_ctx_t ctx,
-    const char *dec_key, const int key_len, int encryption_mode)
+    const char *dec_key, const int key_len,
+    const struct fko_enc_key *enc_key, int encryption_mode)
 {
     unsigned char  *ndx;
     unsigned char  *cipher;
@@ -194,7 +199,7 @@ _rijndael_decrypt(fko_ctx_t ctx,
     /* Create a bucket for the (base64) decoded encrypted data and get the
      * raw cipher data.
     */
-    cipher = calloc(1, ctx->encrypted_msg_len);
+    cipher = ctx_calloc(ctx, 1, ctx->encrypted_msg_len);
     if(cipher == NULL)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -204,7 +209,7 @@ _rijndael_decrypt(fko_ctx_t ctx,
 #else
     if((cipher_len = b64_decode(ctx->encrypted_msg, cipher)) < 0)
     {
-        if(zero_free((char *)cipher, ctx->encrypted_msg_len) == FKO_SUCCESS)
+        if(ctx_zero_free(ctx, (char *)cipher, ctx->encrypted_msg_len) == FKO_SUCCESS)
             return(FKO_ERROR_INVALID_DATA_ENCRYPT_CIPHERLEN_DECODEFAIL);
         else
             return(FKO_ERROR_ZERO_OUT_DATA);
@@ -216,37 +221,41 @@ _rijndael_decrypt(fko_ctx_t ctx,
     */
     if((cipher_len % RIJNDAEL_BLOCKSIZE) != 0)
     {
-        if(zero_free((char *)cipher, ctx->encrypted_msg_len) == FKO_SUCCESS)
+        if(ctx_zero_free(ctx, (char *)cipher, ctx->encrypted_msg_len) == FKO_SUCCESS)
             return(FKO_ERROR_INVALID_DATA_ENCRYPT_CIPHERLEN_VALIDFAIL);
         else
             return(FKO_ERROR_ZERO_OUT_DATA);
     }
 
     if(ctx->encoded_msg != NULL)
-        zero_free_rv = zero_free(ctx->encoded_msg,
+        zero_free_rv = ctx_zero_free(ctx, ctx->encoded_msg,
                 strnlen(ctx->encoded_msg, MAX_SPA_ENCODED_MSG_SIZE));
 
     /* Create a bucket for the plaintext data and decrypt the message
      * data into it.
     */
-    ctx->encoded_msg = calloc(1, cipher_len);
+    ctx->encoded_msg = ctx_calloc(ctx, 1, cipher_len);
     if(ctx->encoded_msg == NULL)
     {
-        if(zero_free((char *)cipher, ctx->encrypted_msg_len) == FKO_SUCCESS)
+        if(ctx_zero_free(ctx, (char *)cipher, ctx->encrypted_msg_len) == FKO_SUCCESS)
             return(FKO_ERROR_MEMORY_ALLOCATION);
         else
             return(FKO_ERROR_ZERO_OUT_DATA);
     }
 
-    pt_len = rij_decrypt(cipher, cipher_len, dec_key, key_len,
-                (unsigned char*)ctx->encoded_msg, encryption_mode);
+    if(enc_key != NULL)
+        pt_len = rij_decrypt_enc_key(cipher, cipher_len, enc_key,
+                    (unsigned char*)ctx->encoded_msg, encryption_mode);
+    else
+        pt_len = rij_decrypt(cipher, cipher_len, dec_key, key_len,
+                    (unsigned char*)ctx->encoded_msg, encryption_mode);
 
     debug("\n_rijndael_decrypt() : decrypted msg len: %d", pt_len);
     debug("_rijndael_decrypt() : decrypted msg: \n\t%s\n", ctx->encoded_msg);
 
     /* Done with cipher...
     */
-    if(zero_free((char *)cipher, ctx->encrypted_msg_len) != FKO_SUCCESS)
+    if(ctx_zero_free(ctx, (char *)cipher, ctx->encrypted_msg_len) != FKO_SUCCESS)
         zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
 
     /* The length of the decrypted data should be within 32 bytes of the
@@ -394,10 +403,10 @@ gpg_encrypt(fko_ctx_t ctx, const char *enc_key)
     strip_b64_eq(b64cipher);
 
     if(ctx->encrypted_msg != NULL)
-        zero_free_rv = zero_free(ctx->encrypted_msg,
+        zero_free_rv = ctx_zero_free(ctx, ctx->encrypted_msg,
                 strnlen(ctx->encrypted_msg, MAX_SPA_ENCODED_MSG_SIZE));
 
-    ctx->encrypted_msg = strdup(b64cipher);
+    ctx->encrypted_msg = ctx_strdup(ctx, b64cipher);
 
     /* Clean-up
     */
@@ -440,13 +449,13 @@ gpg_decrypt(fko_ctx_t ctx, const char *dec_key)
     /* Create a bucket for the (base64) decoded encrypted data and get the
      * raw cipher data.
     */
-    cipher = calloc(1, ctx->encrypted_msg_len);
+    cipher = ctx_calloc(ctx, 1, ctx->encrypted_msg_len);
     if(cipher == NULL)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
     if((b64_decode_len = b64_decode(ctx->encrypted_msg, cipher)) < 0)
     {
-        if(zero_free((char *) cipher, ctx->encrypted_msg_len) == FKO_SUCCESS)
+        if(ctx_zero_free(ctx, (char *) cipher, ctx->encrypted_msg_len) == FKO_SUCCESS)
             return(FKO_ERROR_INVALID_DATA_ENCRYPT_GPG_CIPHER_DECODEFAIL);
         else
             return(FKO_ERROR_ZERO_OUT_DATA);
@@ -471,7 +480,7 @@ gpg_decrypt(fko_ctx_t ctx, const char *dec_key)
 
     /* Done with cipher...
     */
-    if(zero_free((char *) cipher, ctx->encrypted_msg_len) != FKO_SUCCESS)
+    if(ctx_zero_free(ctx, (char *) cipher, ctx->encrypted_msg_len) != FKO_SUCCESS)
         return(FKO_ERROR_ZERO_OUT_DATA);
     else
         if(res != FKO_SUCCESS) /* bail if there was some other problem */
@@ -672,7 +681,7 @@ fko_decrypt_spa_data(fko_ctx_t ctx, const char * const dec_key, const int key_le
     {
         ctx->encryption_type = FKO_ENCRYPTION_RIJNDAEL;
         res = _rijndael_decrypt(ctx,
-            dec_key, key_len, ctx->encryption_mode);
+            dec_key, key_len, NULL, ctx->encryption_mode);
     }
     else
         return(FKO_ERROR_INVALID_DATA_ENCRYPT_TYPE_UNKNOWN);
@@ -680,6 +689,79 @@ fko_decrypt_spa_data(fko_ctx_t ctx, const char * const dec_key, const int key_le
     return(res);
 }
 
+/* Decrypt, decode and parse Rijndael SPA data with a key prepared by
+ * fko_new_enc_key().
+*/
+int
+fko_decrypt_spa_data_enc_key(fko_ctx_t ctx, const fko_enc_key_t enc_key)
+{
+    if(!CTX_INITIALIZED(ctx))
+        return(FKO_ERROR_CTX_NOT_INITIALIZED);
+
+    if(enc_key == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    if(fko_encryption_type(ctx->encrypted_msg) != FKO_ENCRYPTION_RIJNDAEL)
+        return(FKO_ERROR_INVALID_DATA_ENCRYPT_TYPE_UNKNOWN);
+
+    ctx->encryption_type = FKO_ENCRYPTION_RIJNDAEL;
+
+    return(_rijndael_decrypt(ctx, NULL, 0, enc_key, ctx->encryption_mode));
+}
+
+/* Prepare a Rijndael key for fko_decrypt_spa_data_enc_key() or
+ * fko_new_with_data_keys().  The password is padded for encryption_mode
+ * here, and the keys derived from it for each salt are kept in a small
+ * cache shared by all prepared keys.
+*/
+int
+fko_new_enc_key(fko_enc_key_t *r_enc_key, const char * const enc_key,
+    const int enc_key_len, const int encryption_mode)
+{
+    fko_enc_key_t   key = NULL;
+
+    if(r_enc_key == NULL || enc_key == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    if(enc_key_len < 0 || enc_key_len > RIJNDAEL_MAX_KEYSIZE)
+        return(FKO_ERROR_INVALID_KEY_LEN);
+
+    if(encryption_mode < 0 || encryption_mode >= FKO_LAST_ENC_MODE
+            || encryption_mode == FKO_ENC_MODE_ASYMMETRIC)
+        return(FKO_ERROR_INVALID_DATA_ENCRYPT_MODE_VALIDFAIL);
+
+    key = calloc(1, sizeof *key);
+    if(key == NULL)
+        return(FKO_ERROR_MEMORY_ALLOCATION);
+
+    rij_enc_key_init(key, enc_key, enc_key_len, encryption_mode);
+
+    *r_enc_key = key;
+
+    return(FKO_SUCCESS);
+}
+
+/* Wipe and free a prepared Rijndael key along with the keys derived from
+ * it.
+*/
+int
+fko_destroy_enc_key(fko_enc_key_t enc_key)
+{
+    int zero_free_rv = FKO_SUCCESS;
+
+    if(enc_key == NULL)
+        return(FKO_SUCCESS);
+
+    rij_key_cache_purge(enc_key);
+
+    if(zero_buf((char *)enc_key, sizeof *enc_key) != FKO_SUCCESS)
+        zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
+
+    free(enc_key);
+
+    return(zero_free_rv);
+}
+
 /* Return the assumed encryption type based on the raw encrypted data.
 */
 int
@@ -726,9 +808,9 @@ fko_set_gpg_recipient(fko_ctx_t ctx, const char * const recip)
         return(FKO_ERROR_WRONG_ENCRYPTION_TYPE);
 
     if(ctx->gpg_recipient != NULL)
-        free(ctx->gpg_recipient);
+        ctx_free(ctx, ctx->gpg_recipient);
 
-    ctx->gpg_recipient = strdup(recip);
+    ctx->gpg_recipient = ctx_strdup(ctx, recip);
     if(ctx->gpg_recipient == NULL)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -737,7 +819,7 @@ fko_set_gpg_recipient(fko_ctx_t ctx, const char * const recip)
     res = get_gpg_key(ctx, &key, 0);
     if(res != FKO_SUCCESS)
     {
-        free(ctx->gpg_recipient);
+        ctx_free(ctx, ctx->gpg_recipient);
         ctx->gpg_recipient = NULL;
         return(res);
     }
@@ -775,9 +857,9 @@ fko_set_gpg_exe(fko_ctx_t ctx, const char * const gpg_exe)
         return(FKO_ERROR_GPGME_BAD_GPG_EXE);
 
     if(ctx->gpg_exe != NULL)
-        free(ctx->gpg_exe);
+        ctx_free(ctx, ctx->gpg_exe);
 
-    ctx->gpg_exe = strdup(gpg_exe);
+    ctx->gpg_exe = ctx_strdup(ctx, gpg_exe);
     if(ctx->gpg_exe == NULL)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -843,9 +925,9 @@ fko_set_gpg_signer(fko_ctx_t ctx, const char * const signer)
         return(FKO_ERROR_WRONG_ENCRYPTION_TYPE);
 
     if(ctx->gpg_signer != NULL)
-        free(ctx->gpg_signer);
+        ctx_free(ctx, ctx->gpg_signer);
 
-    ctx->gpg_signer = strdup(signer);
+    ctx->gpg_signer = ctx_strdup(ctx, signer);
     if(ctx->gpg_signer == NULL)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -854,7 +936,7 @@ fko_set_gpg_signer(fko_ctx_t ctx, const char * const signer)
     res = get_gpg_key(ctx, &key, 1);
     if(res != FKO_SUCCESS)
     {
-        free(ctx->gpg_signer);
+        ctx_free(ctx, ctx->gpg_signer);
         ctx->gpg_signer = NULL;
         return(res);
     }
@@ -910,9 +992,9 @@ fko_set_gpg_home_dir(fko_ctx_t ctx, const char * const gpg_home_dir)
         return(FKO_ERROR_GPGME_BAD_HOME_DIR);
 
     if(ctx->gpg_home_dir != NULL)
-        free(ctx->gpg_home_dir);
+        ctx_free(ctx, ctx->gpg_home_dir);
 
-    ctx->gpg_home_dir = strdup(gpg_home_dir);
+    ctx->gpg_home_dir = ctx_strdup(ctx, gpg_home_dir);
     if(ctx->gpg_home_dir == NULL)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -1211,4 +1293,116 @@ fko_gpg_signature_fpr_match(fko_ctx_t ctx, const char * const id,
 #endif  /* HAVE_LIBGPGME */
 }
 
+#ifdef HAVE_C_UNIT_TESTS
+
+/* Create SPA data encrypted with key in the given mode
+*/
+static char *
+utest_spa_data(const char *key, const int encryption_mode)
+{
+    fko_ctx_t   ctx = NULL;
+    char       *spa_data = NULL, *copy = NULL;
+
+    if(fko_new(&ctx) != FKO_SUCCESS)
+        return NULL;
+
+    if(fko_set_sdp_id(ctx, 12345) == FKO_SUCCESS
+            && fko_set_spa_message(ctx, "192.0.2.1,tcp/22") == FKO_SUCCESS
+            && fko_set_spa_encryption_mode(ctx, encryption_mode) == FKO_SUCCESS
+            && fko_spa_data_final(ctx, key, strlen(key), NULL, 0) == FKO_SUCCESS
+            && fko_get_spa_data(ctx, &spa_data) == FKO_SUCCESS)
+        copy = strdup(spa_data);
+
+    fko_destroy(ctx);
+    return copy;
+}
+
+DECLARE_UTEST(enc_key_decrypt, "decrypt SPA data with prepared and cached keys")
+{
+    fko_ctx_t       ctx = NULL;
+    fko_enc_key_t   key = NULL, same_key = NULL, legacy_key = NULL, bad_key = NULL;
+    char           *cbc_data = NULL, *legacy_data = NULL, *msg = NULL;
+    unsigned long   hits, misses, hits0, misses0;
+
+    cbc_data    = utest_spa_data("enckey1234", FKO_ENC_MODE_CBC);
+    legacy_data = utest_spa_data("enckey1234", FKO_ENC_MODE_CBC_LEGACY_IV);
+    CU_ASSERT_FATAL(cbc_data != NULL && legacy_data != NULL);
+
+    CU_ASSERT(fko_new_enc_key(&key, "enckey1234", 10, FKO_ENC_MODE_CBC) == FKO_SUCCESS);
+    CU_ASSERT(fko_new_enc_key(&same_key, "enckey1234", 10, FKO_ENC_MODE_CBC) == FKO_SUCCESS);
+    CU_ASSERT(fko_new_enc_key(&legacy_key, "enckey1234", 10,
+                FKO_ENC_MODE_CBC_LEGACY_IV) == FKO_SUCCESS);
+    CU_ASSERT(fko_new_enc_key(&bad_key, "enckey1235", 10, FKO_ENC_MODE_CBC) == FKO_SUCCESS);
+    CU_ASSERT(fko_new_enc_key(&bad_key, NULL, 10, FKO_ENC_MODE_CBC) == FKO_ERROR_INVALID_DATA);
+    CU_ASSERT(fko_new_enc_key(&bad_key, "enckey1234", RIJNDAEL_MAX_KEYSIZE+1,
+                FKO_ENC_MODE_CBC) == FKO_ERROR_INVALID_KEY_LEN);
+    CU_ASSERT(fko_new_enc_key(&bad_key, "enckey1234", 10,
+                FKO_ENC_MODE_ASYMMETRIC) == FKO_ERROR_INVALID_DATA_ENCRYPT_MODE_VALIDFAIL);
+
+    /* The first decryption derives the key, later ones with the same
+     * password and salt (from any prepared key) find it in the cache
+    */
+    rij_key_cache_stats(&hits0, &misses0);
+
+    CU_ASSERT(fko_new_with_data_keys(&ctx, cbc_data, key, NULL, 12345) == FKO_SUCCESS);
+    CU_ASSERT(fko_get_spa_message(ctx, &msg) == FKO_SUCCESS);
+    CU_ASSERT(msg != NULL && strcmp(msg, "192.0.2.1,tcp/22") == 0);
+    fko_destroy(ctx);
+    ctx = NULL;
+
+    CU_ASSERT(fko_new_with_data_keys(&ctx, cbc_data, same_key, NULL, 12345) == FKO_SUCCESS);
+    fko_destroy(ctx);
+    ctx = NULL;
+
+    rij_key_cache_stats(&hits, &misses);
+    CU_ASSERT(misses - misses0 == 1);
+    CU_ASSERT(hits - hits0 == 1);
+
+    CU_ASSERT(fko_new_with_data_keys(&ctx, cbc_data, bad_key, NULL, 12345) != FKO_SUCCESS);
+    CU_ASSERT(ctx == NULL);
+
+    /* Legacy IV mode pads the short password
+    */
+    CU_ASSERT(fko_new_with_data_keys(&ctx, legacy_data, legacy_key, NULL, 12345) == FKO_SUCCESS);
+    fko_destroy(ctx);
+    ctx = NULL;
+    CU_ASSERT(fko_new_with_data_keys(&ctx, legacy_data, key, NULL, 12345) != FKO_SUCCESS);
+    ctx = NULL;
+
+    /* A key prepared for the other mode falls back to the raw password
+    */
+    CU_ASSERT(fko_new_with_data(&ctx, cbc_data, NULL, 0, FKO_ENC_MODE_CBC,
+                NULL, 0, FKO_HMAC_UNKNOWN, 12345) == FKO_SUCCESS);
+    CU_ASSERT(fko_decrypt_spa_data_enc_key(ctx, legacy_key) == FKO_SUCCESS);
+    fko_destroy(ctx);
+    ctx = NULL;
+
+    /* Destroying a key drops what was derived from its password
+    */
+    CU_ASSERT(fko_destroy_enc_key(key) == FKO_SUCCESS);
+    rij_key_cache_stats(&hits0, &misses0);
+    CU_ASSERT(fko_new_with_data_keys(&ctx, cbc_data, same_key, NULL, 12345) == FKO_SUCCESS);
+    fko_destroy(ctx);
+    rij_key_cache_stats(&hits, &misses);
+    CU_ASSERT(misses - misses0 == 1);
+
+    CU_ASSERT(fko_new_with_data_keys(&ctx, cbc_data, NULL, NULL, 12345) == FKO_ERROR_INVALID_DATA);
+
+    fko_destroy_enc_key(same_key);
+    fko_destroy_enc_key(legacy_key);
+    fko_destroy_enc_key(bad_key);
+    free(cbc_data);
+    free(legacy_data);
+}
+
+int register_ts_fko_encryption(void)
+{
+    ts_init(&TEST_SUITE(fko_encryption), TEST_SUITE_DESCR(fko_encryption), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(fko_encryption), UTEST_FCT(enc_key_decrypt), UTEST_DESCR(enc_key_decrypt));
+
+    return register_ts(&TEST_SUITE(fko_encryption));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */
+
 /***EOF***/
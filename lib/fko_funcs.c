@@ -162,15 +162,32 @@ fko_new(fko_ctx_t *r_ctx)
     return(FKO_SUCCESS);
 }
 
+/* Give back the memory of a context, wherever it came from
+*/
+static void
+free_ctx(fko_ctx_t ctx)
+{
+    fko_arena_t arena = ctx->arena;
+
+    memset(ctx, 0x0, sizeof(*ctx));
+
+    if(arena != NULL)
+        arena_ctx_release(arena);
+    else
+        free(ctx);
+}
+
 /* Initialize an fko context with external (encrypted/encoded) data.
  * This is used to create a context with the purpose of decoding
  * and parsing the provided data into the context data.
 */
-int
-fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
+static int
+new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
     const char * const dec_key, const int dec_key_len,
     int encryption_mode, const char * const hmac_key,
-    const int hmac_key_len, const int hmac_type, const uint32_t sdp_id)
+    const int hmac_key_len, const int hmac_type,
+    const fko_hmac_key_t prep_hmac_key, const fko_enc_key_t prep_enc_key,
+    const uint32_t sdp_id, fko_arena_t arena)
 {
     fko_ctx_t   ctx = NULL;
     int         res = FKO_SUCCESS; /* Are we optimistic or what? */
@@ -192,8 +209,9 @@ fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
     if(dec_key_len < 0 || hmac_key_len < 0)
         return(FKO_ERROR_INVALID_KEY_LEN);
 
-    ctx = calloc(1, sizeof *ctx);
-    if(ctx == NULL)
+    if(arena != NULL && (ctx = arena_ctx_alloc(arena)) != NULL)
+        ctx->arena = arena;
+    else if((ctx = calloc(1, sizeof *ctx)) == NULL)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
     // if SDP client ID is nonzero, SDP mode is enabled
@@ -207,18 +225,18 @@ fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
 
     if(! is_valid_encoded_msg_len(enc_msg_len))
     {
-        free(ctx);
+        free_ctx(ctx);
         return(FKO_ERROR_INVALID_DATA_FUNCS_NEW_MSGLEN_VALIDFAIL);
     }
 
     /* First, add the data to the context.
     */
-    ctx->encrypted_msg     = strdup(enc_msg);
+    ctx->encrypted_msg     = ctx_strndup(ctx, enc_msg, enc_msg_len);
     ctx->encrypted_msg_len = enc_msg_len;
 
     if(ctx->encrypted_msg == NULL)
     {
-        free(ctx);
+        free_ctx(ctx);
         return(FKO_ERROR_MEMORY_ALLOCATION);
     }
 
@@ -245,9 +263,12 @@ fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
 
     /* Check HMAC if the access stanza had an HMAC key
     */
-    if(hmac_key_len > 0 && hmac_key != NULL)
+    if(prep_hmac_key != NULL || (hmac_key_len > 0 && hmac_key != NULL))
     {
-        res = fko_verify_hmac(ctx, hmac_key, hmac_key_len);
+        if(prep_hmac_key != NULL)
+            res = fko_verify_hmac_key(ctx, prep_hmac_key);
+        else
+            res = fko_verify_hmac(ctx, hmac_key, hmac_key_len);
 		if(res != FKO_SUCCESS)
 		{
 			fko_destroy(ctx);
@@ -281,9 +302,12 @@ fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
 
     /* If a decryption key is provided, go ahead and decrypt and decode.
     */
-    if(dec_key != NULL)
+    if(prep_enc_key != NULL || dec_key != NULL)
     {
-        res = fko_decrypt_spa_data(ctx, dec_key, dec_key_len);
+        if(prep_enc_key != NULL)
+            res = fko_decrypt_spa_data_enc_key(ctx, prep_enc_key);
+        else
+            res = fko_decrypt_spa_data(ctx, dec_key, dec_key_len);
 
         if(res != FKO_SUCCESS)
         {
@@ -306,6 +330,65 @@ fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
     return(res);
 }
 
+int
+fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
+    const char * const dec_key, const int dec_key_len,
+    int encryption_mode, const char * const hmac_key,
+    const int hmac_key_len, const int hmac_type, const uint32_t sdp_id)
+{
+    return(new_with_data(r_ctx, enc_msg, dec_key, dec_key_len,
+        encryption_mode, hmac_key, hmac_key_len, hmac_type, NULL, NULL,
+        sdp_id, NULL));
+}
+
+/* Same as fko_new_with_data(), but the HMAC is checked with a key that was
+ * prepared by fko_new_hmac_key() (which also sets the HMAC type).
+*/
+int
+fko_new_with_data_hmac_key(fko_ctx_t *r_ctx, const char * const enc_msg,
+    const char * const dec_key, const int dec_key_len,
+    int encryption_mode, const fko_hmac_key_t hmac_key,
+    const uint32_t sdp_id)
+{
+    if(hmac_key == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    return(new_with_data(r_ctx, enc_msg, dec_key, dec_key_len,
+        encryption_mode, NULL, 0, FKO_HMAC_UNKNOWN, hmac_key, NULL, sdp_id,
+        NULL));
+}
+
+/* Same as fko_new_with_data(), but with a Rijndael key prepared by
+ * fko_new_enc_key() (which also sets the encryption mode) and, if the
+ * data carries an HMAC, a key prepared by fko_new_hmac_key().
+*/
+int
+fko_new_with_data_keys(fko_ctx_t *r_ctx, const char * const enc_msg,
+    const fko_enc_key_t enc_key, const fko_hmac_key_t hmac_key,
+    const uint32_t sdp_id)
+{
+    if(enc_key == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    return(new_with_data(r_ctx, enc_msg, NULL, 0, enc_key->encryption_mode,
+        NULL, 0, FKO_HMAC_UNKNOWN, hmac_key, enc_key, sdp_id, NULL));
+}
+
+/* Same as fko_new_with_data_keys(), but the context and all of its buffers
+ * are carved out of arena (see fko_new_arena()) instead of the heap.  With
+ * a NULL enc_key the data is not decrypted.  If the arena is already
+ * holding a context, the new one comes from the heap.
+*/
+int
+fko_new_with_data_arena(fko_ctx_t *r_ctx, const char * const enc_msg,
+    const fko_enc_key_t enc_key, const fko_hmac_key_t hmac_key,
+    const uint32_t sdp_id, fko_arena_t arena)
+{
+    return(new_with_data(r_ctx, enc_msg, NULL, 0,
+        enc_key != NULL ? enc_key->encryption_mode : FKO_DEFAULT_ENC_MODE,
+        NULL, 0, FKO_HMAC_UNKNOWN, hmac_key, enc_key, sdp_id, arena));
+}
+
 /* Destroy a context and free its resources
 */
 int
@@ -321,63 +404,63 @@ fko_destroy(fko_ctx_t ctx)
         return(zero_free_rv);
 
     if(ctx->rand_val != NULL)
-        free(ctx->rand_val);
+        ctx_free(ctx, ctx->rand_val);
 
     if(ctx->username != NULL)
-        free(ctx->username);
+        ctx_free(ctx, ctx->username);
 
     if(ctx->version != NULL)
-        free(ctx->version);
+        ctx_free(ctx, ctx->version);
 
     if(ctx->message != NULL)
-        free(ctx->message);
+        ctx_free(ctx, ctx->message);
 
     if(ctx->nat_access != NULL)
-        free(ctx->nat_access);
+        ctx_free(ctx, ctx->nat_access);
 
     if(ctx->server_auth != NULL)
-        free(ctx->server_auth);
+        ctx_free(ctx, ctx->server_auth);
 
     if(ctx->digest != NULL)
-        if(zero_free(ctx->digest, ctx->digest_len) != FKO_SUCCESS)
+        if(ctx_zero_free(ctx, ctx->digest, ctx->digest_len) != FKO_SUCCESS)
             zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
 
     if(ctx->raw_digest != NULL)
-        if(zero_free(ctx->raw_digest, ctx->raw_digest_len) != FKO_SUCCESS)
+        if(ctx_zero_free(ctx, ctx->raw_digest, ctx->raw_digest_len) != FKO_SUCCESS)
             zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
 
     if(ctx->encoded_sdp_id != NULL)
-        if(zero_free(ctx->encoded_sdp_id, ctx->encoded_sdp_id_len) != FKO_SUCCESS)
+        if(ctx_zero_free(ctx, ctx->encoded_sdp_id, ctx->encoded_sdp_id_len) != FKO_SUCCESS)
             zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
 
     if(ctx->encoded_msg != NULL)
-        if(zero_free(ctx->encoded_msg, ctx->encoded_msg_len) != FKO_SUCCESS)
+        if(ctx_zero_free(ctx, ctx->encoded_msg, ctx->encoded_msg_len) != FKO_SUCCESS)
             zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
 
     if(ctx->encrypted_msg != NULL)
-        if(zero_free(ctx->encrypted_msg, ctx->encrypted_msg_len) != FKO_SUCCESS)
+        if(ctx_zero_free(ctx, ctx->encrypted_msg, ctx->encrypted_msg_len) != FKO_SUCCESS)
             zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
 
     if(ctx->final_msg != NULL)
-        if(zero_free(ctx->final_msg, ctx->final_msg_len) != FKO_SUCCESS)
+        if(ctx_zero_free(ctx, ctx->final_msg, ctx->final_msg_len) != FKO_SUCCESS)
             zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
 
     if(ctx->msg_hmac != NULL)
-        if(zero_free(ctx->msg_hmac, ctx->msg_hmac_len) != FKO_SUCCESS)
+        if(ctx_zero_free(ctx, ctx->msg_hmac, ctx->msg_hmac_len) != FKO_SUCCESS)
             zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
 
 #if HAVE_LIBGPGME
     if(ctx->gpg_exe != NULL)
-        free(ctx->gpg_exe);
+        ctx_free(ctx, ctx->gpg_exe);
 
     if(ctx->gpg_home_dir != NULL)
-        free(ctx->gpg_home_dir);
+        ctx_free(ctx, ctx->gpg_home_dir);
 
     if(ctx->gpg_recipient != NULL)
-        free(ctx->gpg_recipient);
+        ctx_free(ctx, ctx->gpg_recipient);
 
     if(ctx->gpg_signer != NULL)
-        free(ctx->gpg_signer);
+        ctx_free(ctx, ctx->gpg_signer);
 
     if(ctx->recipient_key != NULL)
         gpgme_key_unref(ctx->recipient_key);
@@ -402,9 +485,7 @@ fko_destroy(fko_ctx_t ctx)
 
 #endif /* HAVE_LIBGPGME */
 
-    memset(ctx, 0x0, sizeof(*ctx));
-
-    free(ctx);
+    free_ctx(ctx);
 
     return(zero_free_rv);
 }
@@ -573,49 +654,26 @@ fko_get_sdp_id(fko_ctx_t ctx, uint32_t *sdp_id)
 int
 fko_strip_sdp_id(fko_ctx_t ctx)
 {
-	char *tbuf = NULL;
-	char *ndx = NULL;
 	int res = 0;
 
 	// first store the encoded sdp client id in the context
-	tbuf = calloc(1, B64_SDP_ID_STR_LEN + 1);
-	if(tbuf == NULL)
-	{
-		fko_destroy(ctx);
-		ctx = NULL;
-		return FKO_ERROR_MEMORY_ALLOCATION;
-	}
-
-	strncpy(tbuf, ctx->encrypted_msg, B64_SDP_ID_STR_LEN);
-	tbuf[B64_SDP_ID_STR_LEN] = '\0';
-	res = fko_set_encoded_sdp_id(ctx, tbuf);
-	free(tbuf);
-	tbuf = NULL;
-
+	res = fko_set_encoded_sdp_id(ctx, ctx->encrypted_msg);
 	if(res != FKO_SUCCESS)
 	{
 		return res;
 	}
 
-	// the ID is always 6 bytes
-	ndx = ctx->encrypted_msg + B64_SDP_ID_STR_LEN;
-
-	tbuf = strndup(ndx, MAX_SPA_ENCODED_MSG_SIZE);
-	if(tbuf == NULL)
+	// the ID is always 6 bytes, move the rest of the data down over it
+	// and wipe the tail that is left behind
+	if(ctx->encrypted_msg_len < B64_SDP_ID_STR_LEN)
 	{
-		return FKO_ERROR_MEMORY_ALLOCATION;
+		return(FKO_ERROR_INVALID_DATA_FUNCS_NEW_MSGLEN_VALIDFAIL);
 	}
 
-	free(ctx->encrypted_msg);
-
-	ctx->encrypted_msg = strndup(tbuf, MAX_SPA_ENCODED_MSG_SIZE);
-
-	free(tbuf);
-
-	if(ctx->encrypted_msg == NULL)
-	{
-		return FKO_ERROR_MEMORY_ALLOCATION;
-	}
+	memmove(ctx->encrypted_msg, ctx->encrypted_msg + B64_SDP_ID_STR_LEN,
+			ctx->encrypted_msg_len - B64_SDP_ID_STR_LEN);
+	memset(ctx->encrypted_msg + ctx->encrypted_msg_len - B64_SDP_ID_STR_LEN,
+			0x0, B64_SDP_ID_STR_LEN);
 
 	ctx->encrypted_msg_len = strnlen(ctx->encrypted_msg, MAX_SPA_ENCODED_MSG_SIZE);
 
@@ -687,9 +745,9 @@ fko_spa_data_final(fko_ctx_t ctx,
         /* encrypted_msg needs to
          * be freed before re-assignment.
         */
-        free(ctx->encrypted_msg);
+        ctx_free(ctx, ctx->encrypted_msg);
 
-        ctx->encrypted_msg = strdup(tbuf);
+        ctx->encrypted_msg = ctx_strdup(ctx, tbuf);
         free(tbuf);
 
         ctx->encrypted_msg_len = strnlen(ctx->encrypted_msg, MAX_SPA_ENCODED_MSG_SIZE);
@@ -726,10 +784,10 @@ fko_spa_data_final(fko_ctx_t ctx,
          * be freed before re-assignment.
         */
         debug("fko_spa_data_final() : freeing old message string...");
-        free(ctx->encrypted_msg);
+        ctx_free(ctx, ctx->encrypted_msg);
 
         debug("fko_spa_data_final() : duplicating new message...");
-        ctx->encrypted_msg = strdup(tbuf);
+        ctx->encrypted_msg = ctx_strdup(ctx, tbuf);
         free(tbuf);
 
         ctx->encrypted_msg_len = strnlen(ctx->encrypted_msg, MAX_SPA_ENCODED_MSG_SIZE);
@@ -760,7 +818,7 @@ fko_spa_data_final(fko_ctx_t ctx,
                 = ctx->encrypted_msg_len+1+ctx->msg_hmac_len+1;
 
             debug("fko_spa_data_final() : expanding message buffer...");
-            tbuf = realloc(ctx->encrypted_msg, data_with_hmac_len);
+            tbuf = ctx_realloc(ctx, ctx->encrypted_msg, data_with_hmac_len);
             if (tbuf == NULL)
                 return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -833,11 +891,11 @@ fko_set_spa_data(fko_ctx_t ctx, const char * const enc_msg)
         return(FKO_ERROR_INVALID_DATA_FUNCS_SET_MSGLEN_VALIDFAIL);
 
     if(ctx->encrypted_msg != NULL)
-        free(ctx->encrypted_msg);
+        ctx_free(ctx, ctx->encrypted_msg);
 
     /* First, add the data to the context.
     */
-    ctx->encrypted_msg = strdup(enc_msg);
+    ctx->encrypted_msg = ctx_strdup(ctx, enc_msg);
     ctx->encrypted_msg_len = enc_msg_len;
 
     if(ctx->encrypted_msg == NULL)
@@ -865,11 +923,11 @@ fko_afl_set_spa_data(fko_ctx_t ctx, const char * const enc_msg, const int enc_ms
         return(FKO_ERROR_INVALID_DATA_FUNCS_SET_MSGLEN_VALIDFAIL);
 
     if(ctx->encrypted_msg != NULL)
-        free(ctx->encrypted_msg);
+        ctx_free(ctx, ctx->encrypted_msg);
 
     /* Copy the raw encrypted data into the context
     */
-    ctx->encrypted_msg = calloc(1, enc_msg_len);
+    ctx->encrypted_msg = ctx_calloc(ctx, 1, enc_msg_len);
     if(ctx->encrypted_msg == NULL)
         return(FKO_ERROR_MEMORY_ALLOCATION);
 
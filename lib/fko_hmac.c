@@ -34,14 +34,93 @@
 #include "hmac.h"
 #include "base64.h"
 
+#ifdef HAVE_C_UNIT_TESTS
+DECLARE_TEST_SUITE(fko_hmac, "FKO hmac test suite");
+#endif
+
+/* A prepared HMAC key (see fko_new_hmac_key())
+*/
+struct fko_hmac_key {
+    hmac_prepared_t prep;
+};
+
+static int
+hmac_b64_digest_len(const int hmac_type)
+{
+    switch(hmac_type)
+    {
+        case FKO_HMAC_MD5:
+            return MD5_B64_LEN;
+        case FKO_HMAC_SHA1:
+            return SHA1_B64_LEN;
+        case FKO_HMAC_SHA256:
+            return SHA256_B64_LEN;
+        case FKO_HMAC_SHA384:
+            return SHA384_B64_LEN;
+        case FKO_HMAC_SHA512:
+            return SHA512_B64_LEN;
+    }
+    return -1;
+}
+
+/* Calculate the HMAC of the encrypted data with the prepared key, compare
+ * it with the digest at the end of the data and chop that digest off.  The
+ * data is hashed and compared in place.
+*/
+static int
+verify_hmac_prepared(fko_ctx_t ctx, const hmac_prepared_t *prep)
+{
+    unsigned char   hmac[SHA512_DIGEST_LEN] = {0};
+    char            hmac_base64[MD_HEX_SIZE(SHA512_DIGEST_LEN)+1] = {0};
+    int             hmac_b64_len = 0, msg_len = 0, res = FKO_SUCCESS;
+
+    if (! is_valid_encoded_msg_len(ctx->encrypted_msg_len))
+        return(FKO_ERROR_INVALID_DATA_HMAC_MSGLEN_VALIDFAIL);
+
+    if((hmac_b64_len = hmac_b64_digest_len(prep->hmac_type)) < 0)
+        return(FKO_ERROR_UNSUPPORTED_HMAC_MODE);
+
+    if((ctx->encrypted_msg_len - hmac_b64_len)
+            < MIN_SPA_ENCODED_MSG_SIZE)
+        return(FKO_ERROR_INVALID_DATA_HMAC_ENCMSGLEN_VALIDFAIL);
+
+    res = fko_set_spa_hmac_type(ctx, prep->hmac_type);
+    if(res != FKO_SUCCESS)
+        return(res);
+
+    msg_len = ctx->encrypted_msg_len - hmac_b64_len;
+
+    hmac_with_prepared(prep, ctx->encrypted_msg, msg_len, hmac);
+    b64_encode(hmac, hmac_base64, prep->digest_len);
+    strip_b64_eq(hmac_base64);
+
+    if(constant_runtime_cmp(ctx->encrypted_msg + msg_len,
+            hmac_base64, hmac_b64_len) != 0)
+        res = FKO_ERROR_INVALID_DATA_HMAC_COMPAREFAIL;
+
+    /* Now we chop the HMAC digest off of the encrypted msg
+    */
+    memset(ctx->encrypted_msg + msg_len, 0x0, hmac_b64_len);
+    ctx->encrypted_msg_len = msg_len;
+
+    if(ctx->msg_hmac != NULL)
+        ctx_free(ctx, ctx->msg_hmac);
+
+    ctx->msg_hmac = ctx_strdup(ctx, hmac_base64);
+    if(ctx->msg_hmac == NULL)
+        return(FKO_ERROR_MEMORY_ALLOCATION);
+
+    ctx->msg_hmac_len = hmac_b64_len;
+
+    return(res);
+}
+
 int
 fko_verify_hmac(fko_ctx_t ctx,
     const char * const hmac_key, const int hmac_key_len)
 {
-    char    *hmac_digest_from_data = NULL;
-    char    *tbuf = NULL;
-    int      res = FKO_SUCCESS;
-    int      hmac_b64_digest_len = 0, zero_free_rv = FKO_SUCCESS;
+    struct fko_hmac_key key;
+    int                 res = FKO_SUCCESS;
 
     /* Must be initialized
     */
@@ -57,111 +136,81 @@ fko_verify_hmac(fko_ctx_t ctx,
     if(hmac_key_len < 0 || hmac_key_len > MAX_DIGEST_BLOCK_LEN)
         return(FKO_ERROR_INVALID_HMAC_KEY_LEN);
 
-    if(ctx->hmac_type == FKO_HMAC_MD5)
-        hmac_b64_digest_len = MD5_B64_LEN;
-    else if(ctx->hmac_type == FKO_HMAC_SHA1)
-        hmac_b64_digest_len = SHA1_B64_LEN;
-    else if(ctx->hmac_type == FKO_HMAC_SHA256)
-        hmac_b64_digest_len = SHA256_B64_LEN;
-    else if(ctx->hmac_type == FKO_HMAC_SHA384)
-        hmac_b64_digest_len = SHA384_B64_LEN;
-    else if(ctx->hmac_type == FKO_HMAC_SHA512)
-        hmac_b64_digest_len = SHA512_B64_LEN;
-    else
+    if(hmac_prepare(&key.prep, ctx->hmac_type, hmac_key, hmac_key_len) != 0)
         return(FKO_ERROR_UNSUPPORTED_HMAC_MODE);
 
-    if((ctx->encrypted_msg_len - hmac_b64_digest_len)
-            < MIN_SPA_ENCODED_MSG_SIZE)
-        return(FKO_ERROR_INVALID_DATA_HMAC_ENCMSGLEN_VALIDFAIL);
+    res = verify_hmac_prepared(ctx, &key.prep);
 
-    /* Get digest value
-    */
-    hmac_digest_from_data = strndup((ctx->encrypted_msg
-            + ctx->encrypted_msg_len - hmac_b64_digest_len),
-            hmac_b64_digest_len);
+    if(zero_buf((char *)&key, sizeof(key)) != FKO_SUCCESS && res == FKO_SUCCESS)
+        res = FKO_ERROR_ZERO_OUT_DATA;
 
-    if(hmac_digest_from_data == NULL)
-        return(FKO_ERROR_MEMORY_ALLOCATION);
+    return(res);
+}
 
-    /* Now we chop the HMAC digest off of the encrypted msg
+/* Same as fko_verify_hmac(), but with a key from fko_new_hmac_key().  The
+ * context takes the HMAC type of the key.
+*/
+int
+fko_verify_hmac_key(fko_ctx_t ctx, const fko_hmac_key_t hmac_key)
+{
+    /* Must be initialized
     */
-    tbuf = strndup(ctx->encrypted_msg,
-            ctx->encrypted_msg_len - hmac_b64_digest_len);
+    if(!CTX_INITIALIZED(ctx))
+        return(FKO_ERROR_CTX_NOT_INITIALIZED);
 
-    if(tbuf == NULL)
-    {
-        if(zero_free(hmac_digest_from_data, strnlen(hmac_digest_from_data,
-                MAX_SPA_ENCODED_MSG_SIZE)) == FKO_SUCCESS)
-            return(FKO_ERROR_MEMORY_ALLOCATION);
-        else
-            return(FKO_ERROR_ZERO_OUT_DATA);
-    }
+    if(hmac_key == NULL)
+        return(FKO_ERROR_INVALID_DATA);
 
-    if(zero_free(ctx->encrypted_msg, ctx->encrypted_msg_len) != FKO_SUCCESS)
-        zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
+    return(verify_hmac_prepared(ctx, &hmac_key->prep));
+}
 
-    ctx->encrypted_msg      = tbuf;
-    ctx->encrypted_msg_len -= hmac_b64_digest_len;
+/* Prepare an HMAC key for repeated use with fko_verify_hmac_key() or
+ * fko_new_with_data_hmac_key().  The key pads are hashed here once instead
+ * of for every SPA packet.
+*/
+int
+fko_new_hmac_key(fko_hmac_key_t *r_hmac_key, const char * const hmac_key,
+    const int hmac_key_len, const int hmac_type)
+{
+    fko_hmac_key_t  key = NULL;
 
-    if(ctx->encryption_mode == FKO_ENC_MODE_ASYMMETRIC)
-    {
-        /* See if we need to add the "hQ" string to the front of the
-         * encrypted data.
-         */
-        if(! ctx->added_gpg_prefix)
-        {
-            //res = add_gpg_prefix(ctx);
-        }
-    }
-    else
-    {
-        /* See if we need to add the "Salted__" string to the front of the
-         * encrypted data.
-         */
-        if(! ctx->added_salted_str)
-        {
-            //res = add_salted_str(ctx);
-        }
-    }
+    if(r_hmac_key == NULL || hmac_key == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    if(hmac_key_len < 0 || hmac_key_len > MAX_DIGEST_BLOCK_LEN)
+        return(FKO_ERROR_INVALID_HMAC_KEY_LEN);
+
+    key = calloc(1, sizeof *key);
+    if(key == NULL)
+        return(FKO_ERROR_MEMORY_ALLOCATION);
 
-    if (res != FKO_SUCCESS)
+    if(hmac_prepare(&key->prep, hmac_type, hmac_key, hmac_key_len) != 0)
     {
-        if(zero_free(hmac_digest_from_data, strnlen(hmac_digest_from_data,
-                        MAX_SPA_ENCODED_MSG_SIZE)) != FKO_SUCCESS)
-            zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
-
-        if(zero_free_rv == FKO_SUCCESS)
-            return(res);
-        else
-            return(zero_free_rv);
+        free(key);
+        return(FKO_ERROR_UNSUPPORTED_HMAC_MODE);
     }
 
-    /* Calculate the HMAC from the encrypted data and then
-     * compare
-    */
-    res = fko_set_spa_hmac_type(ctx, ctx->hmac_type);
-    if(res == FKO_SUCCESS)
-    {
-        res = fko_set_spa_hmac(ctx, hmac_key, hmac_key_len);
+    *r_hmac_key = key;
 
-        if(res == FKO_SUCCESS)
-        {
-            if(constant_runtime_cmp(hmac_digest_from_data,
-                    ctx->msg_hmac, hmac_b64_digest_len) != 0)
-            {
-                res = FKO_ERROR_INVALID_DATA_HMAC_COMPAREFAIL;
-            }
-        }
-    }
+    return(FKO_SUCCESS);
+}
+
+/* Wipe and free a prepared HMAC key
+*/
+int
+fko_destroy_hmac_key(fko_hmac_key_t hmac_key)
+{
+    int zero_free_rv = FKO_SUCCESS;
+
+    if(hmac_key == NULL)
+        return(FKO_SUCCESS);
 
-    if(zero_free(hmac_digest_from_data, strnlen(hmac_digest_from_data,
-                    MAX_SPA_ENCODED_MSG_SIZE)) != FKO_SUCCESS)
+    if(zero_buf((char *)hmac_key, sizeof *hmac_key) != FKO_SUCCESS)
         zero_free_rv = FKO_ERROR_ZERO_OUT_DATA;
 
-    if(res == FKO_SUCCESS)
-        return(zero_free_rv);
-    else
-        return(res);
+    free(hmac_key);
+
+    return(zero_free_rv);
 }
 
 /* Return the fko HMAC data
@@ -298,9 +347,9 @@ int fko_set_spa_hmac(fko_ctx_t ctx,
     strip_b64_eq(hmac_base64);
 
     if(ctx->msg_hmac != NULL)
-        free(ctx->msg_hmac);
+        ctx_free(ctx, ctx->msg_hmac);
 
-    ctx->msg_hmac = strdup(hmac_base64);
+    ctx->msg_hmac = ctx_strdup(ctx, hmac_base64);
 
     free(hmac_base64);
 
@@ -328,4 +377,122 @@ int fko_set_spa_hmac(fko_ctx_t ctx,
     return FKO_SUCCESS;
 }
 
+#ifdef HAVE_C_UNIT_TESTS
+
+DECLARE_UTEST(prepared_digest, "HMACs from prepared keys match the one-shot ones")
+{
+    hmac_prepared_t prep;
+    unsigned char   one_shot[SHA512_DIGEST_LEN], prepared[SHA512_DIGEST_LEN];
+    char            key[MAX_DIGEST_BLOCK_LEN], msg[512];
+    int             key_lens[] = {1, 16, 32, 64, 100, MAX_DIGEST_BLOCK_LEN};
+    int             i, j, type;
+
+    for(i=0; i < (int)sizeof(key); i++)
+        key[i] = (char)(i * 7 + 1);
+    for(i=0; i < (int)sizeof(msg); i++)
+        msg[i] = 'A' + (i % 26);
+
+    for(type=FKO_HMAC_MD5; type < FKO_LAST_HMAC_MODE; type++)
+    {
+        for(j=0; j < (int)(sizeof(key_lens)/sizeof(key_lens[0])); j++)
+        {
+            memset(one_shot, 0x0, sizeof(one_shot));
+            memset(prepared, 0x0, sizeof(prepared));
+
+            if(type == FKO_HMAC_MD5)
+                hmac_md5(msg, sizeof(msg), one_shot, key, key_lens[j]);
+            else if(type == FKO_HMAC_SHA1)
+                hmac_sha1(msg, sizeof(msg), one_shot, key, key_lens[j]);
+            else if(type == FKO_HMAC_SHA256)
+                hmac_sha256(msg, sizeof(msg), one_shot, key, key_lens[j]);
+            else if(type == FKO_HMAC_SHA384)
+                hmac_sha384(msg, sizeof(msg), one_shot, key, key_lens[j]);
+            else
+                hmac_sha512(msg, sizeof(msg), one_shot, key, key_lens[j]);
+
+            CU_ASSERT(hmac_prepare(&prep, type, key, key_lens[j]) == 0);
+
+            /* The prepared states must survive being used twice
+            */
+            hmac_with_prepared(&prep, msg, sizeof(msg), prepared);
+            CU_ASSERT(memcmp(one_shot, prepared, prep.digest_len) == 0);
+            memset(prepared, 0x0, sizeof(prepared));
+            hmac_with_prepared(&prep, msg, sizeof(msg), prepared);
+            CU_ASSERT(memcmp(one_shot, prepared, prep.digest_len) == 0);
+        }
+    }
+
+    CU_ASSERT(hmac_prepare(&prep, FKO_HMAC_UNKNOWN, key, 16) != 0);
+}
+
+DECLARE_UTEST(verify_prepared_key, "verify SPA data with a prepared HMAC key")
+{
+    fko_ctx_t       ctx = NULL, dec_ctx = NULL;
+    fko_hmac_key_t  hkey = NULL, bad_hkey = NULL;
+    char           *spa_data = NULL, *spa_copy = NULL;
+
+    CU_ASSERT_FATAL(fko_new(&ctx) == FKO_SUCCESS);
+    CU_ASSERT(fko_set_sdp_id(ctx, 12345) == FKO_SUCCESS);
+    CU_ASSERT(fko_set_spa_message(ctx, "192.0.2.1,tcp/22") == FKO_SUCCESS);
+    CU_ASSERT(fko_set_spa_hmac_type(ctx, FKO_HMAC_SHA256) == FKO_SUCCESS);
+    CU_ASSERT_FATAL(fko_spa_data_final(ctx, "enckey1234", 10,
+                "hmackey1234", 11) == FKO_SUCCESS);
+    CU_ASSERT_FATAL(fko_get_spa_data(ctx, &spa_data) == FKO_SUCCESS);
+    spa_copy = strdup(spa_data);
+    CU_ASSERT_FATAL(spa_copy != NULL);
+
+    CU_ASSERT(fko_new_hmac_key(&hkey, "hmackey1234", 11,
+                FKO_HMAC_SHA256) == FKO_SUCCESS);
+    CU_ASSERT(fko_new_hmac_key(&bad_hkey, "hmackey1235", 11,
+                FKO_HMAC_SHA256) == FKO_SUCCESS);
+    CU_ASSERT(fko_new_hmac_key(&bad_hkey, "hmackey1234", 11,
+                FKO_LAST_HMAC_MODE) == FKO_ERROR_UNSUPPORTED_HMAC_MODE);
+    CU_ASSERT(fko_new_hmac_key(&bad_hkey, "hmackey1234",
+                MAX_DIGEST_BLOCK_LEN+1, FKO_HMAC_SHA256) == FKO_ERROR_INVALID_HMAC_KEY_LEN);
+
+    /* The same key can be used for any number of packets
+    */
+    CU_ASSERT(fko_new_with_data_hmac_key(&dec_ctx, spa_copy, "enckey1234", 10,
+                FKO_ENC_MODE_CBC, hkey, 12345) == FKO_SUCCESS);
+    fko_destroy(dec_ctx);
+    dec_ctx = NULL;
+    CU_ASSERT(fko_new_with_data_hmac_key(&dec_ctx, spa_copy, "enckey1234", 10,
+                FKO_ENC_MODE_CBC, hkey, 12345) == FKO_SUCCESS);
+    fko_destroy(dec_ctx);
+    dec_ctx = NULL;
+
+    CU_ASSERT(fko_new_with_data_hmac_key(&dec_ctx, spa_copy, "enckey1234", 10,
+                FKO_ENC_MODE_CBC, bad_hkey, 12345) == FKO_ERROR_INVALID_DATA_HMAC_COMPAREFAIL);
+    CU_ASSERT(fko_new_with_data_hmac_key(&dec_ctx, spa_copy, "enckey1234", 10,
+                FKO_ENC_MODE_CBC, NULL, 12345) == FKO_ERROR_INVALID_DATA);
+
+    /* fko_verify_hmac() strips the digest the same way
+    */
+    CU_ASSERT(fko_new_with_data(&dec_ctx, spa_copy, NULL, 0, FKO_ENC_MODE_CBC,
+                NULL, 0, FKO_HMAC_SHA256, 0) == FKO_SUCCESS);
+    CU_ASSERT(fko_verify_hmac(dec_ctx, "hmackey1234", 11) == FKO_SUCCESS);
+    CU_ASSERT(dec_ctx->encrypted_msg_len == (int)strlen(spa_copy) - SHA256_B64_LEN);
+    CU_ASSERT(dec_ctx->msg_hmac_len == SHA256_B64_LEN);
+    CU_ASSERT(strncmp(dec_ctx->msg_hmac, spa_copy + strlen(spa_copy)
+                - SHA256_B64_LEN, SHA256_B64_LEN) == 0);
+    fko_destroy(dec_ctx);
+
+    CU_ASSERT(fko_destroy_hmac_key(hkey) == FKO_SUCCESS);
+    CU_ASSERT(fko_destroy_hmac_key(bad_hkey) == FKO_SUCCESS);
+    CU_ASSERT(fko_destroy_hmac_key(NULL) == FKO_SUCCESS);
+    free(spa_copy);
+    fko_destroy(ctx);
+}
+
+int register_ts_fko_hmac(void)
+{
+    ts_init(&TEST_SUITE(fko_hmac), TEST_SUITE_DESCR(fko_hmac), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(fko_hmac), UTEST_FCT(prepared_digest), UTEST_DESCR(prepared_digest));
+    ts_add_utest(&TEST_SUITE(fko_hmac), UTEST_FCT(verify_prepared_key), UTEST_DESCR(verify_prepared_key));
+
+    return register_ts(&TEST_SUITE(fko_hmac));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */
+
 /***EOF***/
@@ -236,9 +236,9 @@ fko_set_spa_message(fko_ctx_t ctx, const char * const msg)
      * do not want to be leaking memory.
     */
     if(ctx->message != NULL)
-        free(ctx->message);
+        ctx_free(ctx, ctx->message);
 
-    ctx->message = strdup(msg);
+    ctx->message = ctx_strdup(ctx, msg);
 
     ctx->state |= FKO_DATA_MODIFIED;
 
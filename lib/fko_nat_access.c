@@ -73,9 +73,9 @@ fko_set_spa_nat_access(fko_ctx_t ctx, const char * const msg)
      * do not want to be leaking memory.
     */
     if(ctx->nat_access != NULL)
-        free(ctx->nat_access);
+        ctx_free(ctx, ctx->nat_access);
 
-    ctx->nat_access = strdup(msg);
+    ctx->nat_access = ctx_strdup(ctx, msg);
 
     ctx->state |= FKO_DATA_MODIFIED;
 
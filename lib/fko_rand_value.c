@@ -81,12 +81,12 @@ fko_set_rand_value(fko_ctx_t ctx, const char * const new_val)
             return(FKO_ERROR_INVALID_DATA_RAND_LEN_VALIDFAIL);
 
         if(ctx->rand_val != NULL)
-            free(ctx->rand_val);
+            ctx_free(ctx, ctx->rand_val);
 
 #if HAVE_LIBFIU
         fiu_return_on("fko_set_rand_value_strdup", FKO_ERROR_MEMORY_ALLOCATION);
 #endif
-        ctx->rand_val = strdup(new_val);
+        ctx->rand_val = ctx_strdup(ctx, new_val);
         if(ctx->rand_val == NULL)
             return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -129,12 +129,12 @@ fko_set_rand_value(fko_ctx_t ctx, const char * const new_val)
     srand(seed);
 
     if(ctx->rand_val != NULL)
-        free(ctx->rand_val);
+        ctx_free(ctx, ctx->rand_val);
 
 #if HAVE_LIBFIU
         fiu_return_on("fko_set_rand_value_calloc1", FKO_ERROR_MEMORY_ALLOCATION);
 #endif
-    ctx->rand_val = calloc(1, FKO_RAND_VAL_SIZE+1);
+    ctx->rand_val = ctx_calloc(ctx, 1, FKO_RAND_VAL_SIZE+1);
     if(ctx->rand_val == NULL)
             return(FKO_ERROR_MEMORY_ALLOCATION);
 
@@ -73,9 +73,9 @@ fko_set_spa_server_auth(fko_ctx_t ctx, const char * const msg)
      * do not want to be leaking memory.
     */
     if(ctx->server_auth != NULL)
-        free(ctx->server_auth);
+        ctx_free(ctx, ctx->server_auth);
 
-    ctx->server_auth = strdup(msg);
+    ctx->server_auth = ctx_strdup(ctx, msg);
 
     ctx->state |= FKO_DATA_MODIFIED;
 
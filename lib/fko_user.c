@@ -118,9 +118,9 @@ fko_set_username(fko_ctx_t ctx, const char * const spoof_user)
      * do not want to be leaking memory.
     */
     if(ctx->username != NULL)
-        free(ctx->username);
+        ctx_free(ctx, ctx->username);
 
-    ctx->username = strdup(username);
+    ctx->username = ctx_strdup(ctx, username);
 
     ctx->state |= FKO_DATA_MODIFIED;
 
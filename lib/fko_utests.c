@@ -2,6 +2,46 @@
 
 #include "fko.h"
 
+#include <stdlib.h>
+
+#if defined(__GLIBC__)
+/* Counting wrappers around the libc allocator, for the fko_arena tests
+ * that check an arena-backed context decodes SPA data without calling
+ * malloc().  glibc calls these for strdup() and friends as well, and its
+ * __libc_* entry points do the actual allocation.
+*/
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+unsigned long   utest_malloc_calls;
+int             utest_malloc_counting;
+
+void *
+malloc(size_t size)
+{
+    if(utest_malloc_counting)
+        utest_malloc_calls++;
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    if(utest_malloc_counting)
+        utest_malloc_calls++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    if(utest_malloc_counting)
+        utest_malloc_calls++;
+    return __libc_realloc(ptr, size);
+}
+#endif
+
 /**
  * Register test suites from FKO files.
  * 
@@ -11,6 +51,12 @@
 static void register_test_suites(void)
 {
     register_ts_fko_decode();
+    register_ts_fko_hmac();
+    register_ts_fko_encryption();
+    register_ts_rijndael_accel();
+    register_ts_base64();
+    register_ts_fko_arena();
+    register_ts_sha2_accel();
 }
 
 /* The main() function for setting up and running the tests.
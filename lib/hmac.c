@@ -430,3 +430,118 @@ hmac_sha512(const char *msg, const unsigned int msg_len,
 
     return;
 }
+
+/* Hash the key pads for hmac_type once and keep the resulting inner and
+ * outer digest states in prep.
+*/
+int
+hmac_prepare(hmac_prepared_t *prep, const int hmac_type,
+    const char *hmac_key, const int hmac_key_len)
+{
+    hmac_md5_ctx    md5_ctx;
+    hmac_sha1_ctx   sha1_ctx;
+    hmac_sha256_ctx sha256_ctx;
+    hmac_sha384_ctx sha384_ctx;
+    hmac_sha512_ctx sha512_ctx;
+
+    memset(prep, 0, sizeof(*prep));
+    prep->hmac_type = hmac_type;
+
+    switch(hmac_type)
+    {
+        case FKO_HMAC_MD5:
+            memset(&md5_ctx, 0, sizeof(md5_ctx));
+            hmac_md5_init(&md5_ctx, hmac_key, hmac_key_len);
+            prep->state.md5.inside  = md5_ctx.ctx_inside;
+            prep->state.md5.outside = md5_ctx.ctx_outside;
+            prep->digest_len = MD5_DIGEST_LEN;
+            memset(&md5_ctx, 0, sizeof(md5_ctx));
+            break;
+        case FKO_HMAC_SHA1:
+            memset(&sha1_ctx, 0, sizeof(sha1_ctx));
+            hmac_sha1_init(&sha1_ctx, hmac_key, hmac_key_len);
+            prep->state.sha1.inside  = sha1_ctx.ctx_inside;
+            prep->state.sha1.outside = sha1_ctx.ctx_outside;
+            prep->digest_len = SHA1_DIGEST_LEN;
+            memset(&sha1_ctx, 0, sizeof(sha1_ctx));
+            break;
+        case FKO_HMAC_SHA256:
+            memset(&sha256_ctx, 0, sizeof(sha256_ctx));
+            hmac_sha256_init(&sha256_ctx, hmac_key, hmac_key_len);
+            prep->state.sha256.inside  = sha256_ctx.ctx_inside;
+            prep->state.sha256.outside = sha256_ctx.ctx_outside;
+            prep->digest_len = SHA256_DIGEST_LEN;
+            memset(&sha256_ctx, 0, sizeof(sha256_ctx));
+            break;
+        case FKO_HMAC_SHA384:
+            memset(&sha384_ctx, 0, sizeof(sha384_ctx));
+            hmac_sha384_init(&sha384_ctx, hmac_key, hmac_key_len);
+            prep->state.sha384.inside  = sha384_ctx.ctx_inside;
+            prep->state.sha384.outside = sha384_ctx.ctx_outside;
+            prep->digest_len = SHA384_DIGEST_LEN;
+            memset(&sha384_ctx, 0, sizeof(sha384_ctx));
+            break;
+        case FKO_HMAC_SHA512:
+            memset(&sha512_ctx, 0, sizeof(sha512_ctx));
+            hmac_sha512_init(&sha512_ctx, hmac_key, hmac_key_len);
+            prep->state.sha512.inside  = sha512_ctx.ctx_inside;
+            prep->state.sha512.outside = sha512_ctx.ctx_outside;
+            prep->digest_len = SHA512_DIGEST_LEN;
+            memset(&sha512_ctx, 0, sizeof(sha512_ctx));
+            break;
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Calculate the HMAC of msg starting from the prepared digest states,
+ * which are left untouched.
+*/
+void
+hmac_with_prepared(const hmac_prepared_t *prep, const char *msg,
+    const unsigned int msg_len, unsigned char *hmac)
+{
+    hmac_md5_ctx    md5_ctx;
+    hmac_sha1_ctx   sha1_ctx;
+    hmac_sha256_ctx sha256_ctx;
+    hmac_sha384_ctx sha384_ctx;
+    hmac_sha512_ctx sha512_ctx;
+
+    switch(prep->hmac_type)
+    {
+        case FKO_HMAC_MD5:
+            md5_ctx.ctx_inside  = prep->state.md5.inside;
+            md5_ctx.ctx_outside = prep->state.md5.outside;
+            hmac_md5_update(&md5_ctx, msg, msg_len);
+            hmac_md5_final(&md5_ctx, hmac);
+            break;
+        case FKO_HMAC_SHA1:
+            sha1_ctx.ctx_inside  = prep->state.sha1.inside;
+            sha1_ctx.ctx_outside = prep->state.sha1.outside;
+            hmac_sha1_update(&sha1_ctx, msg, msg_len);
+            hmac_sha1_final(&sha1_ctx, hmac);
+            break;
+        case FKO_HMAC_SHA256:
+            sha256_ctx.ctx_inside  = prep->state.sha256.inside;
+            sha256_ctx.ctx_outside = prep->state.sha256.outside;
+            hmac_sha256_update(&sha256_ctx, msg, msg_len);
+            hmac_sha256_final(&sha256_ctx, hmac);
+            break;
+        case FKO_HMAC_SHA384:
+            sha384_ctx.ctx_inside  = prep->state.sha384.inside;
+            sha384_ctx.ctx_outside = prep->state.sha384.outside;
+            hmac_sha384_update(&sha384_ctx, msg, msg_len);
+            hmac_sha384_final(&sha384_ctx, hmac);
+            break;
+        case FKO_HMAC_SHA512:
+            sha512_ctx.ctx_inside  = prep->state.sha512.inside;
+            sha512_ctx.ctx_outside = prep->state.sha512.outside;
+            hmac_sha512_update(&sha512_ctx, msg, msg_len);
+            hmac_sha512_final(&sha512_ctx, hmac);
+            break;
+    }
+
+    return;
+}
@@ -35,6 +35,23 @@
 
 #define MAX_DIGEST_BLOCK_LEN    SHA512_BLOCK_LEN
 
+/* Digest states after the inner and outer key pads have been hashed.  An
+ * HMAC with the same key starts from a copy of these, which saves building
+ * and hashing both pads for every message.
+*/
+typedef struct hmac_prepared {
+    int hmac_type;
+    int digest_len;
+
+    union {
+        struct { MD5Context inside, outside; } md5;
+        struct { SHA1_INFO  inside, outside; } sha1;
+        struct { SHA256_CTX inside, outside; } sha256;
+        struct { SHA384_CTX inside, outside; } sha384;
+        struct { SHA512_CTX inside, outside; } sha512;
+    } state;
+} hmac_prepared_t;
+
 void hmac_md5(const char *msg, const unsigned int msg_len,
         unsigned char *hmac, const char *hmac_key, const int hmac_key_len);
 void hmac_sha1(const char *msg, const unsigned int msg_len,
@@ -45,6 +62,10 @@ void hmac_sha384(const char *msg, const unsigned int msg_len,
         unsigned char *hmac, const char *hmac_key, const int hmac_key_len);
 void hmac_sha512(const char *msg, const unsigned int msg_len,
         unsigned char *hmac, const char *hmac_key, const int hmac_key_len);
+int hmac_prepare(hmac_prepared_t *prep, const int hmac_type,
+        const char *hmac_key, const int hmac_key_len);
+void hmac_with_prepared(const hmac_prepared_t *prep, const char *msg,
+        const unsigned int msg_len, unsigned char *hmac);
 
 #endif /* HMAC_H */
 
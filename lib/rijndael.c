@@ -30,6 +30,7 @@
 */
 #include "fko_common.h"
 #include "rijndael.h"
+#include "rijndael_accel.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -476,6 +477,9 @@ block_encrypt(RIJNDAEL_context *ctx, uint8_t *input, int inputlen,
 
     nblocks = inputlen / RIJNDAEL_BLOCKSIZE;
 
+    if (rijndael_accel_encrypt(ctx, input, nblocks, output, iv) == 0)
+        return;
+
     switch (ctx->mode) {
         case MODE_ECB:		/* electronic code book */
             for (i = 0; i<nblocks; i++) {
@@ -544,6 +548,10 @@ block_decrypt(RIJNDAEL_context *ctx, uint8_t *input, int inputlen,
     uint8_t block[RIJNDAEL_BLOCKSIZE], block2[RIJNDAEL_BLOCKSIZE];
 
     nblocks = inputlen / RIJNDAEL_BLOCKSIZE;
+
+    if (rijndael_accel_decrypt(ctx, input, nblocks, output, iv) == 0)
+        return;
+
     switch (ctx->mode) {
         case MODE_ECB:
             for (i = 0; i<nblocks; i++) {
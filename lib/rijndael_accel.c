@@ -0,0 +1,580 @@
+/*
+ *****************************************************************************
+ *
+ * File:    rijndael_accel.c
+ *
+ * Purpose: Accelerated backends for block_encrypt() and block_decrypt().
+ *          AES-NI is used when the compiler supports it and the CPU has the
+ *          instructions, and the OpenSSL EVP interface (libcrypto is linked
+ *          for sdp_com anyway) can be selected with --with-aes-backend.
+ *          Both are bit-compatible with the table code in rijndael.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fko_common.h"
+#include "rijndael_accel.h"
+
+#include <string.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+
+#if HAVE_AESNI
+  #include <wmmintrin.h>
+  #include <emmintrin.h>
+#endif
+
+#ifdef HAVE_C_UNIT_TESTS
+DECLARE_TEST_SUITE(rijndael_accel, "Rijndael backend test suite");
+#endif
+
+static int              rij_backend = RIJ_BACKEND_BUILTIN;
+static pthread_once_t   rij_backend_once = PTHREAD_ONCE_INIT;
+
+/* Increment the 128-bit big-endian counter block the same way the CTR
+ * code in rijndael.c does.
+*/
+static void
+ctr_inc(uint8_t *ctr)
+{
+    int i;
+
+    for(i=RIJNDAEL_BLOCKSIZE-1; i >= 0; i--)
+        if(++ctr[i] != 0)
+            break;
+}
+
+#if HAVE_AESNI
+
+#define AESNI_FN __attribute__((target("aes,sse2")))
+
+#define LOAD(p)     _mm_loadu_si128((const __m128i *)(p))
+#define STORE(p, b) _mm_storeu_si128((__m128i *)(p), (b))
+
+/* The key schedule words in ctx->keys hold the first byte of each word in
+ * their low 8 bits, so on x86 each group of four words is already laid out
+ * in memory the way AES-NI expects a round key.
+*/
+static AESNI_FN void
+aesni_enc_keys(const RIJNDAEL_context *ctx, __m128i *rk)
+{
+    int i;
+
+    for(i=0; i <= ctx->nrounds; i++)
+        rk[i] = LOAD(&ctx->keys[4*i]);
+}
+
+/* Round keys for the equivalent inverse cipher, in the order aesdec uses
+ * them.
+*/
+static AESNI_FN void
+aesni_dec_keys(const RIJNDAEL_context *ctx, __m128i *dk)
+{
+    int     i, nr = ctx->nrounds;
+
+    dk[0] = LOAD(&ctx->keys[4*nr]);
+    for(i=1; i < nr; i++)
+        dk[i] = _mm_aesimc_si128(LOAD(&ctx->keys[4*(nr-i)]));
+    dk[nr] = LOAD(&ctx->keys[0]);
+}
+
+static inline AESNI_FN __m128i
+aesni_enc1(const __m128i *rk, const int nr, __m128i b)
+{
+    int r;
+
+    b = _mm_xor_si128(b, rk[0]);
+    for(r=1; r < nr; r++)
+        b = _mm_aesenc_si128(b, rk[r]);
+    return _mm_aesenclast_si128(b, rk[nr]);
+}
+
+static inline AESNI_FN __m128i
+aesni_dec1(const __m128i *dk, const int nr, __m128i b)
+{
+    int r;
+
+    b = _mm_xor_si128(b, dk[0]);
+    for(r=1; r < nr; r++)
+        b = _mm_aesdec_si128(b, dk[r]);
+    return _mm_aesdeclast_si128(b, dk[nr]);
+}
+
+/* Four independent blocks at a time keep the AES unit busy in the modes
+ * that can be run in parallel.
+*/
+static inline AESNI_FN void
+aesni_enc4(const __m128i *rk, const int nr, __m128i *b)
+{
+    int r;
+
+    b[0] = _mm_xor_si128(b[0], rk[0]);
+    b[1] = _mm_xor_si128(b[1], rk[0]);
+    b[2] = _mm_xor_si128(b[2], rk[0]);
+    b[3] = _mm_xor_si128(b[3], rk[0]);
+    for(r=1; r < nr; r++)
+    {
+        b[0] = _mm_aesenc_si128(b[0], rk[r]);
+        b[1] = _mm_aesenc_si128(b[1], rk[r]);
+        b[2] = _mm_aesenc_si128(b[2], rk[r]);
+        b[3] = _mm_aesenc_si128(b[3], rk[r]);
+    }
+    b[0] = _mm_aesenclast_si128(b[0], rk[nr]);
+    b[1] = _mm_aesenclast_si128(b[1], rk[nr]);
+    b[2] = _mm_aesenclast_si128(b[2], rk[nr]);
+    b[3] = _mm_aesenclast_si128(b[3], rk[nr]);
+}
+
+static inline AESNI_FN void
+aesni_dec4(const __m128i *dk, const int nr, __m128i *b)
+{
+    int r;
+
+    b[0] = _mm_xor_si128(b[0], dk[0]);
+    b[1] = _mm_xor_si128(b[1], dk[0]);
+    b[2] = _mm_xor_si128(b[2], dk[0]);
+    b[3] = _mm_xor_si128(b[3], dk[0]);
+    for(r=1; r < nr; r++)
+    {
+        b[0] = _mm_aesdec_si128(b[0], dk[r]);
+        b[1] = _mm_aesdec_si128(b[1], dk[r]);
+        b[2] = _mm_aesdec_si128(b[2], dk[r]);
+        b[3] = _mm_aesdec_si128(b[3], dk[r]);
+    }
+    b[0] = _mm_aesdeclast_si128(b[0], dk[nr]);
+    b[1] = _mm_aesdeclast_si128(b[1], dk[nr]);
+    b[2] = _mm_aesdeclast_si128(b[2], dk[nr]);
+    b[3] = _mm_aesdeclast_si128(b[3], dk[nr]);
+}
+
+/* Input blocks are always loaded before the corresponding output is
+ * stored, so input and output may be the same buffer.
+*/
+static AESNI_FN int
+aesni_crypt(const RIJNDAEL_context *ctx, const uint8_t *in, const int nblocks,
+        uint8_t *out, const uint8_t *iv, const int enc)
+{
+    __m128i rk[15], b[4], c[4], fb;
+    uint8_t ctr[RIJNDAEL_BLOCKSIZE];
+    int     i = 0, k, nr = ctx->nrounds;
+
+    if(! enc && (ctx->mode == MODE_ECB || ctx->mode == MODE_CBC))
+        aesni_dec_keys(ctx, rk);
+    else
+        aesni_enc_keys(ctx, rk);
+
+    switch(ctx->mode)
+    {
+        case MODE_ECB:
+            for(; i+4 <= nblocks; i+=4)
+            {
+                for(k=0; k < 4; k++)
+                    b[k] = LOAD(in + RIJNDAEL_BLOCKSIZE*(i+k));
+                if(enc)
+                    aesni_enc4(rk, nr, b);
+                else
+                    aesni_dec4(rk, nr, b);
+                for(k=0; k < 4; k++)
+                    STORE(out + RIJNDAEL_BLOCKSIZE*(i+k), b[k]);
+            }
+            for(; i < nblocks; i++)
+            {
+                b[0] = LOAD(in + RIJNDAEL_BLOCKSIZE*i);
+                b[0] = enc ? aesni_enc1(rk, nr, b[0]) : aesni_dec1(rk, nr, b[0]);
+                STORE(out + RIJNDAEL_BLOCKSIZE*i, b[0]);
+            }
+            break;
+
+        case MODE_CBC:
+            fb = LOAD(iv);
+            if(enc)
+            {
+                for(; i < nblocks; i++)
+                {
+                    fb = aesni_enc1(rk, nr,
+                            _mm_xor_si128(fb, LOAD(in + RIJNDAEL_BLOCKSIZE*i)));
+                    STORE(out + RIJNDAEL_BLOCKSIZE*i, fb);
+                }
+                break;
+            }
+            for(; i+4 <= nblocks; i+=4)
+            {
+                for(k=0; k < 4; k++)
+                    b[k] = c[k] = LOAD(in + RIJNDAEL_BLOCKSIZE*(i+k));
+                aesni_dec4(rk, nr, b);
+                b[0] = _mm_xor_si128(b[0], fb);
+                b[1] = _mm_xor_si128(b[1], c[0]);
+                b[2] = _mm_xor_si128(b[2], c[1]);
+                b[3] = _mm_xor_si128(b[3], c[2]);
+                fb   = c[3];
+                for(k=0; k < 4; k++)
+                    STORE(out + RIJNDAEL_BLOCKSIZE*(i+k), b[k]);
+            }
+            for(; i < nblocks; i++)
+            {
+                c[0] = LOAD(in + RIJNDAEL_BLOCKSIZE*i);
+                STORE(out + RIJNDAEL_BLOCKSIZE*i,
+                        _mm_xor_si128(aesni_dec1(rk, nr, c[0]), fb));
+                fb = c[0];
+            }
+            break;
+
+        case MODE_CFB:
+            fb = LOAD(iv);
+            if(enc)
+            {
+                for(; i < nblocks; i++)
+                {
+                    fb = _mm_xor_si128(aesni_enc1(rk, nr, fb),
+                            LOAD(in + RIJNDAEL_BLOCKSIZE*i));
+                    STORE(out + RIJNDAEL_BLOCKSIZE*i, fb);
+                }
+                break;
+            }
+            /* The keystream for decryption only depends on ciphertext
+             * that we already have.
+            */
+            for(; i+4 <= nblocks; i+=4)
+            {
+                for(k=0; k < 4; k++)
+                    c[k] = LOAD(in + RIJNDAEL_BLOCKSIZE*(i+k));
+                b[0] = fb;
+                b[1] = c[0];
+                b[2] = c[1];
+                b[3] = c[2];
+                fb   = c[3];
+                aesni_enc4(rk, nr, b);
+                for(k=0; k < 4; k++)
+                    STORE(out + RIJNDAEL_BLOCKSIZE*(i+k), _mm_xor_si128(b[k], c[k]));
+            }
+            for(; i < nblocks; i++)
+            {
+                c[0] = LOAD(in + RIJNDAEL_BLOCKSIZE*i);
+                STORE(out + RIJNDAEL_BLOCKSIZE*i,
+                        _mm_xor_si128(aesni_enc1(rk, nr, fb), c[0]));
+                fb = c[0];
+            }
+            break;
+
+        case MODE_OFB:
+            fb = LOAD(iv);
+            for(; i < nblocks; i++)
+            {
+                fb = aesni_enc1(rk, nr, fb);
+                STORE(out + RIJNDAEL_BLOCKSIZE*i,
+                        _mm_xor_si128(fb, LOAD(in + RIJNDAEL_BLOCKSIZE*i)));
+            }
+            break;
+
+        case MODE_CTR:
+            memcpy(ctr, iv, RIJNDAEL_BLOCKSIZE);
+            for(; i+4 <= nblocks; i+=4)
+            {
+                for(k=0; k < 4; k++)
+                {
+                    b[k] = LOAD(ctr);
+                    ctr_inc(ctr);
+                }
+                aesni_enc4(rk, nr, b);
+                for(k=0; k < 4; k++)
+                    STORE(out + RIJNDAEL_BLOCKSIZE*(i+k), _mm_xor_si128(b[k],
+                                LOAD(in + RIJNDAEL_BLOCKSIZE*(i+k))));
+            }
+            for(; i < nblocks; i++)
+            {
+                b[0] = aesni_enc1(rk, nr, LOAD(ctr));
+                ctr_inc(ctr);
+                STORE(out + RIJNDAEL_BLOCKSIZE*i,
+                        _mm_xor_si128(b[0], LOAD(in + RIJNDAEL_BLOCKSIZE*i)));
+            }
+            break;
+
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+aesni_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes");
+}
+
+#endif /* HAVE_AESNI */
+
+static const EVP_CIPHER *
+evp_cipher(const RIJNDAEL_context *ctx)
+{
+    switch(ctx->mode)
+    {
+        case MODE_ECB:
+            return ctx->nrounds == 10 ? EVP_aes_128_ecb()
+                : ctx->nrounds == 12 ? EVP_aes_192_ecb() : EVP_aes_256_ecb();
+        case MODE_CBC:
+            return ctx->nrounds == 10 ? EVP_aes_128_cbc()
+                : ctx->nrounds == 12 ? EVP_aes_192_cbc() : EVP_aes_256_cbc();
+        case MODE_CFB:
+            return ctx->nrounds == 10 ? EVP_aes_128_cfb128()
+                : ctx->nrounds == 12 ? EVP_aes_192_cfb128() : EVP_aes_256_cfb128();
+        case MODE_OFB:
+            return ctx->nrounds == 10 ? EVP_aes_128_ofb()
+                : ctx->nrounds == 12 ? EVP_aes_192_ofb() : EVP_aes_256_ofb();
+        case MODE_CTR:
+            return ctx->nrounds == 10 ? EVP_aes_128_ctr()
+                : ctx->nrounds == 12 ? EVP_aes_192_ctr() : EVP_aes_256_ctr();
+        default:
+            return NULL;
+    }
+}
+
+/* EVP does its own key expansion from ctx->key, which is the key that
+ * rijndael_setup() was given by rijndael_init() and the key cache.
+*/
+static int
+evp_crypt(const RIJNDAEL_context *ctx, const uint8_t *in, const int nblocks,
+        uint8_t *out, const uint8_t *iv, const int enc)
+{
+    EVP_CIPHER_CTX     *ectx;
+    const EVP_CIPHER   *cipher;
+    int                 len = nblocks * RIJNDAEL_BLOCKSIZE, out_len = 0;
+    int                 res = -1;
+
+    if((cipher = evp_cipher(ctx)) == NULL)
+        return -1;
+
+    if((ectx = EVP_CIPHER_CTX_new()) == NULL)
+        return -1;
+
+    if(EVP_CipherInit_ex(ectx, cipher, NULL, ctx->key,
+                ctx->mode == MODE_ECB ? NULL : iv, enc) == 1
+            && EVP_CIPHER_CTX_set_padding(ectx, 0) == 1
+            && EVP_CipherUpdate(ectx, out, &out_len, in, len) == 1
+            && out_len == len)
+        res = 0;
+
+    EVP_CIPHER_CTX_free(ectx);
+    return res;
+}
+
+static void
+rij_backend_init(void)
+{
+    rij_backend = RIJNDAEL_DEFAULT_BACKEND;
+    if(! rijndael_backend_available(rij_backend))
+        rij_backend = RIJ_BACKEND_BUILTIN;
+}
+
+int
+rijndael_backend(void)
+{
+    pthread_once(&rij_backend_once, rij_backend_init);
+    return rij_backend;
+}
+
+int
+rijndael_backend_available(const int backend)
+{
+    switch(backend)
+    {
+        case RIJ_BACKEND_BUILTIN:
+        case RIJ_BACKEND_OPENSSL:
+            return 1;
+#if HAVE_AESNI
+        case RIJ_BACKEND_AESNI:
+            return aesni_supported();
+#endif
+        default:
+            return 0;
+    }
+}
+
+/* Switch backends (for tests and benchmarks).  This must not be called
+ * while other threads are encrypting.
+*/
+int
+rijndael_set_backend(const int backend)
+{
+    pthread_once(&rij_backend_once, rij_backend_init);
+
+    if(! rijndael_backend_available(backend))
+        return -1;
+
+    rij_backend = backend;
+    return 0;
+}
+
+const char *
+rijndael_backend_name(const int backend)
+{
+    switch(backend)
+    {
+        case RIJ_BACKEND_BUILTIN:
+            return "builtin";
+        case RIJ_BACKEND_AESNI:
+            return "aesni";
+        case RIJ_BACKEND_OPENSSL:
+            return "openssl";
+        default:
+            return "unknown";
+    }
+}
+
+static int
+accel_crypt(RIJNDAEL_context *ctx, const uint8_t *input, const int nblocks,
+        uint8_t *output, const uint8_t *iv, const int enc)
+{
+    if(nblocks <= 0)
+        return -1;
+
+    switch(rijndael_backend())
+    {
+#if HAVE_AESNI
+        case RIJ_BACKEND_AESNI:
+            return aesni_crypt(ctx, input, nblocks, output, iv, enc);
+#endif
+        case RIJ_BACKEND_OPENSSL:
+            return evp_crypt(ctx, input, nblocks, output, iv, enc);
+        default:
+            return -1;
+    }
+}
+
+int
+rijndael_accel_encrypt(RIJNDAEL_context *ctx, const uint8_t *input,
+        const int nblocks, uint8_t *output, const uint8_t *iv)
+{
+    return accel_crypt(ctx, input, nblocks, output, iv, 1);
+}
+
+int
+rijndael_accel_decrypt(RIJNDAEL_context *ctx, const uint8_t *input,
+        const int nblocks, uint8_t *output, const uint8_t *iv)
+{
+    return accel_crypt(ctx, input, nblocks, output, iv, 0);
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+#define UT_MAX_BLOCKS 9
+
+/* Every backend that is available on this machine has to produce the same
+ * output as the table code, for each mode and key size, for block counts
+ * on both sides of the four-block AES-NI loop and with a CTR counter that
+ * carries across bytes.
+*/
+DECLARE_UTEST(backends_match_builtin, "accelerated backends match the table code")
+{
+    static const int    modes[] = { MODE_ECB, MODE_CBC, MODE_CFB, MODE_OFB, MODE_CTR };
+    static const int    key_sizes[] = { 16, 24, 32 };
+    RIJNDAEL_context    ctx;
+    uint8_t             pt[UT_MAX_BLOCKS*RIJNDAEL_BLOCKSIZE];
+    uint8_t             ct_ref[sizeof(pt)], pt_ref[sizeof(pt)];
+    uint8_t             ct[sizeof(pt)], dec[sizeof(pt)];
+    uint8_t             key[RIJNDAEL_MAX_KEYSIZE], iv[RIJNDAEL_BLOCKSIZE];
+    int                 orig = rijndael_backend(), b, m, k, n, i;
+
+    for(i=0; i < (int)sizeof(pt); i++)
+        pt[i] = (uint8_t)(i * 7 + 3);
+    for(i=0; i < RIJNDAEL_MAX_KEYSIZE; i++)
+        key[i] = (uint8_t)(0xa5 ^ i);
+    for(i=0; i < RIJNDAEL_BLOCKSIZE; i++)
+        iv[i] = i < 13 ? (uint8_t)i : 0xff;
+
+    for(b=RIJ_BACKEND_BUILTIN+1; b < RIJ_BACKEND_MAX; b++)
+    {
+        if(! rijndael_backend_available(b))
+            continue;
+
+        for(m=0; m < (int)(sizeof(modes)/sizeof(modes[0])); m++)
+        for(k=0; k < (int)(sizeof(key_sizes)/sizeof(key_sizes[0])); k++)
+        for(n=1; n <= UT_MAX_BLOCKS; n++)
+        {
+            memset(&ctx, 0x0, sizeof(ctx));
+            memcpy(ctx.key, key, sizeof(key));
+            rijndael_setup(&ctx, key_sizes[k], ctx.key);
+            ctx.mode = modes[m];
+
+            CU_ASSERT(rijndael_set_backend(RIJ_BACKEND_BUILTIN) == 0);
+            block_encrypt(&ctx, pt, n*RIJNDAEL_BLOCKSIZE, ct_ref, iv);
+            block_decrypt(&ctx, ct_ref, n*RIJNDAEL_BLOCKSIZE, pt_ref, iv);
+            CU_ASSERT(memcmp(pt_ref, pt, n*RIJNDAEL_BLOCKSIZE) == 0);
+
+            CU_ASSERT(rijndael_set_backend(b) == 0);
+            block_encrypt(&ctx, pt, n*RIJNDAEL_BLOCKSIZE, ct, iv);
+            block_decrypt(&ctx, ct_ref, n*RIJNDAEL_BLOCKSIZE, dec, iv);
+            CU_ASSERT(memcmp(ct, ct_ref, n*RIJNDAEL_BLOCKSIZE) == 0);
+            CU_ASSERT(memcmp(dec, pt, n*RIJNDAEL_BLOCKSIZE) == 0);
+        }
+    }
+
+    rijndael_set_backend(orig);
+}
+
+/* FIPS-197 appendix C.3 (AES-256) through every backend
+*/
+DECLARE_UTEST(fips197_vector, "FIPS-197 AES-256 known answer")
+{
+    static const uint8_t expected[RIJNDAEL_BLOCKSIZE] = {
+        0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf,
+        0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89
+    };
+    RIJNDAEL_context    ctx;
+    uint8_t             pt[RIJNDAEL_BLOCKSIZE], ct[RIJNDAEL_BLOCKSIZE];
+    uint8_t             dec[RIJNDAEL_BLOCKSIZE], iv[RIJNDAEL_BLOCKSIZE] = {0};
+    int                 orig = rijndael_backend(), b, i;
+
+    memset(&ctx, 0x0, sizeof(ctx));
+    for(i=0; i < RIJNDAEL_MAX_KEYSIZE; i++)
+        ctx.key[i] = (uint8_t)i;
+    for(i=0; i < RIJNDAEL_BLOCKSIZE; i++)
+        pt[i] = (uint8_t)(i * 0x11);
+    rijndael_setup(&ctx, RIJNDAEL_MAX_KEYSIZE, ctx.key);
+    ctx.mode = MODE_ECB;
+
+    for(b=RIJ_BACKEND_BUILTIN; b < RIJ_BACKEND_MAX; b++)
+    {
+        if(rijndael_set_backend(b) != 0)
+            continue;
+        block_encrypt(&ctx, pt, sizeof(pt), ct, iv);
+        block_decrypt(&ctx, ct, sizeof(ct), dec, iv);
+        CU_ASSERT(memcmp(ct, expected, sizeof(ct)) == 0);
+        CU_ASSERT(memcmp(dec, pt, sizeof(pt)) == 0);
+    }
+
+    rijndael_set_backend(orig);
+}
+
+int register_ts_rijndael_accel(void)
+{
+    ts_init(&TEST_SUITE(rijndael_accel), TEST_SUITE_DESCR(rijndael_accel), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(rijndael_accel), UTEST_FCT(backends_match_builtin), UTEST_DESCR(backends_match_builtin));
+    ts_add_utest(&TEST_SUITE(rijndael_accel), UTEST_FCT(fips197_vector), UTEST_DESCR(fips197_vector));
+
+    return register_ts(&TEST_SUITE(rijndael_accel));
+}
+#endif /* HAVE_C_UNIT_TESTS */
+
+/***EOF***/
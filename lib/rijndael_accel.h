@@ -0,0 +1,67 @@
+/*
+ *****************************************************************************
+ *
+ * File:    rijndael_accel.h
+ *
+ * Purpose: Header for the accelerated Rijndael backends in rijndael_accel.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef RIJNDAEL_ACCEL_H
+#define RIJNDAEL_ACCEL_H 1
+
+#include "rijndael.h"
+
+/* Block cipher backends for block_encrypt() and block_decrypt().  All of
+ * them produce the same output as the builtin table code for every mode.
+*/
+#define RIJ_BACKEND_BUILTIN     0   /* Table code in rijndael.c */
+#define RIJ_BACKEND_AESNI       1   /* x86 AES-NI instructions */
+#define RIJ_BACKEND_OPENSSL     2   /* OpenSSL EVP interface */
+#define RIJ_BACKEND_MAX         3
+
+#ifndef RIJNDAEL_DEFAULT_BACKEND
+  #define RIJNDAEL_DEFAULT_BACKEND RIJ_BACKEND_BUILTIN
+#endif
+
+/* Prototypes
+*/
+int rijndael_backend(void);
+int rijndael_backend_available(const int backend);
+int rijndael_set_backend(const int backend);
+const char *rijndael_backend_name(const int backend);
+
+/* Encrypt or decrypt nblocks blocks with the current backend.  These
+ * return -1 without touching the output if the backend cannot handle the
+ * context (the builtin backend or an unknown mode), in which case the
+ * caller falls back to the table code.
+*/
+int rijndael_accel_encrypt(RIJNDAEL_context *ctx, const uint8_t *input,
+    const int nblocks, uint8_t *output, const uint8_t *iv);
+int rijndael_accel_decrypt(RIJNDAEL_context *ctx, const uint8_t *input,
+    const int nblocks, uint8_t *output, const uint8_t *iv);
+
+#endif /* RIJNDAEL_ACCEL_H */
+
+/***EOF***/
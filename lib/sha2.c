@@ -40,6 +40,7 @@
 #include <string.h>	/* memcpy()/memset() or bcopy()/bzero() */
 #include <assert.h>	/* assert() */
 #include "sha2.h"
+#include "sha2_accel.h"
 
 #if HAVE_SYS_BYTEORDER_H
   #include <sys/byteorder.h>
@@ -241,12 +242,13 @@ typedef u_int64_t sha2_word64;	/* Exactly 8 bytes */
  */
 void SHA512_Last(SHA512_CTX*);
 void SHA256_Transform(SHA256_CTX*, const sha2_word32*);
+static void SHA256_Transform_builtin(SHA256_CTX*, const sha2_word32*);
 void SHA512_Transform(SHA512_CTX*, const sha2_word64*);
 
 
 /*** SHA-XYZ INITIAL HASH VALUES AND CONSTANTS ************************/
 /* Hash constant words K for SHA-256: */
-const static sha2_word32 K256[64] = {
+const sha2_word32 K256[64] = {
 	0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL,
 	0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
 	0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL,
@@ -278,7 +280,7 @@ const static sha2_word32 sha256_initial_hash_value[8] = {
 };
 
 /* Hash constant words K for SHA-384 and SHA-512: */
-const static sha2_word64 K512[80] = {
+const sha2_word64 K512[80] = {
 	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL,
 	0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
 	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
@@ -393,7 +395,7 @@ void SHA256_Init(SHA256_CTX* context) {
 	(h) = T1 + Sigma0_256(a) + Maj((a), (b), (c)); \
 	j++
 
-void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
+static void SHA256_Transform_builtin(SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word32	T1, *W256;
 	int		j;
@@ -451,7 +453,7 @@ void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 
 #else /* SHA2_UNROLL_TRANSFORM */
 
-void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
+static void SHA256_Transform_builtin(SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word32	T1, T2, *W256;
 	int		j;
@@ -531,6 +533,12 @@ void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 
 #endif /* SHA2_UNROLL_TRANSFORM */
 
+/* Use the accelerated code in sha2_accel.c when the CPU has it */
+void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
+	if (sha256_accel_blocks(context->state, (const sha2_byte*)data, 1) != 0)
+		SHA256_Transform_builtin(context, data);
+}
+
 void SHA256_Update(SHA256_CTX* context, const sha2_byte *data, size_t len) {
 	unsigned int	freespace, usedspace;
 
@@ -563,9 +571,16 @@ void SHA256_Update(SHA256_CTX* context, const sha2_byte *data, size_t len) {
 			return;
 		}
 	}
+	if (len >= SHA256_BLOCK_LEN &&
+	    sha256_accel_blocks(context->state, data, len / SHA256_BLOCK_LEN) == 0) {
+		/* All complete blocks in one go */
+		context->bitcount += (sha2_word64)(len - len % SHA256_BLOCK_LEN) << 3;
+		data += len - len % SHA256_BLOCK_LEN;
+		len %= SHA256_BLOCK_LEN;
+	}
 	while (len >= SHA256_BLOCK_LEN) {
 		/* Process as many complete blocks as we can */
-		SHA256_Transform(context, (sha2_word32*)data);
+		SHA256_Transform_builtin(context, (sha2_word32*)data);
 		context->bitcount += SHA256_BLOCK_LEN << 3;
 		len -= SHA256_BLOCK_LEN;
 		data += SHA256_BLOCK_LEN;
@@ -0,0 +1,800 @@
+/*
+ *****************************************************************************
+ *
+ * File:    sha2_accel.c
+ *
+ * Purpose: Accelerated SHA-256 and SHA-384/512 code.  A single message is
+ *          hashed with the x86 SHA extensions when the CPU has them, and
+ *          batches of messages (the replay digests of several SPA packets,
+ *          say) are hashed side by side in AVX2 registers.  The CPU
+ *          features are checked at run time and the portable code in
+ *          sha2.c is used for anything the CPU cannot do.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fko_common.h"
+#include "sha2_accel.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if HAVE_SHANI || HAVE_X86_SIMD
+  #include <immintrin.h>
+#endif
+#if HAVE_SHANI
+  #include <cpuid.h>
+#endif
+
+#ifdef HAVE_C_UNIT_TESTS
+  #include "cunit_common.h"
+  #include "fko.h"
+  #include "digest.h"
+DECLARE_TEST_SUITE(sha2_accel, "SHA-2 backend test suite");
+#endif
+
+static int              sha2_cur_backend = SHA2_BACKEND_BUILTIN;
+static pthread_once_t   sha2_backend_once = PTHREAD_ONCE_INIT;
+
+/* Largest number of messages hashed side by side (8 SHA-256 lanes)
+*/
+#define MB_MAX_LANES        8
+
+/* One message of a multi-buffer batch.  Its blocks are the full blocks of
+ * the message followed by one or two blocks in tail holding the rest of
+ * the message and the padding.
+*/
+typedef struct mb_lane {
+    const uint8_t  *data;
+    size_t          nfull;
+    size_t          nblocks;
+    uint8_t         tail[2*SHA512_BLOCK_LEN];
+} mb_lane_t;
+
+/* Lanes without a message left hash this
+*/
+static const uint8_t mb_idle_block[SHA512_BLOCK_LEN];
+
+static void
+mb_lane_init(mb_lane_t *lane, const uint8_t *data, const size_t len,
+        const size_t block_len, const size_t len_field)
+{
+    size_t  rem = len % block_len, ntail, i;
+    uint64_t bits = (uint64_t)len << 3;
+
+    lane->data  = data;
+    lane->nfull = len / block_len;
+
+    memset(lane->tail, 0x0, sizeof(lane->tail));
+    memcpy(lane->tail, data + lane->nfull * block_len, rem);
+    lane->tail[rem] = 0x80;
+
+    ntail = (rem + 1 + len_field <= block_len) ? 1 : 2;
+    lane->nblocks = lane->nfull + ntail;
+
+    /* Message length in bits, big-endian, at the end of the last block
+    */
+    for(i=0; i < 8; i++)
+        lane->tail[ntail*block_len - 1 - i] = (uint8_t)(bits >> (8*i));
+}
+
+static const uint8_t *
+mb_lane_block(const mb_lane_t *lane, const size_t k, const size_t block_len)
+{
+    if(k < lane->nfull)
+        return lane->data + k * block_len;
+    if(k < lane->nblocks)
+        return lane->tail + (k - lane->nfull) * block_len;
+    return mb_idle_block;
+}
+
+#if HAVE_SHANI
+
+#define SHANI_FN __attribute__((target("sha,sse4.1")))
+
+/* SHA-256 with the SHA extensions.  The state is kept as ABEF and CDGH
+ * the way sha256rnds2 wants it, and four message schedule words are
+ * computed at a time with sha256msg1/sha256msg2.
+*/
+static SHANI_FN void
+shani_blocks(uint32_t *state, const uint8_t *data, size_t nblocks)
+{
+    const __m128i   bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                0x0405060700010203ULL);
+    __m128i         st0, st1, tmp, msg, abef, cdgh, m[4];
+    int             i;
+
+    tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+    st1 = _mm_loadu_si128((const __m128i *)&state[4]);
+
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);         /* CDAB */
+    st1 = _mm_shuffle_epi32(st1, 0x1b);         /* EFGH */
+    st0 = _mm_alignr_epi8(tmp, st1, 8);         /* ABEF */
+    st1 = _mm_blend_epi16(st1, tmp, 0xf0);      /* CDGH */
+
+    for(; nblocks > 0; nblocks--, data += SHA256_BLOCK_LEN)
+    {
+        abef = st0;
+        cdgh = st1;
+
+        for(i=0; i < 16; i++)
+        {
+            if(i < 4)
+                m[i] = _mm_shuffle_epi8(
+                        _mm_loadu_si128((const __m128i *)(data + 16*i)), bswap);
+            else
+            {
+                tmp = _mm_sha256msg1_epu32(m[i&3], m[(i+1)&3]);
+                tmp = _mm_add_epi32(tmp,
+                        _mm_alignr_epi8(m[(i+3)&3], m[(i+2)&3], 4));
+                m[i&3] = _mm_sha256msg2_epu32(tmp, m[(i+3)&3]);
+            }
+
+            msg = _mm_add_epi32(m[i&3],
+                    _mm_loadu_si128((const __m128i *)&K256[4*i]));
+            st1 = _mm_sha256rnds2_epu32(st1, st0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0e);
+            st0 = _mm_sha256rnds2_epu32(st0, st1, msg);
+        }
+
+        st0 = _mm_add_epi32(st0, abef);
+        st1 = _mm_add_epi32(st1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(st0, 0x1b);         /* FEBA */
+    st1 = _mm_shuffle_epi32(st1, 0xb1);         /* DCHG */
+    st0 = _mm_blend_epi16(tmp, st1, 0xf0);      /* DCBA */
+    st1 = _mm_alignr_epi8(st1, tmp, 8);         /* HGFE */
+
+    _mm_storeu_si128((__m128i *)&state[0], st0);
+    _mm_storeu_si128((__m128i *)&state[4], st1);
+}
+
+static int
+shani_supported(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    /* Older compilers do not know "sha" for __builtin_cpu_supports(), so
+     * look at CPUID leaf 7 directly.
+    */
+    __builtin_cpu_init();
+    if(! __builtin_cpu_supports("sse4.1"))
+        return 0;
+
+    if(! __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return 0;
+
+    return (ebx & bit_SHA) != 0;
+}
+
+#endif /* HAVE_SHANI */
+
+#if HAVE_X86_SIMD
+
+#define AVX2_FN __attribute__((target("avx2")))
+
+#define ROR32(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), \
+                        _mm256_slli_epi32((x), 32-(n)))
+#define ROR64(x, n) _mm256_or_si256(_mm256_srli_epi64((x), (n)), \
+                        _mm256_slli_epi64((x), 64-(n)))
+#define XOR3(a, b, c) _mm256_xor_si256(_mm256_xor_si256((a), (b)), (c))
+
+/* Same round structure as the portable code, with one message per 32-bit
+ * (SHA-256) or 64-bit (SHA-512) element.  st[i] holds word i of the state
+ * of every lane.
+*/
+static AVX2_FN void
+avx2_sha256_x8(__m256i *st, const uint8_t * const *blk)
+{
+    const __m256i   bswap = _mm256_set_epi64x(
+                        0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL,
+                        0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m256i         w[16], r[8], t[8], u[8];
+    __m256i         a, b, c, d, e, f, g, h, t1, t2;
+    int             i, j, half;
+
+    /* Transpose the blocks so that w[i] holds word i of every lane
+    */
+    for(half=0; half < 2; half++)
+    {
+        for(j=0; j < 8; j++)
+            r[j] = _mm256_loadu_si256((const __m256i *)(blk[j] + 32*half));
+
+        for(j=0; j < 8; j+=2)
+        {
+            t[j]   = _mm256_unpacklo_epi32(r[j], r[j+1]);
+            t[j+1] = _mm256_unpackhi_epi32(r[j], r[j+1]);
+        }
+        for(j=0; j < 8; j+=4)
+        {
+            u[j]   = _mm256_unpacklo_epi64(t[j],   t[j+2]);
+            u[j+1] = _mm256_unpackhi_epi64(t[j],   t[j+2]);
+            u[j+2] = _mm256_unpacklo_epi64(t[j+1], t[j+3]);
+            u[j+3] = _mm256_unpackhi_epi64(t[j+1], t[j+3]);
+        }
+        for(j=0; j < 4; j++)
+        {
+            w[8*half+j]   = _mm256_shuffle_epi8(
+                    _mm256_permute2x128_si256(u[j], u[j+4], 0x20), bswap);
+            w[8*half+j+4] = _mm256_shuffle_epi8(
+                    _mm256_permute2x128_si256(u[j], u[j+4], 0x31), bswap);
+        }
+    }
+
+    a = st[0]; b = st[1]; c = st[2]; d = st[3];
+    e = st[4]; f = st[5]; g = st[6]; h = st[7];
+
+    for(i=0; i < 64; i++)
+    {
+        if(i >= 16)
+            w[i&15] = _mm256_add_epi32(
+                _mm256_add_epi32(w[i&15], w[(i+9)&15]),
+                _mm256_add_epi32(
+                    XOR3(ROR32(w[(i+1)&15], 7), ROR32(w[(i+1)&15], 18),
+                        _mm256_srli_epi32(w[(i+1)&15], 3)),
+                    XOR3(ROR32(w[(i+14)&15], 17), ROR32(w[(i+14)&15], 19),
+                        _mm256_srli_epi32(w[(i+14)&15], 10))));
+
+        t1 = _mm256_add_epi32(
+            _mm256_add_epi32(h, XOR3(ROR32(e, 6), ROR32(e, 11), ROR32(e, 25))),
+            _mm256_add_epi32(
+                _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g)),
+                _mm256_add_epi32(_mm256_set1_epi32((int)K256[i]), w[i&15])));
+        t2 = _mm256_add_epi32(
+            XOR3(ROR32(a, 2), ROR32(a, 13), ROR32(a, 22)),
+            _mm256_or_si256(_mm256_and_si256(a, b),
+                _mm256_and_si256(c, _mm256_or_si256(a, b))));
+
+        h = g; g = f; f = e;
+        e = _mm256_add_epi32(d, t1);
+        d = c; c = b; b = a;
+        a = _mm256_add_epi32(t1, t2);
+    }
+
+    st[0] = _mm256_add_epi32(st[0], a);
+    st[1] = _mm256_add_epi32(st[1], b);
+    st[2] = _mm256_add_epi32(st[2], c);
+    st[3] = _mm256_add_epi32(st[3], d);
+    st[4] = _mm256_add_epi32(st[4], e);
+    st[5] = _mm256_add_epi32(st[5], f);
+    st[6] = _mm256_add_epi32(st[6], g);
+    st[7] = _mm256_add_epi32(st[7], h);
+}
+
+static AVX2_FN void
+avx2_sha512_x4(__m256i *st, const uint8_t * const *blk)
+{
+    const __m256i   bswap = _mm256_set_epi64x(
+                        0x08090a0b0c0d0e0fULL, 0x0001020304050607ULL,
+                        0x08090a0b0c0d0e0fULL, 0x0001020304050607ULL);
+    __m256i         w[16], r[4], t[4];
+    __m256i         a, b, c, d, e, f, g, h, t1, t2;
+    int             i, j, q;
+
+    for(q=0; q < 4; q++)
+    {
+        for(j=0; j < 4; j++)
+            r[j] = _mm256_loadu_si256((const __m256i *)(blk[j] + 32*q));
+
+        t[0] = _mm256_unpacklo_epi64(r[0], r[1]);
+        t[1] = _mm256_unpackhi_epi64(r[0], r[1]);
+        t[2] = _mm256_unpacklo_epi64(r[2], r[3]);
+        t[3] = _mm256_unpackhi_epi64(r[2], r[3]);
+
+        w[4*q]   = _mm256_shuffle_epi8(_mm256_permute2x128_si256(t[0], t[2], 0x20), bswap);
+        w[4*q+1] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(t[1], t[3], 0x20), bswap);
+        w[4*q+2] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(t[0], t[2], 0x31), bswap);
+        w[4*q+3] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(t[1], t[3], 0x31), bswap);
+    }
+
+    a = st[0]; b = st[1]; c = st[2]; d = st[3];
+    e = st[4]; f = st[5]; g = st[6]; h = st[7];
+
+    for(i=0; i < 80; i++)
+    {
+        if(i >= 16)
+            w[i&15] = _mm256_add_epi64(
+                _mm256_add_epi64(w[i&15], w[(i+9)&15]),
+                _mm256_add_epi64(
+                    XOR3(ROR64(w[(i+1)&15], 1), ROR64(w[(i+1)&15], 8),
+                        _mm256_srli_epi64(w[(i+1)&15], 7)),
+                    XOR3(ROR64(w[(i+14)&15], 19), ROR64(w[(i+14)&15], 61),
+                        _mm256_srli_epi64(w[(i+14)&15], 6))));
+
+        t1 = _mm256_add_epi64(
+            _mm256_add_epi64(h, XOR3(ROR64(e, 14), ROR64(e, 18), ROR64(e, 41))),
+            _mm256_add_epi64(
+                _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g)),
+                _mm256_add_epi64(_mm256_set1_epi64x((long long)K512[i]), w[i&15])));
+        t2 = _mm256_add_epi64(
+            XOR3(ROR64(a, 28), ROR64(a, 34), ROR64(a, 39)),
+            _mm256_or_si256(_mm256_and_si256(a, b),
+                _mm256_and_si256(c, _mm256_or_si256(a, b))));
+
+        h = g; g = f; f = e;
+        e = _mm256_add_epi64(d, t1);
+        d = c; c = b; b = a;
+        a = _mm256_add_epi64(t1, t2);
+    }
+
+    st[0] = _mm256_add_epi64(st[0], a);
+    st[1] = _mm256_add_epi64(st[1], b);
+    st[2] = _mm256_add_epi64(st[2], c);
+    st[3] = _mm256_add_epi64(st[3], d);
+    st[4] = _mm256_add_epi64(st[4], e);
+    st[5] = _mm256_add_epi64(st[5], f);
+    st[6] = _mm256_add_epi64(st[6], g);
+    st[7] = _mm256_add_epi64(st[7], h);
+}
+
+/* Hash up to 8 messages with SHA-256.  Every lane runs as many blocks as
+ * the longest message; a lane's digest is taken as soon as its own last
+ * block is done and whatever it hashes after that is thrown away.
+*/
+static AVX2_FN void
+avx2_sha256_group(uint8_t **out, const uint8_t * const *in,
+        const size_t *len, const int n)
+{
+    mb_lane_t       lanes[MB_MAX_LANES];
+    const uint8_t  *blk[MB_MAX_LANES];
+    __m256i         st[8];
+    uint32_t        words[8][MB_MAX_LANES];
+    size_t          k, max_blocks = 0;
+    SHA256_CTX      init;
+    int             i, j;
+
+    SHA256_Init(&init);
+    for(i=0; i < 8; i++)
+        st[i] = _mm256_set1_epi32((int)init.state[i]);
+
+    for(j=0; j < n; j++)
+    {
+        mb_lane_init(&lanes[j], in[j], len[j], SHA256_BLOCK_LEN, 8);
+        if(lanes[j].nblocks > max_blocks)
+            max_blocks = lanes[j].nblocks;
+    }
+
+    for(k=0; k < max_blocks; k++)
+    {
+        for(j=0; j < MB_MAX_LANES; j++)
+            blk[j] = j < n ? mb_lane_block(&lanes[j], k, SHA256_BLOCK_LEN)
+                : mb_idle_block;
+
+        avx2_sha256_x8(st, blk);
+
+        for(j=0; j < n; j++)
+        {
+            if(lanes[j].nblocks != k+1)
+                continue;
+
+            for(i=0; i < 8; i++)
+                _mm256_storeu_si256((__m256i *)words[i], st[i]);
+            for(i=0; i < 8; i++)
+            {
+                out[j][4*i]   = (uint8_t)(words[i][j] >> 24);
+                out[j][4*i+1] = (uint8_t)(words[i][j] >> 16);
+                out[j][4*i+2] = (uint8_t)(words[i][j] >> 8);
+                out[j][4*i+3] = (uint8_t)(words[i][j]);
+            }
+        }
+    }
+
+    memset(lanes, 0x0, sizeof(lanes));
+    memset(words, 0x0, sizeof(words));
+}
+
+static AVX2_FN void
+avx2_sha512_group(uint8_t **out, const uint8_t * const *in,
+        const size_t *len, const int n, const int digest_len)
+{
+    mb_lane_t       lanes[4];
+    const uint8_t  *blk[4];
+    __m256i         st[8];
+    uint64_t        words[8][4];
+    size_t          k, max_blocks = 0;
+    SHA512_CTX      init;
+    int             i, j, b;
+
+    if(digest_len == SHA384_DIGEST_LEN)
+        SHA384_Init(&init);
+    else
+        SHA512_Init(&init);
+    for(i=0; i < 8; i++)
+        st[i] = _mm256_set1_epi64x((long long)init.state[i]);
+
+    for(j=0; j < n; j++)
+    {
+        mb_lane_init(&lanes[j], in[j], len[j], SHA512_BLOCK_LEN, 16);
+        if(lanes[j].nblocks > max_blocks)
+            max_blocks = lanes[j].nblocks;
+    }
+
+    for(k=0; k < max_blocks; k++)
+    {
+        for(j=0; j < 4; j++)
+            blk[j] = j < n ? mb_lane_block(&lanes[j], k, SHA512_BLOCK_LEN)
+                : mb_idle_block;
+
+        avx2_sha512_x4(st, blk);
+
+        for(j=0; j < n; j++)
+        {
+            if(lanes[j].nblocks != k+1)
+                continue;
+
+            for(i=0; i < 8; i++)
+                _mm256_storeu_si256((__m256i *)words[i], st[i]);
+            for(b=0; b < digest_len; b++)
+                out[j][b] = (uint8_t)(words[b/8][j] >> (56 - 8*(b%8)));
+        }
+    }
+
+    memset(lanes, 0x0, sizeof(lanes));
+    memset(words, 0x0, sizeof(words));
+}
+
+static int
+avx2_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif /* HAVE_X86_SIMD */
+
+static void
+sha2_backend_init(void)
+{
+    int b;
+
+    for(b=SHA2_BACKEND_MAX-1; b > SHA2_BACKEND_BUILTIN; b--)
+        if(sha2_backend_available(b))
+            break;
+
+    sha2_cur_backend = b;
+}
+
+int
+sha2_backend(void)
+{
+    pthread_once(&sha2_backend_once, sha2_backend_init);
+    return sha2_cur_backend;
+}
+
+int
+sha2_backend_available(const int backend)
+{
+    switch(backend)
+    {
+        case SHA2_BACKEND_BUILTIN:
+            return 1;
+#if HAVE_X86_SIMD
+        case SHA2_BACKEND_AVX2:
+            return avx2_supported();
+#endif
+#if HAVE_SHANI
+        case SHA2_BACKEND_SHANI:
+            return shani_supported();
+#endif
+        default:
+            return 0;
+    }
+}
+
+/* Switch backends (for tests and benchmarks).  This must not be called
+ * while other threads are hashing.
+*/
+int
+sha2_set_backend(const int backend)
+{
+    pthread_once(&sha2_backend_once, sha2_backend_init);
+
+    if(! sha2_backend_available(backend))
+        return -1;
+
+    sha2_cur_backend = backend;
+    return 0;
+}
+
+const char *
+sha2_backend_name(const int backend)
+{
+    switch(backend)
+    {
+        case SHA2_BACKEND_BUILTIN:
+            return "builtin";
+        case SHA2_BACKEND_AVX2:
+            return "avx2";
+        case SHA2_BACKEND_SHANI:
+            return "shani";
+        default:
+            return "unknown";
+    }
+}
+
+int
+sha256_accel_blocks(uint32_t *state, const uint8_t *data, const size_t nblocks)
+{
+#if HAVE_SHANI
+    if(sha2_backend() == SHA2_BACKEND_SHANI)
+    {
+        shani_blocks(state, data, nblocks);
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+void
+sha256_mb(uint8_t **out, const uint8_t * const *in, const size_t *len,
+        const int count)
+{
+    SHA256_CTX  ctx;
+    int         i = 0;
+
+#if HAVE_X86_SIMD
+    /* With SHA-NI, hashing the messages one after the other is at least as
+     * fast as the AVX2 lanes (see test/fko-wrapper/fko_sha_bench.c)
+    */
+    if(sha2_backend() == SHA2_BACKEND_AVX2)
+    {
+        for(; i+1 < count; i+=MB_MAX_LANES)
+            avx2_sha256_group(out+i, in+i, len+i,
+                    count-i < MB_MAX_LANES ? count-i : MB_MAX_LANES);
+    }
+#endif
+
+    for(; i < count; i++)
+    {
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, in[i], len[i]);
+        SHA256_Final(out[i], &ctx);
+    }
+}
+
+void
+sha512_mb(uint8_t **out, const uint8_t * const *in, const size_t *len,
+        const int count, const int digest_len)
+{
+    SHA512_CTX  ctx;
+    int         i = 0;
+
+#if HAVE_X86_SIMD
+    if(sha2_backend() != SHA2_BACKEND_BUILTIN && avx2_supported())
+    {
+        for(; i+1 < count; i+=4)
+            avx2_sha512_group(out+i, in+i, len+i,
+                    count-i < 4 ? count-i : 4, digest_len);
+    }
+#endif
+
+    for(; i < count; i++)
+    {
+        if(digest_len == SHA384_DIGEST_LEN)
+        {
+            SHA384_Init(&ctx);
+            SHA384_Update(&ctx, in[i], len[i]);
+            SHA384_Final(out[i], &ctx);
+        }
+        else
+        {
+            SHA512_Init(&ctx);
+            SHA512_Update(&ctx, in[i], len[i]);
+            SHA512_Final(out[i], &ctx);
+        }
+    }
+}
+
+#ifdef HAVE_C_UNIT_TESTS /* LCOV_EXCL_START */
+
+#define UT_MAX_MSGS     19
+#define UT_MAX_LEN      300
+
+/* Every backend that is available on this machine has to produce the same
+ * digests as the portable code, for lengths on both sides of every padding
+ * boundary and for batches that do not fill the last group of lanes.
+*/
+DECLARE_UTEST(backends_match_builtin, "SHA-2 backends match the portable code")
+{
+    static const size_t lens[] = { 0, 1, 3, 55, 56, 63, 64, 65, 111, 112,
+        119, 120, 127, 128, 129, 200, 255, 256, UT_MAX_LEN };
+    uint8_t         msgs[UT_MAX_MSGS][UT_MAX_LEN];
+    uint8_t         ref256[UT_MAX_MSGS][SHA256_DIGEST_LEN];
+    uint8_t         ref384[UT_MAX_MSGS][SHA384_DIGEST_LEN];
+    uint8_t         ref512[UT_MAX_MSGS][SHA512_DIGEST_LEN];
+    uint8_t         md[UT_MAX_MSGS][SHA512_DIGEST_LEN];
+    uint8_t        *out[UT_MAX_MSGS];
+    const uint8_t  *in[UT_MAX_MSGS];
+    size_t          len[UT_MAX_MSGS];
+    int             orig = sha2_backend(), b, n, i, j;
+
+    for(i=0; i < UT_MAX_MSGS; i++)
+    {
+        for(j=0; j < UT_MAX_LEN; j++)
+            msgs[i][j] = (uint8_t)(i * 31 + j * 7 + 1);
+        in[i]  = msgs[i];
+        out[i] = md[i];
+        len[i] = lens[i];
+    }
+
+    CU_ASSERT(sha2_set_backend(SHA2_BACKEND_BUILTIN) == 0);
+    for(i=0; i < UT_MAX_MSGS; i++)
+    {
+        sha256(ref256[i], msgs[i], len[i]);
+        sha384(ref384[i], msgs[i], len[i]);
+        sha512(ref512[i], msgs[i], len[i]);
+    }
+
+    for(b=SHA2_BACKEND_BUILTIN; b < SHA2_BACKEND_MAX; b++)
+    {
+        if(sha2_set_backend(b) != 0)
+            continue;
+
+        for(i=0; i < UT_MAX_MSGS; i++)
+        {
+            sha256(md[i], msgs[i], len[i]);
+            CU_ASSERT(memcmp(md[i], ref256[i], SHA256_DIGEST_LEN) == 0);
+        }
+
+        for(n=1; n <= UT_MAX_MSGS; n++)
+        {
+            memset(md, 0x0, sizeof(md));
+            sha256_mb(out, in, len, n);
+            for(i=0; i < n; i++)
+                CU_ASSERT(memcmp(md[i], ref256[i], SHA256_DIGEST_LEN) == 0);
+
+            memset(md, 0x0, sizeof(md));
+            sha512_mb(out, in, len, n, SHA384_DIGEST_LEN);
+            for(i=0; i < n; i++)
+                CU_ASSERT(memcmp(md[i], ref384[i], SHA384_DIGEST_LEN) == 0);
+
+            memset(md, 0x0, sizeof(md));
+            sha512_mb(out, in, len, n, SHA512_DIGEST_LEN);
+            for(i=0; i < n; i++)
+                CU_ASSERT(memcmp(md[i], ref512[i], SHA512_DIGEST_LEN) == 0);
+        }
+    }
+
+    sha2_set_backend(orig);
+}
+
+/* FIPS 180-2 "abc" through every backend, single and batched
+*/
+DECLARE_UTEST(fips180_vectors, "FIPS 180-2 SHA-256/512 known answers")
+{
+    static const uint8_t expected256[SHA256_DIGEST_LEN] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+        0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+        0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+    };
+    static const uint8_t expected512[SHA512_DIGEST_LEN] = {
+        0xdd, 0xaf, 0x35, 0xa1, 0x93, 0x61, 0x7a, 0xba,
+        0xcc, 0x41, 0x73, 0x49, 0xae, 0x20, 0x41, 0x31,
+        0x12, 0xe6, 0xfa, 0x4e, 0x89, 0xa9, 0x7e, 0xa2,
+        0x0a, 0x9e, 0xee, 0xe6, 0x4b, 0x55, 0xd3, 0x9a,
+        0x21, 0x92, 0x99, 0x2a, 0x27, 0x4f, 0xc1, 0xa8,
+        0x36, 0xba, 0x3c, 0x23, 0xa3, 0xfe, 0xeb, 0xbd,
+        0x45, 0x4d, 0x44, 0x23, 0x64, 0x3c, 0xe8, 0x0e,
+        0x2a, 0x9a, 0xc9, 0x4f, 0xa5, 0x4c, 0xa4, 0x9f
+    };
+    const uint8_t  *in[2] = { (const uint8_t *)"abc", (const uint8_t *)"abc" };
+    size_t          len[2] = { 3, 3 };
+    uint8_t         md[2][SHA512_DIGEST_LEN];
+    uint8_t        *out[2] = { md[0], md[1] };
+    int             orig = sha2_backend(), b;
+
+    for(b=SHA2_BACKEND_BUILTIN; b < SHA2_BACKEND_MAX; b++)
+    {
+        if(sha2_set_backend(b) != 0)
+            continue;
+
+        sha256(md[0], (unsigned char *)"abc", 3);
+        CU_ASSERT(memcmp(md[0], expected256, SHA256_DIGEST_LEN) == 0);
+
+        sha256_mb(out, in, len, 2);
+        CU_ASSERT(memcmp(md[0], expected256, SHA256_DIGEST_LEN) == 0);
+        CU_ASSERT(memcmp(md[1], expected256, SHA256_DIGEST_LEN) == 0);
+
+        sha512_mb(out, in, len, 2, SHA512_DIGEST_LEN);
+        CU_ASSERT(memcmp(md[0], expected512, SHA512_DIGEST_LEN) == 0);
+        CU_ASSERT(memcmp(md[1], expected512, SHA512_DIGEST_LEN) == 0);
+    }
+
+    sha2_set_backend(orig);
+}
+
+/* fko_get_raw_spa_digests() gives the same digests as a context made from
+ * each packet, and an empty string for data that is not SPA data.
+*/
+DECLARE_UTEST(raw_spa_digests, "batched raw SPA digests match fko_get_raw_spa_digest()")
+{
+    static const short  types[] = { FKO_DIGEST_MD5, FKO_DIGEST_SHA1,
+        FKO_DIGEST_SHA256, FKO_DIGEST_SHA384, FKO_DIGEST_SHA512 };
+    char                pkts[UT_MAX_MSGS][UT_MAX_LEN+1];
+    char                digests[UT_MAX_MSGS][MD_HEX_SIZE(SHA512_DIGEST_LEN)+1];
+    char               *spa_data[UT_MAX_MSGS], *out[UT_MAX_MSGS], *md = NULL;
+    fko_ctx_t           ctx = NULL;
+    int                 orig = sha2_backend(), b, t, i, j;
+
+    for(i=0; i < UT_MAX_MSGS; i++)
+    {
+        /* Valid base64 of different lengths, and one packet too short
+        */
+        for(j=0; j < 100 + 11*i; j++)
+            pkts[i][j] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[(i*7+j) % 64];
+        pkts[i][i == 5 ? 4 : j] = '\0';
+        spa_data[i] = pkts[i];
+        out[i]      = digests[i];
+    }
+
+    CU_ASSERT(fko_get_raw_spa_digests(spa_data, UT_MAX_MSGS, FKO_LAST_DIGEST_TYPE,
+                out, sizeof(digests[0])) != FKO_SUCCESS);
+    CU_ASSERT(fko_get_raw_spa_digests(spa_data, UT_MAX_MSGS, FKO_DIGEST_SHA512,
+                out, MD_HEX_SIZE(SHA512_DIGEST_LEN)) != FKO_SUCCESS);
+
+    for(b=SHA2_BACKEND_BUILTIN; b < SHA2_BACKEND_MAX; b++)
+    {
+        if(sha2_set_backend(b) != 0)
+            continue;
+
+        for(t=0; t < (int)(sizeof(types)/sizeof(types[0])); t++)
+        {
+            CU_ASSERT(fko_get_raw_spa_digests(spa_data, UT_MAX_MSGS, types[t],
+                        out, sizeof(digests[0])) == FKO_SUCCESS);
+
+            for(i=0; i < UT_MAX_MSGS; i++)
+            {
+                if(fko_new_with_data_arena(&ctx, spa_data[i], NULL, NULL,
+                            0, NULL) != FKO_SUCCESS)
+                {
+                    CU_ASSERT(digests[i][0] == '\0');
+                    continue;
+                }
+                CU_ASSERT(fko_set_raw_spa_digest_type(ctx, types[t]) == FKO_SUCCESS);
+                CU_ASSERT(fko_set_raw_spa_digest(ctx) == FKO_SUCCESS);
+                CU_ASSERT(fko_get_raw_spa_digest(ctx, &md) == FKO_SUCCESS);
+                CU_ASSERT(md != NULL && strcmp(md, digests[i]) == 0);
+                fko_destroy(ctx);
+                ctx = NULL;
+            }
+        }
+    }
+
+    sha2_set_backend(orig);
+}
+
+int register_ts_sha2_accel(void)
+{
+    ts_init(&TEST_SUITE(sha2_accel), TEST_SUITE_DESCR(sha2_accel), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(sha2_accel), UTEST_FCT(backends_match_builtin), UTEST_DESCR(backends_match_builtin));
+    ts_add_utest(&TEST_SUITE(sha2_accel), UTEST_FCT(fips180_vectors), UTEST_DESCR(fips180_vectors));
+    ts_add_utest(&TEST_SUITE(sha2_accel), UTEST_FCT(raw_spa_digests), UTEST_DESCR(raw_spa_digests));
+
+    return register_ts(&TEST_SUITE(sha2_accel));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */ /* LCOV_EXCL_STOP */
+
+/***EOF***/
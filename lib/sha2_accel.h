@@ -0,0 +1,83 @@
+/*
+ *****************************************************************************
+ *
+ * File:    sha2_accel.h
+ *
+ * Purpose: Header for the accelerated SHA-2 backends in sha2_accel.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef SHA2_ACCEL_H
+#define SHA2_ACCEL_H 1
+
+#include "sha2.h"
+
+/* SHA-2 backends, picked at run time from what the CPU supports (the best
+ * one available is the default).  All of them produce the same digests as
+ * the portable code in sha2.c.
+ *
+ *   builtin - the portable code, one message at a time
+ *   avx2    - the portable code for single messages, and 8 SHA-256 or 4
+ *             SHA-384/512 messages hashed side by side in AVX2 registers
+ *             for the *_multi() functions
+ *   shani   - SHA-256 with the x86 SHA extensions, and the avx2 multi-buffer
+ *             code for SHA-384/512 if the CPU has AVX2
+*/
+#define SHA2_BACKEND_BUILTIN    0
+#define SHA2_BACKEND_AVX2       1
+#define SHA2_BACKEND_SHANI      2
+#define SHA2_BACKEND_MAX        3
+
+/* Round constants from sha2.c
+*/
+extern const uint32_t K256[64];
+extern const uint64_t K512[80];
+
+/* Prototypes
+*/
+int sha2_backend(void);
+int sha2_backend_available(const int backend);
+int sha2_set_backend(const int backend);
+const char *sha2_backend_name(const int backend);
+
+/* Run the SHA-256 compression function over nblocks 64-byte blocks with
+ * the current backend.  Returns -1 without touching the state if the
+ * backend has no single-buffer SHA-256 code, in which case the caller
+ * falls back to SHA256_Transform().
+*/
+int sha256_accel_blocks(uint32_t *state, const uint8_t *data,
+    const size_t nblocks);
+
+/* Hash count independent messages.  out[i] receives the digest of the
+ * len[i] bytes at in[i].  digest_len selects SHA-384 or SHA-512 for
+ * sha512_mb().
+*/
+void sha256_mb(uint8_t **out, const uint8_t * const *in, const size_t *len,
+    const int count);
+void sha512_mb(uint8_t **out, const uint8_t * const *in, const size_t *len,
+    const int count, const int digest_len);
+
+#endif /* SHA2_ACCEL_H */
+
+/***EOF***/
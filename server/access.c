@@ -38,10 +38,10 @@
 #include <arpa/inet.h>
 #include "pwd.h"
 #include "access.h"
+#include "addr_trie.h"
 #include "utils.h"
 #include "log_msg.h"
 #include "cmd_cycle.h"
-#include "bstrlib.h"
 #include <json-c/json.h>
 #include "fwknopd_errors.h"
 #include "sdp_ctrl_client.h"
@@ -1013,6 +1013,9 @@ free_acc_stanza_data(acc_stanza_t *acc)
         free(acc->key_base64);
     }
 
+    if(acc->key_prep != NULL)
+        fko_destroy_enc_key(acc->key_prep);
+
     if(acc->hmac_key != NULL)
     {
         zero_buf_wrapper(acc->hmac_key, acc->hmac_key_len);
@@ -1025,6 +1028,9 @@ free_acc_stanza_data(acc_stanza_t *acc)
         free(acc->hmac_key_base64);
     }
 
+    if(acc->hmac_key_prep != NULL)
+        fko_destroy_hmac_key(acc->hmac_key_prep);
+
     if(acc->cmd_sudo_exec_user != NULL)
         free(acc->cmd_sudo_exec_user);
 
@@ -1068,6 +1074,13 @@ free_acc_stanza_data(acc_stanza_t *acc)
         free(acc->gpg_remote_fpr);
         free_acc_string_list(acc->gpg_remote_fpr_list);
     }
+
+    // holds the keys too
+    if(acc->json_src != NULL)
+    {
+        zero_buf_wrapper(acc->json_src, strlen(acc->json_src));
+        free(acc->json_src);
+    }
     return;
 }
 
@@ -1192,6 +1205,198 @@ expand_acc_ent_lists(fko_srv_options_t *opts)
 }
 
 
+/* Legacy mode stanzas indexed by SOURCE and DESTINATION prefix.  Stanza
+ * n (counted from 0 in list order) is value n in both tries, so the
+ * stanzas an incoming packet may match are the bits set in both the set
+ * for its source and the set for its destination address.  Stanzas
+ * with a netmask that is not a prefix (e.g. 255.0.255.0) are entered
+ * as 0.0.0.0/0 and flagged as inexact, their lists are still compared
+ * entry by entry.
+*/
+typedef struct acc_addr_index
+{
+    addr_trie_t    *src_trie;
+    addr_trie_t    *dst_trie;
+    acc_stanza_t  **stanzas;
+    unsigned char  *inexact;
+    unsigned int    nb_stanzas;
+} acc_addr_index_t;
+
+static void
+free_acc_addr_index(fko_srv_options_t *opts)
+{
+    acc_addr_index_t *idx = opts->acc_addr_index;
+
+    if(idx == NULL)
+        return;
+
+    addr_trie_free(idx->src_trie);
+    addr_trie_free(idx->dst_trie);
+    free(idx->stanzas);
+    free(idx->inexact);
+    free(idx);
+
+    opts->acc_addr_index = NULL;
+}
+
+/* Add every entry of an address list to a trie, returns 1 if one of them
+ * could not be represented exactly and 0.0.0.0/0 was added instead, and
+ * -1 on error.  A NULL list matches any address.
+*/
+static int
+index_addr_list(addr_trie_t *trie, acc_int_list_t *ip_list, const unsigned int value)
+{
+    acc_int_list_t *ent;
+
+    if(ip_list == NULL)
+        return addr_trie_add(trie, 0, 0, value);
+
+    for(ent = ip_list; ent != NULL; ent = ent->next)
+    {
+        if(addr_mask_is_prefix(ent->mask) < 0)
+            return addr_trie_add(trie, 0, 0, value) == 0 ? 1 : -1;
+    }
+
+    for(ent = ip_list; ent != NULL; ent = ent->next)
+    {
+        if(addr_trie_add(trie, ent->maddr & ent->mask, ent->mask, value) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+acc_addr_index_build(fko_srv_options_t *opts)
+{
+    acc_addr_index_t   *idx = NULL;
+    acc_stanza_t       *acc = NULL;
+    unsigned int        n   = 0;
+    int                 src_res, dst_res;
+
+    free_acc_addr_index(opts);
+
+    for(acc = opts->acc_stanzas; acc != NULL; acc = acc->next)
+        n++;
+
+    if(n == 0)
+        return FWKNOPD_SUCCESS;
+
+    if((idx = calloc(1, sizeof(acc_addr_index_t))) == NULL)
+        return FKO_ERROR_MEMORY_ALLOCATION;
+
+    idx->nb_stanzas = n;
+    idx->src_trie   = addr_trie_new(n);
+    idx->dst_trie   = addr_trie_new(n);
+    idx->stanzas    = calloc(n, sizeof(acc_stanza_t *));
+    idx->inexact    = calloc(n, sizeof(unsigned char));
+
+    opts->acc_addr_index = idx;
+
+    if(idx->src_trie == NULL || idx->dst_trie == NULL
+            || idx->stanzas == NULL || idx->inexact == NULL)
+    {
+        free_acc_addr_index(opts);
+        return FKO_ERROR_MEMORY_ALLOCATION;
+    }
+
+    for(acc = opts->acc_stanzas, n = 0; acc != NULL; acc = acc->next, n++)
+    {
+        idx->stanzas[n] = acc;
+
+        src_res = index_addr_list(idx->src_trie, acc->source_list, n);
+        dst_res = index_addr_list(idx->dst_trie, acc->destination_list, n);
+
+        if(src_res < 0 || dst_res < 0)
+        {
+            free_acc_addr_index(opts);
+            return FKO_ERROR_MEMORY_ALLOCATION;
+        }
+
+        idx->inexact[n] = (src_res || dst_res);
+    }
+
+    addr_trie_compile(idx->src_trie);
+    addr_trie_compile(idx->dst_trie);
+
+    log_msg(LOG_DEBUG,
+        "Indexed %u access stanzas (%u source / %u destination trie nodes)",
+        idx->nb_stanzas, addr_trie_nodes(idx->src_trie),
+        addr_trie_nodes(idx->dst_trie));
+
+    return FWKNOPD_SUCCESS;
+}
+
+/* Return the next legacy mode stanza after stanza number *stanza_num
+ * (0 to start from the top) whose SOURCE and DESTINATION lists match
+ * src and dst (host byte order), and set *stanza_num to its number.
+ * Stanzas are returned in access.conf order.  Returns NULL when there
+ * are no more matches.
+*/
+acc_stanza_t *
+acc_addr_index_next(fko_srv_options_t *opts, const uint32_t src,
+        const uint32_t dst, int *stanza_num)
+{
+    acc_addr_index_t   *idx = opts->acc_addr_index;
+    acc_stanza_t       *acc = NULL;
+    const uint64_t     *src_set, *dst_set;
+    uint64_t            word;
+    unsigned int        w, n;
+    int                 num;
+
+    if(idx == NULL)
+    {
+        /* No index, walk the list
+        */
+        for(acc = opts->acc_stanzas, num = 1; acc != NULL; acc = acc->next, num++)
+        {
+            if(num <= *stanza_num)
+                continue;
+
+            if(compare_addr_list(acc->source_list, src)
+                    && (acc->destination_list == NULL
+                        || compare_addr_list(acc->destination_list, dst)))
+            {
+                *stanza_num = num;
+                return acc;
+            }
+        }
+        return NULL;
+    }
+
+    if((src_set = addr_trie_lookup(idx->src_trie, src)) == NULL
+            || (dst_set = addr_trie_lookup(idx->dst_trie, dst)) == NULL)
+        return NULL;
+
+    /* Stanza numbers start at 1, so *stanza_num is the first value
+     * not yet returned
+    */
+    n = *stanza_num;
+    for(w = n / 64; w < ADDR_TRIE_WORDS(idx->nb_stanzas); w++)
+    {
+        word = src_set[w] & dst_set[w];
+        if(w == n / 64)
+            word &= ~0ULL << (n % 64);
+
+        while(word)
+        {
+            n   = w * 64 + __builtin_ctzll(word);
+            acc = idx->stanzas[n];
+            word &= word - 1;
+
+            if(idx->inexact[n]
+                    && (! compare_addr_list(acc->source_list, src)
+                        || (acc->destination_list != NULL
+                            && ! compare_addr_list(acc->destination_list, dst))))
+                continue;
+
+            *stanza_num = n + 1;
+            return acc;
+        }
+    }
+
+    return NULL;
+}
 
 void
 free_acc_stanzas(fko_srv_options_t *opts)
@@ -1212,18 +1417,49 @@ free_acc_stanzas(fko_srv_options_t *opts)
         free(last_acc);
     }
 
+    free_acc_addr_index(opts);
+
     return;
 }
 
+/* Take a reference on an SDP access table stanza so that it outlives
+ * the read-side section it was found in.  Returns 0 without taking one
+ * for a stanza that no table counts (legacy mode), which lives until
+ * the configuration is freed anyway.
+*/
+int
+acc_stanza_hold(acc_stanza_t *acc)
+{
+    // a stanza found in a table keeps refs > 0 for the whole section
+    if(acc == NULL || __atomic_load_n(&acc->refs, __ATOMIC_ACQUIRE) == 0)
+        return 0;
+
+    __atomic_add_fetch(&acc->refs, 1, __ATOMIC_ACQ_REL);
+    return 1;
+}
+
+/* Drop a reference taken by a table or acc_stanza_hold(), freeing the
+ * stanza with the last one
+*/
+void
+acc_stanza_release(acc_stanza_t *acc)
+{
+    if(acc == NULL)
+        return;
+
+    if(__atomic_load_n(&acc->refs, __ATOMIC_ACQUIRE) == 0
+            || __atomic_sub_fetch(&acc->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free_acc_stanza_data(acc);
+        free(acc);
+    }
+}
+
 static void
 destroy_hash_node_cb(hash_table_node_t *node)
 {
-  if(node->key != NULL) bdestroy((bstring)(node->key));
-  if(node->data != NULL)
-  {
-      free_acc_stanza_data((acc_stanza_t*)(node->data));
-      free(node->data);
-  }
+  // the stanza may still be held by another snapshot of the table
+  acc_stanza_release((acc_stanza_t *)(node->data));
 }
 
 static int
@@ -1346,7 +1582,6 @@ acc_stanza_add(fko_srv_options_t *opts, char *val)
     acc_stanza_t    *acc     = opts->acc_stanzas;
     acc_stanza_t    *new_acc = calloc(1, sizeof(acc_stanza_t));
     acc_stanza_t    *last_acc;
-    bstring          key     = NULL;
     int              hash_table_len = 0;
     int              is_err = 0;
 
@@ -1397,8 +1632,8 @@ acc_stanza_add(fko_srv_options_t *opts, char *val)
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             }
 
-            opts->acc_stanza_hash_tbl = hash_table_create(hash_table_len,
-                    NULL, NULL, destroy_hash_node_cb);
+            opts->acc_stanza_hash_tbl = hash_table_create_int(hash_table_len,
+                    destroy_hash_node_cb);
             if(opts->acc_stanza_hash_tbl == NULL)
             {
                 log_msg(LOG_ERR,
@@ -1420,26 +1655,42 @@ acc_stanza_add(fko_srv_options_t *opts, char *val)
             clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
         }
 
-        key = bfromcstr(val);
+        new_acc->sdp_id = strtoul_wrapper(val, 0, UINT32_MAX,
+                NO_EXIT_UPON_ERR, &is_err);
+        if(is_err != FKO_SUCCESS)
+        {
+            log_msg(LOG_ERR,
+                "[*] SDP_ID value not in range in access file: '%s'",
+                opts->config[CONF_ACCESS_FILE]
+            );
+            free_acc_stanza_data(new_acc);
+            free(new_acc);
+            clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+        }
 
-        if( hash_table_set(opts->acc_stanza_hash_tbl, key, new_acc) != FKO_SUCCESS )
+        if( hash_table_set_int(opts->acc_stanza_hash_tbl, new_acc->sdp_id, new_acc) != FKO_SUCCESS )
         {
             log_msg(LOG_ERR,
                 "[*] Fatal error creating access stanza hash table node"
             );
-            bdestroy(key);
             free_acc_stanza_data(new_acc);
             free(new_acc);
             clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
         }
+        __atomic_add_fetch(&new_acc->refs, 1, __ATOMIC_ACQ_REL);
     }
 
     return(new_acc);
 }
 
-static void
+/* Returns FWKNOPD_SUCCESS, or FWKNOPD_ERROR_BAD_STANZA_DATA if the stanza
+ * cannot be used.
+*/
+static int
 set_one_acc_defaults(acc_stanza_t *acc)
 {
+    int     res = FKO_SUCCESS;
+
     access_counter_g++;
 
     /* set default fw_access_timeout if necessary
@@ -1509,15 +1760,61 @@ set_one_acc_defaults(acc_stanza_t *acc)
         acc->hmac_type = FKO_DEFAULT_HMAC_MODE;
     }
 
-    return;
+    /* Prepare the Rijndael and HMAC keys once here rather than for every
+     * SPA packet that is checked against this stanza.  If the Rijndael key
+     * cannot be prepared it is used as is, and the same error is reported
+     * per packet.  A stanza whose HMAC key cannot be prepared is refused.
+    */
+    if(acc->key_prep != NULL)
+    {
+        fko_destroy_enc_key(acc->key_prep);
+        acc->key_prep = NULL;
+    }
+
+    if(acc->key != NULL && acc->encryption_mode != FKO_ENC_MODE_ASYMMETRIC)
+    {
+        res = fko_new_enc_key(&acc->key_prep, acc->key, acc->key_len,
+                acc->encryption_mode);
+        if(res != FKO_SUCCESS)
+        {
+            log_msg(LOG_WARNING,
+                "Could not prepare the Rijndael key for stanza source: '%s' (#%d): %s",
+                acc->source, access_counter_g, fko_errstr(res)
+            );
+            acc->key_prep = NULL;
+        }
+    }
+
+    if(acc->hmac_key_prep != NULL)
+    {
+        fko_destroy_hmac_key(acc->hmac_key_prep);
+        acc->hmac_key_prep = NULL;
+    }
+
+    if(acc->hmac_key_len > 0 && acc->hmac_key != NULL)
+    {
+        res = fko_new_hmac_key(&acc->hmac_key_prep, acc->hmac_key,
+                acc->hmac_key_len, acc->hmac_type);
+        if(res != FKO_SUCCESS)
+        {
+            log_msg(LOG_ERR,
+                "[*] Could not prepare the HMAC key for stanza source: '%s' (#%d): %s",
+                acc->source, access_counter_g, fko_errstr(res)
+            );
+            acc->hmac_key_prep = NULL;
+            return FWKNOPD_ERROR_BAD_STANZA_DATA;
+        }
+    }
+
+    return FWKNOPD_SUCCESS;
 }
 
 static int
 traverse_set_acc_defaults_cb(hash_table_node_t *node, void *arg)
 {
     acc_stanza_t *acc = (acc_stanza_t *)(node->data);
-    if(acc)
-        set_one_acc_defaults(acc);
+    if(acc && set_one_acc_defaults(acc) != FWKNOPD_SUCCESS)
+        clean_exit(access_opts_g, NO_FW_CLEANUP, EXIT_FAILURE);
     return 0;
 }
 
@@ -1536,7 +1833,8 @@ set_acc_defaults(fko_srv_options_t *opts)
     {
         while(acc)
         {
-            set_one_acc_defaults(acc);
+            if(set_one_acc_defaults(acc) != FWKNOPD_SUCCESS)
+                clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             acc = acc->next;
         }
     }
@@ -2189,7 +2487,11 @@ make_acc_stanza_from_json(fko_srv_options_t *opts, json_object *jdata, acc_stanz
         rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
     }
 
-    set_one_acc_defaults(stanza);
+    if(rv == FWKNOPD_SUCCESS && set_one_acc_defaults(stanza) != FWKNOPD_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Key setup failed on stanza for SDP ID %d", stanza->sdp_id);
+        rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
+    }
 
 cleanup:
     if(rv != FWKNOPD_SUCCESS)
@@ -2209,14 +2511,13 @@ cleanup:
  * remove stanzas from the hash table
  */
 static void
-remove_access_stanzas(hash_table_t *acc_table, int access_array_len, json_object *jdata)
+remove_access_stanzas(hash_table_t *acc_table, int access_array_len,
+        json_object *jdata, ctrl_delta_stats_t *delta)
 {
     int rv = FKO_SUCCESS;
     int idx;
     int sdp_id = 0;
     json_object *jentry = NULL;
-    bstring key = NULL;
-    char id[SDP_MAX_CLIENT_ID_STR_LEN + 1] = {0};
 
     // walk through the access array
     for(idx = 0; idx < access_array_len; idx++)
@@ -2228,41 +2529,90 @@ remove_access_stanzas(hash_table_t *acc_table, int access_array_len, json_object
             continue;
         }
 
-        // convert the sdp id integer to a bstring
-        snprintf(id, SDP_MAX_CLIENT_ID_STR_LEN, "%d", sdp_id);
-        key = bfromcstr(id);
-
-        if( hash_table_delete(acc_table, key) != FKO_SUCCESS )
+        if( hash_table_delete_int(acc_table, (uint32_t)sdp_id) != FKO_SUCCESS )
         {
             log_msg(LOG_WARNING, "Did not find hash table node with SDP ID %d to remove. Continuing.", sdp_id);
         }
         else
         {
             log_msg(LOG_NOTICE, "Removed access stanza for SDP ID %d from access list.", sdp_id);
+            delta->removed++;
         }
+    }
+}
+
+/* FNV-1a, only used to tell changed controller stanzas apart quickly
+*/
+static uint32_t
+json_src_hash(const char *src)
+{
+    uint32_t hash = 2166136261U;
 
-        bdestroy(key);
+    while(*src)
+    {
+        hash ^= (unsigned char)*src++;
+        hash *= 16777619U;
     }
+
+    return hash;
 }
 
 /* Take a json data array from a controller message
  * add/replace stanzas in the hash table
  */
 static int
-modify_access_table(fko_srv_options_t *opts, int access_array_len, json_object *jdata)
+modify_access_table(fko_srv_options_t *opts, hash_table_t *cur_table,
+        hash_table_t *acc_table, int access_array_len, json_object *jdata,
+        ctrl_delta_stats_t *delta)
 {
     int rv = FWKNOPD_SUCCESS;
     acc_stanza_t *new_acc = NULL;
+    acc_stanza_t *old_acc = NULL;
     int idx = 0;
     int nodes = 0;
+    int sdp_id = 0;
+    const char *src = NULL;
+    uint32_t src_hash = 0;
     json_object *jstanza = NULL;
-    bstring key = NULL;
-    char id[SDP_MAX_CLIENT_ID_STR_LEN + 1] = {0};
 
     // walk through the access array
     for(idx = 0; idx < access_array_len; idx++)
     {
         jstanza = json_object_array_get_idx(jdata, idx);
+
+        // a stanza identical to the one in the current table is taken
+        // over as is, saving its list expansion and key decoding
+        old_acc = NULL;
+        src = json_object_to_json_string_ext(jstanza, JSON_C_TO_STRING_PLAIN);
+        if(src != NULL)
+            src_hash = json_src_hash(src);
+
+        if(cur_table != NULL && src != NULL
+                && sdp_get_json_int_field("sdp_id", jstanza, &sdp_id) == SDP_SUCCESS)
+            old_acc = hash_table_get_int(cur_table, (uint32_t)sdp_id);
+
+        if(old_acc != NULL && old_acc->json_src != NULL
+                && old_acc->json_hash == src_hash
+                && strcmp(old_acc->json_src, src) == 0)
+        {
+            if(hash_table_get_int(acc_table, old_acc->sdp_id) != old_acc)
+            {
+                if( hash_table_set_int(acc_table, old_acc->sdp_id, old_acc) != FKO_SUCCESS )
+                {
+                    log_msg(LOG_ERR,
+                        "Fatal error creating access stanza hash table node"
+                    );
+                    return FKO_ERROR_MEMORY_ALLOCATION;
+                }
+                __atomic_add_fetch(&old_acc->refs, 1, __ATOMIC_ACQ_REL);
+            }
+
+            log_msg(LOG_DEBUG, "Access entry for SDP ID %d unchanged", sdp_id);
+            delta->unchanged++;
+            nodes++;
+            continue;
+        }
+
         if((rv = make_acc_stanza_from_json(opts, jstanza, &new_acc)) != FWKNOPD_SUCCESS)
         {
             if(rv == FKO_ERROR_MEMORY_ALLOCATION)
@@ -2275,20 +2625,25 @@ modify_access_table(fko_srv_options_t *opts, int access_array_len, json_object *
             continue;
         }
 
-        // convert the sdp id integer to a bstring
-        snprintf(id, SDP_MAX_CLIENT_ID_STR_LEN, "%d", new_acc->sdp_id);
-        key = bfromcstr(id);
-
-        if( hash_table_set(opts->acc_stanza_hash_tbl, key, new_acc) != FKO_SUCCESS )
+        if( hash_table_set_int(acc_table, new_acc->sdp_id, new_acc) != FKO_SUCCESS )
         {
             log_msg(LOG_ERR,
                 "Fatal error creating access stanza hash table node"
             );
-            bdestroy(key);
             free_acc_stanza_data(new_acc);
             free(new_acc);
             return FKO_ERROR_MEMORY_ALLOCATION;
         }
+        __atomic_add_fetch(&new_acc->refs, 1, __ATOMIC_ACQ_REL);
+
+        // without a copy the stanza is simply rebuilt next time
+        if(src != NULL && (new_acc->json_src = strdup(src)) != NULL)
+            new_acc->json_hash = src_hash;
+
+        if(old_acc != NULL)
+            delta->changed++;
+        else
+            delta->added++;
 
         log_msg(LOG_NOTICE, "Added access entry for SDP ID %d", new_acc->sdp_id);
         nodes++;
@@ -2306,16 +2661,326 @@ modify_access_table(fko_srv_options_t *opts, int access_array_len, json_object *
 
 }
 
+/* SDP access table snapshots
+ *
+ * The table published in opts->acc_stanza_hash_tbl is never modified.
+ * Controller messages build a new table beside it, sharing the stanzas
+ * that did not change (acc_stanza_t refs counts the tables holding each
+ * one), and swap it in with an atomic store.  Readers only record the
+ * current epoch in a per-thread slot while they use the table, so packet
+ * processing never waits on an update.  A replaced table is freed once
+ * every slot is either idle or holds an epoch from after the swap.
+ *
+ * Everything else (building, publishing and reclaiming) happens under
+ * acc_hash_tbl_mutex.  The stanza reference counts are atomic, as a
+ * queued SPA grant may hold a stanza (acc_stanza_hold()) and drop it on
+ * another thread.
+*/
+typedef struct acc_delta_check
+{
+    hash_table_t        *new_table;
+    ctrl_delta_stats_t  *delta;
+} acc_delta_check_t;
+
+#define ACC_READER_UNREGISTERED   -1
+#define ACC_READER_USES_MUTEX     -2
+
+static __thread int         acc_reader_slot  = ACC_READER_UNREGISTERED;
+static __thread uint32_t    acc_reader_gen   = 0;
+static __thread int         acc_reader_depth = 0;
+
+/* Enter an access table read-side section.  Sections nest, and the
+ * table returned by acc_table_current() along with any stanza found in
+ * it stay valid until the outermost acc_table_read_unlock().
+*/
+void
+acc_table_read_lock(fko_srv_options_t *opts)
+{
+    uint32_t    gen;
+
+    if(acc_reader_depth++ > 0)
+        return;
+
+    gen = __atomic_load_n(&opts->acc_reader_gen, __ATOMIC_ACQUIRE);
+    if(acc_reader_slot == ACC_READER_UNREGISTERED || acc_reader_gen != gen)
+    {
+        acc_reader_gen  = gen;
+        acc_reader_slot = __atomic_fetch_add(&opts->acc_reader_count, 1,
+                __ATOMIC_SEQ_CST);
+        if(acc_reader_slot >= MAX_ACC_TABLE_READERS)
+        {
+            log_msg(LOG_WARNING,
+                "Out of access table reader slots, falling back to locking");
+            acc_reader_slot = ACC_READER_USES_MUTEX;
+        }
+    }
+
+    if(acc_reader_slot == ACC_READER_USES_MUTEX)
+    {
+        pthread_mutex_lock(&(opts->acc_hash_tbl_mutex));
+        return;
+    }
+
+    // the slot must be visible before the table pointer is loaded
+    __atomic_store_n(&opts->acc_reader_epochs[acc_reader_slot],
+            __atomic_load_n(&opts->acc_table_epoch, __ATOMIC_SEQ_CST),
+            __ATOMIC_SEQ_CST);
+}
+
+void
+acc_table_read_unlock(fko_srv_options_t *opts)
+{
+    if(acc_reader_depth <= 0 || --acc_reader_depth > 0)
+        return;
+
+    if(acc_reader_slot == ACC_READER_USES_MUTEX)
+        pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
+    else
+        __atomic_store_n(&opts->acc_reader_epochs[acc_reader_slot], 0,
+                __ATOMIC_RELEASE);
+}
+
+/* The published table, only to be used inside a read-side section
+*/
+hash_table_t *
+acc_table_current(fko_srv_options_t *opts)
+{
+    return __atomic_load_n(&opts->acc_stanza_hash_tbl, __ATOMIC_SEQ_CST);
+}
+
+static void
+free_retired_table(acc_retired_table_t *ret)
+{
+    if(ret->tbl != NULL)
+        hash_table_destroy(ret->tbl);
+    else if(ret->free_obj != NULL)
+        ret->free_obj(ret->obj);
+    free(ret);
+}
+
+/* Free the replaced tables no reader can still be using.
+ * Called with acc_hash_tbl_mutex held.
+*/
+static void
+reclaim_acc_tables(fko_srv_options_t *opts)
+{
+    acc_retired_table_t    *ret, **prev;
+    uint64_t                oldest = UINT64_MAX, epoch;
+    int                     i, nb_readers;
+
+    if(opts->acc_retired_tbls == NULL)
+        return;
+
+    nb_readers = __atomic_load_n(&opts->acc_reader_count, __ATOMIC_SEQ_CST);
+    if(nb_readers > MAX_ACC_TABLE_READERS)
+        nb_readers = MAX_ACC_TABLE_READERS;
+
+    for(i = 0; i < nb_readers; i++)
+    {
+        epoch = __atomic_load_n(&opts->acc_reader_epochs[i], __ATOMIC_SEQ_CST);
+        if(epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    prev = &opts->acc_retired_tbls;
+    while((ret = *prev) != NULL)
+    {
+        if(ret->epoch <= oldest)
+        {
+            *prev = ret->next;
+            free_retired_table(ret);
+        }
+        else
+            prev = &ret->next;
+    }
+}
+
+/* Swap in a new table and retire the old one.
+ * Called with acc_hash_tbl_mutex held.
+*/
+static int
+publish_acc_table(fko_srv_options_t *opts, hash_table_t *acc_table)
+{
+    hash_table_t           *old = opts->acc_stanza_hash_tbl;
+    acc_retired_table_t    *ret = NULL;
+
+    if(old != NULL && (ret = calloc(1, sizeof(acc_retired_table_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Fatal memory allocation error retiring access table");
+        return FKO_ERROR_MEMORY_ALLOCATION;
+    }
+
+    __atomic_store_n(&opts->acc_stanza_hash_tbl, acc_table, __ATOMIC_SEQ_CST);
+    opts->acc_table_version++;
+
+    if(ret != NULL)
+    {
+        ret->tbl   = old;
+        ret->epoch = __atomic_add_fetch(&opts->acc_table_epoch, 1, __ATOMIC_SEQ_CST);
+        ret->next  = opts->acc_retired_tbls;
+        opts->acc_retired_tbls = ret;
+    }
+
+    log_msg(LOG_INFO, "Published access table version %"PRIu64" (%"PRIu32" stanzas)",
+            opts->acc_table_version, acc_table->count);
+
+    reclaim_acc_tables(opts);
+    return FWKNOPD_SUCCESS;
+}
+
+/* Free replaced access tables once their readers are done, for callers
+ * that run periodically
+*/
+void
+acc_table_reclaim(fko_srv_options_t *opts)
+{
+    if(pthread_mutex_lock(&(opts->acc_hash_tbl_mutex)))
+    {
+        log_msg(LOG_ERR, "Mutex lock error.");
+        return;
+    }
+
+    reclaim_acc_tables(opts);
+
+    pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
+}
+
+/* Hand over an object that was replaced (with an atomic store) while
+ * readers may still use it under acc_table_read_lock().  free_obj is
+ * called on it once they are done.
+*/
+int
+acc_table_retire(fko_srv_options_t *opts, void *obj, void (*free_obj)(void *obj))
+{
+    acc_retired_table_t    *ret = NULL;
+
+    if((ret = calloc(1, sizeof(acc_retired_table_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Fatal memory allocation error retiring access data");
+        return FKO_ERROR_MEMORY_ALLOCATION;
+    }
+
+    ret->obj      = obj;
+    ret->free_obj = free_obj;
+
+    if(pthread_mutex_lock(&(opts->acc_hash_tbl_mutex)))
+    {
+        log_msg(LOG_ERR, "Mutex lock error.");
+        free(ret);
+        return FWKNOPD_ERROR_MUTEX;
+    }
+
+    ret->epoch = __atomic_add_fetch(&opts->acc_table_epoch, 1, __ATOMIC_SEQ_CST);
+    ret->next  = opts->acc_retired_tbls;
+    opts->acc_retired_tbls = ret;
+
+    reclaim_acc_tables(opts);
+
+    pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
+    return FWKNOPD_SUCCESS;
+}
+
+/* Tear down the published and retired tables.  Only for use once all
+ * reader threads have stopped.
+*/
+void
+destroy_acc_tables(fko_srv_options_t *opts)
+{
+    acc_retired_table_t    *ret;
+    int                     i;
+
+    if(opts->acc_stanza_hash_tbl != NULL)
+    {
+        hash_table_destroy(opts->acc_stanza_hash_tbl);
+        opts->acc_stanza_hash_tbl = NULL;
+    }
+
+    while((ret = opts->acc_retired_tbls) != NULL)
+    {
+        opts->acc_retired_tbls = ret->next;
+        free_retired_table(ret);
+    }
+
+    // threads started later register again
+    for(i = 0; i < MAX_ACC_TABLE_READERS; i++)
+        opts->acc_reader_epochs[i] = 0;
+    opts->acc_reader_count = 0;
+    opts->acc_reader_gen++;
+}
+
+static hash_table_t *
+create_acc_table(fko_srv_options_t *opts, uint32_t nb_stanzas)
+{
+    hash_table_t   *acc_table = NULL;
+    int             hash_table_len = 0;
+    int             is_err = 0;
+
+    hash_table_len = strtol_wrapper(opts->config[CONF_ACC_STANZA_HASH_TABLE_LENGTH],
+                           MIN_ACC_STANZA_HASH_TABLE_LENGTH,
+                           MAX_ACC_STANZA_HASH_TABLE_LENGTH,
+                           NO_EXIT_UPON_ERR,
+                           &is_err);
+
+    if(is_err != FKO_SUCCESS)
+    {
+        // this error should be impossible because the config variable
+        // is checked at startup
+        log_msg(LOG_ERR, "[*] var %s value '%s' not in the range %d-%d",
+                "ACC_STANZA_HASH_TABLE_LENGTH",
+                opts->config[CONF_ACC_STANZA_HASH_TABLE_LENGTH],
+                MIN_ACC_STANZA_HASH_TABLE_LENGTH,
+                MAX_ACC_STANZA_HASH_TABLE_LENGTH);
+        return NULL;
+    }
+
+    // a copy starts out as large as the table it copies has grown
+    if(nb_stanzas > (uint32_t)hash_table_len)
+        hash_table_len = nb_stanzas;
+
+    if((acc_table = hash_table_create_int(hash_table_len, destroy_hash_node_cb)) == NULL)
+        log_msg(LOG_ERR,
+            "[*] Fatal memory allocation error creating access stanza hash table"
+        );
+
+    return acc_table;
+}
+
+static int
+traverse_count_removed_cb(hash_table_node_t *node, void *arg)
+{
+    acc_stanza_t        *acc   = (acc_stanza_t *)(node->data);
+    acc_delta_check_t   *check = (acc_delta_check_t *)arg;
+
+    if(hash_table_get_int(check->new_table, acc->sdp_id) == NULL)
+        check->delta->removed++;
+
+    return 0;
+}
+
+static int
+traverse_copy_acc_cb(hash_table_node_t *node, void *arg)
+{
+    acc_stanza_t *acc = (acc_stanza_t *)(node->data);
+
+    if(hash_table_set_int((hash_table_t *)arg, acc->sdp_id, acc) != 0)
+        return -1;
+
+    __atomic_add_fetch(&acc->refs, 1, __ATOMIC_ACQ_REL);
+    return 0;
+}
+
 /* Take a json data array from a controller message
- * Alter/recreate the hash table based on the action
+ * Build the next version of the access table based on the action
  */
 int
 process_access_msg(fko_srv_options_t *opts, int action, json_object *jdata)
 {
     int rv = FWKNOPD_SUCCESS;
-    int hash_table_len = 0;
     int access_array_len = 0;
-    int is_err = 0;
+    hash_table_t *cur_table = NULL;
+    hash_table_t *new_table = NULL;
+    ctrl_delta_stats_t delta;
+    acc_delta_check_t check;
 
     if(jdata == NULL || json_object_get_type(jdata) == json_type_null)
     {
@@ -2332,89 +2997,92 @@ process_access_msg(fko_srv_options_t *opts, int action, json_object *jdata)
 
     log_msg(LOG_DEBUG, "jdata contains %d objects", access_array_len);
 
+    memset(&delta, 0x0, sizeof(delta));
 
-    // lock the hash table mutex
+    // only one writer at a time, readers are not held up
     if(pthread_mutex_lock(&(opts->acc_hash_tbl_mutex)))
     {
         log_msg(LOG_ERR, "Mutex lock error.");
         return FWKNOPD_ERROR_MUTEX;
     }
 
-    if(action == CTRL_ACTION_ACCESS_REMOVE)
-    {
-        if(opts->acc_stanza_hash_tbl == NULL)
-        {
-            //table is not initialized, nothing to do
-            log_msg(LOG_WARNING, "Received access remove message, but access table not "
-                    "initialized. Nothing to do.");
-            pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
-            return FWKNOPD_ERROR_UNTIMELY_MSG;
-        }
+    cur_table = opts->acc_stanza_hash_tbl;
 
-        remove_access_stanzas(opts->acc_stanza_hash_tbl, access_array_len, jdata);
+    if(action == CTRL_ACTION_ACCESS_REMOVE && cur_table == NULL)
+    {
+        //table is not initialized, nothing to do
+        log_msg(LOG_WARNING, "Received access remove message, but access table not "
+                "initialized. Nothing to do.");
         pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
-
-        return FWKNOPD_SUCCESS;
+        return FWKNOPD_ERROR_UNTIMELY_MSG;
     }
 
-    // if this is an access data refresh, destroy the hash table
-    if(action == CTRL_ACTION_ACCESS_REFRESH)
+    // a refresh starts from an empty table, anything else from a copy
+    // of the current one
+    if(action == CTRL_ACTION_ACCESS_REFRESH || cur_table == NULL)
+        new_table = create_acc_table(opts, 0);
+    else
+        new_table = create_acc_table(opts, cur_table->count);
+
+    if(new_table == NULL)
     {
-        if(opts->acc_stanza_hash_tbl != NULL)
-        {
-            // destroy the table
-            hash_table_destroy(opts->acc_stanza_hash_tbl);
-            opts->acc_stanza_hash_tbl = NULL;
-        }
+        pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
+        return FKO_ERROR_MEMORY_ALLOCATION;
     }
 
-    // create the hash table if necessary
-    if(opts->acc_stanza_hash_tbl == NULL)
+    if(action != CTRL_ACTION_ACCESS_REFRESH && cur_table != NULL
+            && hash_table_traverse(cur_table, traverse_copy_acc_cb, new_table) != 0)
     {
-        //need to initialize hash table
-        hash_table_len = strtol_wrapper(opts->config[CONF_ACC_STANZA_HASH_TABLE_LENGTH],
-                               MIN_ACC_STANZA_HASH_TABLE_LENGTH,
-                               MAX_ACC_STANZA_HASH_TABLE_LENGTH,
-                               NO_EXIT_UPON_ERR,
-                               &is_err);
+        log_msg(LOG_ERR, "[*] Fatal memory allocation error copying access table");
+        rv = FKO_ERROR_MEMORY_ALLOCATION;
+        goto cleanup;
+    }
 
-        if(is_err != FKO_SUCCESS)
+    if(action == CTRL_ACTION_ACCESS_REMOVE)
+    {
+        remove_access_stanzas(new_table, access_array_len, jdata, &delta);
+    }
+    else
+    {
+        // control message is either REFRESH or UPDATE
+        // in either case, use data array to modify the table
+        if((rv = modify_access_table(opts, cur_table, new_table,
+                        access_array_len, jdata, &delta)) != FWKNOPD_SUCCESS)
         {
-            // this error should be impossible because the config variable
-            // is checked at startup
-
-            pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
+            log_msg(LOG_ERR, "modify_access_table was unsuccessful");
 
-            log_msg(LOG_ERR, "[*] var %s value '%s' not in the range %d-%d",
-                    "ACC_STANZA_HASH_TABLE_LENGTH",
-                    opts->config[CONF_ACC_STANZA_HASH_TABLE_LENGTH],
-                    MIN_ACC_STANZA_HASH_TABLE_LENGTH,
-                    MAX_ACC_STANZA_HASH_TABLE_LENGTH);
-
-            return FWKNOPD_ERROR_BAD_CONFIG;
+            // partial updates are published as before, unless memory ran out
+            if(rv == FKO_ERROR_MEMORY_ALLOCATION)
+                goto cleanup;
         }
 
-        opts->acc_stanza_hash_tbl = hash_table_create(hash_table_len,
-                NULL, NULL, destroy_hash_node_cb);
-        if(opts->acc_stanza_hash_tbl == NULL)
+        // whatever a refresh did not mention is gone
+        if(action == CTRL_ACTION_ACCESS_REFRESH && cur_table != NULL)
         {
-            pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
-
-            log_msg(LOG_ERR,
-                "[*] Fatal memory allocation error creating access stanza hash table"
-            );
-            return FKO_ERROR_MEMORY_ALLOCATION;
+            check.new_table = new_table;
+            check.delta     = &delta;
+            hash_table_traverse(cur_table, traverse_count_removed_cb, &check);
         }
     }
 
-    // control message is either REFRESH or UPDATE
-    // in either case, use data array to modify the table
-    if((rv = modify_access_table(opts, access_array_len, jdata)) != FWKNOPD_SUCCESS)
+    if(publish_acc_table(opts, new_table) == FWKNOPD_SUCCESS)
     {
-        log_msg(LOG_ERR, "modify_access_table was unsuccessful");
+        new_table = NULL;
+        opts->acc_last_delta = delta;
+
+        log_msg(LOG_INFO, "Access %s: %u added, %u changed, %u removed, %u unchanged",
+                action == CTRL_ACTION_ACCESS_REFRESH ? "refresh"
+                    : (action == CTRL_ACTION_ACCESS_REMOVE ? "removal" : "update"),
+                delta.added, delta.changed, delta.removed, delta.unchanged);
     }
+    else
+        rv = FKO_ERROR_MEMORY_ALLOCATION;
+
+cleanup:
+    // only drops the references a failed update took
+    if(new_table != NULL)
+        hash_table_destroy(new_table);
 
-    // release lock on the table
     pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
 
     return rv;
@@ -2585,16 +3253,6 @@ parse_access_file(fko_srv_options_t *opts)
             /* Start new stanza.
             */
             curr_acc = acc_stanza_add(opts, val);
-            curr_acc->sdp_id = (uint32_t)strtol_wrapper(val, 0,
-                                        UINT32_MAX, NO_EXIT_UPON_ERR, &is_err);
-            if(is_err != FKO_SUCCESS)
-            {
-                log_msg(LOG_ERR,
-                    "[*] SDP_ID value not in range in access file: '%s'",
-                    opts->config[CONF_ACCESS_FILE] );
-                fclose(file_ptr);
-                clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
-            }
             got_sdp_id++;
         }
         else if (curr_acc == NULL)
@@ -2972,6 +3630,13 @@ parse_access_file(fko_srv_options_t *opts)
     */
     set_acc_defaults(opts);
 
+    /* Index the stanzas by address for incoming SPA packets.  Without
+     * the index packets are matched by walking the stanza list.
+    */
+    if(acc_addr_index_build(opts) != FWKNOPD_SUCCESS)
+        log_msg(LOG_WARNING,
+            "[*] Could not build the access stanza address index, falling back to a linear search");
+
     return;
 }
 
@@ -3187,6 +3852,9 @@ dump_access_list(fko_srv_options_t *opts)
     int             i = 0;
 
     acc_stanza_t    *acc = opts->acc_stanzas;
+    hash_table_stats_t stats;
+    ctrl_delta_stats_t delta;
+    uint64_t         version = 0;
 
     int opened = 0;
     FILE *dest = NULL;
@@ -3230,8 +3898,21 @@ dump_access_list(fko_srv_options_t *opts)
         }
 
         hash_table_traverse(opts->acc_stanza_hash_tbl, traverse_dump_hash_cb, dest);
+        hash_table_get_stats(opts->acc_stanza_hash_tbl, &stats);
+        version = opts->acc_table_version;
+        delta   = opts->acc_last_delta;
 
         pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
+
+        fprintf(dest,
+            "Access stanza table: %"PRIu32" stanzas in %"PRIu32" buckets "
+            "(%"PRIu32" used, longest chain %"PRIu32"%s)\n",
+            stats.nodes, stats.buckets, stats.used_buckets, stats.max_chain,
+            stats.rehashing ? ", growing" : "");
+        fprintf(dest,
+            "Access table version %"PRIu64", last controller message: "
+            "%u added, %u changed, %u removed, %u unchanged\n\n",
+            version, delta.added, delta.changed, delta.removed, delta.unchanged);
     }
     else
     {
@@ -3364,10 +4045,258 @@ DECLARE_UTEST(compare_port_list, "check compare_port_list function")
     CU_ASSERT(compare_port_list(acc_pl, in2_pl, 0) == 1);    /* All ports must match in2 port list - 2 */
 }
 
+/* SDP mode stanzas are kept in a table keyed by the integer SDP ID
+*/
+DECLARE_UTEST(acc_stanza_int_table, "check the SDP ID keyed access stanza table")
+{
+    hash_table_t    *tbl = hash_table_create_int(7, destroy_hash_node_cb);
+    acc_stanza_t    *acc = NULL;
+    uint32_t         id;
+
+    CU_ASSERT_FATAL(tbl != NULL);
+
+    for(id = 1; id <= 100; id++)
+    {
+        acc = calloc(1, sizeof(acc_stanza_t));
+        CU_ASSERT_FATAL(acc != NULL);
+        acc->sdp_id = id;
+        CU_ASSERT(hash_table_set_int(tbl, id, acc) == 0);
+    }
+
+    /* Replacing a stanza frees the old one through the delete callback */
+    acc = calloc(1, sizeof(acc_stanza_t));
+    CU_ASSERT_FATAL(acc != NULL);
+    acc->sdp_id = UINT32_MAX;
+    CU_ASSERT(hash_table_set_int(tbl, 42, acc) == 0);
+    CU_ASSERT(hash_table_get_int(tbl, 42) == acc);
+
+    acc = hash_table_get_int(tbl, 99);
+    CU_ASSERT(acc != NULL && acc->sdp_id == 99);
+    CU_ASSERT(hash_table_get_int(tbl, 0) == NULL);
+    CU_ASSERT(hash_table_get_int(tbl, 101) == NULL);
+
+    CU_ASSERT(hash_table_delete_int(tbl, 99) == 0);
+    CU_ASSERT(hash_table_get_int(tbl, 99) == NULL);
+    CU_ASSERT(hash_table_delete_int(tbl, 99) != 0);
+
+    /* String keyed calls are refused */
+    CU_ASSERT(hash_table_get(tbl, NULL) == NULL);
+
+    hash_table_destroy(tbl);
+}
+
+static int
+count_nodes_cb(hash_table_node_t *node, void *arg)
+{
+    (*(uint32_t *)arg)++;
+    return 0;
+}
+
+/* Tables grow a few buckets at a time without losing stanzas on the way
+*/
+DECLARE_UTEST(acc_stanza_table_growth, "check access stanza table rehashing")
+{
+    hash_table_t       *tbl = hash_table_create_int(10, destroy_hash_node_cb);
+    hash_table_stats_t  stats;
+    acc_stanza_t       *acc = NULL;
+    uint32_t            id, seen_rehash = 0, found, visited = 0;
+
+    CU_ASSERT_FATAL(tbl != NULL);
+    hash_table_set_max_load(tbl, 100);
+
+    for(id = 1; id <= 10000; id++)
+    {
+        acc = calloc(1, sizeof(acc_stanza_t));
+        CU_ASSERT_FATAL(acc != NULL);
+        acc->sdp_id = id;
+        CU_ASSERT(hash_table_set_int(tbl, id, acc) == 0);
+
+        if(tbl->old_buckets != NULL && seen_rehash++ % 500 == 0)
+        {
+            for(found = 1; found <= id; found++)
+                if(hash_table_get_int(tbl, found) == NULL)
+                    break;
+            CU_ASSERT(found == id + 1);
+        }
+    }
+    CU_ASSERT(seen_rehash > 0);
+
+    hash_table_get_stats(tbl, &stats);
+    CU_ASSERT(stats.nodes == 10000);
+    CU_ASSERT(stats.buckets >= 10000 || stats.rehashing);
+    CU_ASSERT(stats.max_chain <= 2 * HASH_TABLE_CHAIN_HIST_LEN);
+
+    hash_table_traverse(tbl, count_nodes_cb, &visited);
+    CU_ASSERT(visited == 10000);
+
+    for(id = 1; id <= 10000; id += 2)
+        CU_ASSERT(hash_table_delete_int(tbl, id) == 0);
+
+    hash_table_get_stats(tbl, &stats);
+    CU_ASSERT(stats.nodes == 5000);
+    for(id = 1; id <= 10000; id++)
+        CU_ASSERT((hash_table_get_int(tbl, id) != NULL) == (id % 2 == 0));
+
+    hash_table_destroy(tbl);
+}
+
+/* A replaced table outlives the readers that entered before the swap
+*/
+DECLARE_UTEST(acc_table_snapshots, "check access table snapshot reclamation")
+{
+    static fko_srv_options_t    opts;
+    hash_table_t               *tbl = NULL;
+    acc_stanza_t               *acc = NULL;
+
+    memset(&opts, 0x00, sizeof(opts));
+    pthread_mutex_init(&(opts.acc_hash_tbl_mutex), NULL);
+    opts.acc_table_epoch = 1;
+
+    tbl = hash_table_create_int(10, destroy_hash_node_cb);
+    acc = calloc(1, sizeof(acc_stanza_t));
+    CU_ASSERT_FATAL(tbl != NULL && acc != NULL);
+    acc->sdp_id = 7;
+    CU_ASSERT(hash_table_set_int(tbl, acc->sdp_id, acc) == 0);
+    acc->refs++;
+    CU_ASSERT(publish_acc_table(&opts, tbl) == FWKNOPD_SUCCESS);
+    CU_ASSERT(opts.acc_table_version == 1);
+
+    acc_table_read_lock(&opts);
+    acc_table_read_lock(&opts);
+    CU_ASSERT(acc_table_current(&opts) == tbl);
+    CU_ASSERT(hash_table_get_int(acc_table_current(&opts), 7) == acc);
+
+    /* Replace the table while the reader still holds it
+    */
+    tbl = hash_table_create_int(10, destroy_hash_node_cb);
+    CU_ASSERT_FATAL(tbl != NULL);
+    CU_ASSERT(hash_table_traverse(acc_table_current(&opts), traverse_copy_acc_cb, tbl) == 0);
+    CU_ASSERT(acc->refs == 2);
+    CU_ASSERT(hash_table_delete_int(tbl, 7) == 0);
+    CU_ASSERT(publish_acc_table(&opts, tbl) == FWKNOPD_SUCCESS);
+    CU_ASSERT(opts.acc_retired_tbls != NULL);
+    CU_ASSERT(acc->refs == 1 && acc->sdp_id == 7);
+
+    acc_table_read_unlock(&opts);
+    acc_table_reclaim(&opts);
+    CU_ASSERT(opts.acc_retired_tbls != NULL);
+
+    /* A held stanza outlives the read section and the old table
+    */
+    CU_ASSERT(acc_stanza_hold(acc) == 1);
+    CU_ASSERT(acc->refs == 2);
+
+    /* The outermost unlock lets the old table go
+    */
+    acc_table_read_unlock(&opts);
+    acc_table_reclaim(&opts);
+    CU_ASSERT(opts.acc_retired_tbls == NULL);
+    CU_ASSERT(acc->refs == 1 && acc->sdp_id == 7);
+    acc_stanza_release(acc);
+
+    acc_table_read_lock(&opts);
+    CU_ASSERT(acc_table_current(&opts) == tbl);
+    CU_ASSERT(hash_table_get_int(acc_table_current(&opts), 7) == NULL);
+    acc_table_read_unlock(&opts);
+
+    destroy_acc_tables(&opts);
+    CU_ASSERT(opts.acc_stanza_hash_tbl == NULL);
+    pthread_mutex_destroy(&(opts.acc_hash_tbl_mutex));
+}
+
+static acc_stanza_t *
+test_addr_stanza(acc_stanza_t **list, const char *src, const char *dst)
+{
+    acc_stanza_t *acc = calloc(1, sizeof(acc_stanza_t)), *tail = *list;
+
+    if(acc == NULL)
+        return NULL;
+
+    add_int_ent(&(acc->source_list), src);
+    if(dst != NULL)
+        add_int_ent(&(acc->destination_list), dst);
+
+    if(tail == NULL)
+        *list = acc;
+    else
+    {
+        while(tail->next != NULL)
+            tail = tail->next;
+        tail->next = acc;
+    }
+    return acc;
+}
+
+static int
+test_addr_matches(fko_srv_options_t *opts, const char *src, const char *dst,
+        int *first, int *last)
+{
+    struct in_addr  src_in, dst_in;
+    int             stanza_num = 0, count = 0;
+
+    inet_aton(src, &src_in);
+    inet_aton(dst, &dst_in);
+    *first = *last = 0;
+
+    while(acc_addr_index_next(opts, ntohl(src_in.s_addr),
+                ntohl(dst_in.s_addr), &stanza_num) != NULL)
+    {
+        if(count++ == 0)
+            *first = stanza_num;
+        *last = stanza_num;
+    }
+    return count;
+}
+
+DECLARE_UTEST(acc_addr_index, "check the legacy mode stanza address index")
+{
+    static fko_srv_options_t    opts;
+    int                         i, pass, first, last;
+
+    memset(&opts, 0x00, sizeof(opts));
+
+    test_addr_stanza(&opts.acc_stanzas, "10.0.0.0/8", NULL);
+    test_addr_stanza(&opts.acc_stanzas, "10.1.0.0/16", "192.168.1.1");
+    test_addr_stanza(&opts.acc_stanzas, "10.0.1.0/255.0.255.0", NULL);
+    test_addr_stanza(&opts.acc_stanzas, "ANY", "192.168.0.0/16");
+    for(i = 0; i < 66; i++)
+        test_addr_stanza(&opts.acc_stanzas, "172.16.0.1", NULL);
+
+    /* The same answers with the index and with the list walk
+    */
+    for(pass = 0; pass < 2; pass++)
+    {
+        if(pass == 0)
+        {
+            CU_ASSERT(acc_addr_index_build(&opts) == FWKNOPD_SUCCESS);
+            CU_ASSERT_FATAL(opts.acc_addr_index != NULL);
+        }
+        else
+            free_acc_addr_index(&opts);
+
+        CU_ASSERT(test_addr_matches(&opts, "10.1.2.3", "192.168.1.1", &first, &last) == 3);
+        CU_ASSERT(first == 1 && last == 4);
+        CU_ASSERT(test_addr_matches(&opts, "10.1.2.3", "192.168.1.2", &first, &last) == 2);
+        CU_ASSERT(first == 1 && last == 4);
+        CU_ASSERT(test_addr_matches(&opts, "10.5.1.9", "8.8.8.8", &first, &last) == 2);
+        CU_ASSERT(first == 1 && last == 3);
+        CU_ASSERT(test_addr_matches(&opts, "10.5.2.9", "8.8.8.8", &first, &last) == 1);
+        CU_ASSERT(test_addr_matches(&opts, "172.16.0.1", "192.168.9.9", &first, &last) == 67);
+        CU_ASSERT(first == 4 && last == 70);
+        CU_ASSERT(test_addr_matches(&opts, "11.0.0.1", "8.8.8.8", &first, &last) == 0);
+    }
+
+    free_acc_stanzas(&opts);
+}
+
 int register_ts_access(void)
 {
     ts_init(&TEST_SUITE(access), TEST_SUITE_DESCR(access), NULL, NULL);
     ts_add_utest(&TEST_SUITE(access), UTEST_FCT(compare_port_list), UTEST_DESCR(compare_port_list));
+    ts_add_utest(&TEST_SUITE(access), UTEST_FCT(acc_stanza_int_table), UTEST_DESCR(acc_stanza_int_table));
+    ts_add_utest(&TEST_SUITE(access), UTEST_FCT(acc_stanza_table_growth), UTEST_DESCR(acc_stanza_table_growth));
+    ts_add_utest(&TEST_SUITE(access), UTEST_FCT(acc_table_snapshots), UTEST_DESCR(acc_table_snapshots));
+    ts_add_utest(&TEST_SUITE(access), UTEST_FCT(acc_addr_index), UTEST_DESCR(acc_addr_index));
 
     return register_ts(&TEST_SUITE(access));
 }
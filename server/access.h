@@ -44,8 +44,18 @@
 /* Function Prototypes
 */
 int process_access_msg(fko_srv_options_t *opts, int action, json_object *jdata);
+void acc_table_read_lock(fko_srv_options_t *opts);
+void acc_table_read_unlock(fko_srv_options_t *opts);
+hash_table_t *acc_table_current(fko_srv_options_t *opts);
+void acc_table_reclaim(fko_srv_options_t *opts);
+int acc_table_retire(fko_srv_options_t *opts, void *obj, void (*free_obj)(void *obj));
+void destroy_acc_tables(fko_srv_options_t *opts);
+int acc_stanza_hold(acc_stanza_t *acc);
+void acc_stanza_release(acc_stanza_t *acc);
 void parse_access_file(fko_srv_options_t *opts);
 int compare_addr_list(acc_int_list_t *source_list, const uint32_t ip);
+acc_stanza_t *acc_addr_index_next(fko_srv_options_t *opts, const uint32_t src,
+        const uint32_t dst, int *stanza_num);
 int acc_check_service_access(acc_stanza_t *acc, char *service_str);
 int acc_check_port_access(acc_stanza_t *acc, char *port_str);
 void dump_access_list(fko_srv_options_t *opts);
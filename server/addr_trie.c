@@ -0,0 +1,367 @@
+/*
+ *****************************************************************************
+ *
+ * File:    addr_trie.c
+ *
+ * Purpose: A binary trie over IPv4 prefixes (host byte order) that maps an
+ *          address to the set of values whose prefixes contain it.  Each
+ *          prefix carries a bitset of value numbers; addr_trie_compile()
+ *          folds every prefix's set into those of the longer prefixes below
+ *          it, so a lookup is a single walk of at most 32 nodes that
+ *          returns the set of the longest matching prefix.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "addr_trie.h"
+#include "log_msg.h"
+
+#ifdef HAVE_C_UNIT_TESTS
+  #include "cunit_common.h"
+  DECLARE_TEST_SUITE(addr_trie, "Address trie test suite");
+#endif
+
+#define ADDR_TRIE_NO_SET    -1
+
+/* Nodes live in one array and refer to each other by index, the root
+ * being node 0 (so 0 also means "no child").  A child is always created
+ * after its parent, which addr_trie_compile() relies on.
+*/
+typedef struct addr_trie_node
+{
+    uint32_t    child[2];
+    uint32_t    parent;
+    int32_t     set;        /* index into sets, in words / nb_words */
+} addr_trie_node_t;
+
+struct addr_trie
+{
+    addr_trie_node_t   *nodes;
+    unsigned int        nb_nodes;
+    unsigned int        max_nodes;
+
+    uint64_t           *sets;
+    unsigned int        nb_sets;
+    unsigned int        max_sets;
+
+    unsigned int        nb_values;
+    unsigned int        nb_words;
+    int                 compiled;
+};
+
+static int
+new_node(addr_trie_t *trie, const uint32_t parent)
+{
+    addr_trie_node_t   *nodes;
+    unsigned int        max;
+
+    if(trie->nb_nodes == trie->max_nodes)
+    {
+        max = trie->max_nodes * 2;
+        if((nodes = realloc(trie->nodes, max * sizeof(addr_trie_node_t))) == NULL)
+            return -1;
+        trie->nodes     = nodes;
+        trie->max_nodes = max;
+    }
+
+    memset(&trie->nodes[trie->nb_nodes], 0x0, sizeof(addr_trie_node_t));
+    trie->nodes[trie->nb_nodes].parent = parent;
+    trie->nodes[trie->nb_nodes].set    = ADDR_TRIE_NO_SET;
+
+    return trie->nb_nodes++;
+}
+
+static int
+new_set(addr_trie_t *trie)
+{
+    uint64_t       *sets;
+    unsigned int    max;
+
+    if(trie->nb_sets == trie->max_sets)
+    {
+        max = trie->max_sets * 2;
+        if((sets = realloc(trie->sets, (size_t)max * trie->nb_words * sizeof(uint64_t))) == NULL)
+            return -1;
+        trie->sets     = sets;
+        trie->max_sets = max;
+    }
+
+    memset(&trie->sets[(size_t)trie->nb_sets * trie->nb_words], 0x0,
+            trie->nb_words * sizeof(uint64_t));
+
+    return trie->nb_sets++;
+}
+
+/* Create a trie for values 0 .. nb_values-1
+*/
+addr_trie_t *
+addr_trie_new(const unsigned int nb_values)
+{
+    addr_trie_t *trie = NULL;
+
+    if(nb_values == 0 || (trie = calloc(1, sizeof(addr_trie_t))) == NULL)
+        return NULL;
+
+    trie->nb_values = nb_values;
+    trie->nb_words  = ADDR_TRIE_WORDS(nb_values);
+    trie->max_nodes = 64;
+    trie->max_sets  = 8;
+
+    trie->nodes = calloc(trie->max_nodes, sizeof(addr_trie_node_t));
+    trie->sets  = calloc((size_t)trie->max_sets * trie->nb_words, sizeof(uint64_t));
+
+    if(trie->nodes == NULL || trie->sets == NULL || new_node(trie, 0) != 0)
+    {
+        addr_trie_free(trie);
+        return NULL;
+    }
+
+    return trie;
+}
+
+void
+addr_trie_free(addr_trie_t *trie)
+{
+    if(trie == NULL)
+        return;
+
+    free(trie->nodes);
+    free(trie->sets);
+    free(trie);
+}
+
+/* Return the prefix length of a contiguous mask, or -1 for a mask such
+ * as 255.0.255.0 which a prefix trie cannot represent.
+*/
+int
+addr_mask_is_prefix(const uint32_t mask)
+{
+    int len = 0;
+
+    while(len < 32 && (mask & (0x80000000U >> len)))
+        len++;
+
+    if(len < 32 && (mask << len) != 0)
+        return -1;
+
+    return len;
+}
+
+/* Add value to the set of the prefix addr/mask.  Returns 0 on success,
+ * -1 on a bad mask or value, an allocation failure, or once the trie has
+ * been compiled.
+*/
+int
+addr_trie_add(addr_trie_t *trie, const uint32_t addr, const uint32_t mask,
+        const unsigned int value)
+{
+    uint32_t    node = 0;
+    int         len, depth, bit, next, set;
+
+    if(trie->compiled || value >= trie->nb_values
+            || (len = addr_mask_is_prefix(mask)) < 0)
+        return -1;
+
+    for(depth = 0; depth < len; depth++)
+    {
+        bit = (addr >> (31 - depth)) & 1;
+
+        if(trie->nodes[node].child[bit] == 0)
+        {
+            if((next = new_node(trie, node)) < 0)
+                return -1;
+            trie->nodes[node].child[bit] = next;
+        }
+        node = trie->nodes[node].child[bit];
+    }
+
+    if(trie->nodes[node].set == ADDR_TRIE_NO_SET)
+    {
+        if((set = new_set(trie)) < 0)
+            return -1;
+        trie->nodes[node].set = set;
+    }
+
+    trie->sets[(size_t)trie->nodes[node].set * trie->nb_words + value / 64]
+        |= 1ULL << (value % 64);
+
+    return 0;
+}
+
+/* Fold each prefix's set into the sets of the prefixes it contains, and
+ * let nodes without a prefix of their own share their parent's set.
+ * Nodes are visited parent first, so every parent is final by the time
+ * its children are looked at.
+*/
+int
+addr_trie_compile(addr_trie_t *trie)
+{
+    addr_trie_node_t   *node;
+    uint64_t           *dst, *src;
+    unsigned int        i, w;
+    int32_t             parent_set;
+
+    if(trie->compiled)
+        return 0;
+
+    for(i = 1; i < trie->nb_nodes; i++)
+    {
+        node       = &trie->nodes[i];
+        parent_set = trie->nodes[node->parent].set;
+
+        if(parent_set == ADDR_TRIE_NO_SET)
+            continue;
+
+        if(node->set == ADDR_TRIE_NO_SET)
+        {
+            node->set = parent_set;
+            continue;
+        }
+
+        dst = &trie->sets[(size_t)node->set * trie->nb_words];
+        src = &trie->sets[(size_t)parent_set * trie->nb_words];
+        for(w = 0; w < trie->nb_words; w++)
+            dst[w] |= src[w];
+    }
+
+    trie->compiled = 1;
+    return 0;
+}
+
+/* The values of all prefixes containing addr, as a bitset of
+ * ADDR_TRIE_WORDS(nb_values) words, or NULL if there are none.  Only
+ * valid on a compiled trie.
+*/
+const uint64_t *
+addr_trie_lookup(const addr_trie_t *trie, const uint32_t addr)
+{
+    uint32_t    node = 0, next;
+    int32_t     set  = trie->nodes[0].set;
+    int         depth;
+
+    for(depth = 0; depth < 32; depth++)
+    {
+        if((next = trie->nodes[node].child[(addr >> (31 - depth)) & 1]) == 0)
+            break;
+        node = next;
+        if(trie->nodes[node].set != ADDR_TRIE_NO_SET)
+            set = trie->nodes[node].set;
+    }
+
+    if(set == ADDR_TRIE_NO_SET)
+        return NULL;
+
+    return &trie->sets[(size_t)set * trie->nb_words];
+}
+
+unsigned int
+addr_trie_nodes(const addr_trie_t *trie)
+{
+    return trie->nb_nodes;
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+#define TEST_ADDR(a, b, c, d)   (((uint32_t)(a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+static int
+set_has(const uint64_t *set, const unsigned int value)
+{
+    return set != NULL && (set[value / 64] & (1ULL << (value % 64))) != 0;
+}
+
+DECLARE_UTEST(longest_prefix_sets, "check prefix sets along the trie")
+{
+    addr_trie_t     *trie = addr_trie_new(130);
+    const uint64_t  *set;
+
+    CU_ASSERT_FATAL(trie != NULL);
+
+    CU_ASSERT(addr_trie_add(trie, TEST_ADDR(10,0,0,0), 0xFF000000, 0) == 0);
+    CU_ASSERT(addr_trie_add(trie, TEST_ADDR(10,1,0,0), 0xFFFF0000, 1) == 0);
+    CU_ASSERT(addr_trie_add(trie, TEST_ADDR(10,1,2,3), 0xFFFFFFFF, 129) == 0);
+    CU_ASSERT(addr_trie_add(trie, TEST_ADDR(192,168,0,0), 0xFFFF0000, 64) == 0);
+    CU_ASSERT(addr_trie_add(trie, 0, 0, 2) == 0);
+
+    /* Non-contiguous masks and out of range values are refused
+    */
+    CU_ASSERT(addr_trie_add(trie, TEST_ADDR(10,0,0,0), 0xFF00FF00, 3) != 0);
+    CU_ASSERT(addr_trie_add(trie, TEST_ADDR(10,0,0,0), 0xFF000000, 130) != 0);
+
+    CU_ASSERT(addr_trie_compile(trie) == 0);
+
+    set = addr_trie_lookup(trie, TEST_ADDR(10,1,2,3));
+    CU_ASSERT(set_has(set, 0) && set_has(set, 1) && set_has(set, 2) && set_has(set, 129));
+    CU_ASSERT(! set_has(set, 64));
+
+    set = addr_trie_lookup(trie, TEST_ADDR(10,1,2,4));
+    CU_ASSERT(set_has(set, 0) && set_has(set, 1) && set_has(set, 2) && ! set_has(set, 129));
+
+    set = addr_trie_lookup(trie, TEST_ADDR(10,200,0,1));
+    CU_ASSERT(set_has(set, 0) && ! set_has(set, 1) && set_has(set, 2));
+
+    set = addr_trie_lookup(trie, TEST_ADDR(192,168,7,7));
+    CU_ASSERT(set_has(set, 64) && set_has(set, 2) && ! set_has(set, 0));
+
+    set = addr_trie_lookup(trie, TEST_ADDR(8,8,8,8));
+    CU_ASSERT(set_has(set, 2) && ! set_has(set, 0) && ! set_has(set, 64));
+
+    /* Nothing may be added once compiled
+    */
+    CU_ASSERT(addr_trie_add(trie, TEST_ADDR(1,2,3,4), 0xFFFFFFFF, 5) != 0);
+
+    addr_trie_free(trie);
+
+    /* Without a default route some addresses match nothing
+    */
+    trie = addr_trie_new(1);
+    CU_ASSERT_FATAL(trie != NULL);
+    CU_ASSERT(addr_trie_add(trie, TEST_ADDR(172,16,0,0), 0xFFF00000, 0) == 0);
+    CU_ASSERT(addr_trie_compile(trie) == 0);
+    CU_ASSERT(set_has(addr_trie_lookup(trie, TEST_ADDR(172,31,255,255)), 0));
+    CU_ASSERT(addr_trie_lookup(trie, TEST_ADDR(172,32,0,0)) == NULL);
+    addr_trie_free(trie);
+}
+
+DECLARE_UTEST(mask_is_prefix, "check prefix length of masks")
+{
+    CU_ASSERT(addr_mask_is_prefix(0) == 0);
+    CU_ASSERT(addr_mask_is_prefix(0xFFFFFFFF) == 32);
+    CU_ASSERT(addr_mask_is_prefix(0xFFFFFF00) == 24);
+    CU_ASSERT(addr_mask_is_prefix(0x80000000) == 1);
+    CU_ASSERT(addr_mask_is_prefix(0xFF00FF00) == -1);
+    CU_ASSERT(addr_mask_is_prefix(0x00FFFFFF) == -1);
+}
+
+int register_ts_addr_trie(void)
+{
+    ts_init(&TEST_SUITE(addr_trie), TEST_SUITE_DESCR(addr_trie), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(addr_trie), UTEST_FCT(longest_prefix_sets), UTEST_DESCR(longest_prefix_sets));
+    ts_add_utest(&TEST_SUITE(addr_trie), UTEST_FCT(mask_is_prefix), UTEST_DESCR(mask_is_prefix));
+
+    return register_ts(&TEST_SUITE(addr_trie));
+}
+#endif /* HAVE_C_UNIT_TESTS */
+
+/***EOF***/
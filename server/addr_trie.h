@@ -0,0 +1,59 @@
+/*
+ *****************************************************************************
+ *
+ * File:    addr_trie.h
+ *
+ * Purpose: Header file for addr_trie.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef ADDR_TRIE_H
+#define ADDR_TRIE_H
+
+#include <stdint.h>
+
+/* Number of 64-bit words in the value set of a trie built for nb_values
+*/
+#define ADDR_TRIE_WORDS(nb_values)  (((nb_values) + 63) / 64)
+
+typedef struct addr_trie addr_trie_t;
+
+/* Prototypes
+*/
+addr_trie_t *addr_trie_new(const unsigned int nb_values);
+void addr_trie_free(addr_trie_t *trie);
+int addr_trie_add(addr_trie_t *trie, const uint32_t addr, const uint32_t mask,
+        const unsigned int value);
+int addr_trie_compile(addr_trie_t *trie);
+const uint64_t *addr_trie_lookup(const addr_trie_t *trie, const uint32_t addr);
+unsigned int addr_trie_nodes(const addr_trie_t *trie);
+int addr_mask_is_prefix(const uint32_t mask);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_addr_trie(void);
+#endif
+
+#endif /* ADDR_TRIE_H */
+
+/***EOF***/
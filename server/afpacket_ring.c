@@ -0,0 +1,333 @@
+/*
+ *****************************************************************************
+ *
+ * File:    afpacket_ring.c
+ *
+ * Purpose: Linux AF_PACKET (TPACKET_V3) capture ring for fwknopd.  Frames
+ *          are read straight out of a ring that is shared with the kernel
+ *          and handed to process_packet() in place, and PCAP_FILTER is
+ *          compiled with libpcap and attached to the socket so that
+ *          unwanted packets never reach the ring.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+
+#include "fwknopd_common.h"
+#include "afpacket_ring.h"
+
+#if HAVE_AF_PACKET_RING
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+
+#if HAVE_SYS_SOCKET_H
+  #include <sys/socket.h>
+#endif
+#if HAVE_ARPA_INET_H
+  #include <arpa/inet.h>
+#endif
+
+struct afpacket_ring
+{
+    int                 fd;
+    uint8_t            *map;
+    size_t              map_len;
+    int                 nb_blocks;
+    int                 cur_block;
+    int                 in_only;
+};
+
+static void
+afpacket_err(char *errstr, const size_t errstr_len, const char *what)
+{
+    snprintf(errstr, errstr_len, "%s: %s", what, strerror(errno));
+    return;
+}
+
+/* Compile the pcap filter expression for an Ethernet link and attach it
+ * to the socket.  Classic BPF as produced by pcap_compile() has the same
+ * layout as the kernel's struct sock_filter.
+*/
+static int
+afpacket_set_filter(const int fd, const int snaplen, const char *filter,
+        char *errstr, const size_t errstr_len)
+{
+    pcap_t             *dead;
+    struct bpf_program  prog;
+    struct sock_fprog   fprog;
+    int                 rv = 0;
+
+    if((dead = pcap_open_dead(DLT_EN10MB, snaplen)) == NULL)
+    {
+        snprintf(errstr, errstr_len, "pcap_open_dead() failed");
+        return -1;
+    }
+
+    if(pcap_compile(dead, &prog, filter, 1, PCAP_NETMASK_UNKNOWN) == -1)
+    {
+        snprintf(errstr, errstr_len, "Error compiling pcap filter: %s",
+            pcap_geterr(dead));
+        pcap_close(dead);
+        return -1;
+    }
+
+    fprog.len    = prog.bf_len;
+    fprog.filter = (struct sock_filter *)prog.bf_insns;
+
+    if(setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) != 0)
+    {
+        afpacket_err(errstr, errstr_len, "setsockopt SO_ATTACH_FILTER");
+        rv = -1;
+    }
+
+    pcap_freecode(&prog);
+    pcap_close(dead);
+    return rv;
+}
+
+afpacket_ring_t *
+afpacket_open(const char *intf, const int snaplen, const int promisc,
+        const int in_only, const int nb_blocks, const char *filter,
+        char *errstr, const size_t errstr_len)
+{
+    afpacket_ring_t    *ring;
+    struct tpacket_req3 req;
+    struct sockaddr_ll  sll;
+    struct packet_mreq  mreq;
+    struct ifreq        ifr;
+    int                 version = TPACKET_V3, ifindex;
+
+    if((ifindex = if_nametoindex(intf)) == 0)
+    {
+        afpacket_err(errstr, errstr_len, "if_nametoindex");
+        return NULL;
+    }
+
+    if((ring = calloc(1, sizeof(afpacket_ring_t))) == NULL)
+    {
+        snprintf(errstr, errstr_len, "calloc() failed");
+        return NULL;
+    }
+    ring->map       = MAP_FAILED;
+    ring->nb_blocks = nb_blocks;
+    ring->in_only   = in_only;
+
+    /* With protocol 0 the socket receives nothing until bind() below
+     * sets ETH_P_ALL.
+    */
+    if((ring->fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0)
+    {
+        afpacket_err(errstr, errstr_len, "socket(AF_PACKET)");
+        free(ring);
+        return NULL;
+    }
+
+    /* process_packet() expects Ethernet framing (which the loopback
+     * interface has on Linux as well).
+    */
+    memset(&ifr, 0x0, sizeof(ifr));
+    strlcpy(ifr.ifr_name, intf, sizeof(ifr.ifr_name));
+    if(ioctl(ring->fd, SIOCGIFHWADDR, &ifr) != 0)
+    {
+        afpacket_err(errstr, errstr_len, "ioctl SIOCGIFHWADDR");
+        goto err;
+    }
+    if(ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER
+            && ifr.ifr_hwaddr.sa_family != ARPHRD_LOOPBACK)
+    {
+        snprintf(errstr, errstr_len, "%s is not an Ethernet interface", intf);
+        goto err;
+    }
+
+    /* Attach the filter before the socket is bound so that nothing
+     * unfiltered gets queued once it starts receiving.
+    */
+    if(filter != NULL && filter[0] != '\0'
+            && afpacket_set_filter(ring->fd, snaplen, filter, errstr, errstr_len) != 0)
+        goto err;
+
+    if(setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0)
+    {
+        afpacket_err(errstr, errstr_len, "setsockopt PACKET_VERSION");
+        goto err;
+    }
+
+    memset(&req, 0x0, sizeof(req));
+    req.tp_block_size       = AF_PACKET_BLOCK_SIZE;
+    req.tp_block_nr         = nb_blocks;
+    req.tp_frame_size       = AF_PACKET_FRAME_SIZE;
+    req.tp_frame_nr         = (AF_PACKET_BLOCK_SIZE / AF_PACKET_FRAME_SIZE) * nb_blocks;
+    req.tp_retire_blk_tov   = AF_PACKET_BLOCK_TIMEOUT;
+
+    if(setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0)
+    {
+        afpacket_err(errstr, errstr_len, "setsockopt PACKET_RX_RING");
+        goto err;
+    }
+
+    ring->map_len = (size_t)AF_PACKET_BLOCK_SIZE * nb_blocks;
+    ring->map = mmap(NULL, ring->map_len, PROT_READ|PROT_WRITE, MAP_SHARED,
+            ring->fd, 0);
+    if(ring->map == MAP_FAILED)
+    {
+        afpacket_err(errstr, errstr_len, "mmap");
+        goto err;
+    }
+
+    memset(&sll, 0x0, sizeof(sll));
+    sll.sll_family   = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex  = ifindex;
+
+    if(bind(ring->fd, (struct sockaddr *)&sll, sizeof(sll)) != 0)
+    {
+        afpacket_err(errstr, errstr_len, "bind");
+        goto err;
+    }
+
+    if(promisc)
+    {
+        memset(&mreq, 0x0, sizeof(mreq));
+        mreq.mr_ifindex = ifindex;
+        mreq.mr_type    = PACKET_MR_PROMISC;
+
+        if(setsockopt(ring->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                    &mreq, sizeof(mreq)) != 0)
+        {
+            afpacket_err(errstr, errstr_len, "setsockopt PACKET_ADD_MEMBERSHIP");
+            goto err;
+        }
+    }
+
+    return ring;
+
+err:
+    afpacket_close(ring);
+    return NULL;
+}
+
+int
+afpacket_fd(const afpacket_ring_t *ring)
+{
+    return ring->fd;
+}
+
+/* Hand every frame in up to max_blocks ready blocks to cb (in the same
+ * way as pcap_dispatch()) and give the blocks back to the kernel.  The
+ * return value is the number of frames passed to cb.
+*/
+int
+afpacket_dispatch(afpacket_ring_t *ring, const int max_blocks,
+        pcap_handler cb, unsigned char *user)
+{
+    struct tpacket_block_desc  *bd;
+    struct tpacket3_hdr        *ppd;
+    struct sockaddr_ll         *sll;
+    struct pcap_pkthdr          hdr;
+    uint32_t                    i, nb_pkts;
+    int                         blocks, frames = 0;
+
+    for(blocks=0; blocks < max_blocks; blocks++)
+    {
+        bd = (struct tpacket_block_desc *)(ring->map
+                + (size_t)ring->cur_block * AF_PACKET_BLOCK_SIZE);
+
+        if((__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+                    & TP_STATUS_USER) == 0)
+            break;
+
+        nb_pkts = bd->hdr.bh1.num_pkts;
+        ppd = (struct tpacket3_hdr *)((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+
+        for(i=0; i < nb_pkts; i++)
+        {
+            sll = (struct sockaddr_ll *)((uint8_t *)ppd
+                    + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+
+            /* The equivalent of pcap_setdirection(PCAP_D_IN)
+            */
+            if(! ring->in_only || sll->sll_pkttype != PACKET_OUTGOING)
+            {
+                hdr.ts.tv_sec  = ppd->tp_sec;
+                hdr.ts.tv_usec = ppd->tp_nsec / 1000;
+                hdr.caplen     = ppd->tp_snaplen;
+                hdr.len        = ppd->tp_len;
+
+                cb(user, &hdr, (uint8_t *)ppd + ppd->tp_mac);
+                frames++;
+            }
+
+            ppd = (struct tpacket3_hdr *)((uint8_t *)ppd + ppd->tp_next_offset);
+        }
+
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                __ATOMIC_RELEASE);
+
+        ring->cur_block = (ring->cur_block + 1) % ring->nb_blocks;
+    }
+
+    return frames;
+}
+
+/* Packets seen and dropped by the kernel since the last call
+*/
+int
+afpacket_stats(afpacket_ring_t *ring, unsigned int *packets,
+        unsigned int *drops)
+{
+    struct tpacket_stats_v3 st;
+    socklen_t               len = sizeof(st);
+
+    memset(&st, 0x0, sizeof(st));
+    if(getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) != 0)
+        return -1;
+
+    *packets = st.tp_packets;
+    *drops   = st.tp_drops;
+    return 0;
+}
+
+void
+afpacket_close(afpacket_ring_t *ring)
+{
+    if(ring == NULL)
+        return;
+
+    if(ring->map != MAP_FAILED)
+        munmap(ring->map, ring->map_len);
+    if(ring->fd >= 0)
+        close(ring->fd);
+    free(ring);
+    return;
+}
+
+#endif /* HAVE_AF_PACKET_RING */
+
+/***EOF***/
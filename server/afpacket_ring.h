@@ -0,0 +1,69 @@
+/*
+ *****************************************************************************
+ *
+ * File:    afpacket_ring.h
+ *
+ * Purpose: Header file for afpacket_ring.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef AFPACKET_RING_H
+#define AFPACKET_RING_H
+
+#if USE_LIBPCAP && HAVE_LINUX_IF_PACKET_H
+  #include <linux/if_packet.h>
+  #ifdef TPACKET3_HDRLEN
+    #define HAVE_AF_PACKET_RING 1
+  #endif
+#endif
+
+#if HAVE_AF_PACKET_RING
+
+/* Ring geometry.  Each block holds many frames and is handed back to the
+ * kernel as a whole; a block that is not full is passed up to us after
+ * AF_PACKET_BLOCK_TIMEOUT milliseconds.
+*/
+#define AF_PACKET_BLOCK_SIZE        (1 << 18)
+#define AF_PACKET_FRAME_SIZE        2048
+#define AF_PACKET_BLOCK_TIMEOUT     2
+
+typedef struct afpacket_ring afpacket_ring_t;
+
+/* Prototypes
+*/
+afpacket_ring_t *afpacket_open(const char *intf, const int snaplen,
+        const int promisc, const int in_only, const int nb_blocks,
+        const char *filter, char *errstr, const size_t errstr_len);
+int afpacket_fd(const afpacket_ring_t *ring);
+int afpacket_dispatch(afpacket_ring_t *ring, const int max_blocks,
+        pcap_handler cb, unsigned char *user);
+int afpacket_stats(afpacket_ring_t *ring, unsigned int *packets,
+        unsigned int *drops);
+void afpacket_close(afpacket_ring_t *ring);
+
+#endif /* HAVE_AF_PACKET_RING */
+
+#endif  /* AFPACKET_RING_H */
+
+/***EOF***/
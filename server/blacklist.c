@@ -0,0 +1,598 @@
+/*
+ *****************************************************************************
+ *
+ * File:    blacklist.c
+ *
+ * Purpose: The BLACKLIST and BLACKLIST_FILE source addresses, compiled
+ *          into a prefix trie that incoming packets are checked against
+ *          before any SPA processing, and optionally into a kernel socket
+ *          or capture filter.  A reload publishes a new list, and the old
+ *          one is freed through the access table epochs once no packet
+ *          handler can still be reading it.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "blacklist.h"
+#include "addr_trie.h"
+#include "access.h"
+#include "log_msg.h"
+#include "fwknopd_errors.h"
+#include "utils.h"
+
+#if HAVE_SYS_SOCKET_H
+  #include <sys/socket.h>
+#endif
+#if HAVE_ARPA_INET_H
+  #include <arpa/inet.h>
+#endif
+#ifdef __linux__
+  #include <linux/filter.h>
+#endif
+
+#ifdef HAVE_C_UNIT_TESTS
+  #include "cunit_common.h"
+  DECLARE_TEST_SUITE(blacklist, "Blacklist test suite");
+#endif
+
+/* Socket filters are limited to BPF_MAXINSNS (4096) instructions, and
+ * each entry takes four, see blacklist_socket_prog().
+*/
+#define BLACKLIST_MAX_FILTER_ENTS   1000
+
+typedef struct blacklist_ent
+{
+    uint32_t    addr;       /* host byte order */
+    uint32_t    mask;
+} blacklist_ent_t;
+
+struct blacklist
+{
+    addr_trie_t        *trie;
+    blacklist_ent_t    *ents;
+    unsigned int        nb_ents;
+    unsigned int        max_ents;
+};
+
+static void
+free_blacklist(struct blacklist *bl)
+{
+    if(bl == NULL)
+        return;
+
+    addr_trie_free(bl->trie);
+    free(bl->ents);
+    free(bl);
+}
+
+static void
+free_blacklist_obj(void *obj)
+{
+    free_blacklist((struct blacklist *)obj);
+}
+
+/* Parse one "IP", "IP/bits" or "IP/netmask" entry
+*/
+static int
+blacklist_add_ent(struct blacklist *bl, const char *str, const char *from)
+{
+    char            ip_str[MAX_IPV4_STR_LEN] = {0};
+    char           *ndx;
+    struct in_addr  in;
+    uint32_t        mask = 0xFFFFFFFF;
+    size_t          len;
+    int             bits, is_err;
+    blacklist_ent_t *ents;
+
+    ndx = strchr(str, '/');
+    len = ndx != NULL ? (size_t)(ndx - str) : strlen(str);
+    if(len >= sizeof(ip_str))
+        goto bad_ent;
+    memcpy(ip_str, str, len);
+
+    if(ndx != NULL)
+    {
+        ndx++;
+
+        if(strchr(ndx, '.') != NULL)
+        {
+            if(inet_aton(ndx, &in) == 0
+                    || addr_mask_is_prefix(ntohl(in.s_addr)) < 0)
+                goto bad_ent;
+            mask = ntohl(in.s_addr);
+        }
+        else
+        {
+            bits = strtol_wrapper(ndx, 0, 32, NO_EXIT_UPON_ERR, &is_err);
+            if(is_err != FKO_SUCCESS)
+                goto bad_ent;
+            mask = bits == 0 ? 0 : 0xFFFFFFFF << (32 - bits);
+        }
+    }
+
+    if(! is_valid_ipv4_addr(ip_str) || inet_aton(ip_str, &in) == 0)
+        goto bad_ent;
+
+    if(bl->nb_ents == bl->max_ents)
+    {
+        bl->max_ents = bl->max_ents ? bl->max_ents * 2 : 16;
+        if((ents = realloc(bl->ents, bl->max_ents * sizeof(blacklist_ent_t))) == NULL)
+            return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+        bl->ents = ents;
+    }
+
+    bl->ents[bl->nb_ents].addr = ntohl(in.s_addr) & mask;
+    bl->ents[bl->nb_ents].mask = mask;
+    bl->nb_ents++;
+
+    return FWKNOPD_SUCCESS;
+
+bad_ent:
+    log_msg(LOG_ERR, "[*] Invalid %s entry: '%s'", from, str);
+    return FWKNOPD_ERROR_BAD_CONFIG;
+}
+
+/* Entries are separated by commas and/or whitespace.  "NONE" is
+ * accepted (and ignored) for compatibility with the Perl fwknopd.
+*/
+static int
+blacklist_add_list(struct blacklist *bl, const char *list, const char *from)
+{
+    char   *buf, *tok, *saveptr = NULL;
+    int     res = FWKNOPD_SUCCESS;
+
+    if((buf = strdup(list)) == NULL)
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+
+    for(tok = strtok_r(buf, ", \t\r\n", &saveptr); tok != NULL;
+            tok = strtok_r(NULL, ", \t\r\n", &saveptr))
+    {
+        if(strcasecmp(tok, "NONE") == 0)
+            continue;
+
+        if((res = blacklist_add_ent(bl, tok, from)) != FWKNOPD_SUCCESS)
+            break;
+    }
+
+    free(buf);
+    return res;
+}
+
+static int
+blacklist_add_file(struct blacklist *bl, const char *file)
+{
+    FILE   *fp;
+    char    line[MAX_LINE_LEN] = {0};
+    char   *ndx;
+    int     res = FWKNOPD_SUCCESS;
+
+    if(verify_file_perms_ownership(file) != 1)
+        return FWKNOPD_ERROR_BAD_CONFIG;
+
+    if((fp = fopen(file, "r")) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Could not open BLACKLIST_FILE: %s", file);
+        return FWKNOPD_ERROR_BAD_CONFIG;
+    }
+
+    while(res == FWKNOPD_SUCCESS && fgets(line, sizeof(line), fp) != NULL)
+    {
+        if((ndx = strchr(line, '#')) != NULL)
+            *ndx = '\0';
+
+        res = blacklist_add_list(bl, line, "BLACKLIST_FILE");
+    }
+
+    fclose(fp);
+    return res;
+}
+
+/* Build a new blacklist from the BLACKLIST and BLACKLIST_FILE settings
+ * and publish it.  On an error the current list stays in place.
+*/
+int
+blacklist_load(fko_srv_options_t *opts)
+{
+    struct blacklist   *bl = NULL, *old = NULL;
+    unsigned int        i;
+    int                 res = FWKNOPD_SUCCESS;
+
+    if((bl = calloc(1, sizeof(struct blacklist))) == NULL)
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+
+    if(opts->config[CONF_BLACKLIST] != NULL)
+        res = blacklist_add_list(bl, opts->config[CONF_BLACKLIST], "BLACKLIST");
+
+    if(res == FWKNOPD_SUCCESS && opts->config[CONF_BLACKLIST_FILE] != NULL)
+        res = blacklist_add_file(bl, opts->config[CONF_BLACKLIST_FILE]);
+
+    if(res == FWKNOPD_SUCCESS && bl->nb_ents > 0)
+    {
+        if((bl->trie = addr_trie_new(1)) == NULL)
+            res = FWKNOPD_ERROR_MEMORY_ALLOCATION;
+
+        for(i = 0; res == FWKNOPD_SUCCESS && i < bl->nb_ents; i++)
+            if(addr_trie_add(bl->trie, bl->ents[i].addr, bl->ents[i].mask, 0) != 0)
+                res = FWKNOPD_ERROR_MEMORY_ALLOCATION;
+
+        if(res == FWKNOPD_SUCCESS)
+            addr_trie_compile(bl->trie);
+    }
+
+    if(res != FWKNOPD_SUCCESS)
+    {
+        free_blacklist(bl);
+        return res;
+    }
+
+    if(bl->nb_ents == 0)
+    {
+        free_blacklist(bl);
+        bl = NULL;
+    }
+
+    old = __atomic_exchange_n(&opts->blacklist, bl, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&opts->blacklist_gen, 1, __ATOMIC_SEQ_CST);
+
+    if(bl != NULL)
+        log_msg(LOG_INFO, "Loaded %u BLACKLIST entries (%u trie nodes)",
+                bl->nb_ents, addr_trie_nodes(bl->trie));
+    else if(old != NULL)
+        log_msg(LOG_INFO, "BLACKLIST is now empty");
+
+    if(old != NULL && acc_table_retire(opts, old, free_blacklist_obj) != FWKNOPD_SUCCESS)
+        log_msg(LOG_WARNING, "[*] The replaced BLACKLIST could not be freed");
+
+    return FWKNOPD_SUCCESS;
+}
+
+/* Return 1 if packets from src_ip (network byte order) are to be
+ * dropped.  Safe to call from any packet handling thread.
+*/
+int
+blacklist_match(fko_srv_options_t *opts, const uint32_t src_ip)
+{
+    struct blacklist   *bl;
+    int                 match = 0;
+
+    if(__atomic_load_n(&opts->blacklist, __ATOMIC_RELAXED) == NULL)
+        return 0;
+
+    acc_table_read_lock(opts);
+
+    bl = __atomic_load_n(&opts->blacklist, __ATOMIC_SEQ_CST);
+    if(bl != NULL && addr_trie_lookup(bl->trie, ntohl(src_ip)) != NULL)
+        match = 1;
+
+    acc_table_read_unlock(opts);
+
+    if(match)
+        __atomic_add_fetch(&opts->blacklist_drops, 1, __ATOMIC_RELAXED);
+
+    return match;
+}
+
+static int
+kernel_filter_enabled(fko_srv_options_t *opts)
+{
+    return opts->config[CONF_BLACKLIST_KERNEL_FILTER] != NULL
+        && strncasecmp(opts->config[CONF_BLACKLIST_KERNEL_FILTER], "Y", 1) == 0;
+}
+
+#ifdef SO_ATTACH_FILTER
+/* A classic BPF program for a UDP socket that drops datagrams from the
+ * blacklisted sources.  The source address is loaded relative to the IP
+ * header (SKF_NET_OFF) in host byte order and kept in X:
+ *
+ *      ld  [net + 12]
+ *      tax
+ *  per entry:
+ *      txa
+ *      and #mask
+ *      jeq #addr, 0, 1
+ *      ret #0
+ *  and last:
+ *      ret #-1
+*/
+static struct sock_filter *
+blacklist_socket_prog(const struct blacklist *bl, unsigned short *len)
+{
+    struct sock_filter *insns;
+    unsigned int        i, n = 0;
+
+    if((insns = calloc(bl->nb_ents * 4 + 3, sizeof(struct sock_filter))) == NULL)
+        return NULL;
+
+    insns[n++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_NET_OFF + 12);
+    insns[n++] = (struct sock_filter)BPF_STMT(BPF_MISC|BPF_TAX, 0);
+
+    for(i = 0; i < bl->nb_ents; i++)
+    {
+        insns[n++] = (struct sock_filter)BPF_STMT(BPF_MISC|BPF_TXA, 0);
+        insns[n++] = (struct sock_filter)BPF_STMT(BPF_ALU|BPF_AND|BPF_K, bl->ents[i].mask);
+        insns[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, bl->ents[i].addr, 0, 1);
+        insns[n++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0);
+    }
+
+    insns[n++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0xFFFFFFFF);
+
+    *len = n;
+    return insns;
+}
+#endif
+
+/* Install the current blacklist as a socket filter on a UDP socket (or
+ * remove the filter when the list is empty).  Does nothing unless
+ * BLACKLIST_KERNEL_FILTER is set.  The blacklist is still checked in
+ * blacklist_match(), this only saves the kernel handing the packets over.
+*/
+int
+blacklist_attach_socket_filter(fko_srv_options_t *opts, const int fd)
+{
+#ifdef SO_ATTACH_FILTER
+    struct blacklist   *bl;
+    struct sock_fprog   prog;
+    int                 res = FWKNOPD_SUCCESS;
+
+    if(! kernel_filter_enabled(opts))
+        return FWKNOPD_SUCCESS;
+
+    acc_table_read_lock(opts);
+
+    memset(&prog, 0x0, sizeof(prog));
+    bl = __atomic_load_n(&opts->blacklist, __ATOMIC_SEQ_CST);
+
+    if(bl != NULL && bl->nb_ents > BLACKLIST_MAX_FILTER_ENTS)
+    {
+        log_msg(LOG_WARNING,
+            "BLACKLIST has more than %d entries, not installing a socket filter",
+            BLACKLIST_MAX_FILTER_ENTS);
+        bl = NULL;
+    }
+
+    if(bl == NULL)
+    {
+        // there may be no filter to remove
+        setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+    }
+    else if((prog.filter = blacklist_socket_prog(bl, &prog.len)) == NULL)
+    {
+        res = FWKNOPD_ERROR_MEMORY_ALLOCATION;
+    }
+    else if(setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Could not install the BLACKLIST socket filter: %s",
+            strerror(errno));
+        res = FWKNOPD_ERROR;
+    }
+
+    acc_table_read_unlock(opts);
+
+    free(prog.filter);
+    return res;
+#else
+    return FWKNOPD_SUCCESS;
+#endif
+}
+
+/* Return filter extended to leave out the blacklisted sources, for
+ * libpcap or the AF_PACKET ring, or NULL if filter is to be used as is.
+ * The caller frees the returned string.
+*/
+char *
+blacklist_pcap_filter(fko_srv_options_t *opts, const char *filter)
+{
+    struct blacklist   *bl = opts->blacklist;
+    struct in_addr      in;
+    char               *buf = NULL;
+    size_t              size, len;
+    unsigned int        i;
+
+    if(! kernel_filter_enabled(opts) || bl == NULL)
+        return NULL;
+
+    if(bl->nb_ents > BLACKLIST_MAX_FILTER_ENTS)
+    {
+        log_msg(LOG_WARNING,
+            "BLACKLIST has more than %d entries, not adding it to PCAP_FILTER",
+            BLACKLIST_MAX_FILTER_ENTS);
+        return NULL;
+    }
+
+    /* "src net 255.255.255.255/32 or " per entry
+    */
+    size = strlen(filter) + bl->nb_ents * 32 + 32;
+    if((buf = calloc(1, size)) == NULL)
+        return NULL;
+
+    if(filter[0] != '\0')
+        len = snprintf(buf, size, "(%s) and not (", filter);
+    else
+        len = snprintf(buf, size, "not (");
+
+    for(i = 0; i < bl->nb_ents; i++)
+    {
+        in.s_addr = htonl(bl->ents[i].addr);
+        len += snprintf(buf + len, size - len, "%ssrc net %s/%d",
+                i ? " or " : "", inet_ntoa(in), addr_mask_is_prefix(bl->ents[i].mask));
+    }
+
+    snprintf(buf + len, size - len, ")");
+    return buf;
+}
+
+/* Free the current blacklist.  Only for use once all packet handling
+ * threads have stopped.
+*/
+void
+blacklist_free(fko_srv_options_t *opts)
+{
+    free_blacklist(opts->blacklist);
+    opts->blacklist = NULL;
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+static void
+test_blacklist_opts(fko_srv_options_t *opts, const char *list, const char *kernel)
+{
+    memset(opts, 0x00, sizeof(*opts));
+    pthread_mutex_init(&(opts->acc_hash_tbl_mutex), NULL);
+    opts->acc_table_epoch = 1;
+    opts->config[CONF_BLACKLIST] = strdup(list);
+    opts->config[CONF_BLACKLIST_KERNEL_FILTER] = strdup(kernel);
+}
+
+static void
+test_blacklist_free_opts(fko_srv_options_t *opts)
+{
+    blacklist_free(opts);
+    destroy_acc_tables(opts);
+    pthread_mutex_destroy(&(opts->acc_hash_tbl_mutex));
+    free(opts->config[CONF_BLACKLIST]);
+    free(opts->config[CONF_BLACKLIST_KERNEL_FILTER]);
+}
+
+static int
+test_blacklisted(fko_srv_options_t *opts, const char *ip)
+{
+    struct in_addr in;
+
+    inet_aton(ip, &in);
+    return blacklist_match(opts, in.s_addr);
+}
+
+DECLARE_UTEST(blacklist_reload, "check blacklist parsing, matching and reload")
+{
+    static fko_srv_options_t    opts;
+    char                       *filter;
+
+    test_blacklist_opts(&opts, "192.0.2.0/24, 198.51.100.7 10.0.0.0/255.0.0.0", "Y");
+
+    CU_ASSERT(blacklist_load(&opts) == FWKNOPD_SUCCESS);
+    CU_ASSERT(opts.blacklist_gen == 1);
+    CU_ASSERT(test_blacklisted(&opts, "192.0.2.77") == 1);
+    CU_ASSERT(test_blacklisted(&opts, "198.51.100.7") == 1);
+    CU_ASSERT(test_blacklisted(&opts, "198.51.100.8") == 0);
+    CU_ASSERT(test_blacklisted(&opts, "10.9.8.7") == 1);
+    CU_ASSERT(test_blacklisted(&opts, "11.0.0.1") == 0);
+    CU_ASSERT(opts.blacklist_drops == 3);
+
+    filter = blacklist_pcap_filter(&opts, "udp port 62201");
+    CU_ASSERT_FATAL(filter != NULL);
+    CU_ASSERT_STRING_EQUAL(filter, "(udp port 62201) and not (src net 192.0.2.0/24"
+            " or src net 198.51.100.7/32 or src net 10.0.0.0/8)");
+    free(filter);
+
+    /* A bad entry leaves the current list in place
+    */
+    free(opts.config[CONF_BLACKLIST]);
+    opts.config[CONF_BLACKLIST] = strdup("192.0.2.0/24, 10.0.0.0/255.0.255.0");
+    CU_ASSERT(blacklist_load(&opts) != FWKNOPD_SUCCESS);
+    CU_ASSERT(opts.blacklist_gen == 1);
+    CU_ASSERT(test_blacklisted(&opts, "10.9.8.7") == 1);
+
+    /* Reload while a reader is still in its section
+    */
+    free(opts.config[CONF_BLACKLIST]);
+    opts.config[CONF_BLACKLIST] = strdup("203.0.113.0/24");
+    acc_table_read_lock(&opts);
+    CU_ASSERT(blacklist_load(&opts) == FWKNOPD_SUCCESS);
+    CU_ASSERT(opts.acc_retired_tbls != NULL);
+    acc_table_read_unlock(&opts);
+    acc_table_reclaim(&opts);
+    CU_ASSERT(opts.acc_retired_tbls == NULL);
+
+    CU_ASSERT(test_blacklisted(&opts, "10.9.8.7") == 0);
+    CU_ASSERT(test_blacklisted(&opts, "203.0.113.1") == 1);
+
+    /* NONE empties the list
+    */
+    free(opts.config[CONF_BLACKLIST]);
+    opts.config[CONF_BLACKLIST] = strdup("NONE");
+    CU_ASSERT(blacklist_load(&opts) == FWKNOPD_SUCCESS);
+    CU_ASSERT(opts.blacklist == NULL);
+    CU_ASSERT(test_blacklisted(&opts, "203.0.113.1") == 0);
+    CU_ASSERT(blacklist_pcap_filter(&opts, "") == NULL);
+
+    test_blacklist_free_opts(&opts);
+}
+
+#ifdef SO_ATTACH_FILTER
+DECLARE_UTEST(blacklist_socket_filter, "check the blacklist socket filter drops datagrams")
+{
+    static fko_srv_options_t    opts;
+    struct sockaddr_in          saddr;
+    socklen_t                   slen = sizeof(saddr);
+    char                        buf[16];
+    int                         rfd, sfd, i;
+
+    test_blacklist_opts(&opts, "127.0.0.0/8", "Y");
+    CU_ASSERT_FATAL(blacklist_load(&opts) == FWKNOPD_SUCCESS);
+
+    rfd = socket(AF_INET, SOCK_DGRAM, 0);
+    sfd = socket(AF_INET, SOCK_DGRAM, 0);
+    CU_ASSERT_FATAL(rfd >= 0 && sfd >= 0);
+
+    memset(&saddr, 0x0, sizeof(saddr));
+    saddr.sin_family      = AF_INET;
+    saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CU_ASSERT_FATAL(bind(rfd, (struct sockaddr *)&saddr, sizeof(saddr)) == 0);
+    CU_ASSERT_FATAL(getsockname(rfd, (struct sockaddr *)&saddr, &slen) == 0);
+
+    CU_ASSERT(blacklist_attach_socket_filter(&opts, rfd) == FWKNOPD_SUCCESS);
+    CU_ASSERT(sendto(sfd, "x", 1, 0, (struct sockaddr *)&saddr, sizeof(saddr)) == 1);
+    usleep(10000);
+    CU_ASSERT(recv(rfd, buf, sizeof(buf), MSG_DONTWAIT) < 0);
+
+    /* A list without the sender lets its datagrams through again
+    */
+    free(opts.config[CONF_BLACKLIST]);
+    opts.config[CONF_BLACKLIST] = strdup("192.0.2.1");
+    CU_ASSERT(blacklist_load(&opts) == FWKNOPD_SUCCESS);
+    CU_ASSERT(blacklist_attach_socket_filter(&opts, rfd) == FWKNOPD_SUCCESS);
+    CU_ASSERT(sendto(sfd, "y", 1, 0, (struct sockaddr *)&saddr, sizeof(saddr)) == 1);
+    for(i = 0; i < 100 && recv(rfd, buf, sizeof(buf), MSG_DONTWAIT) < 0; i++)
+        usleep(1000);
+    CU_ASSERT(i < 100 && buf[0] == 'y');
+
+    close(rfd);
+    close(sfd);
+    test_blacklist_free_opts(&opts);
+}
+#endif
+
+int register_ts_blacklist(void)
+{
+    ts_init(&TEST_SUITE(blacklist), TEST_SUITE_DESCR(blacklist), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(blacklist), UTEST_FCT(blacklist_reload), UTEST_DESCR(blacklist_reload));
+#ifdef SO_ATTACH_FILTER
+    ts_add_utest(&TEST_SUITE(blacklist), UTEST_FCT(blacklist_socket_filter), UTEST_DESCR(blacklist_socket_filter));
+#endif
+
+    return register_ts(&TEST_SUITE(blacklist));
+}
+#endif /* HAVE_C_UNIT_TESTS */
+
+/***EOF***/
@@ -0,0 +1,48 @@
+/*
+ *****************************************************************************
+ *
+ * File:    blacklist.h
+ *
+ * Purpose: Header file for blacklist.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef BLACKLIST_H
+#define BLACKLIST_H
+
+/* Prototypes
+*/
+int blacklist_load(fko_srv_options_t *opts);
+int blacklist_match(fko_srv_options_t *opts, const uint32_t src_ip);
+int blacklist_attach_socket_filter(fko_srv_options_t *opts, const int fd);
+char *blacklist_pcap_filter(fko_srv_options_t *opts, const char *filter);
+void blacklist_free(fko_srv_options_t *opts);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_blacklist(void);
+#endif
+
+#endif /* BLACKLIST_H */
+
+/***EOF***/
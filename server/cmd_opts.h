@@ -48,20 +48,34 @@ static char *config_map[NUMBER_OF_CONFIG_ENTRIES] = {
     "PCAP_DISPATCH_COUNT",
     "PCAP_LOOP_SLEEP",
     "ENABLE_PCAP_ANY_DIRECTION",
+    "ENABLE_AF_PACKET_RING",
+    "AF_PACKET_RING_BLOCKS",
     "EXIT_AT_INTF_DOWN",
     "MAX_SNIFF_BYTES",
     "ENABLE_SPA_PACKET_AGING",
     "MAX_SPA_PACKET_AGE",
     "ENABLE_DIGEST_PERSISTENCE",
+    "DIGEST_SYNC_RECORDS",
+    "DIGEST_SYNC_INTERVAL",
     "RULES_CHECK_THRESHOLD",
+    "RULES_RECONCILE_INTERVAL",
     "CMD_EXEC_TIMEOUT",
-    //"BLACKLIST",
+    "BLACKLIST",
+    "BLACKLIST_FILE",
+    "BLACKLIST_KERNEL_FILTER",
     "ENABLE_SPA_OVER_HTTP",
     "ENABLE_TCP_SERVER",
     "TCPSERV_PORT",
     "ENABLE_UDP_SERVER",
     "UDPSERV_PORT",
     "UDPSERV_SELECT_TIMEOUT",
+    "UDPSERV_BATCH_SIZE",
+    "UDPSERV_SOCKETS",
+    "SPA_WORKER_THREADS",
+    "SPA_QUEUE_SIZE",
+    "SPA_RATE_LIMIT",
+    "SPA_RATE_BURST",
+    "SPA_RATE_TABLE_SIZE",
     "LOCALE",
     "SYSLOG_IDENTITY",
     "SYSLOG_FACILITY",
@@ -139,6 +153,7 @@ static char *config_map[NUMBER_OF_CONFIG_ENTRIES] = {
 	"ALLOW_LEGACY_ACCESS_REQUESTS",
 	"ACC_STANZA_HASH_TABLE_LENGTH",
 	"SERVICE_HASH_TABLE_LENGTH",
+	"HASH_TABLE_MAX_LOAD",
 	"DISABLE_SDP_CTRL_CLIENT",
 	"DISABLE_CONNECTION_TRACKING",
 	"CONN_ID_FILE",
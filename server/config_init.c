@@ -33,6 +33,9 @@
 #include "config_init.h"
 #include "service.h"
 #include "access.h"
+#include "blacklist.h"
+#include "rate_limit.h"
+#include "spa_stage.h"
 #include "cmd_opts.h"
 #include "utils.h"
 #include "log_msg.h"
@@ -136,7 +139,13 @@ free_configs(fko_srv_options_t *opts)
 
     destroy_service_table(opts);
 
-    if(opts->acc_stanza_hash_tbl != NULL)
+    blacklist_free(opts);
+
+    rate_limit_free(opts);
+
+    spa_stage_free(opts);
+
+    if(opts->acc_stanza_hash_tbl != NULL || opts->acc_retired_tbls != NULL)
     {
         // lock the hash table mutex
         if(pthread_mutex_lock(&(opts->acc_hash_tbl_mutex)))
@@ -145,7 +154,7 @@ free_configs(fko_srv_options_t *opts)
         }
         else
         {
-            hash_table_destroy(opts->acc_stanza_hash_tbl);
+            destroy_acc_tables(opts);
             pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
             pthread_mutex_destroy(&(opts->acc_hash_tbl_mutex));
         }
@@ -167,22 +176,46 @@ validate_int_var_ranges(fko_srv_options_t *opts)
         1, RCHK_MAX_PCAP_LOOP_SLEEP);
     range_check(opts, "MAX_SPA_PACKET_AGE", opts->config[CONF_MAX_SPA_PACKET_AGE],
         1, RCHK_MAX_SPA_PACKET_AGE);
+    range_check(opts, "DIGEST_SYNC_RECORDS", opts->config[CONF_DIGEST_SYNC_RECORDS],
+        1, RCHK_MAX_DIGEST_SYNC_RECORDS);
+    range_check(opts, "DIGEST_SYNC_INTERVAL", opts->config[CONF_DIGEST_SYNC_INTERVAL],
+        0, RCHK_MAX_DIGEST_SYNC_INTERVAL);
     range_check(opts, "MAX_SNIFF_BYTES", opts->config[CONF_MAX_SNIFF_BYTES],
         1, RCHK_MAX_SNIFF_BYTES);
+    range_check(opts, "AF_PACKET_RING_BLOCKS", opts->config[CONF_AF_PACKET_RING_BLOCKS],
+        1, RCHK_MAX_AF_PACKET_RING_BLOCKS);
     range_check(opts, "RULES_CHECK_THRESHOLD", opts->config[CONF_RULES_CHECK_THRESHOLD],
         0, RCHK_MAX_RULES_CHECK_THRESHOLD);
+    range_check(opts, "RULES_RECONCILE_INTERVAL", opts->config[CONF_RULES_RECONCILE_INTERVAL],
+        0, RCHK_MAX_RULES_RECONCILE_INTERVAL);
     range_check(opts, "TCPSERV_PORT", opts->config[CONF_TCPSERV_PORT],
         1, RCHK_MAX_TCPSERV_PORT);
     range_check(opts, "UDPSERV_PORT", opts->config[CONF_UDPSERV_PORT],
         1, RCHK_MAX_UDPSERV_PORT);
     range_check(opts, "UDPSERV_PORT", opts->config[CONF_UDPSERV_SELECT_TIMEOUT],
         1, RCHK_MAX_UDPSERV_SELECT_TIMEOUT);
+    range_check(opts, "UDPSERV_BATCH_SIZE", opts->config[CONF_UDPSERV_BATCH_SIZE],
+        1, RCHK_MAX_UDPSERV_BATCH_SIZE);
+    range_check(opts, "UDPSERV_SOCKETS", opts->config[CONF_UDPSERV_SOCKETS],
+        1, RCHK_MAX_UDPSERV_SOCKETS);
+    range_check(opts, "SPA_WORKER_THREADS", opts->config[CONF_SPA_WORKER_THREADS],
+        0, RCHK_MAX_SPA_WORKER_THREADS);
+    range_check(opts, "SPA_QUEUE_SIZE", opts->config[CONF_SPA_QUEUE_SIZE],
+        16, RCHK_MAX_SPA_QUEUE_SIZE);
+    range_check(opts, "SPA_RATE_LIMIT", opts->config[CONF_SPA_RATE_LIMIT],
+        0, RCHK_MAX_SPA_RATE_LIMIT);
+    range_check(opts, "SPA_RATE_BURST", opts->config[CONF_SPA_RATE_BURST],
+        1, RCHK_MAX_SPA_RATE_BURST);
+    range_check(opts, "SPA_RATE_TABLE_SIZE", opts->config[CONF_SPA_RATE_TABLE_SIZE],
+        64, RCHK_MAX_SPA_RATE_TABLE_SIZE);
     range_check(opts, "ACC_STANZA_HASH_TABLE_LENGTH", opts->config[CONF_ACC_STANZA_HASH_TABLE_LENGTH],
         MIN_ACC_STANZA_HASH_TABLE_LENGTH, MAX_ACC_STANZA_HASH_TABLE_LENGTH);
     range_check(opts, "MAX_WAIT_ACC_DATA", opts->config[CONF_MAX_WAIT_ACC_DATA],
         1, RCHK_MAX_WAIT_ACC_DATA);
     range_check(opts, "SERVICE_HASH_TABLE_LENGTH", opts->config[CONF_SERVICE_HASH_TABLE_LENGTH],
         MIN_SERVICE_HASH_TABLE_LENGTH, MAX_SERVICE_HASH_TABLE_LENGTH);
+    range_check(opts, "HASH_TABLE_MAX_LOAD", opts->config[CONF_HASH_TABLE_MAX_LOAD],
+        0, MAX_HASH_TABLE_MAX_LOAD);
 
 #if FIREWALL_IPFW
     range_check(opts, "IPFW_START_RULE_NUM", opts->config[CONF_IPFW_START_RULE_NUM],
@@ -407,7 +440,9 @@ parse_config_file(fko_srv_options_t *opts, const char *config_file)
 static void
 validate_options(fko_srv_options_t *opts)
 {
+    static uint32_t acc_reader_gen = 0;
     char tmp_path[MAX_PATH_LEN] = {0};
+    int  is_err;
 
     /* If no conf dir is set in the config file, use the default.
     */
@@ -497,6 +532,16 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_PCAP_LOOP_SLEEP,
             DEF_PCAP_LOOP_SLEEP);
 
+    /* Capture from an AF_PACKET ring instead of through libpcap (Linux)
+    */
+    if(opts->config[CONF_ENABLE_AF_PACKET_RING] == NULL)
+        set_config_entry(opts, CONF_ENABLE_AF_PACKET_RING,
+            DEF_ENABLE_AF_PACKET_RING);
+
+    if(opts->config[CONF_AF_PACKET_RING_BLOCKS] == NULL)
+        set_config_entry(opts, CONF_AF_PACKET_RING_BLOCKS,
+            DEF_AF_PACKET_RING_BLOCKS);
+
     /* Control whether to exit if the interface where we're sniffing
      * goes down.
     */
@@ -537,6 +582,16 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_ENABLE_DIGEST_PERSISTENCE,
             DEF_ENABLE_DIGEST_PERSISTENCE);
 
+    /* Digest persistence group commit thresholds.
+    */
+    if(opts->config[CONF_DIGEST_SYNC_RECORDS] == NULL)
+        set_config_entry(opts, CONF_DIGEST_SYNC_RECORDS,
+            DEF_DIGEST_SYNC_RECORDS);
+
+    if(opts->config[CONF_DIGEST_SYNC_INTERVAL] == NULL)
+        set_config_entry(opts, CONF_DIGEST_SYNC_INTERVAL,
+            DEF_DIGEST_SYNC_INTERVAL);
+
     /* Set firewall rule "deep" collection interval - this allows
      * fwknopd to remove rules with proper _exp_<time> expiration
      * times even when added by a different program.
@@ -545,6 +600,13 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_RULES_CHECK_THRESHOLD,
             DEF_RULES_CHECK_THRESHOLD);
 
+    /* Minimum time between those deep checks where the firewall keeps
+     * track of the rules it added (iptables).
+    */
+    if(opts->config[CONF_RULES_RECONCILE_INTERVAL] == NULL)
+        set_config_entry(opts, CONF_RULES_RECONCILE_INTERVAL,
+            DEF_RULES_RECONCILE_INTERVAL);
+
     /* Enable destination rule.
     */
     if(opts->config[CONF_ENABLE_DESTINATION_RULE] == NULL)
@@ -929,6 +991,12 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_ENABLE_SPA_OVER_HTTP,
             DEF_ENABLE_SPA_OVER_HTTP);
 
+    /* Blacklist pushed down to the kernel socket or capture filter
+    */
+    if(opts->config[CONF_BLACKLIST_KERNEL_FILTER] == NULL)
+        set_config_entry(opts, CONF_BLACKLIST_KERNEL_FILTER,
+            DEF_BLACKLIST_KERNEL_FILTER);
+
     /* Enable TCP server.
     */
     if(opts->config[CONF_ENABLE_TCP_SERVER] == NULL)
@@ -963,6 +1031,41 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_UDPSERV_SELECT_TIMEOUT,
             DEF_UDPSERV_SELECT_TIMEOUT);
 
+    /* Number of datagrams read per call and number of sockets for the UDP
+     * server.
+    */
+    if(opts->config[CONF_UDPSERV_BATCH_SIZE] == NULL)
+        set_config_entry(opts, CONF_UDPSERV_BATCH_SIZE,
+            DEF_UDPSERV_BATCH_SIZE);
+
+    if(opts->config[CONF_UDPSERV_SOCKETS] == NULL)
+        set_config_entry(opts, CONF_UDPSERV_SOCKETS,
+            DEF_UDPSERV_SOCKETS);
+
+    /* SPA worker threads and the size of the queue that feeds them.
+    */
+    if(opts->config[CONF_SPA_WORKER_THREADS] == NULL)
+        set_config_entry(opts, CONF_SPA_WORKER_THREADS,
+            DEF_SPA_WORKER_THREADS);
+
+    if(opts->config[CONF_SPA_QUEUE_SIZE] == NULL)
+        set_config_entry(opts, CONF_SPA_QUEUE_SIZE,
+            DEF_SPA_QUEUE_SIZE);
+
+    /* Per source (and SDP ID) rate limiting ahead of SPA processing.
+    */
+    if(opts->config[CONF_SPA_RATE_LIMIT] == NULL)
+        set_config_entry(opts, CONF_SPA_RATE_LIMIT,
+            DEF_SPA_RATE_LIMIT);
+
+    if(opts->config[CONF_SPA_RATE_BURST] == NULL)
+        set_config_entry(opts, CONF_SPA_RATE_BURST,
+            DEF_SPA_RATE_BURST);
+
+    if(opts->config[CONF_SPA_RATE_TABLE_SIZE] == NULL)
+        set_config_entry(opts, CONF_SPA_RATE_TABLE_SIZE,
+            DEF_SPA_RATE_TABLE_SIZE);
+
     /* Syslog identity.
     */
     if(opts->config[CONF_SYSLOG_IDENTITY] == NULL)
@@ -1017,10 +1120,25 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_SERVICE_HASH_TABLE_LENGTH, DEF_SERVICE_HASH_TABLE_LENGTH_STR);
     }
 
+    /* Hash tables grow past their configured length at this load
+     */
+    if(opts->config[CONF_HASH_TABLE_MAX_LOAD] == NULL)
+    {
+        set_config_entry(opts, CONF_HASH_TABLE_MAX_LOAD, DEF_HASH_TABLE_MAX_LOAD_STR);
+    }
+
+    // the access table epochs also cover the blacklist, in either mode
+    pthread_mutex_init(&(opts->acc_hash_tbl_mutex), NULL);
+
+    // readers record the epoch they entered in, 0 marks an idle reader
+    opts->acc_table_epoch = 1;
+
+    // reader slots taken before a restart are not valid anymore
+    opts->acc_reader_gen = ++acc_reader_gen;
+
     if(strncmp(opts->config[CONF_DISABLE_SDP_MODE], "N", 1) == 0)
     {
-        // initialize the hash table mutexes
-        pthread_mutex_init(&(opts->acc_hash_tbl_mutex), NULL);
+        // initialize the service hash table mutex
         pthread_mutex_init(&(opts->service_hash_tbl_mutex), NULL);
     }
 
@@ -1075,6 +1193,9 @@ validate_options(fko_srv_options_t *opts)
     */
     validate_int_var_ranges(opts);
 
+    hash_table_set_default_max_load(strtol_wrapper(opts->config[CONF_HASH_TABLE_MAX_LOAD],
+                0, MAX_HASH_TABLE_MAX_LOAD, EXIT_UPON_ERR, &is_err));
+
     /* Some options just trigger some output of information, or trigger an
      * external function, but do not actually start fwknopd.  If any of those
      * are set, we can return here an skip the validation routines as all
@@ -1385,7 +1506,7 @@ config_init(fko_srv_options_t *opts, int argc, char **argv)
             case CONN_ID_FILE:
                 set_config_entry(opts, CONF_CONN_ID_FILE, optarg);
                 break;
-            case CONF_CONN_REPORT_INTERVAL:
+            case CONN_REPORT_INTERVAL:
                 set_config_entry(opts, CONF_CONN_REPORT_INTERVAL, optarg);
                 break;
             case MAX_WAIT_ACC_DATA:
@@ -19,8 +19,12 @@
 #include "sdp_ctrl_client.h"
 #include <json-c/json.h>
 #include <fcntl.h>
+#if HAVE_ARPA_INET_H
+  #include <arpa/inet.h>
+#endif
 #include "service.h"
 #include "connection_tracker.h"
+#include "conntrack_nl.h"
 
 //const char *conn_id_key = "connection_id";
 const char *sdp_id_key  = "sdp_id";
@@ -50,9 +54,10 @@ static hash_table_t *latest_connection_hash_tbl = NULL;
 static connection_t msg_conn_list = NULL;
 static int verbosity = 0;
 static time_t next_ctrl_msg_due = 0;
-static char conntrack_buf[CONNTRACK_CMD_OUT_BUFSIZE] = {0};
+static int conntrack_fd = -1;
 
-static int close_connections(fko_srv_options_t *opts, char *criteria);
+static int close_connections(fko_srv_options_t *opts, char *criteria,
+                             uint32_t sdp_id, connection_t match);
 
 
 static void print_connection_item(connection_t this_conn)
@@ -270,7 +275,7 @@ static int close_invalid_connection(fko_srv_options_t *opts, connection_t this_c
              reply_src_port);
 
     // close it
-    if( (rv = close_connections(opts, criteria)) != FWKNOPD_SUCCESS)
+    if( (rv = close_connections(opts, criteria, this_conn->sdp_id, this_conn)) != FWKNOPD_SUCCESS)
     {
         return rv;
     }
@@ -291,116 +296,78 @@ static int close_invalid_connection(fko_srv_options_t *opts, connection_t this_c
 }
 
 
-static int create_connection_item_from_line(fko_srv_options_t *opts,
-                                            const char *line,
-                                            time_t now,
-                                            connection_t *this_conn_r)
+/* The conntrack entries collected by search_conntrack()
+*/
+typedef struct conntrack_search
+{
+    conntrack_entry_t  *entries;
+    int                 count;
+    int                 size;
+    int                 match;          // only entries like 'want'
+    conntrack_entry_t   want;
+} conntrack_search_t;
+
+
+static int create_connection_item_from_entry(fko_srv_options_t *opts,
+                                             const conntrack_entry_t *ct,
+                                             time_t now,
+                                             connection_t *this_conn_r)
 {
     int res = FWKNOPD_SUCCESS;
     connection_t this_conn = NULL;
-    char *ndx = NULL;
-    unsigned int id = 0;
-    char return_src_ip_str[MAX_IPV4_STR_LEN] = {0};
-    char return_dst_ip_str[MAX_IPV4_STR_LEN] = {0};
-    unsigned int return_src_port = 0;
-
-    // first determine if 'mark' is nonzero
-    if( (ndx = strstr(line, "mark=")) == NULL)
-    {
-        *this_conn_r = NULL;
-        return FWKNOPD_SUCCESS;
-    }
+    uint32_t addr = 0;
 
-    id = 0;
-    if( !sscanf((ndx+strlen("mark=")), "%u", &id) )
-    {
-        log_msg(LOG_ERR, "create_connection_item_from_line() ERROR: failed to extract "
-                "'mark' value from conntrack line:\n     %s\n", line);
-        *this_conn_r = NULL;
-        return FWKNOPD_SUCCESS;
-    }
+    *this_conn_r = NULL;
 
-    if( id == 0 )
+    if( ct->proto != IPPROTO_TCP && ct->proto != IPPROTO_UDP )
     {
-        *this_conn_r = NULL;
+        log_msg(LOG_ERR, "create_connection_item_from_entry() ERROR: unrecognized "
+                "protocol %u in conntrack entry with mark %"PRIu32, ct->proto, ct->mark);
         return FWKNOPD_SUCCESS;
     }
 
     // get the connection details
     if( (this_conn = calloc(1, sizeof *this_conn)) == NULL)
     {
-        log_msg(LOG_ERR, "create_connection_item_from_line() FATAL MEMORY ERROR. ABORTING.");
-        *this_conn_r = NULL;
+        log_msg(LOG_ERR, "create_connection_item_from_entry() FATAL MEMORY ERROR. ABORTING.");
         return FWKNOPD_ERROR_MEMORY_ALLOCATION;
     }
 
+    strlcpy(this_conn->protocol, ct->proto == IPPROTO_TCP ? "tcp" : "udp",
+            sizeof(this_conn->protocol));
 
-    if( !sscanf(line, "%4s", this_conn->protocol) )
-    {
-        log_msg(LOG_ERR, "create_connection_item_from_line() ERROR: failed to extract "
-                "protocol value from conntrack line:\n     %s\n", line);
-        destroy_connection_item(this_conn);
-        *this_conn_r = NULL;
-        return FWKNOPD_SUCCESS;
-    }
-
-    if( (strncmp(this_conn->protocol, "tcp", 3) != 0) && (strncmp(this_conn->protocol, "udp", 3) != 0) )
-    {
-        log_msg(LOG_ERR, "create_connection_item_from_line() ERROR: unrecognized "
-                "protocol value from conntrack line:\n     %s\n", line);
-        destroy_connection_item(this_conn);
-        *this_conn_r = NULL;
-        return FWKNOPD_SUCCESS;
-    }
-
-    if( (ndx = strstr(line, "src=")) == NULL)
-    {
-        log_msg(LOG_ERR, "create_connection_item_from_line() Failed to find 'src=' "
-                "in line: \n     %s\n", line);
-        destroy_connection_item(this_conn);
-        *this_conn_r = NULL;
-        return FWKNOPD_SUCCESS;
-    }
-
-    if( (res = sscanf(ndx, "src=%15s dst=%15s sport=%u dport=%u src=%15s dst=%15s sport=%u",
-               this_conn->src_ip_str,
-               this_conn->dst_ip_str,
-               &(this_conn->src_port),
-               &(this_conn->dst_port),
-               return_src_ip_str,
-               return_dst_ip_str,
-               &return_src_port)) != 7 )
-    {
-        log_msg(LOG_ERR, "create_connection_item_from_line() Failed to find "
-                "connection details in line: \n     %s\n", ndx);
-        destroy_connection_item(this_conn);
-        *this_conn_r = NULL;
-        return FWKNOPD_SUCCESS;
-    }
+    addr = htonl(ct->orig_src);
+    inet_ntop(AF_INET, &addr, this_conn->src_ip_str, sizeof(this_conn->src_ip_str));
+    addr = htonl(ct->orig_dst);
+    inet_ntop(AF_INET, &addr, this_conn->dst_ip_str, sizeof(this_conn->dst_ip_str));
+    this_conn->src_port = ct->orig_sport;
+    this_conn->dst_port = ct->orig_dport;
 
-    this_conn->sdp_id = (uint32_t)id;
+    this_conn->sdp_id = ct->mark;
     this_conn->start_time = now;
 
     // if dest address does not match returning source address
     // then NAT to another machine is in use
-    if(strncmp(this_conn->dst_ip_str, return_src_ip_str, MAX_IPV4_STR_LEN) != 0)
+    if(ct->orig_dst != ct->reply_src)
     {
-        strncpy(this_conn->nat_dst_ip_str, return_src_ip_str, MAX_IPV4_STR_LEN);
-        this_conn->nat_dst_port = return_src_port;
+        addr = htonl(ct->reply_src);
+        inet_ntop(AF_INET, &addr, this_conn->nat_dst_ip_str, sizeof(this_conn->nat_dst_ip_str));
+        this_conn->nat_dst_port = ct->reply_sport;
     }
-    else if(this_conn->dst_port != return_src_port)
+    else if(ct->orig_dport != ct->reply_sport)
     {
         // if dest port does not match returning source port
         // yet dest IP matched returning source IP (previous check)
         // then it's local NAT
-        this_conn->nat_dst_port = return_src_port;
+        this_conn->nat_dst_port = ct->reply_sport;
     }
 
-    // if TIME_WAIT flag set, connection is closed
-    if( (ndx = strstr(line, "TIME_WAIT")) != NULL)
+    // if in TIME_WAIT, connection is closed
+    if(ct->time_wait)
     {
-        log_msg(LOG_DEBUG, "create_connection_item_from_line() TIME_WAIT flag is set "
-                "in line: \n     %s\n", line);
+        log_msg(LOG_DEBUG, "create_connection_item_from_entry() connection from %s:%u "
+                "to %s:%u is in TIME_WAIT", this_conn->src_ip_str, this_conn->src_port,
+                this_conn->dst_ip_str, this_conn->dst_port);
         this_conn->end_time = now;
     }
 
@@ -414,7 +381,6 @@ static int create_connection_item_from_line(fko_srv_options_t *opts,
         {
             log_msg(LOG_ERR, "Fatal memory error. Aborting.");
             destroy_connection_item(this_conn);
-            *this_conn_r = NULL;
             return res;
         }
 
@@ -422,9 +388,7 @@ static int create_connection_item_from_line(fko_srv_options_t *opts,
         print_connection_item(this_conn);
 
         // function adds the connection item to the msg_conn_list so don't destroy it
-        res = close_invalid_connection(opts, this_conn);
-        *this_conn_r = NULL;
-        return res;
+        return close_invalid_connection(opts, this_conn);
     }
 
     *this_conn_r = this_conn;
@@ -432,110 +396,97 @@ static int create_connection_item_from_line(fko_srv_options_t *opts,
 }
 
 
-static int handle_conntrack_print_issue(char **line, char *next_line, char *bad_start, int *line_repaired)
+static int search_conntrack_cb(const conntrack_entry_t *ct, void *arg)
 {
-    int rv = FWKNOPD_SUCCESS;
-    char *temp = NULL;
-
-    *line_repaired = 0;
-
-    if(*line == NULL || next_line == NULL || bad_start == NULL || line_repaired == NULL)
-    {
-        log_msg(LOG_ERR, "handle_conntrack_print_issue() null arg passed, doing nothing");
-        return rv;
-    }
+    conntrack_search_t *search = (conntrack_search_t*)arg;
+    conntrack_entry_t *entries = NULL;
 
-    if(bad_start <= *line)
+    if(search->match
+            && (ct->proto != search->want.proto
+                || ct->orig_src != search->want.orig_src
+                || ct->orig_sport != search->want.orig_sport
+                || ct->orig_dst != search->want.orig_dst
+                || ct->orig_dport != search->want.orig_dport
+                || ct->reply_sport != search->want.reply_sport))
     {
-        log_msg(LOG_ERR, "handle_conntrack_print_issue() index to start of bad data is invalid");
-        return rv;
+        return FWKNOPD_SUCCESS;
     }
 
-    if((temp = calloc(1, (bad_start - *line) + strlen(next_line) + 1)) == NULL)
+    if(search->count == search->size)
     {
-        log_msg(LOG_ERR, "handle_conntrack_print_issue() fatal memory allocation error");
-        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+        if((entries = realloc(search->entries,
+                (search->size ? search->size * 2 : 64) * sizeof(*entries))) == NULL)
+        {
+            log_msg(LOG_ERR, "search_conntrack_cb() FATAL MEMORY ERROR. ABORTING.");
+            return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+        }
+        search->entries = entries;
+        search->size = search->size ? search->size * 2 : 64;
     }
 
-    memcpy(temp, *line, bad_start - *line);
-    strcat(temp, next_line);
+    search->entries[search->count++] = *ct;
 
-    *line = temp;
-    *line_repaired = 1;
-    return rv;
+    return FWKNOPD_SUCCESS;
 }
 
 
+/* Get the connections marked with sdp_id, or with any SDP ID if it is 0,
+ * straight from the kernel. If match is not NULL, only the connection
+ * with the same addresses, ports and reply source port is returned.
+ */
 static int search_conntrack(fko_srv_options_t *opts,
-                            char *criteria,
+                            uint32_t sdp_id,
+                            connection_t match,
                             connection_t *conn_list_r,
                             int *conn_count_r)
 {
-    char   cmd_buf[CMD_BUFSIZE];
     int    conn_count = 0, res = FWKNOPD_SUCCESS;
+    int    i = 0;
     time_t now;
-    int pid_status = 0;
-    char *line = NULL;
-    char *next_line = NULL;
-    char *ndx = NULL;
-    int line_repaired = 0;
     connection_t this_conn = NULL;
     connection_t conn_list = NULL;
+    conntrack_search_t search;
 
     time(&now);
+    memset(&search, 0x0, sizeof(search));
 
-    memset(cmd_buf, 0x0, CMD_BUFSIZE);
-    memset(conntrack_buf, 0x0, CONNTRACK_CMD_OUT_BUFSIZE);
-
-    if(criteria != NULL)
-        snprintf(cmd_buf, CMD_BUFSIZE, "conntrack -L %s", criteria);
-    else
-        snprintf(cmd_buf, CMD_BUFSIZE, "conntrack -L");
-
-    res = run_extcmd(cmd_buf, conntrack_buf, CONNTRACK_CMD_OUT_BUFSIZE,
-            WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
-    conntrack_buf[CONNTRACK_CMD_OUT_BUFSIZE - 1] = 0x0;
-
-    if(!EXTCMD_IS_SUCCESS(res))
+    if(match != NULL)
     {
-        log_msg(LOG_ERR,
-                "search_conntrack() Error %i from cmd:'%s': %s",
-                res, cmd_buf, conntrack_buf);
-        return FWKNOPD_ERROR_CONNTRACK;
+        search.match = 1;
+        search.want.proto = strncmp(match->protocol, "tcp", 3) == 0 ? IPPROTO_TCP : IPPROTO_UDP;
+        if(inet_pton(AF_INET, match->src_ip_str, &search.want.orig_src) != 1
+                || inet_pton(AF_INET, match->dst_ip_str, &search.want.orig_dst) != 1)
+        {
+            log_msg(LOG_ERR, "search_conntrack() invalid connection addresses %s -> %s",
+                    match->src_ip_str, match->dst_ip_str);
+            return FWKNOPD_ERROR_CONNTRACK;
+        }
+        search.want.orig_src = ntohl(search.want.orig_src);
+        search.want.orig_dst = ntohl(search.want.orig_dst);
+        search.want.orig_sport = match->src_port;
+        search.want.orig_dport = match->dst_port;
+        search.want.reply_sport = match->nat_dst_port != 0 ? match->nat_dst_port : match->dst_port;
     }
 
-    line = strtok(conntrack_buf, "\n");
-    log_msg(LOG_DEBUG, "search_conntrack() first line from conntrack call: \n"
-            "    %s\n", line);
+    if(conntrack_fd < 0 && (conntrack_fd = conntrack_nl_open()) < 0)
+        return FWKNOPD_ERROR_CONNTRACK;
 
-    // walk through each of the lines
-    while( line != NULL )
+    if( (res = conntrack_nl_dump(conntrack_fd, sdp_id, search_conntrack_cb, &search)) != FWKNOPD_SUCCESS)
     {
-        // handle issue with conntrack, prints a status message midstream,
-        // inserting it in the middle of a line of data
-        if( (ndx = strstr(line, "conntrack")) != NULL)
-        {
-            if(ndx == line)
-            {
-                line = strtok(NULL, "\n");
-                continue;
-            }
-
-            log_msg(LOG_DEBUG, "Found corrupt conntrack line:\n    %s\n", line);
+        log_msg(LOG_ERR, "search_conntrack() Error %i dumping the conntrack table", res);
 
-            next_line = strtok(NULL, "\n");
-
-            if((res = handle_conntrack_print_issue(&line, next_line, ndx, &line_repaired))
-                    != FWKNOPD_SUCCESS)
-            {
-                goto cleanup;
-            }
-
-            log_msg(LOG_DEBUG, "Corrected conntrack line:\n    %s\n", line);
-        }
+        // start over with a fresh socket next time
+        conntrack_nl_close(conntrack_fd);
+        conntrack_fd = -1;
+        goto cleanup;
+    }
 
-        // extract connection info from line and create connection item
-        if( (res = create_connection_item_from_line(opts, line, now, &this_conn)) != FWKNOPD_SUCCESS)
+    // the dump is complete before any entry is handled, since closing an
+    // invalid connection runs another search
+    for(i = 0; i < search.count; i++)
+    {
+        // create a connection item from the entry
+        if( (res = create_connection_item_from_entry(opts, &search.entries[i], now, &this_conn)) != FWKNOPD_SUCCESS)
         {
             goto cleanup;
         }
@@ -550,16 +501,10 @@ static int search_conntrack(fko_srv_options_t *opts,
 
             conn_count++;
         }
-
-        if(line_repaired)
-        {
-            free(line);
-            line_repaired = 0;
-        }
-
-        line = strtok(NULL, "\n");
     }
 
+    free(search.entries);
+
     *conn_list_r = conn_list;
     *conn_count_r = conn_count;
 
@@ -567,14 +512,14 @@ static int search_conntrack(fko_srv_options_t *opts,
 
 cleanup:
     destroy_connection_list(conn_list);
-    if(line_repaired)
-        free(line);
+    free(search.entries);
 
     return res;
 }
 
 
-static int close_connections(fko_srv_options_t *opts, char *criteria)
+static int close_connections(fko_srv_options_t *opts, char *criteria,
+                             uint32_t sdp_id, connection_t match)
 {
     char   cmd_buf[CMD_BUFSIZE];
     char   cmd_out[STANDARD_CMD_OUT_BUFSIZE];
@@ -604,7 +549,7 @@ static int close_connections(fko_srv_options_t *opts, char *criteria)
         return FWKNOPD_ERROR_CONNTRACK;
     }
 
-    if( (res = search_conntrack(opts, criteria, &conn_list, &conn_count)) != FWKNOPD_SUCCESS)
+    if( (res = search_conntrack(opts, sdp_id, match, &conn_list, &conn_count)) != FWKNOPD_SUCCESS)
     {
         log_msg(LOG_ERR, "close_connections() Error when trying to verify connections were closed");
         return res;
@@ -750,7 +695,7 @@ static int check_conntrack(fko_srv_options_t *opts, int *conn_count_r)
 
     log_msg(LOG_DEBUG, "check_conntrack() Getting latest connections... \n");
 
-    if( (res = search_conntrack(opts, NULL, &this_conn, &conn_count)) != FWKNOPD_SUCCESS)
+    if( (res = search_conntrack(opts, 0, NULL, &this_conn, &conn_count)) != FWKNOPD_SUCCESS)
         return res;
 
     if(verbosity >= LOG_DEBUG)
@@ -1226,8 +1171,8 @@ cleanup:
 static int validate_node_connections(fko_srv_options_t *opts, hash_table_node_t *node)
 {
     int rv = FWKNOPD_SUCCESS;
+    hash_table_t *acc_table = NULL;
     acc_stanza_t *acc = NULL;
-    bstring key = (bstring)node->key;
     connection_t this_conn = (connection_t)(node->data);
     connection_t prev_conn = NULL;
     connection_t next_conn = NULL;
@@ -1245,16 +1190,9 @@ static int validate_node_connections(fko_srv_options_t *opts, hash_table_node_t
 
     memset(criteria, 0x0, CRITERIA_BUF_LEN);
 
-    // lock the hash table mutex
-    if(pthread_mutex_lock(&(opts->acc_hash_tbl_mutex)))
-    {
-        log_msg(LOG_ERR, "Mutex lock error.");
-        return 0;
-    }
-
-    acc = hash_table_get(opts->acc_stanza_hash_tbl, key);
-
-    pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
+    // callers hold an access table read-side section
+    if((acc_table = acc_table_current(opts)) != NULL)
+        acc = hash_table_get_int(acc_table, this_conn->sdp_id);
 
     // see if sdp id still exists in access table
     if( acc == NULL )
@@ -1263,7 +1201,7 @@ static int validate_node_connections(fko_srv_options_t *opts, hash_table_node_t
         // remove all connections marked with this sdp id
         snprintf(criteria, CRITERIA_BUF_LEN, "-m %"PRIu32, this_conn->sdp_id);
 
-        if( (rv = close_connections(opts, criteria)) != FWKNOPD_SUCCESS)
+        if( (rv = close_connections(opts, criteria, this_conn->sdp_id, NULL)) != FWKNOPD_SUCCESS)
         {
             return rv;
         }
@@ -1711,6 +1649,9 @@ void destroy_connection_tracker(fko_srv_options_t *opts)
         destroy_connection_list(msg_conn_list);
         msg_conn_list = NULL;
     }
+
+    conntrack_nl_close(conntrack_fd);
+    conntrack_fd = -1;
 }
 
 #ifdef DEBUG_CONNECTION_TRACKER
@@ -1817,7 +1758,11 @@ int update_connections(fko_srv_options_t *opts)
 
     // what's left in 'latest' conns are new, unknown conns
     // validate and possibly add to known list and to report for ctrl
-    if( hash_table_traverse(latest_connection_hash_tbl, traverse_handle_new_conns_cb, opts)  != FWKNOPD_SUCCESS )
+    acc_table_read_lock(opts);
+    res = hash_table_traverse(latest_connection_hash_tbl, traverse_handle_new_conns_cb, opts);
+    acc_table_read_unlock(opts);
+
+    if(res != FWKNOPD_SUCCESS)
     {
         return FWKNOPD_ERROR_CONNTRACK;
     }
@@ -1865,7 +1810,13 @@ int update_connections(fko_srv_options_t *opts)
 
 int validate_connections(fko_srv_options_t *opts)
 {
-    return hash_table_traverse(connection_hash_tbl, traverse_validate_connections_cb, opts);
+    int rv = FWKNOPD_SUCCESS;
+
+    acc_table_read_lock(opts);
+    rv = hash_table_traverse(connection_hash_tbl, traverse_validate_connections_cb, opts);
+    acc_table_read_unlock(opts);
+
+    return rv;
 }
 
 
@@ -11,7 +11,6 @@
 #define CMD_BUFSIZE                     256
 #define MAX_CONNTRACK_COMMAND_ARGS_LEN  256
 #define STANDARD_CMD_OUT_BUFSIZE        4096
-#define CONNTRACK_CMD_OUT_BUFSIZE       1024*1024
 //#define CONN_ID_BUF_LEN                 21
 #define CRITERIA_BUF_LEN                CMD_BUFSIZE - 20
 
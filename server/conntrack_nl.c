@@ -0,0 +1,685 @@
+/*
+ *****************************************************************************
+ *
+ * File:    conntrack_nl.c
+ *
+ * Purpose: Conntrack table dumps over NFNETLINK.  The kernel filters the
+ *          dump by connmark where it can and the entries are read
+ *          straight from the netlink attributes, which saves forking
+ *          'conntrack -L' and parsing its text output.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "conntrack_nl.h"
+#include "log_msg.h"
+#include "fwknopd_errors.h"
+
+#ifdef HAVE_C_UNIT_TESTS
+  #include "cunit_common.h"
+  DECLARE_TEST_SUITE(conntrack_nl, "Conntrack netlink test suite");
+#endif
+
+#if HAVE_CONNTRACK_NETLINK
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netfilter/nf_conntrack_tcp.h>
+
+#if HAVE_ARPA_INET_H
+  #include <arpa/inet.h>
+#endif
+
+/* Large enough for the biggest batch of entries the kernel sends at once
+*/
+#define CONNTRACK_NL_BUFSIZE    65536
+
+#define CT_NLA_DATA(nla)        ((const char *)(nla) + NLA_HDRLEN)
+#define CT_NLA_PAYLOAD(nla)     ((int)(nla)->nla_len - NLA_HDRLEN)
+
+#define CT_MSG(type)            ((NFNL_SUBSYS_CTNETLINK << 8) | (type))
+
+static uint32_t conntrack_nl_seq;
+
+static void
+parse_attrs(const struct nlattr *tb[], const int max, const void *data, int len)
+{
+    const struct nlattr    *nla = data;
+    int                     type;
+
+    memset(tb, 0, (max + 1) * sizeof(*tb));
+
+    while(len >= (int)sizeof(*nla) && nla->nla_len >= sizeof(*nla)
+            && nla->nla_len <= len)
+    {
+        type = nla->nla_type & NLA_TYPE_MASK;
+        if(type <= max)
+            tb[type] = nla;
+
+        len -= NLA_ALIGN(nla->nla_len);
+        nla  = (const struct nlattr *)((const char *)nla + NLA_ALIGN(nla->nla_len));
+    }
+}
+
+static int
+parse_nested(const struct nlattr *tb[], const int max, const struct nlattr *nla)
+{
+    if(nla == NULL)
+        return 0;
+
+    parse_attrs(tb, max, CT_NLA_DATA(nla), CT_NLA_PAYLOAD(nla));
+    return 1;
+}
+
+static int
+get_u8(const struct nlattr *nla, uint8_t *val)
+{
+    if(nla == NULL || CT_NLA_PAYLOAD(nla) < (int)sizeof(*val))
+        return 0;
+
+    *val = *(const uint8_t *)CT_NLA_DATA(nla);
+    return 1;
+}
+
+static int
+get_be16(const struct nlattr *nla, uint16_t *val)
+{
+    uint16_t    v;
+
+    if(nla == NULL || CT_NLA_PAYLOAD(nla) < (int)sizeof(v))
+        return 0;
+
+    memcpy(&v, CT_NLA_DATA(nla), sizeof(v));
+    *val = ntohs(v);
+    return 1;
+}
+
+static int
+get_be32(const struct nlattr *nla, uint32_t *val)
+{
+    uint32_t    v;
+
+    if(nla == NULL || CT_NLA_PAYLOAD(nla) < (int)sizeof(v))
+        return 0;
+
+    memcpy(&v, CT_NLA_DATA(nla), sizeof(v));
+    *val = ntohl(v);
+    return 1;
+}
+
+/* Append an attribute to nlh, which must have room for it
+*/
+static struct nlattr *
+put_attr(struct nlmsghdr *nlh, const int type, const void *data, const int size)
+{
+    struct nlattr  *nla = (struct nlattr *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+
+    nla->nla_type = type;
+    nla->nla_len  = NLA_HDRLEN + size;
+    if(size > 0)
+        memcpy((char *)nla + NLA_HDRLEN, data, size);
+
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+
+    return nla;
+}
+
+static int
+parse_tuple(const struct nlattr *nla, uint8_t *proto, uint32_t *src,
+        uint32_t *dst, uint16_t *sport, uint16_t *dport)
+{
+    const struct nlattr    *tb[CTA_TUPLE_MAX+1];
+    const struct nlattr    *ip[CTA_IP_MAX+1];
+    const struct nlattr    *pr[CTA_PROTO_MAX+1];
+
+    if(! parse_nested(tb, CTA_TUPLE_MAX, nla)
+            || ! parse_nested(ip, CTA_IP_MAX, tb[CTA_TUPLE_IP])
+            || ! parse_nested(pr, CTA_PROTO_MAX, tb[CTA_TUPLE_PROTO]))
+        return 0;
+
+    if(! get_be32(ip[CTA_IP_V4_SRC], src)
+            || ! get_be32(ip[CTA_IP_V4_DST], dst)
+            || ! get_u8(pr[CTA_PROTO_NUM], proto))
+        return 0;
+
+    *sport = *dport = 0;
+    get_be16(pr[CTA_PROTO_SRC_PORT], sport);
+    get_be16(pr[CTA_PROTO_DST_PORT], dport);
+
+    return 1;
+}
+
+/* Fill in ct from a CT_NEW message.  Returns 0 for an entry that is not
+ * wanted, mark is the same as for conntrack_nl_dump().
+*/
+static int
+parse_entry(const struct nlmsghdr *nlh, const uint32_t mark, conntrack_entry_t *ct)
+{
+    const struct nlattr    *tb[CTA_MAX+1];
+    const struct nlattr    *pi[CTA_PROTOINFO_MAX+1];
+    const struct nlattr    *tcp[CTA_PROTOINFO_TCP_MAX+1];
+    const struct nfgenmsg  *nfg = NLMSG_DATA(nlh);
+    uint8_t                 reply_proto, state;
+
+    if(nlh->nlmsg_len < NLMSG_SPACE(sizeof(struct nfgenmsg))
+            || nfg->nfgen_family != AF_INET)
+        return 0;
+
+    parse_attrs(tb, CTA_MAX, (const char *)nlh + NLMSG_SPACE(sizeof(struct nfgenmsg)),
+            nlh->nlmsg_len - NLMSG_SPACE(sizeof(struct nfgenmsg)));
+
+    memset(ct, 0, sizeof(*ct));
+
+    /* Most entries of a full dump are not ours, so the mark is checked
+     * before anything else.  This also covers kernels that ignore the
+     * mark filter of the request.
+    */
+    get_be32(tb[CTA_MARK], &ct->mark);
+    if(mark != 0 ? ct->mark != mark : ct->mark == 0)
+        return 0;
+
+    if(! parse_tuple(tb[CTA_TUPLE_ORIG], &ct->proto, &ct->orig_src,
+                &ct->orig_dst, &ct->orig_sport, &ct->orig_dport)
+            || ! parse_tuple(tb[CTA_TUPLE_REPLY], &reply_proto, &ct->reply_src,
+                &ct->reply_dst, &ct->reply_sport, &ct->reply_dport))
+    {
+        log_msg(LOG_DEBUG, "parse_entry() skipping conntrack entry with incomplete tuples");
+        return 0;
+    }
+
+    if(parse_nested(pi, CTA_PROTOINFO_MAX, tb[CTA_PROTOINFO])
+            && parse_nested(tcp, CTA_PROTOINFO_TCP_MAX, pi[CTA_PROTOINFO_TCP])
+            && get_u8(tcp[CTA_PROTOINFO_TCP_STATE], &state))
+        ct->time_wait = (state == TCP_CONNTRACK_TIME_WAIT);
+
+    return 1;
+}
+
+/* Open a netfilter netlink socket, or return -1
+*/
+int
+conntrack_nl_open(void)
+{
+    struct sockaddr_nl  addr;
+    int                 fd;
+
+    if((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER)) < 0)
+    {
+        log_msg(LOG_ERR, "conntrack_nl_open() unable to open netfilter netlink socket: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        log_msg(LOG_ERR, "conntrack_nl_open() unable to bind netfilter netlink socket: %s",
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Dump the IPv4 conntrack entries with connmark mark, or with any nonzero
+ * connmark if mark is 0, and pass each of them to cb.  A single mark is
+ * filtered by the kernel; "any nonzero mark" cannot be expressed in the
+ * request, so those entries are dropped here before the tuples are
+ * parsed.
+*/
+int
+conntrack_nl_dump(const int fd, const uint32_t mark,
+        conntrack_entry_cb cb, void *arg)
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct nfgenmsg nfg;
+        char            attrs[2 * NLA_ALIGN(NLA_HDRLEN + sizeof(uint32_t))];
+    } req;
+
+    const struct nlmsghdr  *nlh;
+    const struct nlmsgerr  *err;
+    conntrack_entry_t       ct;
+    struct msghdr           msg;
+    struct iovec            iov;
+    char                   *buf = NULL;
+    uint32_t                seq = ++conntrack_nl_seq, val;
+    ssize_t                 n;
+    int                     len, done = 0, res = FWKNOPD_SUCCESS;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len    = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    req.nlh.nlmsg_type   = CT_MSG(IPCTNL_MSG_CT_GET);
+    req.nlh.nlmsg_flags  = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nlh.nlmsg_seq    = seq;
+    req.nfg.nfgen_family = AF_INET;
+    req.nfg.version      = NFNETLINK_V0;
+
+    if(mark != 0)
+    {
+        val = htonl(mark);
+        put_attr(&req.nlh, CTA_MARK, &val, sizeof(val));
+        val = 0xffffffff;
+        put_attr(&req.nlh, CTA_MARK_MASK, &val, sizeof(val));
+    }
+
+    if((buf = malloc(CONNTRACK_NL_BUFSIZE)) == NULL)
+    {
+        log_msg(LOG_ERR, "conntrack_nl_dump() fatal memory allocation error");
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+    }
+
+    if(send(fd, &req, req.nlh.nlmsg_len, 0) < 0)
+    {
+        log_msg(LOG_ERR, "conntrack_nl_dump() unable to send dump request: %s",
+                strerror(errno));
+        free(buf);
+        return FWKNOPD_ERROR_CONNTRACK;
+    }
+
+    while(! done)
+    {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base   = buf;
+        iov.iov_len    = CONNTRACK_NL_BUFSIZE;
+        msg.msg_iov    = &iov;
+        msg.msg_iovlen = 1;
+
+        if((n = recvmsg(fd, &msg, 0)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            log_msg(LOG_ERR, "conntrack_nl_dump() error reading dump: %s", strerror(errno));
+            res = FWKNOPD_ERROR_CONNTRACK;
+            break;
+        }
+
+        if(n == 0 || (msg.msg_flags & MSG_TRUNC))
+        {
+            log_msg(LOG_ERR, "conntrack_nl_dump() empty or truncated dump message");
+            res = FWKNOPD_ERROR_CONNTRACK;
+            break;
+        }
+
+        len = n;
+        for(nlh = (const struct nlmsghdr *)buf; ! done && NLMSG_OK(nlh, len);
+                nlh = NLMSG_NEXT(nlh, len))
+        {
+            // left over from an earlier dump that was cut short
+            if(nlh->nlmsg_seq != seq)
+                continue;
+
+            if(nlh->nlmsg_type == NLMSG_DONE)
+            {
+                done = 1;
+            }
+            else if(nlh->nlmsg_type == NLMSG_ERROR)
+            {
+                err = NLMSG_DATA(nlh);
+                if(nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(*err)) && err->error == 0)
+                    continue;
+
+                log_msg(LOG_ERR, "conntrack_nl_dump() conntrack dump failed: %s",
+                        nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(*err))
+                        ? strerror(-err->error) : "truncated error message");
+                res  = FWKNOPD_ERROR_CONNTRACK;
+                done = 1;
+            }
+            else if(nlh->nlmsg_type == CT_MSG(IPCTNL_MSG_CT_NEW)
+                    && parse_entry(nlh, mark, &ct))
+            {
+                if((res = cb(&ct, arg)) != FWKNOPD_SUCCESS)
+                    done = 1;
+            }
+        }
+    }
+
+    free(buf);
+    return res;
+}
+
+#else /* HAVE_CONNTRACK_NETLINK */
+
+int
+conntrack_nl_open(void)
+{
+    log_msg(LOG_ERR, "conntrack_nl_open() conntrack over netlink is not supported on this system");
+    return -1;
+}
+
+int
+conntrack_nl_dump(const int fd, const uint32_t mark,
+        conntrack_entry_cb cb, void *arg)
+{
+    return FWKNOPD_ERROR_CONNTRACK;
+}
+
+#endif /* HAVE_CONNTRACK_NETLINK */
+
+void
+conntrack_nl_close(const int fd)
+{
+    if(fd >= 0)
+        close(fd);
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+#if HAVE_CONNTRACK_NETLINK
+
+/* Stands in for the kernel on the other end of a socketpair: answers one
+ * dump request without filtering anything, after a stale message from
+ * an earlier dump
+*/
+typedef struct fake_ct
+{
+    int         fd;
+    int         fail;           /* Answer with an error */
+    int         req_ok;         /* The request looked like a dump request */
+    uint32_t    req_mark;       /* CTA_MARK of the request, if any */
+} fake_ct_t;
+
+typedef struct test_ct_list
+{
+    conntrack_entry_t   ct[8];
+    int                 count;
+    int                 stop_after;
+} test_ct_list_t;
+
+static void
+test_nest_end(struct nlmsghdr *nlh, struct nlattr *nest)
+{
+    nest->nla_len = (char *)nlh + nlh->nlmsg_len - (char *)nest;
+}
+
+static void
+test_put_tuple(struct nlmsghdr *nlh, const int type, const uint8_t proto,
+        const char *src, const char *dst, const uint16_t sport, const uint16_t dport)
+{
+    struct nlattr  *tuple, *nest;
+    uint32_t        addr;
+    uint16_t        port;
+
+    tuple = put_attr(nlh, type | NLA_F_NESTED, NULL, 0);
+
+    nest = put_attr(nlh, CTA_TUPLE_IP | NLA_F_NESTED, NULL, 0);
+    inet_pton(AF_INET, src, &addr);
+    put_attr(nlh, CTA_IP_V4_SRC, &addr, sizeof(addr));
+    inet_pton(AF_INET, dst, &addr);
+    put_attr(nlh, CTA_IP_V4_DST, &addr, sizeof(addr));
+    test_nest_end(nlh, nest);
+
+    nest = put_attr(nlh, CTA_TUPLE_PROTO | NLA_F_NESTED, NULL, 0);
+    put_attr(nlh, CTA_PROTO_NUM, &proto, sizeof(proto));
+    port = htons(sport);
+    put_attr(nlh, CTA_PROTO_SRC_PORT, &port, sizeof(port));
+    port = htons(dport);
+    put_attr(nlh, CTA_PROTO_DST_PORT, &port, sizeof(port));
+    test_nest_end(nlh, nest);
+
+    test_nest_end(nlh, tuple);
+}
+
+/* Append a CT_NEW message to buf, the mark goes last to make sure the
+ * attribute order does not matter
+*/
+static int
+test_put_entry(char *buf, const int len, const uint32_t seq, const uint32_t mark,
+        const uint8_t proto, const char *src, const char *dst, const uint16_t sport,
+        const uint16_t dport, const char *reply_src, const uint16_t reply_sport,
+        const uint8_t tcp_state)
+{
+    struct nlmsghdr    *nlh = (struct nlmsghdr *)(buf + len);
+    struct nfgenmsg    *nfg = NLMSG_DATA(nlh);
+    struct nlattr      *pi, *tcp;
+    uint32_t            val;
+
+    memset(nlh, 0, 512);
+    nlh->nlmsg_len   = NLMSG_LENGTH(sizeof(*nfg));
+    nlh->nlmsg_type  = CT_MSG(IPCTNL_MSG_CT_NEW);
+    nlh->nlmsg_flags = NLM_F_MULTI;
+    nlh->nlmsg_seq   = seq;
+    nfg->nfgen_family = AF_INET;
+    nfg->version      = NFNETLINK_V0;
+
+    test_put_tuple(nlh, CTA_TUPLE_ORIG, proto, src, dst, sport, dport);
+    test_put_tuple(nlh, CTA_TUPLE_REPLY, proto, reply_src, src, reply_sport, sport);
+
+    if(proto == IPPROTO_TCP)
+    {
+        pi  = put_attr(nlh, CTA_PROTOINFO | NLA_F_NESTED, NULL, 0);
+        tcp = put_attr(nlh, CTA_PROTOINFO_TCP | NLA_F_NESTED, NULL, 0);
+        put_attr(nlh, CTA_PROTOINFO_TCP_STATE, &tcp_state, sizeof(tcp_state));
+        test_nest_end(nlh, tcp);
+        test_nest_end(nlh, pi);
+    }
+
+    if(mark != 0)
+    {
+        val = htonl(mark);
+        put_attr(nlh, CTA_MARK, &val, sizeof(val));
+    }
+
+    return len + NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+static int
+test_put_end(char *buf, const int len, const uint32_t seq, const int error)
+{
+    struct nlmsghdr    *nlh = (struct nlmsghdr *)(buf + len);
+    struct nlmsgerr    *err = NLMSG_DATA(nlh);
+
+    memset(nlh, 0, NLMSG_SPACE(sizeof(*err)));
+    nlh->nlmsg_seq = seq;
+
+    if(error != 0)
+    {
+        nlh->nlmsg_type = NLMSG_ERROR;
+        nlh->nlmsg_len  = NLMSG_LENGTH(sizeof(*err));
+        err->error      = error;
+    }
+    else
+    {
+        nlh->nlmsg_type  = NLMSG_DONE;
+        nlh->nlmsg_flags = NLM_F_MULTI;
+        nlh->nlmsg_len   = NLMSG_LENGTH(sizeof(int));
+    }
+
+    return len + NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+static void *
+fake_ct_producer(void *arg)
+{
+    fake_ct_t              *f = arg;
+    char                    req[256], buf[4096];
+    const struct nlmsghdr  *nlh = (const struct nlmsghdr *)req;
+    const struct nlattr    *tb[CTA_MAX+1];
+    uint32_t                seq;
+    int                     len;
+
+    if(recv(f->fd, req, sizeof(req), 0) < (ssize_t)NLMSG_SPACE(sizeof(struct nfgenmsg)))
+        return NULL;
+
+    f->req_ok = nlh->nlmsg_type == CT_MSG(IPCTNL_MSG_CT_GET)
+        && (nlh->nlmsg_flags & NLM_F_DUMP) == NLM_F_DUMP
+        && ((const struct nfgenmsg *)NLMSG_DATA(nlh))->nfgen_family == AF_INET;
+
+    parse_attrs(tb, CTA_MAX, req + NLMSG_SPACE(sizeof(struct nfgenmsg)),
+            nlh->nlmsg_len - NLMSG_SPACE(sizeof(struct nfgenmsg)));
+    get_be32(tb[CTA_MARK], &f->req_mark);
+    seq = nlh->nlmsg_seq;
+
+    len = test_put_entry(buf, 0, seq - 1, 7, IPPROTO_TCP, "10.0.0.9", "10.0.0.2",
+            30000, 22, "10.0.0.2", 22, TCP_CONNTRACK_ESTABLISHED);
+    send(f->fd, buf, len, 0);
+
+    if(f->fail)
+    {
+        len = test_put_end(buf, 0, seq, -EPERM);
+        send(f->fd, buf, len, 0);
+        return NULL;
+    }
+
+    len = test_put_entry(buf, 0, seq, 0, IPPROTO_TCP, "10.0.0.1", "10.0.0.2",
+            40000, 22, "10.0.0.2", 22, TCP_CONNTRACK_ESTABLISHED);
+    len = test_put_entry(buf, len, seq, 7, IPPROTO_TCP, "10.0.0.1", "10.0.0.2",
+            40001, 22, "10.0.0.2", 22, TCP_CONNTRACK_ESTABLISHED);
+    len = test_put_entry(buf, len, seq, 7, IPPROTO_TCP, "10.0.0.1", "10.0.0.2",
+            40002, 443, "192.168.1.5", 8443, TCP_CONNTRACK_TIME_WAIT);
+    send(f->fd, buf, len, 0);
+
+    len = test_put_entry(buf, 0, seq, 9, IPPROTO_UDP, "10.0.0.3", "10.0.0.2",
+            5000, 53, "10.0.0.2", 53, 0);
+    len = test_put_end(buf, len, seq, 0);
+    send(f->fd, buf, len, 0);
+
+    return NULL;
+}
+
+static int
+test_collect(const conntrack_entry_t *ct, void *arg)
+{
+    test_ct_list_t *list = arg;
+
+    if(list->count < 8)
+        list->ct[list->count++] = *ct;
+
+    if(list->stop_after != 0 && list->count >= list->stop_after)
+        return FWKNOPD_ERROR_CONNTRACK;
+
+    return FWKNOPD_SUCCESS;
+}
+
+static int
+test_dump(fake_ct_t *f, const uint32_t mark, test_ct_list_t *list)
+{
+    pthread_t   producer;
+    int         sv[2], res;
+
+    CU_ASSERT_FATAL(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == 0);
+    f->fd = sv[1];
+    CU_ASSERT_FATAL(pthread_create(&producer, NULL, fake_ct_producer, f) == 0);
+
+    res = conntrack_nl_dump(sv[0], mark, test_collect, list);
+
+    pthread_join(producer, NULL);
+    close(sv[0]);
+    close(sv[1]);
+
+    return res;
+}
+
+DECLARE_UTEST(dump_marked, "dump every marked entry from a fake producer")
+{
+    fake_ct_t       f;
+    test_ct_list_t  list;
+
+    memset(&f, 0, sizeof(f));
+    memset(&list, 0, sizeof(list));
+
+    CU_ASSERT(test_dump(&f, 0, &list) == FWKNOPD_SUCCESS);
+    CU_ASSERT(f.req_ok);
+    CU_ASSERT(f.req_mark == 0);
+
+    /* Neither the stale nor the unmarked entry come through
+    */
+    CU_ASSERT_FATAL(list.count == 3);
+
+    CU_ASSERT(list.ct[0].mark == 7);
+    CU_ASSERT(list.ct[0].proto == IPPROTO_TCP);
+    CU_ASSERT(list.ct[0].orig_src == 0x0A000001);
+    CU_ASSERT(list.ct[0].orig_dst == 0x0A000002);
+    CU_ASSERT(list.ct[0].orig_sport == 40001);
+    CU_ASSERT(list.ct[0].orig_dport == 22);
+    CU_ASSERT(list.ct[0].reply_src == 0x0A000002);
+    CU_ASSERT(list.ct[0].reply_sport == 22);
+    CU_ASSERT(list.ct[0].time_wait == 0);
+
+    CU_ASSERT(list.ct[1].reply_src == 0xC0A80105);
+    CU_ASSERT(list.ct[1].reply_sport == 8443);
+    CU_ASSERT(list.ct[1].time_wait == 1);
+
+    CU_ASSERT(list.ct[2].mark == 9);
+    CU_ASSERT(list.ct[2].proto == IPPROTO_UDP);
+    CU_ASSERT(list.ct[2].orig_sport == 5000);
+    CU_ASSERT(list.ct[2].orig_dport == 53);
+}
+
+DECLARE_UTEST(dump_by_mark, "dump the entries of one mark")
+{
+    fake_ct_t       f;
+    test_ct_list_t  list;
+
+    memset(&f, 0, sizeof(f));
+    memset(&list, 0, sizeof(list));
+
+    CU_ASSERT(test_dump(&f, 9, &list) == FWKNOPD_SUCCESS);
+    CU_ASSERT(f.req_ok);
+    CU_ASSERT(f.req_mark == 9);
+    CU_ASSERT(list.count == 1);
+    CU_ASSERT(list.ct[0].mark == 9);
+}
+
+DECLARE_UTEST(dump_errors, "check dump errors and callback aborts")
+{
+    fake_ct_t       f;
+    test_ct_list_t  list;
+
+    memset(&f, 0, sizeof(f));
+    memset(&list, 0, sizeof(list));
+    f.fail = 1;
+
+    CU_ASSERT(test_dump(&f, 0, &list) == FWKNOPD_ERROR_CONNTRACK);
+    CU_ASSERT(list.count == 0);
+
+    memset(&f, 0, sizeof(f));
+    list.stop_after = 2;
+
+    CU_ASSERT(test_dump(&f, 0, &list) == FWKNOPD_ERROR_CONNTRACK);
+    CU_ASSERT(list.count == 2);
+}
+
+#endif /* HAVE_CONNTRACK_NETLINK */
+
+int register_ts_conntrack_nl(void)
+{
+    ts_init(&TEST_SUITE(conntrack_nl), TEST_SUITE_DESCR(conntrack_nl), NULL, NULL);
+#if HAVE_CONNTRACK_NETLINK
+    ts_add_utest(&TEST_SUITE(conntrack_nl), UTEST_FCT(dump_marked), UTEST_DESCR(dump_marked));
+    ts_add_utest(&TEST_SUITE(conntrack_nl), UTEST_FCT(dump_by_mark), UTEST_DESCR(dump_by_mark));
+    ts_add_utest(&TEST_SUITE(conntrack_nl), UTEST_FCT(dump_errors), UTEST_DESCR(dump_errors));
+#endif
+
+    return register_ts(&TEST_SUITE(conntrack_nl));
+}
+#endif /* HAVE_C_UNIT_TESTS */
+
+/***EOF***/
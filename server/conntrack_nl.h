@@ -0,0 +1,74 @@
+/*
+ *****************************************************************************
+ *
+ * File:    conntrack_nl.h
+ *
+ * Purpose: Header file for conntrack_nl.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef CONNTRACK_NL_H
+#define CONNTRACK_NL_H
+
+#if HAVE_LINUX_NETFILTER_NFNETLINK_CONNTRACK_H
+  #define HAVE_CONNTRACK_NETLINK 1
+#endif
+
+/* One IPv4 conntrack entry from a dump.  Addresses and ports are in host
+ * byte order, the ports are 0 for protocols that have none.
+*/
+typedef struct conntrack_entry
+{
+    uint32_t    mark;
+    uint8_t     proto;
+    uint8_t     time_wait;      /* TCP connection in TIME_WAIT */
+    uint16_t    orig_sport;
+    uint16_t    orig_dport;
+    uint16_t    reply_sport;
+    uint16_t    reply_dport;
+    uint32_t    orig_src;
+    uint32_t    orig_dst;
+    uint32_t    reply_src;
+    uint32_t    reply_dst;
+} conntrack_entry_t;
+
+/* Called for each entry of a dump.  Anything but FWKNOPD_SUCCESS ends the
+ * dump and is returned by conntrack_nl_dump().
+*/
+typedef int (*conntrack_entry_cb)(const conntrack_entry_t *ct, void *arg);
+
+/* Prototypes
+*/
+int conntrack_nl_open(void);
+int conntrack_nl_dump(const int fd, const uint32_t mark,
+        conntrack_entry_cb cb, void *arg);
+void conntrack_nl_close(const int fd);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_conntrack_nl(void);
+#endif
+
+#endif /* CONNTRACK_NL_H */
+
+/***EOF***/
@@ -288,6 +288,9 @@ void *control_client_thread_func(void *arg)
             }
         }
 
+        // free access tables replaced while packets were still using them
+        acc_table_reclaim(opts);
+
         // do not begin sending requests until controller is ready
         if( !(sdp_ctrl_client_controller_status(opts->ctrl_client)) )
             continue;
@@ -0,0 +1,684 @@
+/*
+ *****************************************************************************
+ *
+ * File:    event_loop.c
+ *
+ * Purpose: A small event loop (reactor) shared by the UDP server, the TCP
+ *          server and the pcap capture loop.  Descriptors and timers are
+ *          registered with a callback, and evloop_run_once() waits for and
+ *          dispatches whatever is ready.  On Linux this is epoll with a
+ *          timerfd per timer; elsewhere it falls back to poll().
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "event_loop.h"
+#include "log_msg.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#if EVLOOP_EPOLL
+  #include <stdint.h>
+  #include <sys/epoll.h>
+  #include <sys/timerfd.h>
+  #include <sys/eventfd.h>
+#else
+  #include <poll.h>
+#endif
+
+#ifdef HAVE_C_UNIT_TESTS
+  #include "cunit_common.h"
+  DECLARE_TEST_SUITE(event_loop, "Event loop test suite");
+#endif
+
+enum {
+    EVH_FREE = 0,
+    EVH_FD,
+    EVH_TIMER,
+    EVH_WAKE
+};
+
+/* A registered descriptor or timer.  gen changes every time the slot is
+ * reused so that events which are already queued for a handler that a
+ * callback removed are not delivered to its successor.
+*/
+typedef struct evloop_handler
+{
+    int                 type;
+    int                 fd;         /* watched descriptor, or the timerfd */
+    unsigned int        gen;
+    evloop_cb_t         cb;
+    void               *arg;
+#if ! EVLOOP_EPOLL
+    long                usecs;
+    int                 repeat;
+    int                 armed;
+    struct timespec     deadline;
+#endif
+} evloop_handler_t;
+
+struct evloop
+{
+    evloop_handler_t   *handlers;
+    int                 nb_handlers;
+    unsigned int        next_gen;
+#if EVLOOP_EPOLL
+    int                 epfd;
+    int                 wake_fd;
+#else
+    int                 wake_pipe[2];
+    struct pollfd      *pfds;
+    int                *pfd_slots;
+#endif
+};
+
+/* Find a free handler slot (growing the table if need be) and return its
+ * index, or -1.
+*/
+static int
+evloop_slot_new(evloop_t *loop, const int type, const int fd,
+        evloop_cb_t cb, void *arg)
+{
+    evloop_handler_t   *tmp;
+    int                 i, n;
+
+    for(i=0; i < loop->nb_handlers; i++)
+        if(loop->handlers[i].type == EVH_FREE)
+            break;
+
+    if(i == loop->nb_handlers)
+    {
+        n = loop->nb_handlers ? loop->nb_handlers * 2 : 8;
+        if((tmp = realloc(loop->handlers, n * sizeof(evloop_handler_t))) == NULL)
+            return -1;
+        memset(tmp + loop->nb_handlers, 0x0,
+                (n - loop->nb_handlers) * sizeof(evloop_handler_t));
+        loop->handlers    = tmp;
+        loop->nb_handlers = n;
+
+#if ! EVLOOP_EPOLL
+        free(loop->pfds);
+        free(loop->pfd_slots);
+        loop->pfds      = calloc(n + 1, sizeof(struct pollfd));
+        loop->pfd_slots = calloc(n + 1, sizeof(int));
+        if(loop->pfds == NULL || loop->pfd_slots == NULL)
+            return -1;
+#endif
+    }
+
+    memset(&loop->handlers[i], 0x0, sizeof(evloop_handler_t));
+    loop->handlers[i].type = type;
+    loop->handlers[i].fd   = fd;
+    loop->handlers[i].gen  = loop->next_gen++;
+    loop->handlers[i].cb   = cb;
+    loop->handlers[i].arg  = arg;
+
+    return i;
+}
+
+static void
+evloop_slot_free(evloop_t *loop, const int slot)
+{
+    loop->handlers[slot].type = EVH_FREE;
+    loop->handlers[slot].fd   = -1;
+    loop->handlers[slot].gen  = loop->next_gen++;
+    return;
+}
+
+#if EVLOOP_EPOLL
+static int
+evloop_watch(evloop_t *loop, const int slot)
+{
+    struct epoll_event  ev;
+
+    memset(&ev, 0x0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.u64 = ((uint64_t)loop->handlers[slot].gen << 32) | (uint32_t)slot;
+
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->handlers[slot].fd, &ev);
+}
+#else
+static void
+evloop_timer_arm(evloop_handler_t *h)
+{
+    clock_gettime(CLOCK_MONOTONIC, &h->deadline);
+    h->deadline.tv_sec  += h->usecs / 1000000;
+    h->deadline.tv_nsec += (h->usecs % 1000000) * 1000;
+    if(h->deadline.tv_nsec >= 1000000000)
+    {
+        h->deadline.tv_sec++;
+        h->deadline.tv_nsec -= 1000000000;
+    }
+    h->armed = 1;
+    return;
+}
+
+/* Microseconds until the timer is due (zero if it is overdue)
+*/
+static long
+evloop_timer_remaining(const evloop_handler_t *h, const struct timespec *now)
+{
+    long    usecs;
+
+    usecs = (h->deadline.tv_sec - now->tv_sec) * 1000000
+        + (h->deadline.tv_nsec - now->tv_nsec) / 1000;
+
+    return usecs > 0 ? usecs : 0;
+}
+#endif
+
+evloop_t *
+evloop_new(void)
+{
+    evloop_t   *loop;
+#if EVLOOP_EPOLL
+    int         slot;
+#else
+    int         i, flags;
+#endif
+
+    if((loop = calloc(1, sizeof(evloop_t))) == NULL)
+        return NULL;
+
+#if EVLOOP_EPOLL
+    loop->wake_fd = -1;
+
+    if((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        log_msg(LOG_ERR, "evloop_new: epoll_create1() failed: %s",
+            strerror(errno));
+        free(loop);
+        return NULL;
+    }
+
+    if((loop->wake_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0
+            || (slot = evloop_slot_new(loop, EVH_WAKE, loop->wake_fd, NULL, NULL)) < 0
+            || evloop_watch(loop, slot) != 0)
+    {
+        log_msg(LOG_ERR, "evloop_new: could not set up the wakeup eventfd: %s",
+            strerror(errno));
+        evloop_free(loop);
+        return NULL;
+    }
+#else
+    if(pipe(loop->wake_pipe) != 0)
+    {
+        log_msg(LOG_ERR, "evloop_new: pipe() failed: %s", strerror(errno));
+        free(loop);
+        return NULL;
+    }
+    for(i=0; i < 2; i++)
+    {
+        if((flags = fcntl(loop->wake_pipe[i], F_GETFL, 0)) >= 0)
+            fcntl(loop->wake_pipe[i], F_SETFL, flags | O_NONBLOCK);
+        fcntl(loop->wake_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+    return loop;
+}
+
+void
+evloop_free(evloop_t *loop)
+{
+#if EVLOOP_EPOLL
+    int     i;
+#endif
+
+    if(loop == NULL)
+        return;
+
+#if EVLOOP_EPOLL
+    /* The timerfds belong to us, watched descriptors to the caller
+    */
+    for(i=0; i < loop->nb_handlers; i++)
+        if(loop->handlers[i].type == EVH_TIMER)
+            close(loop->handlers[i].fd);
+
+    if(loop->wake_fd >= 0)
+        close(loop->wake_fd);
+    close(loop->epfd);
+#else
+    close(loop->wake_pipe[0]);
+    close(loop->wake_pipe[1]);
+    free(loop->pfds);
+    free(loop->pfd_slots);
+#endif
+
+    free(loop->handlers);
+    free(loop);
+    return;
+}
+
+/* Watch fd for input.  The callback runs from evloop_run_once() each time
+ * fd is readable (or in an error state).
+*/
+int
+evloop_add_fd(evloop_t *loop, const int fd, evloop_cb_t cb, void *arg)
+{
+    int     slot;
+
+    if((slot = evloop_slot_new(loop, EVH_FD, fd, cb, arg)) < 0)
+        return -1;
+
+#if EVLOOP_EPOLL
+    if(evloop_watch(loop, slot) != 0)
+    {
+        log_msg(LOG_ERR, "evloop_add_fd: epoll_ctl() failed for fd %d: %s",
+            fd, strerror(errno));
+        evloop_slot_free(loop, slot);
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/* Stop watching fd.  The descriptor itself is left open.
+*/
+int
+evloop_del_fd(evloop_t *loop, const int fd)
+{
+    int     i;
+
+    for(i=0; i < loop->nb_handlers; i++)
+    {
+        if(loop->handlers[i].type == EVH_FD && loop->handlers[i].fd == fd)
+        {
+#if EVLOOP_EPOLL
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+            evloop_slot_free(loop, i);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Run cb once usecs from now, and then every usecs if repeat is set.  The
+ * return value is the timer id, or -1 on error.  A one-shot timer stays
+ * allocated until evloop_del_timer() is called for it.
+*/
+int
+evloop_add_timer(evloop_t *loop, const long usecs, const int repeat,
+        evloop_cb_t cb, void *arg)
+{
+    int                 slot;
+#if EVLOOP_EPOLL
+    struct itimerspec   its;
+    int                 tfd;
+
+    if((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0)
+    {
+        log_msg(LOG_ERR, "evloop_add_timer: timerfd_create() failed: %s",
+            strerror(errno));
+        return -1;
+    }
+
+    /* An all-zero it_value would disarm the timer
+    */
+    memset(&its, 0x0, sizeof(its));
+    its.it_value.tv_sec  = usecs / 1000000;
+    its.it_value.tv_nsec = (usecs % 1000000) * 1000;
+    if(its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+        its.it_value.tv_nsec = 1;
+    if(repeat)
+        its.it_interval = its.it_value;
+
+    if(timerfd_settime(tfd, 0, &its, NULL) != 0
+            || (slot = evloop_slot_new(loop, EVH_TIMER, tfd, cb, arg)) < 0)
+    {
+        close(tfd);
+        return -1;
+    }
+
+    if(evloop_watch(loop, slot) != 0)
+    {
+        log_msg(LOG_ERR, "evloop_add_timer: epoll_ctl() failed: %s",
+            strerror(errno));
+        close(tfd);
+        evloop_slot_free(loop, slot);
+        return -1;
+    }
+#else
+    if((slot = evloop_slot_new(loop, EVH_TIMER, -1, cb, arg)) < 0)
+        return -1;
+
+    loop->handlers[slot].usecs  = usecs;
+    loop->handlers[slot].repeat = repeat;
+    evloop_timer_arm(&loop->handlers[slot]);
+#endif
+
+    return slot;
+}
+
+int
+evloop_del_timer(evloop_t *loop, const int timer_id)
+{
+    if(timer_id < 0 || timer_id >= loop->nb_handlers
+            || loop->handlers[timer_id].type != EVH_TIMER)
+        return -1;
+
+#if EVLOOP_EPOLL
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->handlers[timer_id].fd, NULL);
+    close(loop->handlers[timer_id].fd);
+#endif
+    evloop_slot_free(loop, timer_id);
+    return 0;
+}
+
+/* Make a thread blocked in evloop_run_once() return.  This is the only
+ * call that may be made from another thread.
+*/
+void
+evloop_wakeup(evloop_t *loop)
+{
+#if EVLOOP_EPOLL
+    uint64_t    one = 1;
+
+    if(write(loop->wake_fd, &one, sizeof(one)) < 0)
+        return;
+#else
+    if(write(loop->wake_pipe[1], "x", 1) < 0)
+        return;
+#endif
+    return;
+}
+
+/* Wait up to max_usecs (forever if negative) for descriptors or timers to
+ * become ready and run their callbacks.  Returns the number of callbacks
+ * run, zero on a timeout, wakeup or signal, and -1 on error.
+*/
+int
+evloop_run_once(evloop_t *loop, const long max_usecs)
+{
+    evloop_cb_t         cb;
+    void               *arg;
+    int                 i, n, slot, fd, ran = 0;
+#if EVLOOP_EPOLL
+    struct epoll_event  evs[EVLOOP_MAX_EVENTS];
+    unsigned int        gen;
+    uint64_t            cnt;
+    int                 timeout;
+
+    if(max_usecs < 0)
+        timeout = -1;
+    else
+        timeout = (max_usecs + 999) / 1000;
+
+    if((n = epoll_wait(loop->epfd, evs, EVLOOP_MAX_EVENTS, timeout)) < 0)
+        return (errno == EINTR) ? 0 : -1;
+
+    for(i=0; i < n; i++)
+    {
+        slot = (int)(evs[i].data.u64 & 0xffffffff);
+        gen  = (unsigned int)(evs[i].data.u64 >> 32);
+
+        /* An earlier callback in this batch may have removed it
+        */
+        if(slot >= loop->nb_handlers || loop->handlers[slot].gen != gen)
+            continue;
+
+        cb  = loop->handlers[slot].cb;
+        arg = loop->handlers[slot].arg;
+        fd  = loop->handlers[slot].fd;
+
+        switch(loop->handlers[slot].type)
+        {
+            case EVH_WAKE:
+                while(read(fd, &cnt, sizeof(cnt)) > 0);
+                break;
+            case EVH_TIMER:
+                if(read(fd, &cnt, sizeof(cnt)) < 0)
+                    break;
+                cb(loop, -1, arg);
+                ran++;
+                break;
+            case EVH_FD:
+                cb(loop, fd, arg);
+                ran++;
+                break;
+        }
+    }
+#else
+    struct timespec     now;
+    evloop_handler_t   *h;
+    unsigned int       *gens = NULL;
+    int                *slots = NULL;
+    long                usecs = max_usecs, rem;
+    int                 nfds = 0, nready = 0;
+    char                buf[64];
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    loop->pfds[0].fd      = loop->wake_pipe[0];
+    loop->pfds[0].events  = POLLIN;
+    loop->pfds[0].revents = 0;
+    nfds = 1;
+
+    for(i=0; i < loop->nb_handlers; i++)
+    {
+        h = &loop->handlers[i];
+        if(h->type == EVH_FD)
+        {
+            loop->pfds[nfds].fd      = h->fd;
+            loop->pfds[nfds].events  = POLLIN;
+            loop->pfds[nfds].revents = 0;
+            loop->pfd_slots[nfds]    = i;
+            nfds++;
+        }
+        else if(h->type == EVH_TIMER && h->armed)
+        {
+            rem = evloop_timer_remaining(h, &now);
+            if(usecs < 0 || rem < usecs)
+                usecs = rem;
+        }
+    }
+
+    if((n = poll(loop->pfds, nfds, usecs < 0 ? -1 : (int)((usecs + 999) / 1000))) < 0)
+        return (errno == EINTR) ? 0 : -1;
+
+    if(loop->pfds[0].revents)
+        while(read(loop->wake_pipe[0], buf, sizeof(buf)) > 0);
+
+    /* Take a copy of the ready handlers (a callback may add handlers and
+     * so reallocate pfds) along with their generation so that one removed
+     * by an earlier callback is skipped.
+    */
+    if(n > 0)
+    {
+        gens  = calloc(nfds, sizeof(unsigned int));
+        slots = calloc(nfds, sizeof(int));
+        if(gens == NULL || slots == NULL)
+            nfds = 0;
+        for(i=1; i < nfds; i++)
+        {
+            if(loop->pfds[i].revents == 0)
+                continue;
+            slots[nready] = loop->pfd_slots[i];
+            gens[nready]  = loop->handlers[slots[nready]].gen;
+            nready++;
+        }
+    }
+
+    for(i=0; i < nready; i++)
+    {
+        slot = slots[i];
+        if(loop->handlers[slot].gen != gens[i])
+            continue;
+
+        cb  = loop->handlers[slot].cb;
+        arg = loop->handlers[slot].arg;
+        fd  = loop->handlers[slot].fd;
+        cb(loop, fd, arg);
+        ran++;
+    }
+    free(gens);
+    free(slots);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for(i=0; i < loop->nb_handlers; i++)
+    {
+        h = &loop->handlers[i];
+        if(h->type != EVH_TIMER || ! h->armed
+                || evloop_timer_remaining(h, &now) > 0)
+            continue;
+
+        if(h->repeat)
+            evloop_timer_arm(h);
+        else
+            h->armed = 0;
+
+        cb  = h->cb;
+        arg = h->arg;
+        cb(loop, -1, arg);
+        ran++;
+    }
+#endif
+
+    return ran;
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+static void
+utest_count_cb(evloop_t *loop, int fd, void *arg)
+{
+    char    buf[16];
+
+    if(fd >= 0 && read(fd, buf, sizeof(buf)) < 0)
+        return;
+    (*(int *)arg)++;
+    return;
+}
+
+typedef struct utest_pair
+{
+    int     fds[2][2];
+    int     calls;
+} utest_pair_t;
+
+/* Each of the two readers removes the other one
+*/
+static void
+utest_remove_other_cb(evloop_t *loop, int fd, void *arg)
+{
+    utest_pair_t   *p = (utest_pair_t *)arg;
+
+    p->calls++;
+    evloop_del_fd(loop, fd == p->fds[0][0] ? p->fds[1][0] : p->fds[0][0]);
+    evloop_del_fd(loop, fd);
+    return;
+}
+
+DECLARE_UTEST(timers_and_wakeup, "timers fire on time and wakeups return")
+{
+    evloop_t       *loop;
+    struct timespec t0, t1;
+    int             once = 0, every = 0, id_once, id_every, i;
+
+    loop = evloop_new();
+    CU_ASSERT_FATAL(loop != NULL);
+
+    id_once  = evloop_add_timer(loop, 1000, 0, utest_count_cb, &once);
+    id_every = evloop_add_timer(loop, 2000, 1, utest_count_cb, &every);
+    CU_ASSERT(id_once >= 0);
+    CU_ASSERT(id_every >= 0);
+
+    for(i=0; i < 20; i++)
+        CU_ASSERT(evloop_run_once(loop, 100000) >= 0);
+
+    CU_ASSERT(once == 1);
+    CU_ASSERT(every >= 10);
+
+    CU_ASSERT(evloop_del_timer(loop, id_once) == 0);
+    CU_ASSERT(evloop_del_timer(loop, id_every) == 0);
+    CU_ASSERT(evloop_del_timer(loop, id_every) == -1);
+
+    /* No timers or descriptors left, so only the wakeup can end this wait
+    */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    evloop_wakeup(loop);
+    CU_ASSERT(evloop_run_once(loop, 5000000) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    CU_ASSERT(t1.tv_sec - t0.tv_sec < 2);
+
+    evloop_free(loop);
+}
+
+DECLARE_UTEST(fd_events, "descriptor callbacks and removal during dispatch")
+{
+    evloop_t       *loop;
+    utest_pair_t    pair;
+    int             fds[2], reads = 0;
+
+    loop = evloop_new();
+    CU_ASSERT_FATAL(loop != NULL);
+
+    CU_ASSERT_FATAL(pipe(fds) == 0);
+    CU_ASSERT(evloop_add_fd(loop, fds[0], utest_count_cb, &reads) == 0);
+    CU_ASSERT(evloop_run_once(loop, 0) == 0);
+    CU_ASSERT(write(fds[1], "a", 1) == 1);
+    CU_ASSERT(evloop_run_once(loop, 1000000) == 1);
+    CU_ASSERT(reads == 1);
+    CU_ASSERT(evloop_del_fd(loop, fds[0]) == 0);
+    CU_ASSERT(write(fds[1], "b", 1) == 1);
+    CU_ASSERT(evloop_run_once(loop, 0) == 0);
+    CU_ASSERT(reads == 1);
+    close(fds[0]);
+    close(fds[1]);
+
+    /* Both descriptors are ready in the same pass, but whichever callback
+     * runs first removes the other.
+    */
+    memset(&pair, 0x0, sizeof(pair));
+    CU_ASSERT_FATAL(pipe(pair.fds[0]) == 0);
+    CU_ASSERT_FATAL(pipe(pair.fds[1]) == 0);
+    CU_ASSERT(evloop_add_fd(loop, pair.fds[0][0], utest_remove_other_cb, &pair) == 0);
+    CU_ASSERT(evloop_add_fd(loop, pair.fds[1][0], utest_remove_other_cb, &pair) == 0);
+    CU_ASSERT(write(pair.fds[0][1], "c", 1) == 1);
+    CU_ASSERT(write(pair.fds[1][1], "d", 1) == 1);
+    CU_ASSERT(evloop_run_once(loop, 1000000) == 1);
+    CU_ASSERT(pair.calls == 1);
+    close(pair.fds[0][0]);
+    close(pair.fds[0][1]);
+    close(pair.fds[1][0]);
+    close(pair.fds[1][1]);
+
+    evloop_free(loop);
+}
+
+int register_ts_event_loop(void)
+{
+    ts_init(&TEST_SUITE(event_loop), TEST_SUITE_DESCR(event_loop), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(event_loop), UTEST_FCT(timers_and_wakeup), UTEST_DESCR(timers_and_wakeup));
+    ts_add_utest(&TEST_SUITE(event_loop), UTEST_FCT(fd_events), UTEST_DESCR(fd_events));
+
+    return register_ts(&TEST_SUITE(event_loop));
+}
+#endif /* HAVE_C_UNIT_TESTS */
+
+/***EOF***/
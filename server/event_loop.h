@@ -0,0 +1,69 @@
+/*
+ *****************************************************************************
+ *
+ * File:    event_loop.h
+ *
+ * Purpose: Header file for event_loop.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+/* epoll(7) with timerfd and eventfd on Linux, poll(2) everywhere else.
+*/
+#if HAVE_SYS_EPOLL_H && HAVE_SYS_TIMERFD_H && HAVE_SYS_EVENTFD_H
+  #define EVLOOP_EPOLL 1
+#endif
+
+/* Events handled per evloop_run_once() call
+*/
+#define EVLOOP_MAX_EVENTS   64
+
+typedef struct evloop evloop_t;
+
+/* Called with the descriptor that became readable, or with -1 when a
+ * timer expires.
+*/
+typedef void (*evloop_cb_t)(evloop_t *loop, int fd, void *arg);
+
+/* Prototypes
+*/
+evloop_t *evloop_new(void);
+void evloop_free(evloop_t *loop);
+int evloop_add_fd(evloop_t *loop, const int fd, evloop_cb_t cb, void *arg);
+int evloop_del_fd(evloop_t *loop, const int fd);
+int evloop_add_timer(evloop_t *loop, const long usecs, const int repeat,
+        evloop_cb_t cb, void *arg);
+int evloop_del_timer(evloop_t *loop, const int timer_id);
+int evloop_run_once(evloop_t *loop, const long max_usecs);
+void evloop_wakeup(evloop_t *loop);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_event_loop(void);
+#endif
+
+#endif  /* EVENT_LOOP_H */
+
+/***EOF***/
@@ -636,6 +636,7 @@ int _run_extcmd_write(const char *cmd, const char *cmd_write, int *pid_status,
         /* don't use env
         */
         execvpe(argv_new[0], argv_new, (char * const *)NULL);
+        exit(EXTCMD_EXECUTION_ERROR);
     }
     else if(pid == -1)
     {
@@ -670,7 +671,7 @@ int _run_extcmd_write(const char *cmd, const char *cmd_write, int *pid_status,
             log_msg(LOG_ERR, "Could not write to cmd stdin");
             retval = -1;
         }
-        pclose(fd);
+        *pid_status = pclose(fd);
     }
 
 #endif
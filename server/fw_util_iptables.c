@@ -40,6 +40,15 @@
 #include "access.h"
 #include "service.h"
 
+#if HAVE_SYS_WAIT_H
+  #include <sys/wait.h>
+#endif
+
+#ifdef HAVE_C_UNIT_TESTS
+  #include "cunit_common.h"
+  DECLARE_TEST_SUITE(fw_util_iptables, "iptables rule transaction test suite");
+#endif
+
 static struct fw_config fwc;
 static char   cmd_buf[CMD_BUFSIZE];
 static char   err_buf[CMD_BUFSIZE];
@@ -50,6 +59,56 @@ static char   cmd_out[STANDARD_CMD_OUT_BUFSIZE];
 */
 static int have_ipt_chk_support = 1;
 
+/* Set by fw_initialize() when iptables-restore is found next to the
+ * iptables binary, in which case access rules are installed in
+ * transactions (see ipt_txn_begin()).
+*/
+static int  have_ipt_restore = 0;
+static char ipt_restore_cmd[MAX_PATH_LEN];
+
+/* An access rule, either waiting in the current transaction or added
+ * and waiting to expire.  The rule is kept in iptables-restore form
+ * (without the "-t <table>" prefix).
+*/
+typedef struct ipt_rule
+{
+    struct fw_chain    *chain;
+    char                rule[CMD_BUFSIZE];
+    char                srcip[MAX_IPV4_STR_LEN];
+    char                dstip[MAX_IPV4_STR_LEN];
+    unsigned int        port;
+    unsigned int        exp_ts;
+    const char         *msg;
+    int                 grant;
+} ipt_rule_t;
+
+/* Only the thread that makes the firewall changes (the main loop, or the
+ * actuator thread when the SPA pipeline is running) touches this.
+*/
+static struct ipt_txn
+{
+    int                 depth;
+    int                 grant;
+    ipt_rule_t     *rules;
+    int                 nb_rules;
+    int                 max_rules;
+} txn;
+
+/* The rules we have added, in a binary min-heap on the expire time.
+ * Expired rules are taken off the top and deleted without listing the
+ * chains, which only happens for the occasional deep check (at most
+ * once every RULES_RECONCILE_INTERVAL seconds).
+*/
+static struct ipt_expiry
+{
+    ipt_rule_t         *rules;
+    int                 nb_rules;
+    int                 max_rules;
+} expiry;
+
+static int      ipt_reconcile_interval = 0;
+static time_t   ipt_last_reconcile = 0;
+
 static void
 zero_cmd_buffers(void)
 {
@@ -872,9 +931,59 @@ set_fw_chain_conf(const int type, const char * const conf_str)
     return 1;
 }
 
+/* Access rules are installed with iptables-restore if it lives next to
+ * the iptables binary (including the iptables-legacy and iptables-nft
+ * variants).
+*/
+static void
+ipt_restore_chk_support(const fko_srv_options_t * const opts)
+{
+    char    restore_exe[MAX_PATH_LEN] = {0};
+    int     res;
+
+    have_ipt_restore = 0;
+
+    /* A truncated path could name some other binary, so only use the
+     * restore command if it fits completely
+    */
+    res = snprintf(restore_exe, sizeof(restore_exe), "%s-restore",
+            opts->fw_config->fw_command);
+    if(res < 0 || (size_t)res >= sizeof(restore_exe))
+    {
+        log_msg(LOG_INFO,
+                "iptables-restore path too long, adding firewall rules one at a time");
+        return;
+    }
+
+    if(access(restore_exe, X_OK) == 0)
+    {
+        res = snprintf(ipt_restore_cmd, sizeof(ipt_restore_cmd), "%s --noflush",
+                restore_exe);
+        if(res < 0 || (size_t)res >= sizeof(ipt_restore_cmd))
+        {
+            log_msg(LOG_INFO,
+                    "%s command too long, adding firewall rules one at a time",
+                    restore_exe);
+            return;
+        }
+        have_ipt_restore = 1;
+        log_msg(LOG_DEBUG, "ipt_restore_chk_support() using '%s'",
+                ipt_restore_cmd);
+    }
+    else
+    {
+        log_msg(LOG_INFO,
+                "%s not available, adding firewall rules one at a time",
+                restore_exe);
+    }
+    return;
+}
+
 int
 fw_config_init(fko_srv_options_t * const opts)
 {
+    int is_err;
+
     memset(&fwc, 0x0, sizeof(struct fw_config));
 
     /* Set our firewall exe command path (iptables in most cases).
@@ -932,6 +1041,15 @@ fw_config_init(fko_srv_options_t * const opts)
         fwc.use_destination = 1;
     }
 
+    ipt_last_reconcile = 0;
+    ipt_reconcile_interval = strtol_wrapper(opts->config[CONF_RULES_RECONCILE_INTERVAL],
+            0, RCHK_MAX_RULES_RECONCILE_INTERVAL, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid RULES_RECONCILE_INTERVAL");
+        return 0;
+    }
+
     /* Let us find it via our opts struct as well.
     */
     opts->fw_config = &fwc;
@@ -952,6 +1070,8 @@ fw_initialize(const fko_srv_options_t * const opts)
     else
         ipt_chk_support(opts);
 
+    ipt_restore_chk_support(opts);
+
     /* Flush the chains (just in case) so we can start fresh.
     */
     if(strncasecmp(opts->config[CONF_FLUSH_IPT_AT_INIT], "Y", 1) == 0)
@@ -987,6 +1107,17 @@ fw_initialize(const fko_srv_options_t * const opts)
 int
 fw_cleanup(const fko_srv_options_t * const opts)
 {
+    if(txn.rules != NULL)
+    {
+        free(txn.rules);
+        memset(&txn, 0x0, sizeof(txn));
+    }
+    if(expiry.rules != NULL)
+    {
+        free(expiry.rules);
+        memset(&expiry, 0x0, sizeof(expiry));
+    }
+
     if(strncasecmp(opts->config[CONF_FLUSH_IPT_AT_EXIT], "N", 1) == 0
             && opts->fw_flush == 0)
         return(0);
@@ -1026,6 +1157,560 @@ create_rule(const fko_srv_options_t * const opts,
     return res;
 }
 
+/* Turn one of the IPT_*_ARGS rule strings into iptables-restore form by
+ * dropping the "-t <table>" prefix and any shell redirection.
+*/
+static int
+ipt_restore_rule(const struct fw_chain * const chain,
+        const char * const rule_buf, char * const buf, const size_t buf_len)
+{
+    char        prefix[MAX_TABLE_NAME_LEN+8] = {0};
+    const char *rule;
+    size_t      len, redir_len = strlen(SH_REDIR);
+
+    snprintf(prefix, sizeof(prefix), "-t %s ", chain->table);
+    if(strncmp(rule_buf, prefix, strlen(prefix)) != 0)
+        return 0;
+
+    rule = rule_buf + strlen(prefix);
+    len  = strlen(rule);
+
+    if(redir_len > 0 && len >= redir_len
+            && strcmp(rule + len - redir_len, SH_REDIR) == 0)
+        len -= redir_len;
+
+    if(len == 0 || len >= buf_len)
+        return 0;
+
+    memcpy(buf, rule, len);
+    buf[len] = '\0';
+    return 1;
+}
+
+static void
+ipt_rule_init(ipt_rule_t * const r, struct fw_chain * const chain,
+        const char * const restore_rule, const char * const srcip,
+        const char * const dstip, const unsigned int port,
+        const unsigned int exp_ts, const char * const msg)
+{
+    memset(r, 0x0, sizeof(ipt_rule_t));
+
+    r->chain  = chain;
+    r->port   = port;
+    r->exp_ts = exp_ts;
+    r->msg    = msg;
+    r->grant  = txn.grant;
+    strlcpy(r->rule, restore_rule, sizeof(r->rule));
+    strlcpy(r->srcip, srcip, sizeof(r->srcip));
+    strlcpy(r->dstip, (dstip == NULL) ? IPT_ANY_IP : dstip, sizeof(r->dstip));
+    return;
+}
+
+/* Binary min-heap helpers for the expiry queue
+*/
+static int
+ipt_expiry_push(const ipt_rule_t * const r)
+{
+    ipt_rule_t  tmp, *rules;
+    int         i, parent, max;
+
+    if(expiry.nb_rules == expiry.max_rules)
+    {
+        max = expiry.max_rules ? expiry.max_rules * 2 : 64;
+        if((rules = realloc(expiry.rules, max * sizeof(ipt_rule_t))) == NULL)
+            return 0;
+        expiry.rules     = rules;
+        expiry.max_rules = max;
+    }
+
+    i = expiry.nb_rules++;
+    expiry.rules[i] = *r;
+
+    while(i > 0)
+    {
+        parent = (i - 1) / 2;
+        if(expiry.rules[parent].exp_ts <= expiry.rules[i].exp_ts)
+            break;
+        tmp = expiry.rules[parent];
+        expiry.rules[parent] = expiry.rules[i];
+        expiry.rules[i] = tmp;
+        i = parent;
+    }
+    return 1;
+}
+
+static void
+ipt_expiry_pop(ipt_rule_t * const r)
+{
+    ipt_rule_t  tmp;
+    int         i = 0, child;
+
+    *r = expiry.rules[0];
+    expiry.rules[0] = expiry.rules[--expiry.nb_rules];
+
+    while((child = 2 * i + 1) < expiry.nb_rules)
+    {
+        if(child + 1 < expiry.nb_rules
+                && expiry.rules[child+1].exp_ts < expiry.rules[child].exp_ts)
+            child++;
+        if(expiry.rules[i].exp_ts <= expiry.rules[child].exp_ts)
+            break;
+        tmp = expiry.rules[child];
+        expiry.rules[child] = expiry.rules[i];
+        expiry.rules[i] = tmp;
+        i = child;
+    }
+    return;
+}
+
+/* Whether we already added this rule.  The rule carries its expire time
+ * in the comment match, so only entries with the same chain and expire
+ * time need their rule text compared.
+*/
+static int
+ipt_rule_installed(const struct fw_chain * const chain,
+        const char * const restore_rule, const unsigned int exp_ts)
+{
+    int i;
+
+    for(i=0; i < expiry.nb_rules; i++)
+        if(expiry.rules[i].exp_ts == exp_ts
+                && expiry.rules[i].chain == chain
+                && strcmp(expiry.rules[i].rule, restore_rule) == 0)
+            return 1;
+
+    return 0;
+}
+
+static void
+ipt_rule_added(const ipt_rule_t * const r, const time_t now)
+{
+    struct fw_chain * const chain = r->chain;
+
+    log_msg(LOG_INFO, "Added %s rule to %s for %s -> %s port %d, expires at %u",
+        r->msg, chain->to_chain, r->srcip, r->dstip, r->port, r->exp_ts
+    );
+
+    chain->active_rules++;
+
+    /* Reset the next expected expire time for this chain if it
+    * is warranted.
+    */
+    if(chain->next_expire < now || r->exp_ts < chain->next_expire)
+        chain->next_expire = r->exp_ts;
+
+    /* A rule that can not be queued for expiry is still removed by the
+     * next deep check.
+    */
+    if(r->rule[0] != '\0' && ! ipt_expiry_push(r))
+        log_msg(LOG_ERR, "ipt_rule_added() realloc error, %s rule in %s left to the deep check",
+                r->msg, chain->to_chain);
+
+    return;
+}
+
+static void
+ipt_rule_removed(const ipt_rule_t * const r)
+{
+    log_msg(LOG_INFO, "Removed %s rule from %s for %s -> %s port %d with expire time of %u",
+        r->msg, r->chain->to_chain, r->srcip, r->dstip, r->port, r->exp_ts
+    );
+
+    if(r->chain->active_rules > 0)
+        r->chain->active_rules--;
+
+    return;
+}
+
+/* Add a single rule with its own iptables command (used outside of a
+ * transaction, or when iptables-restore is not available).
+*/
+static void
+ipt_add_rule_now(const fko_srv_options_t * const opts,
+        struct fw_chain * const chain,
+        const char * const rule_buf,
+        const unsigned int proto,
+        const char * const srcip,
+        const char * const dstip,
+        const unsigned int port,
+        const char * const nat_ip,
+        const unsigned int nat_port,
+        const unsigned int exp_ts,
+        const uint32_t mark,
+        const time_t now,
+        const char * const msg)
+{
+    char        restore_rule[CMD_BUFSIZE] = {0};
+    ipt_rule_t  r;
+
+    /* Check to make sure that the chain and jump rule exist
+    */
+    mk_chain(opts, chain->type);
+
+    if(rule_exists(opts, chain, rule_buf, proto, srcip,
+                dstip, port, nat_ip, nat_port, exp_ts, mark) == 0)
+    {
+        if(create_rule(opts, chain->to_chain, rule_buf))
+        {
+            ipt_restore_rule(chain, rule_buf, restore_rule, sizeof(restore_rule));
+            ipt_rule_init(&r, chain, restore_rule, srcip, dstip, port,
+                    exp_ts, msg);
+            ipt_rule_added(&r, now);
+        }
+    }
+
+    return;
+}
+
+/* Queue a rule in the current transaction, unless it is already in the
+ * transaction or one we added earlier.  The check is made against the
+ * expiry queue rather than with an iptables command per rule; a copy of
+ * the rule that was added behind our back is left for the deep check.
+*/
+static void
+ipt_txn_add(const fko_srv_options_t * const opts,
+        struct fw_chain * const chain,
+        const char * const rule_buf,
+        const unsigned int proto,
+        const char * const srcip,
+        const char * const dstip,
+        const unsigned int port,
+        const char * const nat_ip,
+        const unsigned int nat_port,
+        const unsigned int exp_ts,
+        const uint32_t mark,
+        const time_t now,
+        const char * const msg)
+{
+    char            restore_rule[CMD_BUFSIZE] = {0};
+    ipt_rule_t *r;
+    int             i, max;
+
+    if(txn.depth == 0 || ! have_ipt_restore
+            || ! ipt_restore_rule(chain, rule_buf, restore_rule, sizeof(restore_rule)))
+    {
+        ipt_add_rule_now(opts, chain, rule_buf, proto, srcip, dstip, port,
+                nat_ip, nat_port, exp_ts, mark, now, msg);
+        return;
+    }
+
+    for(i=0; i < txn.nb_rules; i++)
+        if(txn.rules[i].chain == chain
+                && strcmp(txn.rules[i].rule, restore_rule) == 0)
+            return;
+
+    if(ipt_rule_installed(chain, restore_rule, exp_ts))
+        return;
+
+    if(txn.nb_rules == txn.max_rules)
+    {
+        max = txn.max_rules ? txn.max_rules * 2 : 16;
+        if((r = realloc(txn.rules, max * sizeof(ipt_rule_t))) == NULL)
+        {
+            log_msg(LOG_ERR, "ipt_txn_add() realloc error, adding rule directly");
+            ipt_add_rule_now(opts, chain, rule_buf, proto, srcip, dstip, port,
+                    nat_ip, nat_port, exp_ts, mark, now, msg);
+            return;
+        }
+        txn.rules     = r;
+        txn.max_rules = max;
+    }
+
+    ipt_rule_init(&(txn.rules[txn.nb_rules++]), chain, restore_rule,
+            srcip, dstip, port, exp_ts, msg);
+
+    return;
+}
+
+/* Build the iptables-restore input for rules [first, last): one
+ * "*table ... COMMIT" section per table with every rule prefixed by
+ * action ("-A" or "-D").  Only the given table is written if table is
+ * not NULL.  The caller frees the returned buffer.
+*/
+static char *
+ipt_rules_script(const ipt_rule_t * const rules, const int first,
+        const int last, const char * const table, const char * const action)
+{
+    const char *tbl;
+    char       *script;
+    size_t      size, off = 0;
+    int         i, j, seen;
+
+    size = (size_t)(last - first)
+        * (CMD_BUFSIZE + MAX_CHAIN_NAME_LEN + MAX_TABLE_NAME_LEN + 32) + 1;
+
+    if((script = calloc(1, size)) == NULL)
+        return NULL;
+
+    for(i=first; i < last; i++)
+    {
+        tbl = rules[i].chain->table;
+
+        if(table != NULL && strcmp(tbl, table) != 0)
+            continue;
+
+        for(seen=0, j=first; j < i && ! seen; j++)
+            if(strcmp(rules[j].chain->table, tbl) == 0)
+                seen = 1;
+        if(seen)
+            continue;
+
+        off += snprintf(script+off, size-off, "*%s\n", tbl);
+        for(j=i; j < last; j++)
+            if(strcmp(rules[j].chain->table, tbl) == 0)
+                off += snprintf(script+off, size-off, "%s %s %s\n", action,
+                        rules[j].chain->to_chain, rules[j].rule);
+        off += snprintf(script+off, size-off, "COMMIT\n");
+    }
+
+    return script;
+}
+
+static int
+ipt_restore(const fko_srv_options_t * const opts, const char * const script)
+{
+    int res;
+
+    res = run_extcmd_write(ipt_restore_cmd, script, &pid_status, opts);
+
+    log_msg(LOG_DEBUG, "ipt_restore() CMD: '%s' (res: %d, status: %d) input:\n%s",
+        ipt_restore_cmd, res, pid_status, script);
+
+    return(EXTCMD_IS_SUCCESS(res)
+            && WIFEXITED(pid_status) && WEXITSTATUS(pid_status) == 0);
+}
+
+/* iptables-restore commits each table on its own, so after a failure
+ * the tables ahead of the one that failed may already hold our rules.
+ * Delete them a table at a time: a table that never got the rules
+ * fails to restore as a whole and is left as it is.
+*/
+static void
+ipt_txn_rollback(const fko_srv_options_t * const opts,
+        const int first, const int last)
+{
+    char   *script;
+    int     i, j, seen;
+
+    for(i=first; i < last; i++)
+    {
+        for(seen=0, j=first; j < i && ! seen; j++)
+            if(strcmp(txn.rules[j].chain->table, txn.rules[i].chain->table) == 0)
+                seen = 1;
+        if(seen)
+            continue;
+
+        if((script = ipt_rules_script(txn.rules, first, last,
+                        txn.rules[i].chain->table, "-D")) == NULL)
+            continue;
+
+        if(ipt_restore(opts, script))
+            log_msg(LOG_WARNING, "Rolled back fwknop rules in the %s table",
+                    txn.rules[i].chain->table);
+        free(script);
+    }
+    return;
+}
+
+/* Apply rules [first, last) with one iptables-restore run.  If that
+ * fails, our chains or jump rules may have been removed from under us,
+ * so put them back and try once more.
+*/
+static int
+ipt_txn_apply(const fko_srv_options_t * const opts,
+        const int first, const int last)
+{
+    char       *script;
+    time_t      now;
+    int         i, ok, chains_done[NUM_FWKNOP_ACCESS_TYPES] = {0};
+
+    if((script = ipt_rules_script(txn.rules, first, last, NULL, "-A")) == NULL)
+    {
+        log_msg(LOG_ERR, "ipt_txn_apply() calloc error");
+        return 0;
+    }
+
+    if(! (ok = ipt_restore(opts, script)))
+    {
+        ipt_txn_rollback(opts, first, last);
+
+        for(i=first; i < last; i++)
+        {
+            if(chains_done[txn.rules[i].chain->type])
+                continue;
+            mk_chain(opts, txn.rules[i].chain->type);
+            chains_done[txn.rules[i].chain->type] = 1;
+        }
+
+        if(! (ok = ipt_restore(opts, script)))
+        {
+            ipt_txn_rollback(opts, first, last);
+            log_msg(LOG_ERR,
+                "ipt_txn_apply() Error from cmd:'%s', %d rule(s) for %s not added",
+                ipt_restore_cmd, last - first, txn.rules[first].srcip);
+        }
+    }
+    free(script);
+
+    if(ok)
+    {
+        time(&now);
+        for(i=first; i < last; i++)
+            ipt_rule_added(&(txn.rules[i]), now);
+    }
+
+    return ok;
+}
+
+/* Delete one rule by its specification (used when there is no
+ * iptables-restore, or when a batched delete fails because a rule has
+ * been removed from under us).
+*/
+static void
+ipt_delete_rule(const fko_srv_options_t * const opts,
+        const ipt_rule_t * const r)
+{
+    int res;
+
+    zero_cmd_buffers();
+
+    res = snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_DEL_RULE_SPEC_ARGS,
+        opts->fw_config->fw_command,
+        r->chain->table,
+        r->chain->to_chain,
+        r->rule
+    );
+
+    /* A truncated command could delete some other rule, so leave this
+     * one for the deep check.
+    */
+    if(res < 0 || res >= CMD_BUFSIZE-1)
+    {
+        log_msg(LOG_ERR,
+            "ipt_delete_rule() command too long, expired %s rule for %s in %s not deleted",
+            r->msg, r->srcip, r->chain->to_chain);
+        return;
+    }
+
+    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE,
+            WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
+    chop_newline(err_buf);
+
+    log_msg(LOG_DEBUG, "ipt_delete_rule() CMD: '%s' (res: %d, err: %s)",
+        cmd_buf, res, err_buf);
+
+    if(EXTCMD_IS_SUCCESS(res) && err_buf[0] == '\0')
+        ipt_rule_removed(r);
+    else
+    {
+        log_msg(LOG_WARNING,
+            "Expired %s rule for %s in %s is already gone (err: %s)",
+            r->msg, r->srcip, r->chain->to_chain, err_buf);
+
+        if(r->chain->active_rules > 0)
+            r->chain->active_rules--;
+    }
+    return;
+}
+
+/* Take every expired rule off the expiry queue and delete them all with
+ * one iptables-restore.  If that fails (some rule was removed behind our
+ * back), fall back to deleting them one at a time.
+*/
+static void
+ipt_expire_rules(const fko_srv_options_t * const opts, const time_t now)
+{
+    ipt_rule_t *expired = NULL, *tmp;
+    char       *script = NULL;
+    int         i, nb = 0, max = 0, ok = 0;
+
+    while(expiry.nb_rules > 0 && expiry.rules[0].exp_ts <= now)
+    {
+        if(nb == max)
+        {
+            max = max ? max * 2 : 16;
+            if((tmp = realloc(expired, max * sizeof(ipt_rule_t))) == NULL)
+            {
+                log_msg(LOG_ERR, "ipt_expire_rules() realloc error");
+                break;
+            }
+            expired = tmp;
+        }
+        ipt_expiry_pop(&(expired[nb++]));
+    }
+
+    if(nb == 0)
+    {
+        free(expired);
+        return;
+    }
+
+    if(have_ipt_restore
+            && (script = ipt_rules_script(expired, 0, nb, NULL, "-D")) != NULL)
+        ok = ipt_restore(opts, script);
+
+    for(i=0; i < nb; i++)
+    {
+        if(ok)
+            ipt_rule_removed(&(expired[i]));
+        else
+            ipt_delete_rule(opts, &(expired[i]));
+    }
+
+    free(script);
+    free(expired);
+    return;
+}
+
+/* Start collecting access rules instead of adding them one by one.
+ * Transactions nest; the rules go in when the outermost one is
+ * committed, so a caller can wrap several grants in one.
+*/
+void
+ipt_txn_begin(void)
+{
+    txn.depth++;
+    txn.grant++;
+    return;
+}
+
+/* Install the rules collected since the outermost ipt_txn_begin().  All
+ * of the rules go in with a single iptables-restore, and if that fails
+ * the grants are retried one at a time so that a bad one does not hold
+ * up the rest.  Returns 1 if every rule was added.
+*/
+int
+ipt_txn_commit(const fko_srv_options_t * const opts)
+{
+    int first, last, rv = 1;
+
+    if(txn.depth == 0)
+        return 0;
+
+    if(--txn.depth > 0 || txn.nb_rules == 0)
+        return 1;
+
+    if(! ipt_txn_apply(opts, 0, txn.nb_rules))
+    {
+        if(txn.rules[0].grant == txn.rules[txn.nb_rules-1].grant)
+            rv = 0;
+        else
+        {
+            for(first=0; first < txn.nb_rules; first=last)
+            {
+                for(last=first+1; last < txn.nb_rules
+                        && txn.rules[last].grant == txn.rules[first].grant; last++)
+                    ;
+                if(! ipt_txn_apply(opts, first, last))
+                    rv = 0;
+            }
+        }
+    }
+
+    txn.nb_rules = 0;
+    return rv;
+}
+
 static void
 connmark_rule(const fko_srv_options_t * const opts,
         const char * const complete_rule_buf,
@@ -1064,29 +1749,8 @@ connmark_rule(const fko_srv_options_t * const opts,
         );
     }
 
-    /* Check to make sure that the chain and jump rule exist
-    */
-    mk_chain(opts, chain->type);
-
-    if(rule_exists(opts, chain, rule_buf, proto, srcip,
-                dstip, port, nat_ip, nat_port, exp_ts, mark) == 0)
-    {
-        if(create_rule(opts, chain->to_chain, rule_buf))
-        {
-            log_msg(LOG_INFO, "Added %s rule to %s for %s -> %s port %d, expires at %u",
-                msg, chain->to_chain, srcip, (dstip == NULL) ? IPT_ANY_IP : dstip,
-                port, exp_ts
-            );
-
-            chain->active_rules++;
-
-            /* Reset the next expected expire time for this chain if it
-            * is warranted.
-            */
-            if(chain->next_expire < now || exp_ts < chain->next_expire)
-                chain->next_expire = exp_ts;
-        }
-    }
+    ipt_txn_add(opts, chain, rule_buf, proto, srcip, dstip, port,
+            nat_ip, nat_port, exp_ts, mark, now, msg);
 
     return;
 }
@@ -1130,29 +1794,8 @@ ipt_rule(const fko_srv_options_t * const opts,
         );
     }
 
-    /* Check to make sure that the chain and jump rule exist
-    */
-    mk_chain(opts, chain->type);
-
-    if(rule_exists(opts, chain, rule_buf, proto, srcip,
-                dstip, port, nat_ip, nat_port, exp_ts, 0) == 0)
-    {
-        if(create_rule(opts, chain->to_chain, rule_buf))
-        {
-            log_msg(LOG_INFO, "Added %s rule to %s for %s -> %s port %d, expires at %u",
-                msg, chain->to_chain, srcip, (dstip == NULL) ? IPT_ANY_IP : dstip,
-                port, exp_ts
-            );
-
-            chain->active_rules++;
-
-            /* Reset the next expected expire time for this chain if it
-            * is warranted.
-            */
-            if(chain->next_expire < now || exp_ts < chain->next_expire)
-                chain->next_expire = exp_ts;
-        }
-    }
+    ipt_txn_add(opts, chain, rule_buf, proto, srcip, dstip, port,
+            nat_ip, nat_port, exp_ts, 0, now, msg);
 
     return;
 }
@@ -1405,10 +2048,8 @@ static void snat_rule(const fko_srv_options_t * const opts,
 
 /****************************************************************************/
 
-/* Rule Processing - Create an access request...
-*/
-int
-process_spa_request(const fko_srv_options_t * const opts,
+static int
+add_access_rules(const fko_srv_options_t * const opts,
         const acc_stanza_t * const acc, spa_data_t * const spadat)
 {
     char            nat_ip[MAX_IPV4_STR_LEN] = {0};
@@ -1698,6 +2339,23 @@ process_spa_request(const fko_srv_options_t * const opts,
     return(res);
 }
 
+/* Rule Processing - Create an access request...
+ *
+ * The rules for the request are added as one transaction.
+*/
+int
+process_spa_request(const fko_srv_options_t * const opts,
+        const acc_stanza_t * const acc, spa_data_t * const spadat)
+{
+    int res;
+
+    ipt_txn_begin();
+    res = add_access_rules(opts, acc, spadat);
+    ipt_txn_commit(opts);
+
+    return(res);
+}
+
 static void
 rm_expired_rules(const fko_srv_options_t * const opts,
         const char * const ipt_output_buf,
@@ -1867,6 +2525,18 @@ check_firewall_rules(const fko_srv_options_t * const opts,
 
     time(&now);
 
+    ipt_expire_rules(opts, now);
+
+    /* The rules we added are all in the expiry queue, so the chains only
+     * need to be listed for the deep check, which also catches expired
+     * rules that were added by someone else or before a restart.
+    */
+    if(! chk_rm_all || (ipt_last_reconcile > 0
+                && now - ipt_last_reconcile < ipt_reconcile_interval))
+        return;
+
+    ipt_last_reconcile = now;
+
     /* Iterate over each chain and look for active rules to delete.
     */
     for(i=0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
@@ -1968,6 +2638,268 @@ validate_ipt_chain_conf(const char * const chain_str)
     return rv;
 }
 
+#ifdef HAVE_C_UNIT_TESTS
+
+/* Stand-in for iptables-restore: logs its input and fails on any input
+ * that mentions a bad address.
+*/
+#define UTEST_RESTORE_SH \
+    "#!/bin/sh\n" \
+    "in=$(cat)\n" \
+    "printf '%%s\\n' \"$in\" >> %s/input\n" \
+    "case \"$in\" in *192.0.2.99*) exit 1;; esac\n" \
+    "exit 0\n"
+
+static fko_srv_options_t utest_opts;
+static char utest_dir[] = "/tmp/fwknopd_utest.XXXXXX";
+
+DECLARE_TEST_SUITE_INIT(fw_util_iptables)
+{
+    char    path[MAX_PATH_LEN];
+    FILE   *fp;
+
+    if(mkdtemp(utest_dir) == NULL)
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/restore", utest_dir);
+    if((fp = fopen(path, "w")) == NULL)
+        return -1;
+    fprintf(fp, UTEST_RESTORE_SH, utest_dir);
+    fclose(fp);
+    chmod(path, S_IRWXU);
+
+    memset(&utest_opts, 0x0, sizeof(utest_opts));
+    memset(&fwc, 0x0, sizeof(fwc));
+    strlcpy(fwc.fw_command, "/bin/echo", sizeof(fwc.fw_command));
+
+    fwc.chain[IPT_INPUT_ACCESS].type = IPT_INPUT_ACCESS;
+    strlcpy(fwc.chain[IPT_INPUT_ACCESS].table, "filter", MAX_TABLE_NAME_LEN);
+    strlcpy(fwc.chain[IPT_INPUT_ACCESS].to_chain, "FWKNOP_INPUT", MAX_CHAIN_NAME_LEN);
+    strlcpy(fwc.chain[IPT_INPUT_ACCESS].target, "ACCEPT", MAX_TARGET_NAME_LEN);
+
+    fwc.chain[IPT_DNAT_ACCESS].type = IPT_DNAT_ACCESS;
+    strlcpy(fwc.chain[IPT_DNAT_ACCESS].table, "nat", MAX_TABLE_NAME_LEN);
+    strlcpy(fwc.chain[IPT_DNAT_ACCESS].to_chain, "FWKNOP_PREROUTING", MAX_CHAIN_NAME_LEN);
+    strlcpy(fwc.chain[IPT_DNAT_ACCESS].target, "DNAT", MAX_TARGET_NAME_LEN);
+
+    utest_opts.fw_config = &fwc;
+
+    snprintf(ipt_restore_cmd, sizeof(ipt_restore_cmd), "%s", path);
+    have_ipt_restore = 1;
+
+    return 0;
+}
+
+DECLARE_TEST_SUITE_CLEANUP(fw_util_iptables)
+{
+    char    path[MAX_PATH_LEN];
+
+    snprintf(path, sizeof(path), "%s/restore", utest_dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/input", utest_dir);
+    unlink(path);
+    rmdir(utest_dir);
+
+    free(txn.rules);
+    memset(&txn, 0x0, sizeof(txn));
+    free(expiry.rules);
+    memset(&expiry, 0x0, sizeof(expiry));
+    have_ipt_restore = 0;
+    return 0;
+}
+
+static void
+utest_add_access_exp(const char * const srcip, const unsigned int port,
+        const time_t now, const unsigned int exp_ts)
+{
+    struct fw_chain    *chain = &fwc.chain[IPT_INPUT_ACCESS];
+    char                rule_buf[CMD_BUFSIZE] = {0};
+
+    snprintf(rule_buf, CMD_BUFSIZE-1, IPT_RULE_ARGS, chain->table,
+        IPPROTO_TCP, srcip, IPT_ANY_IP, port, exp_ts, chain->target);
+
+    ipt_txn_add(&utest_opts, chain, rule_buf, IPPROTO_TCP, srcip,
+        IPT_ANY_IP, port, NULL, NAT_ANY_PORT, exp_ts, 0, now, "access");
+}
+
+static void
+utest_add_access(const char * const srcip, const unsigned int port,
+        const time_t now)
+{
+    utest_add_access_exp(srcip, port, now, (unsigned int)now + 30);
+}
+
+/* Number of lines in the restore input log that start with prefix
+*/
+static int
+utest_count_input(const char * const prefix)
+{
+    char    path[MAX_PATH_LEN], line[CMD_BUFSIZE*2];
+    FILE   *fp;
+    int     n = 0;
+
+    snprintf(path, sizeof(path), "%s/input", utest_dir);
+    if((fp = fopen(path, "r")) == NULL)
+        return 0;
+    while(fgets(line, sizeof(line), fp) != NULL)
+        if(strncmp(line, prefix, strlen(prefix)) == 0)
+            n++;
+    fclose(fp);
+    return n;
+}
+
+DECLARE_UTEST(txn_script, "rules are grouped into one restore input per transaction")
+{
+    struct fw_chain    *dnat = &fwc.chain[IPT_DNAT_ACCESS];
+    char                rule_buf[CMD_BUFSIZE] = {0};
+    char                expected[1024];
+    char               *script;
+    const time_t        now = 1000;
+
+    ipt_txn_begin();
+    utest_add_access("192.0.2.1", 22, now);
+
+    snprintf(rule_buf, CMD_BUFSIZE-1, IPT_DNAT_RULE_ARGS, dnat->table,
+        IPPROTO_TCP, "192.0.2.1", IPT_ANY_IP, 2222, 1030, dnat->target,
+        "10.0.0.2", 22);
+    ipt_txn_add(&utest_opts, dnat, rule_buf, IPPROTO_TCP, "192.0.2.1",
+        IPT_ANY_IP, 2222, "10.0.0.2", 22, 1030, 0, now, "DNAT");
+
+    utest_add_access("192.0.2.1", 443, now);
+    utest_add_access("192.0.2.1", 22, now);   /* duplicate */
+    CU_ASSERT(txn.nb_rules == 3);
+
+    snprintf(expected, sizeof(expected),
+        "*filter\n"
+        "-A FWKNOP_INPUT -p 6 -s 192.0.2.1 -d 0.0.0.0/0 --dport 22 -m comment --comment _exp_1030 -j ACCEPT\n"
+        "-A FWKNOP_INPUT -p 6 -s 192.0.2.1 -d 0.0.0.0/0 --dport 443 -m comment --comment _exp_1030 -j ACCEPT\n"
+        "COMMIT\n"
+        "*nat\n"
+        "-A FWKNOP_PREROUTING -p 6 -s 192.0.2.1 -d 0.0.0.0/0 --dport 2222 -m comment --comment _exp_1030 -j DNAT --to-destination 10.0.0.2:22\n"
+        "COMMIT\n");
+
+    script = ipt_rules_script(txn.rules, 0, txn.nb_rules, NULL, "-A");
+    CU_ASSERT_FATAL(script != NULL);
+    CU_ASSERT(strcmp(script, expected) == 0);
+    free(script);
+
+    script = ipt_rules_script(txn.rules, 0, txn.nb_rules, "nat", "-D");
+    CU_ASSERT_FATAL(script != NULL);
+    CU_ASSERT(strncmp(script, "*nat\n-D FWKNOP_PREROUTING ", 26) == 0);
+    free(script);
+
+    CU_ASSERT(ipt_txn_commit(&utest_opts) == 1);
+    CU_ASSERT(txn.nb_rules == 0);
+    CU_ASSERT(fwc.chain[IPT_INPUT_ACCESS].active_rules == 2);
+    CU_ASSERT(fwc.chain[IPT_DNAT_ACCESS].active_rules == 1);
+    CU_ASSERT(fwc.chain[IPT_INPUT_ACCESS].next_expire == 1030);
+
+    /* Rules that are already in place are not queued again
+    */
+    ipt_txn_begin();
+    utest_add_access("192.0.2.1", 22, now);
+    utest_add_access("192.0.2.1", 22, now + 1);
+    CU_ASSERT(txn.nb_rules == 1);
+    CU_ASSERT(ipt_txn_commit(&utest_opts) == 1);
+    CU_ASSERT(fwc.chain[IPT_INPUT_ACCESS].active_rules == 3);
+}
+
+DECLARE_UTEST(txn_batch_split, "a failing grant does not hold up the rest of a batch")
+{
+    const time_t    now = 2000;
+
+    fwc.chain[IPT_INPUT_ACCESS].active_rules = 0;
+
+    ipt_txn_begin();
+
+    ipt_txn_begin();
+    utest_add_access("192.0.2.10", 22, now);
+    CU_ASSERT(ipt_txn_commit(&utest_opts) == 1);
+
+    ipt_txn_begin();
+    utest_add_access("192.0.2.99", 22, now);
+    utest_add_access("192.0.2.99", 80, now);
+    CU_ASSERT(ipt_txn_commit(&utest_opts) == 1);
+
+    ipt_txn_begin();
+    utest_add_access("192.0.2.11", 22, now);
+    CU_ASSERT(ipt_txn_commit(&utest_opts) == 1);
+
+    /* Nothing has been applied until the outer transaction is done
+    */
+    CU_ASSERT(txn.nb_rules == 4);
+    CU_ASSERT(fwc.chain[IPT_INPUT_ACCESS].active_rules == 0);
+
+    CU_ASSERT(ipt_txn_commit(&utest_opts) == 0);
+    CU_ASSERT(fwc.chain[IPT_INPUT_ACCESS].active_rules == 2);
+
+    /* Outside of a transaction there is nothing to commit
+    */
+    CU_ASSERT(ipt_txn_commit(&utest_opts) == 0);
+}
+
+DECLARE_UTEST(expiry_queue, "expired rules are deleted in one batch in expiry order")
+{
+    const unsigned int  exp_ts[] = { 3050, 3010, 3040, 3020, 3060, 3030, 3010 };
+    const int           nb = sizeof(exp_ts) / sizeof(exp_ts[0]);
+    char                srcip[MAX_IPV4_STR_LEN];
+    ipt_rule_t          r;
+    unsigned int        last;
+    int                 i, dels;
+
+    free(expiry.rules);
+    memset(&expiry, 0x0, sizeof(expiry));
+    fwc.chain[IPT_INPUT_ACCESS].active_rules = 0;
+
+    ipt_txn_begin();
+    for(i=0; i < nb; i++)
+    {
+        snprintf(srcip, sizeof(srcip), "192.0.2.%d", 100 + i);
+        utest_add_access_exp(srcip, 22, 3000, exp_ts[i]);
+    }
+    CU_ASSERT(ipt_txn_commit(&utest_opts) == 1);
+    CU_ASSERT(expiry.nb_rules == nb);
+    CU_ASSERT(fwc.chain[IPT_INPUT_ACCESS].active_rules == nb);
+
+    /* Nothing is due yet
+    */
+    dels = utest_count_input("-D ");
+    ipt_expire_rules(&utest_opts, 3009);
+    CU_ASSERT(expiry.nb_rules == nb);
+    CU_ASSERT(utest_count_input("-D ") == dels);
+
+    /* The three rules that expire by 3020 go in a single restore run
+    */
+    dels = utest_count_input("-D ");
+    i = utest_count_input("*filter");
+    ipt_expire_rules(&utest_opts, 3020);
+    CU_ASSERT(expiry.nb_rules == nb - 3);
+    CU_ASSERT(utest_count_input("-D ") == dels + 3);
+    CU_ASSERT(utest_count_input("*filter") == i + 1);
+    CU_ASSERT(fwc.chain[IPT_INPUT_ACCESS].active_rules == nb - 3);
+
+    /* What is left comes off the heap in order
+    */
+    for(last=0; expiry.nb_rules > 0; last=r.exp_ts)
+    {
+        ipt_expiry_pop(&r);
+        CU_ASSERT(r.exp_ts >= last);
+        CU_ASSERT(r.exp_ts > 3020);
+    }
+}
+
+int register_ts_fw_util_iptables(void)
+{
+    ts_init(&TEST_SUITE(fw_util_iptables), TEST_SUITE_DESCR(fw_util_iptables),
+            TEST_SUITE_INIT(fw_util_iptables), TEST_SUITE_CLEANUP(fw_util_iptables));
+    ts_add_utest(&TEST_SUITE(fw_util_iptables), UTEST_FCT(txn_script), UTEST_DESCR(txn_script));
+    ts_add_utest(&TEST_SUITE(fw_util_iptables), UTEST_FCT(txn_batch_split), UTEST_DESCR(txn_batch_split));
+    ts_add_utest(&TEST_SUITE(fw_util_iptables), UTEST_FCT(expiry_queue), UTEST_DESCR(expiry_queue));
+
+    return register_ts(&TEST_SUITE(fw_util_iptables));
+}
+#endif /* HAVE_C_UNIT_TESTS */
+
 #endif /* FIREWALL_IPTABLES */
 
 /***EOF***/
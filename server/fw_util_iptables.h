@@ -58,6 +58,7 @@
 #define IPT_TMP_CHK_RULE_ARGS   "-t %s -I %s %i -s " DUMMY_IP " -p udp -j %s" SH_REDIR
 #define IPT_TMP_VERIFY_CHK_ARGS "-t %s -C %s -s " DUMMY_IP " -p udp -j %s" SH_REDIR
 #define IPT_DEL_RULE_ARGS       "-t %s -D %s %i" SH_REDIR
+#define IPT_DEL_RULE_SPEC_ARGS  "-t %s -D %s %s" SH_REDIR
 #define IPT_NEW_CHAIN_ARGS      "-t %s -N %s" SH_REDIR
 #define IPT_FLUSH_CHAIN_ARGS    "-t %s -F %s" SH_REDIR
 #define IPT_CHAIN_EXISTS_ARGS   "-t %s -L %s -n" SH_REDIR
@@ -70,6 +71,12 @@
 #define IPT_ANY_IP              "0.0.0.0/0"
 
 int validate_ipt_chain_conf(const char * const chain_str);
+void ipt_txn_begin(void);
+int ipt_txn_commit(const fko_srv_options_t * const opts);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_fw_util_iptables(void);
+#endif
 
 #endif /* FW_UTIL_IPTABLES_H */
 
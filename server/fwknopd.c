@@ -46,6 +46,10 @@
 #include "connection_tracker.h"
 #include "control_client.h"
 #include "service.h"
+#include "spa_pipeline.h"
+#include "blacklist.h"
+#include "rate_limit.h"
+#include "spa_stage.h"
 #include <pthread.h>
 
 #if USE_LIBPCAP
@@ -186,6 +190,17 @@ main(int argc, char **argv)
                 clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
         }
 
+        /* Compile the BLACKLIST before any packets come in.
+        */
+        if(blacklist_load(&opts) != FWKNOPD_SUCCESS)
+            clean_exit(&opts, NO_FW_CLEANUP, EXIT_FAILURE);
+
+        if(rate_limit_init(&opts) != FWKNOPD_SUCCESS)
+            clean_exit(&opts, NO_FW_CLEANUP, EXIT_FAILURE);
+
+        if(spa_stage_init(&opts) != FWKNOPD_SUCCESS)
+            clean_exit(&opts, NO_FW_CLEANUP, EXIT_FAILURE);
+
         /* Show config (including access.conf vars) and exit dump config was
          * wanted.
         */
@@ -313,7 +328,17 @@ main(int argc, char **argv)
         if(!opts.enable_udp_server
                 && strncasecmp(opts.config[CONF_ENABLE_UDP_SERVER], "N", 1) == 0)
         {
+            /* Started after the TCP server has been forked off so that the
+             * threads only exist in this process.
+            */
+            if(spa_pipeline_start(&opts, 1) != 0)
+                clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
+
             pcap_capture(&opts);
+
+            /* Finish off any queued packets before the configs go away.
+            */
+            spa_pipeline_stop(&opts);
         }
 #endif
 
@@ -323,6 +348,11 @@ main(int argc, char **argv)
         if(handle_signals(&opts) == 1)
             break;
 
+        /* The digest cache is reopened by init_digest_cache() after the
+         * restart.
+        */
+        free_replay_list(&opts);
+
         restarted = 1;
     }
 
@@ -673,6 +703,8 @@ static int handle_signals(fko_srv_options_t *opts)
             dump_config(opts);
             dump_service_list(opts);
             dump_access_list(opts);
+            rate_limit_dump(opts);
+            spa_stage_dump(opts);
         }
         else
         {
@@ -93,11 +93,16 @@
 #define DEF_PCAP_DISPATCH_COUNT         "100"
 #define DEF_PCAP_LOOP_SLEEP             "100000" /* a tenth of a second (in microseconds) */
 #define DEF_ENABLE_PCAP_ANY_DIRECTION   "N"
+#define DEF_ENABLE_AF_PACKET_RING       "N"
+#define DEF_AF_PACKET_RING_BLOCKS       "32"
 #define DEF_EXIT_AT_INTF_DOWN           "Y"
 #define DEF_ENABLE_SPA_PACKET_AGING     "Y"
 #define DEF_MAX_SPA_PACKET_AGE          "120"
 #define DEF_ENABLE_DIGEST_PERSISTENCE   "Y"
+#define DEF_DIGEST_SYNC_RECORDS         "64"
+#define DEF_DIGEST_SYNC_INTERVAL        "100" /* milliseconds */
 #define DEF_RULES_CHECK_THRESHOLD       "20"
+#define DEF_RULES_RECONCILE_INTERVAL    "30" /* seconds */
 #define DEF_MAX_SNIFF_BYTES             "1500"
 #define DEF_GPG_HOME_DIR                "/root/.gnupg"
 #ifdef  GPG_EXE
@@ -111,6 +116,7 @@
   #define DEF_SUDO_EXE                   "/usr/bin/sudo"
 #endif
 #define DEF_ENABLE_SPA_OVER_HTTP        "N"
+#define DEF_BLACKLIST_KERNEL_FILTER     "N"
 #define DEF_ENABLE_TCP_SERVER           "N"
 #define DEF_TCPSERV_PORT                "62201"
 #if USE_LIBPCAP
@@ -120,6 +126,13 @@
 #endif
 #define DEF_UDPSERV_PORT                "62201"
 #define DEF_UDPSERV_SELECT_TIMEOUT      "500000" /* half a second (in microseconds) */
+#define DEF_UDPSERV_BATCH_SIZE          "32"
+#define DEF_UDPSERV_SOCKETS             "1"
+#define DEF_SPA_WORKER_THREADS          "0" /* process packets on the capture thread */
+#define DEF_SPA_QUEUE_SIZE              "1024"
+#define DEF_SPA_RATE_LIMIT              "0" /* packets per second, 0 disables */
+#define DEF_SPA_RATE_BURST              "10"
+#define DEF_SPA_RATE_TABLE_SIZE         "4096"
 #define DEF_SYSLOG_IDENTITY             MY_NAME
 #define DEF_SYSLOG_FACILITY             "LOG_DAEMON"
 #define DEF_ENABLE_DESTINATION_RULE     "N"
@@ -136,17 +149,35 @@
 */
 #define RCHK_MAX_PCAP_LOOP_SLEEP        (2 << 22)
 #define RCHK_MAX_SPA_PACKET_AGE         100000  /* seconds, can disable */
+#define RCHK_MAX_DIGEST_SYNC_RECORDS    10000
+#define RCHK_MAX_DIGEST_SYNC_INTERVAL   3600000 /* milliseconds */
 #define RCHK_MAX_SNIFF_BYTES            (2 << 14)
 #define RCHK_MAX_TCPSERV_PORT           ((2 << 16) - 1)
 #define RCHK_MAX_UDPSERV_PORT           ((2 << 16) - 1)
 #define RCHK_MAX_UDPSERV_SELECT_TIMEOUT (2 << 22)
+#define RCHK_MAX_UDPSERV_BATCH_SIZE     1024
+#define RCHK_MAX_UDPSERV_SOCKETS        64
+#define RCHK_MAX_SPA_WORKER_THREADS     64
+#define RCHK_MAX_SPA_QUEUE_SIZE         65536
+#define RCHK_MAX_SPA_RATE_LIMIT         1000000
+#define RCHK_MAX_SPA_RATE_BURST         1000000
+#define RCHK_MAX_SPA_RATE_TABLE_SIZE    (1 << 22)
 #define RCHK_MAX_PCAP_DISPATCH_COUNT    (2 << 22)
+#define RCHK_MAX_AF_PACKET_RING_BLOCKS  1024
 #define RCHK_MAX_FW_TIMEOUT             (2 << 22) /* seconds */
 #define RCHK_MAX_CMD_CYCLE_TIMER        (2 << 22) /* seconds */
 #define RCHK_MIN_CMD_CYCLE_TIMER        1
 #define RCHK_MAX_RULES_CHECK_THRESHOLD  ((2 << 16) - 1)
+#define RCHK_MAX_RULES_RECONCILE_INTERVAL 86400 /* seconds */
 #define RCHK_MAX_WAIT_ACC_DATA          60
 
+/* Threads that may read the SDP access table: the SPA workers, the
+ * capture threads, plus the main and control client threads.  Any
+ * further reader falls back to taking the writer lock.
+*/
+#define MAX_ACC_TABLE_READERS   (RCHK_MAX_SPA_WORKER_THREADS \
+                                    + RCHK_MAX_UDPSERV_SOCKETS + 4)
+
 #define MIN_ACC_STANZA_HASH_TABLE_LENGTH  10
 #define MAX_ACC_STANZA_HASH_TABLE_LENGTH  10000
 #define DEF_ACC_HASH_TABLE_LENGTH             100
@@ -154,6 +185,8 @@
 #define MIN_SERVICE_HASH_TABLE_LENGTH     10
 #define MAX_SERVICE_HASH_TABLE_LENGTH     10000
 #define DEF_SERVICE_HASH_TABLE_LENGTH_STR         "20"
+#define MAX_HASH_TABLE_MAX_LOAD           1000
+#define DEF_HASH_TABLE_MAX_LOAD_STR       "100"
 
 
 /* FirewallD-specific defines
@@ -234,7 +267,6 @@
 #define MAX_SPA_PACKET_LEN      1500 /* --DSS check this? */
 #define MAX_HOSTNAME_LEN        64
 #define MAX_DECRYPTED_SPA_LEN   1024
-#define MAX_SDP_ID_STR_LEN 11
 
 /* The minimum possible valid SPA data size.
 */
@@ -258,20 +290,34 @@ enum {
     CONF_PCAP_DISPATCH_COUNT,
     CONF_PCAP_LOOP_SLEEP,
     CONF_ENABLE_PCAP_ANY_DIRECTION,
+    CONF_ENABLE_AF_PACKET_RING,
+    CONF_AF_PACKET_RING_BLOCKS,
     CONF_EXIT_AT_INTF_DOWN,
     CONF_MAX_SNIFF_BYTES,
     CONF_ENABLE_SPA_PACKET_AGING,
     CONF_MAX_SPA_PACKET_AGE,
     CONF_ENABLE_DIGEST_PERSISTENCE,
+    CONF_DIGEST_SYNC_RECORDS,
+    CONF_DIGEST_SYNC_INTERVAL,
     CONF_RULES_CHECK_THRESHOLD,
+    CONF_RULES_RECONCILE_INTERVAL,
     CONF_CMD_EXEC_TIMEOUT,
-    //CONF_BLACKLIST,
+    CONF_BLACKLIST,
+    CONF_BLACKLIST_FILE,
+    CONF_BLACKLIST_KERNEL_FILTER,
     CONF_ENABLE_SPA_OVER_HTTP,
     CONF_ENABLE_TCP_SERVER,
     CONF_TCPSERV_PORT,
     CONF_ENABLE_UDP_SERVER,
     CONF_UDPSERV_PORT,
     CONF_UDPSERV_SELECT_TIMEOUT,
+    CONF_UDPSERV_BATCH_SIZE,
+    CONF_UDPSERV_SOCKETS,
+    CONF_SPA_WORKER_THREADS,
+    CONF_SPA_QUEUE_SIZE,
+    CONF_SPA_RATE_LIMIT,
+    CONF_SPA_RATE_BURST,
+    CONF_SPA_RATE_TABLE_SIZE,
     CONF_LOCALE,
     CONF_SYSLOG_IDENTITY,
     CONF_SYSLOG_FACILITY,
@@ -350,6 +396,7 @@ enum {
     CONF_ALLOW_LEGACY_ACCESS_REQUESTS,
     CONF_ACC_STANZA_HASH_TABLE_LENGTH,
     CONF_SERVICE_HASH_TABLE_LENGTH,
+    CONF_HASH_TABLE_MAX_LOAD,
     CONF_DISABLE_SDP_CTRL_CLIENT,
     CONF_DISABLE_CONNECTION_TRACKING,
     CONF_CONN_ID_FILE,
@@ -404,6 +451,9 @@ typedef struct acc_service_list
 typedef struct acc_stanza
 {
     uint32_t             sdp_id;
+    unsigned int         refs;  /* SDP access table snapshots holding this stanza */
+    char                *json_src;  /* Controller stanza this was built from */
+    uint32_t             json_hash;
     char                *service_list_str;
     acc_service_list_t  *service_list;
     char                *source;
@@ -417,10 +467,12 @@ typedef struct acc_stanza
     char                *key;
     int                  key_len;
     char                *key_base64;
+    fko_enc_key_t        key_prep;
     char                *hmac_key;
     int                  hmac_key_len;
     char                *hmac_key_base64;
     int                  hmac_type;
+    fko_hmac_key_t       hmac_key_prep;
     unsigned char        use_rijndael;
     int                  fw_access_timeout;
     unsigned char        enable_cmd_exec;
@@ -471,6 +523,30 @@ typedef struct acc_stanza
     struct acc_stanza   *next;
 } acc_stanza_t;
 
+/* What a controller access or service message did to the table
+*/
+typedef struct ctrl_delta_stats
+{
+    unsigned int         added;
+    unsigned int         changed;
+    unsigned int         removed;
+    unsigned int         unchanged;
+} ctrl_delta_stats_t;
+
+/* A replaced SDP access table, freed once no reader entered before
+ * the epoch it was replaced in.  Other objects read under
+ * acc_table_read_lock() are retired with tbl NULL and a free_obj
+ * function.
+*/
+typedef struct acc_retired_table
+{
+    hash_table_t                *tbl;
+    void                        *obj;
+    void                       (*free_obj)(void *obj);
+    uint64_t                     epoch;
+    struct acc_retired_table    *next;
+} acc_retired_table_t;
+
 /* A simple linked list of strings for command open/close cycles
 */
 typedef struct cmd_cycle_list
@@ -642,7 +718,6 @@ typedef struct spa_pkt_info
     unsigned short  packet_src_port;
     unsigned short  packet_dst_port;
     uint32_t        sdp_id;
-    char            sdp_id_str[MAX_SDP_ID_STR_LEN];
     unsigned char   packet_data[MAX_SPA_PACKET_LEN+1];
 } spa_pkt_info_t;
 
@@ -719,11 +794,15 @@ typedef struct fko_srv_options
     int  hmac_type;
 
 #if USE_FILE_CACHE
-    struct digest_cache_list *digest_cache;   /* In-memory digest cache list */
+    struct digest_cache *digest_cache;   /* In-memory digest cache */
+#else
+    struct digest_db    *digest_db;      /* Open digest db and bloom filter */
 #endif
 
     spa_pkt_info_t  spa_pkt;            /* The current SPA packet */
 
+    struct spa_pipeline *spa_pipeline;  /* Worker threads, if enabled */
+
     /* Counter set from the command line to exit after the specified
      * number of SPA packets are processed.
     */
@@ -736,12 +815,39 @@ typedef struct fko_srv_options
     char           *config[NUMBER_OF_CONFIG_ENTRIES];
 
     acc_stanza_t   *acc_stanzas;       /* List of access stanzas for legacy mode */
-    hash_table_t   *acc_stanza_hash_tbl;  /* List of access stanzas for sdp mode */
-    pthread_mutex_t acc_hash_tbl_mutex;
+    struct acc_addr_index *acc_addr_index;  /* Address index over acc_stanzas */
+
+    /* Compiled BLACKLIST, replaced on reload, see blacklist.c
+    */
+    struct blacklist   *blacklist;
+    uint32_t            blacklist_gen;
+    uint64_t            blacklist_drops;
+
+    /* Per source token buckets, see rate_limit.c
+    */
+    struct rate_limit  *rate_limit;
+
+    /* Per stage packet counters and timings, see spa_stage.c
+    */
+    struct spa_stages  *spa_stages;
+
+    /* SDP mode access stanzas.  The published table is never modified,
+     * see acc_table_read_lock() in access.c.
+    */
+    hash_table_t   *acc_stanza_hash_tbl;
+    pthread_mutex_t acc_hash_tbl_mutex;   /* Serializes table updates */
+    uint64_t        acc_table_version;
+    uint64_t        acc_table_epoch;
+    uint64_t        acc_reader_epochs[MAX_ACC_TABLE_READERS];
+    int             acc_reader_count;
+    uint32_t        acc_reader_gen;
+    struct acc_retired_table *acc_retired_tbls;
+    ctrl_delta_stats_t acc_last_delta;    /* Last controller access message */
 
     hash_table_t   *service_hash_tbl;
     pthread_mutex_t service_hash_tbl_mutex;
     hash_table_t   *reverse_service_hash_tbl;
+    ctrl_delta_stats_t service_last_delta;  /* Last controller service message */
 
     /* The SDP Control Client
      */
@@ -773,7 +879,8 @@ typedef struct fko_srv_options
 #define FW_CLEANUP          1
 #define NO_FW_CLEANUP       0
 void clean_exit(fko_srv_options_t *opts,
-        unsigned int fw_cleanup_flag, unsigned int exit_status);
+        unsigned int fw_cleanup_flag, unsigned int exit_status)
+        __attribute__((noreturn));
 
 #endif /* FWKNOPD_COMMON_H */
 
@@ -2,6 +2,17 @@
 
 #include "fwknopd_common.h"
 #include "access.h"
+#include "service.h"
+#include "replay_cache.h"
+#include "spa_pipeline.h"
+#include "event_loop.h"
+#include "addr_trie.h"
+#include "blacklist.h"
+#include "rate_limit.h"
+#include "spa_stage.h"
+#include "conntrack_nl.h"
+#include "incoming_spa.h"
+#include "fw_util.h"
 
 /**
  * Register test suites from FKO files.
@@ -12,6 +23,19 @@
 static void register_test_suites(void)
 {
     register_ts_access();
+    register_ts_service();
+    register_ts_replay_cache();
+    register_ts_spa_pipeline();
+    register_ts_event_loop();
+    register_ts_addr_trie();
+    register_ts_blacklist();
+    register_ts_rate_limit();
+    register_ts_spa_stage();
+    register_ts_conntrack_nl();
+    register_ts_incoming_spa();
+#if FIREWALL_IPTABLES
+    register_ts_fw_util_iptables();
+#endif
 }
 
 /* The main() function for setting up and running the tests.
@@ -11,6 +11,16 @@
 #include "bstrlib.h"
 #include "dbg.h"
 
+#include <sys/mman.h>
+
+// Bucket arrays of at least this many bytes are mapped directly instead of
+// coming from malloc. Mapping costs the same at any size (pages are zeroed
+// as they are first used), and a drained old array can be given back
+// HASH_TABLE_UNMAP_CHUNK bytes at a time while a rehash moves past it, so
+// neither starting nor finishing a rehash depends on the table size.
+#define HASH_TABLE_MAP_MIN_BYTES (256 * 1024)
+#define HASH_TABLE_UNMAP_CHUNK (64 * 1024)
+
 /*
  * Func: default_compare
  * Args: void *a, void *b
@@ -55,6 +65,84 @@ static uint32_t default_hash(void *a)
     return hash;
 }
 
+/**
+ * Func: int_hash
+ * Args: const uint32_t key - the integer key to be hashed
+ * Expl: Hash used by integer keyed tables. A multiplicative (Fibonacci) hash so that
+ *       sequential IDs still spread over the buckets.
+ */
+static inline uint32_t int_hash(const uint32_t key)
+{
+    uint32_t hash = key * 2654435761U;
+
+    // fold the well mixed high bits into the low ones used by the modulo
+    return hash ^ (hash >> 16);
+}
+
+// max_load given to new tables, see hash_table_set_default_max_load
+static uint32_t default_max_load = HASH_TABLE_DEFAULT_MAX_LOAD;
+
+/**
+ * Func: hash_table_buckets_mapped
+ * Args: const uint32_t length - number of buckets in the array.
+ * Expl: Non-public function telling whether a bucket array of this length is mapped
+ *       rather than allocated with calloc.
+ */
+static int hash_table_buckets_mapped(const uint32_t length)
+{
+#ifdef MAP_ANONYMOUS
+    return (size_t)length * sizeof(hash_table_node_t *) >= HASH_TABLE_MAP_MIN_BYTES;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Func: hash_table_buckets_alloc
+ * Args: const uint32_t length - number of buckets in the array.
+ * Expl: Non-public function allocating an array of empty buckets. Returns NULL if
+ *       there is not enough memory.
+ */
+static hash_table_node_t **hash_table_buckets_alloc(const uint32_t length)
+{
+#ifdef MAP_ANONYMOUS
+    void *buckets = NULL;
+
+    if(hash_table_buckets_mapped(length))
+    {
+        buckets = mmap(NULL, (size_t)length * sizeof(hash_table_node_t *),
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return buckets == MAP_FAILED ? NULL : buckets;
+    }
+#endif
+    return calloc(length, sizeof(hash_table_node_t *));
+}
+
+/**
+ * Func: hash_table_buckets_free
+ * Args: hash_table_node_t **buckets, const uint32_t length - the array and its length.
+ *
+ *       const size_t released - bytes at the start of a mapped array that were
+ *           unmapped already, see hash_table_rehash_step.
+ *
+ * Expl: Non-public function freeing a bucket array from hash_table_buckets_alloc.
+ */
+static void hash_table_buckets_free(hash_table_node_t **buckets, const uint32_t length,
+        const size_t released)
+{
+#ifdef MAP_ANONYMOUS
+    size_t bytes = (size_t)length * sizeof(hash_table_node_t *);
+
+    if(hash_table_buckets_mapped(length))
+    {
+        if(released < bytes)
+            munmap((char *)buckets + released, bytes - released);
+        return;
+    }
+#endif
+    free(buckets);
+}
+
 
 /**
  * Func: hash_table_create
@@ -94,13 +182,14 @@ hash_table_t *hash_table_create(const uint32_t length, hash_table_compare compar
     check_mem(tbl);
 
     // Allocate memory for the array of pointers to buckets, i.e. first node in each bucket
-    tbl->buckets = calloc(final_length, sizeof(hash_table_node_t *));
+    tbl->buckets = hash_table_buckets_alloc(final_length);
     check_mem(tbl->buckets);
 
     tbl->length = final_length;
     tbl->compare = compare == NULL ? default_compare : compare;
     tbl->hash_func = hash_func == NULL ? default_hash : hash_func;
     tbl->delete_cb = delete_cb;
+    tbl->max_load = default_max_load;
 
     debug("Initializing buckets entries to NULL.");
     for (i = 0; i < final_length; i++)
@@ -118,6 +207,28 @@ error:
     return NULL;
 }
 
+/**
+ * Func: hash_table_create_int
+ * Args: const uint32_t length - Number of buckets, as for hash_table_create.
+ *
+ *       hash_table_delete_cb delete_cb - as for hash_table_create. The key of the
+ *           nodes passed to it is NULL, the integer key is in node->int_key.
+ *
+ * Expl: Function for creating a hash table keyed by uint32_t values. The key is
+ *       kept in the node itself, so nothing is allocated to look one up. Only the
+ *       hash_table_*_int functions (and hash_table_traverse/destroy) may be used
+ *       with the table.
+ */
+hash_table_t *hash_table_create_int(const uint32_t length, hash_table_delete_cb delete_cb)
+{
+    hash_table_t *tbl = hash_table_create(length, NULL, NULL, delete_cb);
+
+    if(tbl)
+        tbl->int_keys = 1;
+
+    return tbl;
+}
+
 
 /**
  * Func: hash_table_destroy
@@ -130,6 +241,26 @@ void hash_table_destroy(hash_table_t *tbl)
 
     // if the table exists
     if(tbl) {
+        // nodes not yet moved out of the old array by an unfinished rehash
+        if(tbl->old_buckets)
+        {
+            for(i = tbl->rehash_pos; i < tbl->old_length; i++)
+            {
+                hash_table_node_t *node = tbl->old_buckets[i];
+
+                while(node != NULL)
+                {
+                    hash_table_node_t *next = node->next;
+
+                    if(tbl->delete_cb) tbl->delete_cb(node);
+                    free(node);
+                    node = next;
+                }
+            }
+
+            hash_table_buckets_free(tbl->old_buckets, tbl->old_length, tbl->old_released);
+        }
+
         // if the array of buckets exists
         if(tbl->buckets)
         {
@@ -171,7 +302,7 @@ void hash_table_destroy(hash_table_t *tbl)
             debug("HASH_TABLE_DESTROY: Done deleting nodes.");
 
             // free the buckets array
-            free(tbl->buckets);
+            hash_table_buckets_free(tbl->buckets, tbl->length, 0);
         }
 
         debug("HASH_TABLE_DESTROY: Freeing the table itself.");
@@ -248,132 +379,241 @@ error:
 */
 
 /**
- * Func: hash_table_node_get
+ * Func: hash_table_node_matches
  * Args: hash_table_t *tbl - pointer to the hash table.
  *
- *       void *key - pointer to the key.
+ *       hash_table_node_t *node - the node to check.
+ *
+ *       void *key, const uint32_t int_key, const uint32_t hash - the key being looked
+ *           up (key for string keyed tables, int_key for integer keyed ones) and its hash.
+ *
+ * Expl: Non-public function telling whether node holds the key.
+ */
+static inline int hash_table_node_matches(hash_table_t *tbl, hash_table_node_t *node,
+        void *key, const uint32_t int_key, const uint32_t hash)
+{
+    if(node->hash != hash)
+        return 0;
+
+    if(tbl->int_keys)
+        return node->int_key == int_key;
+
+    return tbl->compare(node->key, key) == 0;
+}
+
+/**
+ * Func: hash_table_node_find
+ * Args: hash_table_t *tbl - pointer to the hash table.
  *
- *       uint32_t *hash - sets/returns the calculated hash value.
+ *       void *key, const uint32_t int_key, const uint32_t hash - as for
+ *           hash_table_node_matches.
  *
- *       int *bucket_num - set/returns the calculated bucket number.
+ *       hash_table_node_t ***slot - set/returns the bucket the node is in, so that it
+ *           can be unlinked. May be NULL.
  *
- *       hash_table_node_t **prev - this is set to null if the desired node is the first
- *           in the bucket.
+ *       hash_table_node_t **prev - set/returns the node before it in the bucket, NULL
+ *           if the node is the first in the bucket. May be NULL.
  *
- * Expl: Non-public function for finding a hash table node.
+ * Expl: Non-public function for finding a hash table node. While the table is being
+ *       rehashed, the buckets of the old array that were not migrated yet are searched
+ *       too. Returns NULL if the key is not in the table.
  */
-static inline hash_table_node_t * hash_table_node_get(hash_table_t *tbl, void *key,
-        uint32_t *hash, int *bucket_num, hash_table_node_t **prev)
+static hash_table_node_t *hash_table_node_find(hash_table_t *tbl, void *key,
+        const uint32_t int_key, const uint32_t hash,
+        hash_table_node_t ***slot, hash_table_node_t **prev)
 {
-    int i = 0;
-    *prev = NULL;
+    hash_table_node_t **bucket = &(tbl->buckets[hash % tbl->length]);
+    hash_table_node_t *node = NULL;
+    hash_table_node_t *last = NULL;
+    uint32_t old_bucket_num = 0;
 
-    // ensure the table's length is nonzero
-    check((tbl->length) > 0, "Invalid table length: %" PRIu32 " ", (tbl->length));
+    for(node = *bucket; node != NULL; last = node, node = node->next)
+        if(hash_table_node_matches(tbl, node, key, int_key, hash))
+            goto found;
 
-    debug("Returned from table length check.");
+    if(tbl->old_buckets == NULL)
+        return NULL;
 
-    // calculate the hash value from the key
-    if((*hash = tbl->hash_func(key)) < 0)
-        goto error;
-    debug("Got hash.");
+    // buckets below rehash_pos have been moved to the new array already
+    old_bucket_num = hash % tbl->old_length;
+    if(old_bucket_num < tbl->rehash_pos)
+        return NULL;
 
-    // get the bucket number from the hash value
-    *bucket_num = *hash % (tbl->length);
-    debug("Bucket number: %d", *bucket_num);
+    bucket = &(tbl->old_buckets[old_bucket_num]);
+    last = NULL;
+    for(node = *bucket; node != NULL; last = node, node = node->next)
+        if(hash_table_node_matches(tbl, node, key, int_key, hash))
+            goto found;
 
-    // ensure we got a logical bucket number
-    check(*bucket_num >= 0, "Invalid bucket number found: %d", *bucket_num);
+    return NULL;
+
+found:
+    if(slot) *slot = bucket;
+    if(prev) *prev = last;
+    return node;
+}
 
-    // retrieve the first node in the bucket
-    hash_table_node_t *node = tbl->buckets[*bucket_num];
-    debug("Set node.");
+/**
+ * Func: hash_table_node_unlink
+ * Args: hash_table_node_t **slot, hash_table_node_t *prev - where the node is, as
+ *           returned by hash_table_node_find.
+ *
+ *       hash_table_node_t *node - the node to take out of its bucket.
+ *
+ * Expl: Non-public function removing a node from its bucket.
+ */
+static inline void hash_table_node_unlink(hash_table_node_t **slot,
+        hash_table_node_t *prev, hash_table_node_t *node)
+{
+    if(prev == NULL)
+        *slot = node->next;
+    else
+        prev->next = node->next;
 
-    // if there is a first node, begin walking the list
-    while(node != NULL)
+    node->next = NULL;
+}
+
+/**
+ * Func: hash_table_rehash_step
+ * Args: hash_table_t *tbl - pointer to the hash table.
+ *
+ * Expl: Non-public function moving the next HASH_TABLE_REHASH_STEP buckets of the old
+ *       array into the new one while the table is being rehashed. This is done on every
+ *       set and delete so that growing the table never stops the caller for long. Nothing
+ *       moves while the table is being traversed. The drained start of a mapped old
+ *       array is unmapped a chunk at a time on the way, so only the last chunk is left
+ *       to free when the rehash is done.
+ */
+static void hash_table_rehash_step(hash_table_t *tbl)
+{
+    hash_table_node_t *node = NULL;
+    hash_table_node_t *next = NULL;
+    uint32_t i;
+
+    if(tbl->old_buckets == NULL || tbl->traversing)
+        return;
+
+    for(i = 0; i < HASH_TABLE_REHASH_STEP && tbl->rehash_pos < tbl->old_length; i++)
     {
-        debug("TRY: %d", i);
-        // make sure the hash and the key both match what's in the node
-        if(node->hash == *hash && tbl->compare(node->key, key) == 0)
+        node = tbl->old_buckets[tbl->rehash_pos];
+        tbl->old_buckets[tbl->rehash_pos] = NULL;
+        tbl->rehash_pos++;
+
+        for(; node != NULL; node = next)
         {
-            // found a match so return it
-            debug("Entered if clause.");
-            return node;
+            next = node->next;
+            node->next = tbl->buckets[node->hash % tbl->length];
+            tbl->buckets[node->hash % tbl->length] = node;
         }
+    }
 
-        debug("Skipped if clause.");
-        i++;
-
-        // keep track of the previous node
-        *prev = node;
+#ifdef MAP_ANONYMOUS
+    // a step drains far less than a chunk, so this keeps up with rehash_pos
+    if(hash_table_buckets_mapped(tbl->old_length)
+            && (size_t)tbl->rehash_pos * sizeof(hash_table_node_t *)
+                >= tbl->old_released + HASH_TABLE_UNMAP_CHUNK)
+    {
+        munmap((char *)tbl->old_buckets + tbl->old_released, HASH_TABLE_UNMAP_CHUNK);
+        tbl->old_released += HASH_TABLE_UNMAP_CHUNK;
+    }
+#endif
 
-        // step to the next node in the list
-        debug("Assigning 'node'");
-        node = node->next;
-        debug("Finished assignments.");
+    if(tbl->rehash_pos >= tbl->old_length)
+    {
+        debug("HASH_TABLE_REHASH: Done, %" PRIu32 " buckets.", tbl->length);
+        hash_table_buckets_free(tbl->old_buckets, tbl->old_length, tbl->old_released);
+        tbl->old_buckets = NULL;
+        tbl->old_length = 0;
+        tbl->old_released = 0;
+        tbl->rehash_pos = 0;
     }
+}
 
-    // return the node
-    // if a match was not found this should return NULL
-    return node;
+/**
+ * Func: hash_table_maybe_grow
+ * Args: hash_table_t *tbl - pointer to the hash table.
+ *
+ * Expl: Non-public function starting a rehash into an array of about twice as many
+ *       buckets once the table holds more than max_load nodes per 100 buckets. If the
+ *       new array cannot be allocated the table simply keeps its size.
+ */
+static void hash_table_maybe_grow(hash_table_t *tbl)
+{
+    hash_table_node_t **new_buckets = NULL;
+    uint32_t new_length = 0;
 
-error:
-    return NULL;
+    if(tbl->max_load == 0 || tbl->old_buckets != NULL || tbl->traversing)
+        return;
+
+    if((uint64_t)tbl->count * 100 <= (uint64_t)tbl->length * tbl->max_load)
+        return;
+
+    if(tbl->length >= HASH_TABLE_MAX_GROWN_BUCKETS / 2)
+        return;
 
+    // keep the length odd, the bucket is picked with a modulo
+    new_length = tbl->length * 2 + 1;
 
+    if((new_buckets = hash_table_buckets_alloc(new_length)) == NULL)
+        return;
+
+    debug("HASH_TABLE_GROW: %" PRIu32 " nodes, %" PRIu32 " -> %" PRIu32 " buckets.",
+            tbl->count, tbl->length, new_length);
+
+    tbl->old_buckets = tbl->buckets;
+    tbl->old_length = tbl->length;
+    tbl->old_released = 0;
+    tbl->rehash_pos = 0;
+    tbl->buckets = new_buckets;
+    tbl->length = new_length;
 }
 
 /**
- * Func: hash_table_set
+ * Func: hash_table_insert
  * Args: hash_table_t *tbl - pointer to the hash table.
  *
- *       void *key - pointer to the key.
+ *       void *key, const uint32_t int_key, const uint32_t hash - the key of the new
+ *           node and its hash.
  *
  *       void *data - pointer to the data.
  *
- * Expl: Function for setting a hash table node. If a node with the same key
- *          is found, it is completely destroyed and replaced by an entirely new node,
- *          including making sure the old key and data memory are freed.
+ * Expl: Non-public function doing the work of hash_table_set and hash_table_set_int.
+ *       A node already holding the key is destroyed, the new node always goes into the
+ *       current bucket array.
  */
-int hash_table_set(hash_table_t *tbl, void *key, void *data)
+static int hash_table_insert(hash_table_t *tbl, void *key, const uint32_t int_key,
+        const uint32_t hash, void *data)
 {
-    uint32_t hash = 0;
-    int bucket_num = 0;
-    hash_table_node_t *old_node = NULL;
+    hash_table_node_t **slot = NULL;
     hash_table_node_t *prev_node = NULL;
+    hash_table_node_t *old_node = NULL;
     hash_table_node_t *new_node = NULL;
+    hash_table_node_t **bucket = NULL;
 
-    debug("Entered hash_table_set.");
-
-    // look for the old node first
-    // even if it doesn't exist, we want the hash value back
-    old_node = hash_table_node_get(tbl, key, &hash, &bucket_num, &prev_node);
+    hash_table_rehash_step(tbl);
 
     // create the new node
     new_node = hash_table_node_create(hash, key, data);
     check_mem(new_node);
+    new_node->int_key = int_key;
 
-    // if prev_node was set, this node takes the old one's place in the list
-    if(prev_node)
+    // if we find a node with this key, destroy it
+    if((old_node = hash_table_node_find(tbl, key, int_key, hash, &slot, &prev_node)) != NULL)
     {
-        (prev_node)->next = new_node;
+        hash_table_node_unlink(slot, prev_node, old_node);
+        tbl->delete_cb(old_node);
+        free(old_node);
     }
     else
     {
-        // this is the first node in the bucket
-        tbl->buckets[bucket_num] = new_node;
+        tbl->count++;
     }
 
-    // if we did find a node with this key
-    if(old_node)
-    {
-        // grab the pointer to the next node in the list
-        new_node->next = old_node->next;
+    bucket = &(tbl->buckets[hash % tbl->length]);
+    new_node->next = *bucket;
+    *bucket = new_node;
 
-        // destroy the old node
-        tbl->delete_cb(old_node);
-        free(old_node);
-    }
+    hash_table_maybe_grow(tbl);
 
     return 0;
 
@@ -381,6 +621,61 @@ error:
     return -1;
 }
 
+/**
+ * Func: hash_table_remove
+ * Args: hash_table_t *tbl - pointer to the hash table.
+ *
+ *       void *key, const uint32_t int_key, const uint32_t hash - the key and its hash.
+ *
+ * Expl: Non-public function doing the work of hash_table_delete and hash_table_delete_int.
+ */
+static int hash_table_remove(hash_table_t *tbl, void *key, const uint32_t int_key,
+        const uint32_t hash)
+{
+    hash_table_node_t **slot = NULL;
+    hash_table_node_t *prev = NULL;
+    hash_table_node_t *node = NULL;
+
+    hash_table_rehash_step(tbl);
+
+    node = hash_table_node_find(tbl, key, int_key, hash, &slot, &prev);
+    if(!node) return -1;
+
+    debug("HASH_TABLE_DELETE: Found node.");
+
+    hash_table_node_unlink(slot, prev, node);
+    tbl->count--;
+
+    tbl->delete_cb(node);
+    free(node);
+
+    return 0;
+}
+
+/**
+ * Func: hash_table_set
+ * Args: hash_table_t *tbl - pointer to the hash table.
+ *
+ *       void *key - pointer to the key.
+ *
+ *       void *data - pointer to the data.
+ *
+ * Expl: Function for setting a hash table node. If a node with the same key
+ *          is found, it is completely destroyed and replaced by an entirely new node,
+ *          including making sure the old key and data memory are freed.
+ */
+int hash_table_set(hash_table_t *tbl, void *key, void *data)
+{
+    debug("Entered hash_table_set.");
+
+    check(!tbl->int_keys, "Table is keyed by integers, use hash_table_set_int.");
+
+    return hash_table_insert(tbl, key, 0, tbl->hash_func(key), data);
+
+error:
+    return -1;
+}
+
 /**
  * Func: hash_table_get
  * Args: hash_table_t *tbl - pointer to the hash table.
@@ -388,19 +683,23 @@ error:
  *       void *key - pointer to the key.
  *
  * Expl: Function for finding a hash table node. This returns a pointer to
- *       the node's data.
+ *       the node's data. Lookups never change the table, so several threads
+ *       may look up keys at the same time.
  */
 void *hash_table_get(hash_table_t *tbl, void *key)
 {
-    uint32_t hash = 0;
-    int bucket_num = 0;
-    hash_table_node_t *prev_node = NULL;
+    hash_table_node_t *node = NULL;
 
-    hash_table_node_t *node = hash_table_node_get(tbl, key, &hash, &bucket_num, &prev_node);
+    check(!tbl->int_keys, "Table is keyed by integers, use hash_table_get_int.");
+
+    node = hash_table_node_find(tbl, key, 0, tbl->hash_func(key), NULL, NULL);
     if(!node) return NULL;
 
     debug("Found desired node.");
     return node->data;
+
+error:
+    return NULL;
 }
 
 
@@ -413,28 +712,41 @@ void *hash_table_get(hash_table_t *tbl, void *key)
  *
  * Expl: Function for traversing the hash table and calling the callback function
  *          for each populated node that's found. This returns 0 or prints an error
- *          and returns the value returned by the callback function.
+ *          and returns the value returned by the callback function. The callback
+ *          may delete nodes; the table is not rehashed until the traversal is done.
  */
 int hash_table_traverse(hash_table_t *tbl, hash_table_traverse_cb traverse_cb, void *cb_arg)
 {
-    int i = 0;
+    hash_table_node_t **buckets[2] = { tbl->buckets, tbl->old_buckets };
+    uint32_t lengths[2] = { tbl->length, tbl->old_length };
+    uint32_t i = 0;
+    int a = 0;
     int rc = 0;
     hash_table_node_t *node = NULL;
     hash_table_node_t *next = NULL;
 
-    for(i = 0; i < (tbl->length); i++) {
-        node = tbl->buckets[i];
-        while(node)
-        {
-            // in case the callback is deleting nodes
-            next = node->next;
-            rc = traverse_cb(node, cb_arg);
-            if(rc != 0) return rc;
-            node = next;
+    tbl->traversing++;
+
+    for(a = 0; a < 2 && rc == 0; a++) {
+        if(buckets[a] == NULL)
+            continue;
+
+        for(i = 0; i < lengths[a] && rc == 0; i++) {
+            node = buckets[a][i];
+            while(node)
+            {
+                // in case the callback is deleting nodes
+                next = node->next;
+                rc = traverse_cb(node, cb_arg);
+                if(rc != 0) break;
+                node = next;
+            }
         }
     }
 
-    return 0;
+    tbl->traversing--;
+
+    return rc;
 }
 
 /**
@@ -449,35 +761,139 @@ int hash_table_traverse(hash_table_t *tbl, hash_table_traverse_cb traverse_cb, v
  */
 int hash_table_delete(hash_table_t *tbl, void *key)
 {
-    uint32_t hash = 0;
-    int bucket_num = 0;
-    hash_table_node_t *prev = NULL;
-
     debug("HASH_TABLE_DELETE: entered.");
 
-    hash_table_node_t *node = hash_table_node_get(tbl, key, &hash, &bucket_num, &prev);
-    if(!node) return -1;
+    check(!tbl->int_keys, "Table is keyed by integers, use hash_table_delete_int.");
 
-    debug("HASH_TABLE_DELETE: Found node.");
+    return hash_table_remove(tbl, key, 0, tbl->hash_func(key));
 
-    if(prev == NULL)
-    {
-        // node was the first in this bucket
-        debug("HASH_TABLE_DELETE: Node was first in bucket.");
-        tbl->buckets[bucket_num] = node->next;
-    }
-    else
-    {
-        // node was anything other than first in this slot
-        debug("HASH_TABLE_DELETE: Node was not first in bucket.");
-        prev->next = node->next;
-    }
+error:
+    return -1;
+}
 
-    debug("HASH_TABLE_DELETE: Free memory.");
+/**
+ * Func: hash_table_set_int
+ * Args: hash_table_t *tbl - pointer to an integer keyed hash table.
+ *
+ *       const uint32_t key - the key.
+ *
+ *       void *data - pointer to the data.
+ *
+ * Expl: hash_table_set for integer keyed tables.
+ */
+int hash_table_set_int(hash_table_t *tbl, const uint32_t key, void *data)
+{
+    check(tbl->int_keys, "Table is not keyed by integers.");
 
-    tbl->delete_cb(node);
-    free(node);
+    return hash_table_insert(tbl, NULL, key, int_hash(key), data);
 
-    return 0;
+error:
+    return -1;
+}
+
+/**
+ * Func: hash_table_get_int
+ * Args: hash_table_t *tbl - pointer to an integer keyed hash table.
+ *
+ *       const uint32_t key - the key.
+ *
+ * Expl: hash_table_get for integer keyed tables.
+ */
+void *hash_table_get_int(hash_table_t *tbl, const uint32_t key)
+{
+    hash_table_node_t *node = NULL;
+
+    if(!tbl->int_keys)
+        return NULL;
+
+    node = hash_table_node_find(tbl, NULL, key, int_hash(key), NULL, NULL);
+
+    return node ? node->data : NULL;
+}
+
+/**
+ * Func: hash_table_delete_int
+ * Args: hash_table_t *tbl - pointer to an integer keyed hash table.
+ *
+ *       const uint32_t key - the key.
+ *
+ * Expl: hash_table_delete for integer keyed tables.
+ */
+int hash_table_delete_int(hash_table_t *tbl, const uint32_t key)
+{
+    if(!tbl->int_keys)
+        return -1;
+
+    return hash_table_remove(tbl, NULL, key, int_hash(key));
 }
 
+/**
+ * Func: hash_table_set_max_load
+ * Args: hash_table_t *tbl - pointer to the hash table.
+ *
+ *       const uint32_t max_load - most nodes per 100 buckets before the table grows,
+ *           0 to never grow it.
+ *
+ * Expl: Function for changing when a table is resized.
+ */
+void hash_table_set_max_load(hash_table_t *tbl, const uint32_t max_load)
+{
+    tbl->max_load = max_load;
+}
+
+/**
+ * Func: hash_table_set_default_max_load
+ * Args: const uint32_t max_load - as for hash_table_set_max_load.
+ *
+ * Expl: Function for setting the max_load of the tables created from now on.
+ */
+void hash_table_set_default_max_load(const uint32_t max_load)
+{
+    default_max_load = max_load;
+}
+
+/**
+ * Func: hash_table_get_stats
+ * Args: hash_table_t *tbl - pointer to the hash table.
+ *
+ *       hash_table_stats_t *stats - filled in with the bucket statistics.
+ *
+ * Expl: Function for looking at how well a table is doing. This walks every bucket,
+ *       so it is meant for dumps and benchmarks rather than the packet path.
+ */
+void hash_table_get_stats(hash_table_t *tbl, hash_table_stats_t *stats)
+{
+    hash_table_node_t **buckets[2] = { tbl->buckets, tbl->old_buckets };
+    uint32_t lengths[2] = { tbl->length, tbl->old_length };
+    hash_table_node_t *node = NULL;
+    uint32_t i = 0, chain = 0;
+    int a = 0;
+
+    memset(stats, 0x0, sizeof(hash_table_stats_t));
+
+    stats->nodes = tbl->count;
+    stats->buckets = tbl->length + tbl->old_length - tbl->rehash_pos;
+    stats->max_load = tbl->max_load;
+    stats->rehashing = tbl->old_buckets != NULL;
+
+    for(a = 0; a < 2; a++)
+    {
+        if(buckets[a] == NULL)
+            continue;
+
+        // migrated buckets of the old array are empty and not counted
+        for(i = (a == 0 ? 0 : tbl->rehash_pos); i < lengths[a]; i++)
+        {
+            for(chain = 0, node = buckets[a][i]; node != NULL; node = node->next)
+                chain++;
+
+            if(chain > 0)
+                stats->used_buckets++;
+            if(chain > stats->max_chain)
+                stats->max_chain = chain;
+
+            stats->chain_hist[chain < HASH_TABLE_CHAIN_HIST_LEN
+                ? chain : HASH_TABLE_CHAIN_HIST_LEN - 1]++;
+        }
+    }
+}
@@ -21,6 +21,17 @@
 #define DEFAULT_NUMBER_OF_BUCKETS 100
 #define MAX_NUMBER_OF_BUCKETS 100000
 
+// Tables grow once they hold more than max_load nodes per 100 buckets,
+// moving HASH_TABLE_REHASH_STEP buckets to the new array on every set or
+// delete until the rehash is done.
+#define HASH_TABLE_DEFAULT_MAX_LOAD 100
+#define HASH_TABLE_REHASH_STEP 8
+#define HASH_TABLE_MAX_GROWN_BUCKETS (1U << 28)
+
+// chain_hist[i] of hash_table_stats_t counts the buckets holding i nodes,
+// the last entry those holding that many or more
+#define HASH_TABLE_CHAIN_HIST_LEN 8
+
 typedef int (*hash_table_compare)(void *a, void *b);
 typedef uint32_t (*hash_table_hash_func)(void *key);
 
@@ -28,6 +39,7 @@ typedef struct hash_table_node {
     void *key;
     void *data;
     uint32_t hash;
+    uint32_t int_key;   // key of integer keyed tables, key is NULL for those
     struct hash_table_node *next;
 } hash_table_node_t;
 
@@ -39,8 +51,29 @@ typedef struct hash_table {
     hash_table_compare compare;
     hash_table_hash_func hash_func;
     hash_table_delete_cb delete_cb;
+    int int_keys;
+    uint32_t count;     // nodes in the table
+    uint32_t max_load;  // nodes per 100 buckets before growing, 0 never grows
+    int traversing;     // no rehashing while a traversal is running
+
+    // the previous bucket array while a rehash is in progress, buckets
+    // below rehash_pos have been moved to buckets already
+    hash_table_node_t **old_buckets;
+    uint32_t old_length;
+    uint32_t rehash_pos;
+    size_t old_released;    // bytes at the start of old_buckets already unmapped
 } hash_table_t;
 
+typedef struct hash_table_stats {
+    uint32_t nodes;
+    uint32_t buckets;
+    uint32_t used_buckets;
+    uint32_t max_chain;
+    uint32_t max_load;
+    int rehashing;
+    uint32_t chain_hist[HASH_TABLE_CHAIN_HIST_LEN];
+} hash_table_stats_t;
+
 
 typedef int (*hash_table_traverse_cb)(hash_table_node_t *node, void *cb_arg);
 
@@ -54,4 +87,15 @@ int hash_table_traverse(hash_table_t *tbl, hash_table_traverse_cb traverse_cb, v
 
 int hash_table_delete(hash_table_t *tbl, void *key);
 
+// Tables keyed by a uint32_t stored in the node itself, so lookups
+// need no key allocation. Only the *_int functions work on these.
+hash_table_t *hash_table_create_int(const uint32_t length, hash_table_delete_cb delete_cb);
+int hash_table_set_int(hash_table_t *tbl, const uint32_t key, void *data);
+void *hash_table_get_int(hash_table_t *tbl, const uint32_t key);
+int hash_table_delete_int(hash_table_t *tbl, const uint32_t key);
+
+void hash_table_set_max_load(hash_table_t *tbl, const uint32_t max_load);
+void hash_table_set_default_max_load(const uint32_t max_load);
+void hash_table_get_stats(hash_table_t *tbl, hash_table_stats_t *stats);
+
 #endif /* HASH_TABLE_H_ */
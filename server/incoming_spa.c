@@ -36,8 +36,12 @@
 #endif
 
 #include "incoming_spa.h"
+#include "spa_pipeline.h"
 #include "service.h"
 #include "access.h"
+#include "blacklist.h"
+#include "rate_limit.h"
+#include "spa_stage.h"
 #include "extcmd.h"
 #include "cmd_cycle.h"
 #include "log_msg.h"
@@ -45,11 +49,16 @@
 #include "fw_util.h"
 #include "fwknopd_errors.h"
 #include "replay_cache.h"
-#include "bstrlib.h"
+
+#ifdef HAVE_C_UNIT_TESTS
+  #include "cunit_common.h"
+  DECLARE_TEST_SUITE(incoming_spa, "Incoming SPA test suite");
+#endif
 
 #define CTX_DUMP_BUFSIZE            4096                /*!< Maximum size allocated to a FKO context dump */
 #define KEEP_SEARCHING 1
 #define STOP_SEARCHING 0
+#define SPA_DISPATCHED 2    /* Stop searching, the request was granted */
 
 /* Validate and in some cases preprocess/reformat the SPA data.  Return an
  * error code value if there is any indication the data is not valid spa data.
@@ -59,9 +68,9 @@ preprocess_spa_data(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
 {
 
     char    *ndx = (char *)&(spa_pkt->packet_data);
-    char    *decoded_sdp_id = NULL;
-    char    *encoded_sdp_id = NULL;
-    int      i, pkt_data_len = 0;
+    char     encoded_sdp_id[B64_SDP_ID_STR_LEN+1];
+    unsigned char decoded_sdp_id[FKO_SDP_ID_SIZE*2];
+    int      i, b64_res, pkt_data_len = 0;
     uint32_t sdp_id = 0;
 
     pkt_data_len = spa_pkt->packet_data_len;
@@ -72,13 +81,15 @@ preprocess_spa_data(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
     */
     spa_pkt->packet_data_len = 0;
 
-    /* These two checks are already done in process_packet(), but this is a
-     * defensive measure to run them again here
+    /* The length checks are already done in process_packet(), but this is a
+     * defensive measure to run them again here.  They are combined with
+     * the check for base64-encoded data; an SPA over HTTP request fails
+     * the latter on the "GET /" and is checked again below once the SPA
+     * data has been extracted.
     */
-    if(pkt_data_len < MIN_SPA_DATA_SIZE)
-        return(SPA_MSG_BAD_DATA);
-
-    if(pkt_data_len > MAX_SPA_PACKET_LEN)
+    b64_res = check_base64(spa_pkt->packet_data, pkt_data_len,
+            MIN_SPA_DATA_SIZE, MAX_SPA_PACKET_LEN);
+    if(b64_res == B64_CHECK_BAD_LEN)
         return(SPA_MSG_BAD_DATA);
 
     /* Ignore any SPA packets that contain the Rijndael or GnuPG prefixes
@@ -99,7 +110,8 @@ preprocess_spa_data(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
      * starts with "GET /" and the user agent starts with "Fwknop", then
      * assume it is a SPA over HTTP request.
     */
-    if(strncasecmp(opts->config[CONF_ENABLE_SPA_OVER_HTTP], "Y", 1) == 0
+    if(b64_res != B64_CHECK_OK
+      && strncasecmp(opts->config[CONF_ENABLE_SPA_OVER_HTTP], "Y", 1) == 0
       && strncasecmp(ndx, "GET /", 5) == 0
       && strstr(ndx, "User-Agent: Fwknop") != NULL)
     {
@@ -129,7 +141,9 @@ preprocess_spa_data(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
             ndx++;
         }
 
-        if(i < MIN_SPA_DATA_SIZE)
+        b64_res = check_base64(spa_pkt->packet_data, i,
+                MIN_SPA_DATA_SIZE, MAX_SPA_PACKET_LEN);
+        if(b64_res == B64_CHECK_BAD_LEN)
             return(SPA_MSG_BAD_DATA);
 
         spa_pkt->packet_data_len = pkt_data_len = i;
@@ -137,7 +151,7 @@ preprocess_spa_data(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
 
     /* Require base64-encoded data
     */
-    if(! is_base64(spa_pkt->packet_data, pkt_data_len))
+    if(b64_res != B64_CHECK_OK)
         return(SPA_MSG_NOT_SPA_DATA);
 
 
@@ -150,46 +164,98 @@ preprocess_spa_data(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
      */
     if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "N", 1) == 0)
     {
-        // make space for the decoded string, really need 5 bytes, but 8 will work
-        decoded_sdp_id = calloc(1, FKO_SDP_ID_SIZE*2);
-        if(decoded_sdp_id == NULL)
-            return(FKO_ERROR_MEMORY_ALLOCATION);
-
-        // Copy out the SDP client ID, NOT extracting yet
-        encoded_sdp_id = strndup((char *)(spa_pkt->packet_data), B64_SDP_ID_STR_LEN);
+        // Copy out the SDP client ID, NOT extracting yet (the packet
+        // data is at least MIN_SPA_DATA_SIZE bytes long)
+        memcpy(encoded_sdp_id, spa_pkt->packet_data, B64_SDP_ID_STR_LEN);
+        encoded_sdp_id[B64_SDP_ID_STR_LEN] = '\0';
 
-        // decode from b64 to original data
-        if(1 > fko_base64_decode(encoded_sdp_id, (unsigned char*)decoded_sdp_id))
+        // decode from b64 to original data, really need 5 bytes, but 8 will work
+        if(1 > fko_base64_decode(encoded_sdp_id, decoded_sdp_id))
         {
             // decode returned error or at least a zero-length string
-            free(encoded_sdp_id);
-            free(decoded_sdp_id);
             return(SPA_MSG_NOT_SPA_DATA);
         }
-        free(encoded_sdp_id);
 
         // copy to a proper uint32_t
         memcpy((void*)(&sdp_id), decoded_sdp_id, FKO_SDP_ID_SIZE);
         if(sdp_id == 0)
         {
             // client ID must not be zero
-            free(decoded_sdp_id);
             return(SPA_MSG_NOT_SPA_DATA);
         }
         spa_pkt->sdp_id = sdp_id;
-        free(decoded_sdp_id);
-
-        // make a string version too
-        snprintf(spa_pkt->sdp_id_str, MAX_SDP_ID_STR_LEN, "%"PRIu32, sdp_id);
     }
 
     return(FKO_SUCCESS);
 }
 
+/* Each thread that processes SPA packets (the main loop or one of the SPA
+ * pipeline workers) decodes them in its own fko arena, so that no heap
+ * allocations are made for the contexts on the hot path.
+*/
+static pthread_key_t    ctx_arena_key;
+static pthread_once_t   ctx_arena_once = PTHREAD_ONCE_INIT;
+
+static void
+destroy_ctx_arena(void *arena)
+{
+    fko_destroy_arena((fko_arena_t)arena);
+    return;
+}
+
+static void
+init_ctx_arena_key(void)
+{
+    pthread_key_create(&ctx_arena_key, destroy_ctx_arena);
+    return;
+}
+
+/* Return the arena of the calling thread, creating it on first use.  NULL
+ * (contexts come from the heap) if it could not be created.
+*/
+static fko_arena_t
+thread_ctx_arena(void)
+{
+    fko_arena_t arena = NULL;
+
+    pthread_once(&ctx_arena_once, init_ctx_arena_key);
+
+    if((arena = pthread_getspecific(ctx_arena_key)) == NULL)
+    {
+        if(fko_new_arena(&arena, 0) != FKO_SUCCESS)
+            return NULL;
+
+        if(pthread_setspecific(ctx_arena_key, arena) != 0)
+        {
+            fko_destroy_arena(arena);
+            return NULL;
+        }
+    }
+    return arena;
+}
+
+/* Free the arena of the calling thread.  The worker threads free theirs
+ * when they exit, this is for the main thread at shutdown.
+*/
+void
+free_spa_ctx_arena(void)
+{
+    fko_arena_t arena = NULL;
+
+    pthread_once(&ctx_arena_once, init_ctx_arena_key);
+
+    if((arena = pthread_getspecific(ctx_arena_key)) != NULL)
+    {
+        pthread_setspecific(ctx_arena_key, NULL);
+        fko_destroy_arena(arena);
+    }
+    return;
+}
+
 /* For replay attack detection
 */
 static int
-get_raw_digest(char **digest, char *pkt_data)
+get_raw_digest(char *digest, const size_t digest_size, char *pkt_data)
 {
     fko_ctx_t    ctx = NULL;
     char        *tmp_digest = NULL;
@@ -199,8 +265,8 @@ get_raw_digest(char **digest, char *pkt_data)
     /* initialize an FKO context with no decryption key just so
      * we can get the outer message digest
     */
-    res = fko_new_with_data(&ctx, (char *)pkt_data, NULL, 0,
-            FKO_DEFAULT_ENC_MODE, NULL, 0, 0, 0);
+    res = fko_new_with_data_arena(&ctx, (char *)pkt_data, NULL, NULL, 0,
+            thread_ctx_arena());
 
     if(res != FKO_SUCCESS)
     {
@@ -262,10 +328,8 @@ get_raw_digest(char **digest, char *pkt_data)
         return(SPA_MSG_DIGEST_ERROR);
     }
 
-    *digest = strdup(tmp_digest);
-
-    if (*digest == NULL)
-        res = SPA_MSG_ERROR;  /* really a strdup() memory allocation problem */
+    if(strlcpy(digest, tmp_digest, digest_size) >= digest_size)
+        res = SPA_MSG_DIGEST_ERROR;
 
     fko_destroy(ctx);
     ctx = NULL;
@@ -371,32 +435,31 @@ check_stanza_expiration(acc_stanza_t *acc, spa_data_t *spadat,
     return 1;
 }
 
-/* Check for access.conf stanza SOURCE match based on SPA packet
- * source IP
+/* Find the first access.conf stanza whose SOURCE and DESTINATION match
+ * the SPA packet addresses
 */
 static int
-src_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, spa_data_t *spadat)
+src_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, spa_data_t *spadat,
+        acc_stanza_t **acc, int *stanza_num)
 {
-    acc_stanza_t *acc = opts->acc_stanzas;
-
-    while (acc)
-    {
-        if(compare_addr_list(acc->source_list, ntohl(spa_pkt->packet_src_ip)))
-            return 1;
+    *stanza_num = 0;
+    *acc = acc_addr_index_next(opts, ntohl(spa_pkt->packet_src_ip),
+            ntohl(spa_pkt->packet_dst_ip), stanza_num);
 
-        acc = acc->next;
-    }
+    if(*acc != NULL)
+        return 1;
 
     log_msg(LOG_WARNING, "No access data found for source IP: %s", spadat->pkt_source_ip);
     return 0;
 }
 
-/* Look for the SDP Client ID in the hash table
+/* Look for the SDP Client ID in the hash table.  The caller must be in
+ * an access table read-side section for as long as it uses the stanza.
  */
 static int
 sdp_id_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, acc_stanza_t **acc)
 {
-    bstring sdp_id = NULL;
+    hash_table_t *acc_table = NULL;
 
     if(spa_pkt->sdp_id == 0)
     {
@@ -406,24 +469,9 @@ sdp_id_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, acc_stanza_t **ac
         return 0;
     }
 
-    sdp_id = bfromcstr(spa_pkt->sdp_id_str);
-    if(sdp_id == NULL)
-    {
-        log_msg(LOG_ERR, "Failed to convert sdp_id_str to bstring. Value: %s", spa_pkt->sdp_id_str);
-        return 0;
-    }
+    if((acc_table = acc_table_current(opts)) != NULL)
+        *acc = hash_table_get_int(acc_table, spa_pkt->sdp_id);
 
-    // lock the hash table mutex
-    if(pthread_mutex_lock(&(opts->acc_hash_tbl_mutex)))
-    {
-        log_msg(LOG_ERR, "Mutex lock error.");
-        return 0;
-    }
-
-    *acc = hash_table_get(opts->acc_stanza_hash_tbl, sdp_id);
-    pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
-
-    bdestroy(sdp_id);
     if(*acc)
         return 1;  //found what we were looking for
 
@@ -434,21 +482,26 @@ sdp_id_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, acc_stanza_t **ac
 }
 
 
+/* digest_buf may already hold the digest if it was computed along with
+ * those of other packets (see process_spa_packets()).
+*/
 static int
-replay_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, char **raw_digest)
+replay_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        char *digest_buf, const size_t digest_size, char **raw_digest)
 {
     if(strncasecmp(opts->config[CONF_ENABLE_DIGEST_PERSISTENCE], "Y", 1) == 0)
     {
         /* Check for a replay attack
         */
-        if(get_raw_digest(raw_digest, (char *)spa_pkt->packet_data) != FKO_SUCCESS)
+        if(digest_buf[0] == '\0'
+                && get_raw_digest(digest_buf, digest_size,
+                    (char *)spa_pkt->packet_data) != FKO_SUCCESS)
         {
             return 0;
         }
-        if (*raw_digest == NULL)
-            return 0;
+        *raw_digest = digest_buf;
 
-        if (is_replay(opts, *raw_digest) != SPA_MSG_SUCCESS)
+        if (is_replay(opts, spa_pkt, *raw_digest) != SPA_MSG_SUCCESS)
         {
             return 0;
         }
@@ -625,6 +678,36 @@ check_mode_ctx(spa_data_t *spadat, fko_ctx_t *ctx, int attempted_decrypt,
     return 1;
 }
 
+/* Create the fko context for a stanza, decrypting with the stanza key if
+ * decrypt is set.  The keys prepared when the stanza was loaded are used
+ * where there are any.  The prepared Rijndael key path passes no raw HMAC
+ * key, so it is only taken if an HMAC key, when there is one, was
+ * prepared too; otherwise the HMAC would go unchecked.
+*/
+static int
+new_ctx_with_data(acc_stanza_t *acc, spa_pkt_info_t *spa_pkt,
+        fko_ctx_t *ctx, const int decrypt)
+{
+    char   *spa_data = (char *)spa_pkt->packet_data;
+
+    if(decrypt && acc->key_prep != NULL
+            && (acc->hmac_key == NULL || acc->hmac_key_prep != NULL))
+        return fko_new_with_data_arena(ctx, spa_data, acc->key_prep,
+                acc->hmac_key_prep, spa_pkt->sdp_id, thread_ctx_arena());
+
+    if(acc->hmac_key_prep != NULL)
+        return fko_new_with_data_hmac_key(ctx, spa_data,
+                decrypt ? acc->key : NULL, decrypt ? acc->key_len : 0,
+                decrypt ? acc->encryption_mode : FKO_ENC_MODE_ASYMMETRIC,
+                acc->hmac_key_prep, spa_pkt->sdp_id);
+
+    return fko_new_with_data(ctx, spa_data,
+            decrypt ? acc->key : NULL, decrypt ? acc->key_len : 0,
+            decrypt ? acc->encryption_mode : FKO_ENC_MODE_ASYMMETRIC,
+            acc->hmac_key, acc->hmac_key_len, acc->hmac_type,
+            spa_pkt->sdp_id);
+}
+
 static void
 handle_rijndael_enc(acc_stanza_t *acc, spa_pkt_info_t *spa_pkt,
         spa_data_t *spadat, fko_ctx_t *ctx, int *attempted_decrypt,
@@ -633,9 +716,7 @@ handle_rijndael_enc(acc_stanza_t *acc, spa_pkt_info_t *spa_pkt,
 {
     if(enc_type == FKO_ENCRYPTION_RIJNDAEL || acc->enable_cmd_exec)
     {
-        *res = fko_new_with_data(ctx, (char *)spa_pkt->packet_data,
-            acc->key, acc->key_len, acc->encryption_mode, acc->hmac_key,
-            acc->hmac_key_len, acc->hmac_type, spa_pkt->sdp_id);
+        *res = new_ctx_with_data(acc, spa_pkt, ctx, 1);
         *attempted_decrypt = 1;
         if(*res == FKO_SUCCESS)
             *cmd_exec_success = 1;
@@ -656,9 +737,7 @@ handle_gpg_enc(acc_stanza_t *acc, spa_pkt_info_t *spa_pkt,
         */
         if(acc->gpg_decrypt_pw != NULL || acc->gpg_allow_no_pw)
         {
-            *res = fko_new_with_data(ctx, (char *)spa_pkt->packet_data, NULL,
-                    0, FKO_ENC_MODE_ASYMMETRIC, acc->hmac_key,
-                    acc->hmac_key_len, acc->hmac_type, spa_pkt->sdp_id);
+            *res = new_ctx_with_data(acc, spa_pkt, ctx, 0);
 
             if(*res != FKO_SUCCESS)
             {
@@ -915,7 +994,7 @@ check_nat_access_types(fko_srv_options_t *opts, acc_stanza_t *acc,
 }
 
 static int
-add_replay_cache(fko_srv_options_t *opts, acc_stanza_t *acc,
+add_replay_cache(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
         spa_data_t *spadat, char *raw_digest, int *added_replay_digest,
         const int stanza_num, int *res)
 {
@@ -923,7 +1002,7 @@ add_replay_cache(fko_srv_options_t *opts, acc_stanza_t *acc,
             && strncasecmp(opts->config[CONF_ENABLE_DIGEST_PERSISTENCE], "Y", 1) == 0)
     {
 
-        *res = add_replay(opts, raw_digest);
+        *res = add_replay(opts, spa_pkt, raw_digest);
         if (*res != SPA_MSG_SUCCESS)
         {
             log_msg(LOG_WARNING, "[%s] (stanza #%d) Could not add digest to replay cache",
@@ -997,6 +1076,65 @@ check_port_proto(acc_stanza_t *acc, spa_data_t *spadat, const int stanza_num)
     return 1;
 }
 
+/* Carry out an accepted SPA request: run the CMD_CYCLE_OPEN command or
+ * the command message, or add the firewall rules.  This runs on the packet
+ * processing thread, or on the pipeline's actuator thread when
+ * SPA_WORKER_THREADS is set.
+*/
+int
+actuate_spa_request(fko_srv_options_t *opts, acc_stanza_t *acc,
+        spa_data_t *spadat, const int stanza_num)
+{
+    int res = FKO_SUCCESS;
+
+    if(acc->cmd_cycle_open != NULL)
+    {
+        if(cmd_cycle_open(opts, acc, spadat, stanza_num, &res))
+            return STOP_SEARCHING; /* successfully processed a matching access stanza */
+        else
+        {
+            return KEEP_SEARCHING;
+        }
+    }
+    else if(spadat->message_type == FKO_COMMAND_MSG)
+    {
+        if(process_cmd_msg(opts, acc, spadat, stanza_num, &res))
+        {
+            /* we processed the command on a matching access stanza, so we
+             * don't look for anything else to do with this SPA packet
+            */
+            return STOP_SEARCHING;
+        }
+        else
+        {
+            return KEEP_SEARCHING;
+        }
+    }
+
+    process_spa_request(opts, acc, spadat);
+
+    return STOP_SEARCHING;
+}
+
+/* With worker threads, the request is queued for the actuator thread and
+ * the stanza search stops here since the outcome is not known yet.
+*/
+static int
+dispatch_spa_request(fko_srv_options_t *opts, acc_stanza_t *acc,
+        spa_data_t *spadat, const int stanza_num)
+{
+    if(opts->spa_pipeline != NULL)
+    {
+        spa_pipeline_actuate(opts, acc, spadat, stanza_num);
+        return SPA_DISPATCHED;
+    }
+
+    if(actuate_spa_request(opts, acc, spadat, stanza_num) == KEEP_SEARCHING)
+        return KEEP_SEARCHING;
+
+    return SPA_DISPATCHED;
+}
+
 /* Handle grant request
  */
 static int
@@ -1012,13 +1150,6 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
     char dump_buf[CTX_DUMP_BUFSIZE];
     short msg_type          = 0;
 
-    /* Check for a match for the SPA source and destination IP and the access stanza
-    */
-    if(! src_dst_check(acc, spa_pkt, spadat, stanza_num))
-    {
-        return KEEP_SEARCHING;
-    }
-
     log_msg(LOG_INFO,
         "(stanza #%d) SPA Packet from IP: %s received with access source match",
         stanza_num, spadat->pkt_source_ip);
@@ -1056,7 +1187,7 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
 
     /* Add this SPA packet into the replay detection cache
     */
-    if(! add_replay_cache(opts, acc, spadat, raw_digest,
+    if(! add_replay_cache(opts, spa_pkt, spadat, raw_digest,
                 &added_replay_digest, stanza_num, &res))
     {
         return KEEP_SEARCHING;
@@ -1191,28 +1322,9 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
 
     /* Command messages.
     */
-    if(acc->cmd_cycle_open != NULL)
+    if(acc->cmd_cycle_open != NULL || spadat->message_type == FKO_COMMAND_MSG)
     {
-        if(cmd_cycle_open(opts, acc, spadat, stanza_num, &res))
-            return STOP_SEARCHING; /* successfully processed a matching access stanza */
-        else
-        {
-            return KEEP_SEARCHING;
-        }
-    }
-    else if(spadat->message_type == FKO_COMMAND_MSG)
-    {
-        if(process_cmd_msg(opts, acc, spadat, stanza_num, &res))
-        {
-            /* we processed the command on a matching access stanza, so we
-             * don't look for anything else to do with this SPA packet
-            */
-            return STOP_SEARCHING;
-        }
-        else
-        {
-            return KEEP_SEARCHING;
-        }
+        return dispatch_spa_request(opts, acc, spadat, stanza_num);
     }
 
     /* From this point forward, we have some kind of access message. So
@@ -1251,89 +1363,164 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
         );
         return KEEP_SEARCHING;
     }
-    else
-    {
-        if(acc->cmd_cycle_open != NULL)
-        {
-            if(cmd_cycle_open(opts, acc, spadat, stanza_num, &res))
-                return STOP_SEARCHING; /* successfully processed a matching access stanza */
-            else
-            {
-                return KEEP_SEARCHING;
-            }
-        }
-        else
-        {
-            process_spa_request(opts, acc, spadat);
-        }
-    }
 
-    return STOP_SEARCHING;
+    return dispatch_spa_request(opts, acc, spadat, stanza_num);
 }
 
 
-/* Process the SPA packet data
+/* A packet on its way through the filter stages
 */
-void
-incoming_spa(fko_srv_options_t *opts)
+typedef struct spa_stage_pkt
 {
-    /* Always a good idea to initialize ctx to null if it will be used
-     * repeatedly (especially when using fko_new_with_data()).
+    spa_pkt_info_t *spa_pkt;
+    spa_data_t      spadat;
+    acc_stanza_t   *acc;            /* Found by the access lookup stage */
+    int             stanza_num;
+    char           *raw_digest;     /* Set by the replay stage */
+    char            raw_digest_buf[MAX_DIGEST_SIZE+1];
+} spa_stage_pkt_t;
+
+/* Intake stages, run on the capture thread before the packet is queued
+ * for the workers.  arg is the spa_pkt_info_t.
+*/
+static int
+stage_blacklist(fko_srv_options_t *opts, void *arg)
+{
+    spa_pkt_info_t *spa_pkt = arg;
+
+    /* Blacklisted sources get no further work, not even a log line
+     * at the default level.
     */
-    fko_ctx_t       ctx = NULL;
+    if(blacklist_match(opts, spa_pkt->packet_src_ip))
+    {
+        log_msg(LOG_DEBUG, "incoming_spa() : source is blacklisted");
+        return 0;
+    }
 
-    char            *raw_digest = NULL;
-    int             stanza_num=0;
-    int             is_err;
-    int             conf_pkt_age = 0;
+    return 1;
+}
 
-    spa_pkt_info_t *spa_pkt = &(opts->spa_pkt);
+static int
+stage_src_rate(fko_srv_options_t *opts, void *arg)
+{
+    spa_pkt_info_t *spa_pkt = arg;
 
-    /* This will hold our pertinent SPA data.
-    */
-    spa_data_t spadat;
+    return rate_limit_check(opts, RATE_LIMIT_SRC_IP, spa_pkt->packet_src_ip);
+}
 
-    acc_stanza_t        *acc = NULL;
+static const spa_stage_t intake_stages[] = {
+    { SPA_STAGE_BLACKLIST,      stage_blacklist },
+    { SPA_STAGE_SRC_RATE,       stage_src_rate }
+};
 
-    log_msg(LOG_DEBUG, "incoming_spa() : just arrived, stay tuned");
+/* Cheap stages, which weed out anything that obviously is not a SPA
+ * packet for us before any digest is computed.  arg is the
+ * spa_stage_pkt_t.
+*/
+static int
+stage_precheck(fko_srv_options_t *opts, void *arg)
+{
+    spa_stage_pkt_t *sp = arg;
 
-    spadat.service_data_list = NULL;
+    return precheck_pkt(opts, sp->spa_pkt, &sp->spadat);
+}
 
-    inet_ntop(AF_INET, &(spa_pkt->packet_src_ip),
-        spadat.pkt_source_ip, sizeof(spadat.pkt_source_ip));
+/* Look up the access stanza here already, so that packets for unknown
+ * SDP Client IDs or sources cost no more than a hash or trie lookup.  The
+ * caller stays in an access table read-side section until the stanza
+ * is no longer used.
+*/
+static int
+stage_access_lookup(fko_srv_options_t *opts, void *arg)
+{
+    spa_stage_pkt_t *sp = arg;
 
-    inet_ntop(AF_INET, &(spa_pkt->packet_dst_ip),
-        spadat.pkt_destination_ip, sizeof(spadat.pkt_destination_ip));
+    if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "Y", 1) == 0)
+        return src_check(opts, sp->spa_pkt, &sp->spadat, &sp->acc, &sp->stanza_num);
 
-    /* At this point, we want to validate and (if needed) preprocess the
-     * SPA data and/or to be reasonably sure we have a SPA packet (i.e
-     * try to eliminate obvious non-spa packets).
+    /* Check for a match for the SPA source and destination IP and the
+     * access stanza
     */
-    if(! precheck_pkt(opts, spa_pkt, &spadat))
-        goto cleanup;
+    return sdp_id_check(opts, sp->spa_pkt, &sp->acc)
+        && src_dst_check(sp->acc, sp->spa_pkt, &sp->spadat, sp->stanza_num);
+}
 
-    if(! replay_check(opts, spa_pkt, &raw_digest))
-        goto cleanup;
+static int
+stage_sdp_rate(fko_srv_options_t *opts, void *arg)
+{
+    spa_stage_pkt_t *sp = arg;
 
-    if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "Y", 1) == 0)
-    {
-        if(! src_check(opts, spa_pkt, &spadat))
-            goto cleanup;
-    }
-    else
+    if(sp->spa_pkt->sdp_id != 0
+            && ! rate_limit_check(opts, RATE_LIMIT_SDP_ID, sp->spa_pkt->sdp_id))
     {
-        if(! sdp_id_check(opts, spa_pkt, &acc))
-            goto cleanup;
+        log_msg(LOG_DEBUG, "[%s] SDP Client ID %"PRIu32" is over its rate limit",
+            sp->spadat.pkt_source_ip, sp->spa_pkt->sdp_id);
+        return 0;
     }
 
+    return 1;
+}
+
+static const spa_stage_t prepare_stages[] = {
+    { SPA_STAGE_PRECHECK,       stage_precheck },
+    { SPA_STAGE_ACCESS_LOOKUP,  stage_access_lookup },
+    { SPA_STAGE_SDP_RATE,       stage_sdp_rate }
+};
+
+/* Costly stages, run once the digests of the batch are in.  arg is the
+ * spa_stage_pkt_t.
+*/
+static int
+stage_replay(fko_srv_options_t *opts, void *arg)
+{
+    spa_stage_pkt_t *sp = arg;
+
+    return replay_check(opts, sp->spa_pkt, sp->raw_digest_buf,
+            sizeof(sp->raw_digest_buf), &sp->raw_digest);
+}
+
+static void
+destroy_spa_ctx(fko_ctx_t *ctx, spa_data_t *spadat, const int stanza_num)
+{
+    if(*ctx == NULL)
+        return;
+
+    if(fko_destroy(*ctx) == FKO_ERROR_ZERO_OUT_DATA)
+        log_msg(LOG_WARNING,
+            "[%s] (stanza #%d) fko_destroy() could not zero out sensitive data buffer.",
+            spadat->pkt_source_ip, stanza_num
+        );
+    *ctx = NULL;
+}
+
+/* Authenticate and decrypt the packet against the stanza the access
+ * lookup stage found (and, in legacy mode, the ones after it), and act
+ * on it.  The packet only counts as passed if a request was granted.
+*/
+static int
+stage_auth(fko_srv_options_t *opts, void *arg)
+{
+    spa_stage_pkt_t *sp = arg;
+    spa_data_t      *spadat = &sp->spadat;
+    acc_stanza_t    *acc = sp->acc;
+
+    /* Always a good idea to initialize ctx to null if it will be used
+     * repeatedly (especially when using fko_new_with_data()).
+    */
+    fko_ctx_t       ctx = NULL;
+
+    int             res = KEEP_SEARCHING;
+    int             is_err;
+    int             conf_pkt_age = 0;
+
     if(strncasecmp(opts->config[CONF_ENABLE_SPA_PACKET_AGING], "Y", 1) == 0)
     {
         conf_pkt_age = strtol_wrapper(opts->config[CONF_MAX_SPA_PACKET_AGE],
                 0, RCHK_MAX_SPA_PACKET_AGE, NO_EXIT_UPON_ERR, &is_err);
         if(is_err != FKO_SUCCESS)
         {
-            log_msg(LOG_ERR, "[*] [%s] invalid MAX_SPA_PACKET_AGE", spadat.pkt_source_ip);
-            goto cleanup;
+            log_msg(LOG_ERR, "[*] [%s] invalid MAX_SPA_PACKET_AGE", spadat->pkt_source_ip);
+            return 0;
         }
     }
 
@@ -1341,62 +1528,271 @@ incoming_spa(fko_srv_options_t *opts)
      * incoming SPA packet is not a replay, see if we should grant any
      * access
     */
-
     if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "Y", 1) == 0)
     {
-        acc = opts->acc_stanzas;
-        /* Loop through all access stanzas looking for a match
+        /* Loop through the access stanzas matching the packet addresses,
+         * src_check() found the first one
         */
         while(acc)
         {
-            stanza_num++;
+            res = process_spa_data(opts, &ctx, acc, sp->spa_pkt, spadat,
+                    sp->stanza_num, sp->raw_digest, conf_pkt_age);
+            if(res != KEEP_SEARCHING)
+                break;
 
-            if( process_spa_data(opts, &ctx, acc, spa_pkt, &spadat, stanza_num,
-                    raw_digest, conf_pkt_age) == KEEP_SEARCHING )
-            {
-                if(ctx != NULL)
-                {
-                    if(fko_destroy(ctx) == FKO_ERROR_ZERO_OUT_DATA)
-                        log_msg(LOG_WARNING,
-                            "[%s] (stanza #%d) fko_destroy() could not zero out sensitive data buffer.",
-                            spadat.pkt_source_ip, stanza_num
-                        );
-                    ctx = NULL;
-                }
+            destroy_spa_ctx(&ctx, spadat, sp->stanza_num);
 
-                acc = acc->next;
-            }
-            else
-            {
-                break;
-            }
+            acc = acc_addr_index_next(opts, ntohl(sp->spa_pkt->packet_src_ip),
+                    ntohl(sp->spa_pkt->packet_dst_ip), &sp->stanza_num);
         }
     }
     else
+        res = process_spa_data(opts, &ctx, acc, sp->spa_pkt, spadat,
+                sp->stanza_num, sp->raw_digest, conf_pkt_age);
+
+    destroy_spa_ctx(&ctx, spadat, sp->stanza_num);
+
+    if(spadat->service_data_list != NULL)
     {
-        process_spa_data(opts, &ctx, acc, spa_pkt, &spadat, stanza_num, raw_digest, conf_pkt_age);
+        free_service_data_list(spadat->service_data_list);
+        spadat->service_data_list = NULL;
     }
 
-cleanup:
-    if (raw_digest != NULL)
-        free(raw_digest);
+    return res == SPA_DISPATCHED;
+}
+
+static const spa_stage_t process_stages[] = {
+    { SPA_STAGE_REPLAY,         stage_replay },
+    { SPA_STAGE_AUTH,           stage_auth }
+};
+
+/* Set up the SPA data for a new packet and run it through the cheap
+ * stages.
+*/
+static int
+prepare_spa_packet(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        spa_stage_pkt_t *sp)
+{
+    log_msg(LOG_DEBUG, "incoming_spa() : just arrived, stay tuned");
+
+    sp->spa_pkt           = spa_pkt;
+    sp->acc               = NULL;
+    sp->stanza_num        = 0;
+    sp->raw_digest        = NULL;
+    sp->raw_digest_buf[0] = '\0';
+
+    sp->spadat.service_data_list = NULL;
+
+    inet_ntop(AF_INET, &(spa_pkt->packet_src_ip),
+        sp->spadat.pkt_source_ip, sizeof(sp->spadat.pkt_source_ip));
+
+    inet_ntop(AF_INET, &(spa_pkt->packet_dst_ip),
+        sp->spadat.pkt_destination_ip, sizeof(sp->spadat.pkt_destination_ip));
 
-    if(ctx != NULL)
+    return spa_stage_run(opts, prepare_stages, ARRAY_SIZE(prepare_stages), sp);
+}
+
+/* Process a batch of SPA packets in order.  All of them go through the
+ * cheap stages first, then the replay digests of those left are computed
+ * together, which lets libfko hash several of them at once, and only
+ * then are they decrypted.
+*/
+void
+process_spa_packets(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkts,
+        const int count)
+{
+    spa_stage_pkt_t pkts[SPA_DIGEST_BATCH];
+    char           *pkt_data[SPA_DIGEST_BATCH];
+    char           *digests[SPA_DIGEST_BATCH];
+    int             prepared[SPA_DIGEST_BATCH];
+    uint64_t        start, ns;
+    int             first, i, n, nb_digests;
+
+    for(first=0; first < count; first += n)
     {
-        if(fko_destroy(ctx) == FKO_ERROR_ZERO_OUT_DATA)
-            log_msg(LOG_WARNING,
-                "[%s] (stanza #%d) fko_destroy() could not zero out sensitive data buffer.",
-                spadat.pkt_source_ip, stanza_num
-            );
-        ctx = NULL;
+        n = count - first < SPA_DIGEST_BATCH ? count - first : SPA_DIGEST_BATCH;
+        nb_digests = 0;
+
+        /* Keeps the stanzas found by the access lookup stage alive across
+         * a controller update until the batch is done
+        */
+        acc_table_read_lock(opts);
+
+        for(i=0; i < n; i++)
+        {
+            prepared[i] = prepare_spa_packet(opts, &spa_pkts[first+i], &pkts[i]);
+            if(prepared[i])
+            {
+                pkt_data[nb_digests] = (char *)spa_pkts[first+i].packet_data;
+                digests[nb_digests]  = pkts[i].raw_digest_buf;
+                nb_digests++;
+            }
+        }
+
+        /* Any digest left empty here (a single packet, or one that libfko
+         * does not like) is computed by replay_check() as usual, which
+         * also takes care of logging the error.
+        */
+        if(nb_digests > 1
+                && strncasecmp(opts->config[CONF_ENABLE_DIGEST_PERSISTENCE], "Y", 1) == 0)
+        {
+            start = spa_stage_now();
+            if(fko_get_raw_spa_digests(pkt_data, nb_digests, FKO_DEFAULT_DIGEST,
+                        digests, sizeof(pkts[0].raw_digest_buf)) != FKO_SUCCESS)
+            {
+                for(i=0; i < n; i++)
+                    pkts[i].raw_digest_buf[0] = '\0';
+            }
+            else
+            {
+                ns = (spa_stage_now() - start) / nb_digests;
+                for(i=0; i < nb_digests; i++)
+                    spa_stage_record(opts, SPA_STAGE_DIGEST, 1, ns);
+            }
+        }
+
+        for(i=0; i < n; i++)
+            if(prepared[i])
+                spa_stage_run(opts, process_stages, ARRAY_SIZE(process_stages), &pkts[i]);
+
+        acc_table_read_unlock(opts);
     }
 
-	if(spadat.service_data_list != NULL)
-	{
-		free_service_data_list(spadat.service_data_list);
-	}
+    return;
+}
+
+/* Process the SPA packet data
+*/
+void
+process_spa_packet(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
+{
+    process_spa_packets(opts, spa_pkt, 1);
+}
+
+/* Hand a captured packet to the worker threads, or process it right here
+ * if there are none.
+*/
+void
+handle_spa_packet(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
+{
+    /* Drop blacklisted sources and shed floods before they take up a
+     * queue slot or any CPU time
+    */
+    if(! spa_stage_run(opts, intake_stages, ARRAY_SIZE(intake_stages), spa_pkt))
+        return;
+
+    if(opts->spa_pipeline != NULL && spa_pipeline_submit(opts, spa_pkt) >= 0)
+        return;
+
+    process_spa_packet(opts, spa_pkt);
 
     return;
 }
 
+void
+incoming_spa(fko_srv_options_t *opts)
+{
+    handle_spa_packet(opts, &(opts->spa_pkt));
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+#define TEST_ENC_KEY    "secretsecretsecret"
+#define TEST_HMAC_KEY   "hmacsecrethmacsecret"
+
+/* Build a legacy mode SPA packet, authenticated with hmac_key if it is
+ * not NULL
+*/
+static void
+test_spa_pkt(spa_pkt_info_t *spa_pkt, const char *hmac_key)
+{
+    fko_ctx_t   ctx = NULL;
+    char       *spa_data = NULL;
+
+    memset(spa_pkt, 0, sizeof(*spa_pkt));
+
+    CU_ASSERT_FATAL(fko_new(&ctx) == FKO_SUCCESS);
+    CU_ASSERT_FATAL(fko_set_disable_sdp_mode(ctx, 1) == FKO_SUCCESS);
+    CU_ASSERT_FATAL(fko_set_username(ctx, "test") == FKO_SUCCESS);
+    CU_ASSERT_FATAL(fko_set_spa_message(ctx, "127.0.0.1,tcp/22") == FKO_SUCCESS);
+    if(hmac_key != NULL)
+        CU_ASSERT_FATAL(fko_set_spa_hmac_type(ctx, FKO_HMAC_SHA256) == FKO_SUCCESS);
+    CU_ASSERT_FATAL(fko_spa_data_final(ctx, TEST_ENC_KEY, strlen(TEST_ENC_KEY),
+                hmac_key, hmac_key != NULL ? strlen(hmac_key) : 0) == FKO_SUCCESS);
+    CU_ASSERT_FATAL(fko_get_spa_data(ctx, &spa_data) == FKO_SUCCESS);
+
+    strlcpy((char *)spa_pkt->packet_data, spa_data, sizeof(spa_pkt->packet_data));
+    spa_pkt->packet_data_len = strlen(spa_data);
+
+    fko_destroy(ctx);
+}
+
+DECLARE_UTEST(unprepared_hmac_key, "check the HMAC is verified without a prepared HMAC key")
+{
+    acc_stanza_t    acc;
+    spa_pkt_info_t  spa_pkt;
+    fko_ctx_t       ctx = NULL;
+
+    memset(&acc, 0, sizeof(acc));
+    acc.key             = TEST_ENC_KEY;
+    acc.key_len         = strlen(TEST_ENC_KEY);
+    acc.encryption_mode = FKO_ENC_MODE_CBC;
+    acc.hmac_key        = TEST_HMAC_KEY;
+    acc.hmac_key_len    = strlen(TEST_HMAC_KEY);
+    acc.hmac_type       = FKO_HMAC_SHA256;
+
+    /* The Rijndael key is prepared but the HMAC key is not
+    */
+    CU_ASSERT_FATAL(fko_new_enc_key(&acc.key_prep, acc.key, acc.key_len,
+                acc.encryption_mode) == FKO_SUCCESS);
+    acc.hmac_key_prep = NULL;
+
+    test_spa_pkt(&spa_pkt, TEST_HMAC_KEY);
+    CU_ASSERT(new_ctx_with_data(&acc, &spa_pkt, &ctx, 1) == FKO_SUCCESS);
+    fko_destroy(ctx);
+    ctx = NULL;
+
+    test_spa_pkt(&spa_pkt, "wronghmacwronghmac");
+    CU_ASSERT(new_ctx_with_data(&acc, &spa_pkt, &ctx, 1) != FKO_SUCCESS);
+    fko_destroy(ctx);
+    ctx = NULL;
+
+    test_spa_pkt(&spa_pkt, NULL);
+    CU_ASSERT(new_ctx_with_data(&acc, &spa_pkt, &ctx, 1) != FKO_SUCCESS);
+    fko_destroy(ctx);
+    ctx = NULL;
+
+    /* Same again with both keys prepared
+    */
+    CU_ASSERT_FATAL(fko_new_hmac_key(&acc.hmac_key_prep, acc.hmac_key,
+                acc.hmac_key_len, acc.hmac_type) == FKO_SUCCESS);
+
+    test_spa_pkt(&spa_pkt, TEST_HMAC_KEY);
+    CU_ASSERT(new_ctx_with_data(&acc, &spa_pkt, &ctx, 1) == FKO_SUCCESS);
+    fko_destroy(ctx);
+    ctx = NULL;
+
+    test_spa_pkt(&spa_pkt, "wronghmacwronghmac");
+    CU_ASSERT(new_ctx_with_data(&acc, &spa_pkt, &ctx, 1) != FKO_SUCCESS);
+    fko_destroy(ctx);
+    ctx = NULL;
+
+    test_spa_pkt(&spa_pkt, NULL);
+    CU_ASSERT(new_ctx_with_data(&acc, &spa_pkt, &ctx, 1) != FKO_SUCCESS);
+    fko_destroy(ctx);
+
+    fko_destroy_enc_key(acc.key_prep);
+    fko_destroy_hmac_key(acc.hmac_key_prep);
+    free_spa_ctx_arena();
+}
+
+int register_ts_incoming_spa(void)
+{
+    ts_init(&TEST_SUITE(incoming_spa), TEST_SUITE_DESCR(incoming_spa), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(incoming_spa), UTEST_FCT(unprepared_hmac_key), UTEST_DESCR(unprepared_hmac_key));
+
+    return register_ts(&TEST_SUITE(incoming_spa));
+}
+#endif /* HAVE_C_UNIT_TESTS */
+
 /***EOF***/
@@ -31,8 +31,24 @@
 #ifndef INCOMING_SPA_H
 #define INCOMING_SPA_H
 
+/* Most packets process_spa_packets() computes the replay digests of in
+ * one go.
+*/
+#define SPA_DIGEST_BATCH    8
+
 /* Prototypes
 */
 void incoming_spa(fko_srv_options_t *opts);
+void handle_spa_packet(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt);
+void process_spa_packet(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt);
+void process_spa_packets(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkts,
+        const int count);
+int actuate_spa_request(fko_srv_options_t *opts, acc_stanza_t *acc,
+        spa_data_t *spadat, const int stanza_num);
+void free_spa_ctx_arena(void);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_incoming_spa(void);
+#endif
 
 #endif  /* INCOMING_SPA_H */
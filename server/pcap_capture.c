@@ -39,10 +39,14 @@
 #include "process_packet.h"
 #include "fw_util.h"
 #include "cmd_cycle.h"
+#include "replay_cache.h"
 #include "log_msg.h"
 #include "fwknopd_errors.h"
 #include "sig_handler.h"
 #include "tcp_server.h"
+#include "event_loop.h"
+#include "afpacket_ring.h"
+#include "blacklist.h"
 
 #if HAVE_SYS_WAIT_H
   #include <sys/wait.h>
@@ -50,32 +54,378 @@
 
 #if USE_LIBPCAP
 
+/* State shared by the capture loop and its event loop callbacks
+*/
+typedef struct pcap_loop
+{
+    fko_srv_options_t  *opts;
+    pcap_t             *pcap;
+    const char         *filter;     /* PCAP_FILTER, less any BLACKLIST */
+#if HAVE_AF_PACKET_RING
+    afpacket_ring_t    *ring;
+    int                 ring_blocks;
+#endif
+    int                 pcap_dispatch_count;
+    int                 rules_chk_threshold;
+    int                 chk_rm_all;
+    int                 pcap_errcnt;
+    int                 pending_break;
+    int                 done;
+} pcap_loop_t;
+
+/* If we got a SIGCHLD and it was the tcp server, then handle it here.
+*/
+static void
+pcap_check_tcp_server(fko_srv_options_t *opts)
+{
+    int     status;
+    pid_t   child_pid;
+
+    if(! got_sigchld)
+        return;
+
+    if(opts->tcp_server_pid > 0)
+    {
+        child_pid = waitpid(0, &status, WNOHANG);
+
+        if(child_pid == opts->tcp_server_pid)
+        {
+            if(WIFSIGNALED(status))
+                log_msg(LOG_WARNING, "TCP server got signal: %i",  WTERMSIG(status));
+
+            log_msg(LOG_WARNING,
+                "TCP server exited with status of %i. Attempting restart.",
+                WEXITSTATUS(status)
+            );
+
+            opts->tcp_server_pid = 0;
+
+            /* Attempt to restart tcp server ? */
+            usleep(1000000);
+            run_tcp_server(opts);
+        }
+    }
+
+    got_sigchld = 0;
+    return;
+}
+
+/* Expired rules, CMD_CYCLE_CLOSE commands and buffered digests.
+*/
+static void
+pcap_housekeeping(pcap_loop_t *pl)
+{
+    fko_srv_options_t  *opts = pl->opts;
+#if FIREWALL_IPFW
+    time_t              now;
+#endif
+
+    /* With SPA_WORKER_THREADS set, this is done by the pipeline's
+     * actuator thread.
+    */
+    if(!opts->test && opts->spa_pipeline == NULL)
+    {
+        if(opts->enable_fw)
+        {
+            /* Check for any expired firewall rules and deal with them.
+            */
+            if(pl->rules_chk_threshold > 0)
+            {
+                opts->check_rules_ctr++;
+                if ((opts->check_rules_ctr % pl->rules_chk_threshold) == 0)
+                {
+                    pl->chk_rm_all = 1;
+                    opts->check_rules_ctr = 0;
+                }
+            }
+            check_firewall_rules(opts, pl->chk_rm_all);
+            pl->chk_rm_all = 0;
+        }
+
+        /* See if any CMD_CYCLE_CLOSE commands need to be executed.
+        */
+        cmd_cycle_close(opts);
+
+        /* Write out digests that have been buffered for too long.
+        */
+        replay_cache_sync(opts);
+    }
+
+#if FIREWALL_IPFW
+    /* Purge expired rules that no longer have any corresponding
+     * dynamic rules.
+    */
+    if(opts->fw_config->total_rules > 0 && opts->spa_pipeline == NULL)
+    {
+        time(&now);
+        if(opts->fw_config->last_purge < (now - opts->fw_config->purge_interval))
+        {
+            ipfw_purge_expired_rules(opts);
+            opts->fw_config->last_purge = now;
+        }
+    }
+#endif
+    return;
+}
+
+/* Count the set of processed packets (pcap_dispatch() return value) - we
+ * use this as a comparison for --packet-limit regardless of SPA packet
+ * validity at this point.
+*/
+static void
+pcap_count_packets(pcap_loop_t *pl, const int res)
+{
+    fko_srv_options_t  *opts = pl->opts;
+
+    if(opts->foreground == 1 && opts->verbose > 2)
+        log_msg(LOG_DEBUG, "pcap_dispatch() processed: %d packets", res);
+
+    opts->packet_ctr += res;
+    if (opts->packet_ctr_limit && opts->packet_ctr >= opts->packet_ctr_limit)
+    {
+        log_msg(LOG_WARNING,
+            "* Incoming packet count limit of %i reached",
+            opts->packet_ctr_limit
+        );
+
+        if(pl->pcap != NULL)
+        {
+            pcap_breakloop(pl->pcap);
+            pl->pending_break = 1;
+        }
+        else
+            pl->done = 1;
+    }
+    return;
+}
+
+/* Run pcap_dispatch() once and account for the result.  pl->done is set
+ * when the capture loop should be left.
+*/
+static void
+pcap_dispatch_once(pcap_loop_t *pl)
+{
+    fko_srv_options_t  *opts = pl->opts;
+    int                 res;
+
+    res = pcap_dispatch(pl->pcap, pl->pcap_dispatch_count,
+        (pcap_handler)&process_packet, (unsigned char *)opts);
+
+    /* Count processed packets
+    */
+    if(res > 0)
+        pcap_count_packets(pl, res);
+    /* If there was an error, complain and go on (to an extent before
+     * giving up).
+    */
+    else if(res == -1)
+    {
+        if((strncasecmp(opts->config[CONF_EXIT_AT_INTF_DOWN], "Y", 1) == 0)
+                && errno == ENETDOWN)
+        {
+            log_msg(LOG_ERR, "[*] Fatal error from pcap_dispatch: %s",
+                pcap_geterr(pl->pcap)
+            );
+            clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+        }
+        else
+        {
+            log_msg(LOG_ERR, "[*] Error from pcap_dispatch: %s",
+                pcap_geterr(pl->pcap)
+            );
+        }
+
+        if(pl->pcap_errcnt++ > MAX_PCAP_ERRORS_BEFORE_BAIL)
+        {
+            log_msg(LOG_ERR, "[*] %i consecutive pcap errors.  Giving up",
+                pl->pcap_errcnt
+            );
+            clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+        }
+    }
+    else if(pl->pending_break == 1 || res == -2)
+    {
+        /* pcap_breakloop was called, so we bail. */
+        log_msg(LOG_INFO, "Gracefully leaving the fwknopd event loop.");
+        pl->done = 1;
+    }
+    else
+        pl->pcap_errcnt = 0;
+
+    return;
+}
+
+#if EVLOOP_EPOLL
+static void
+pcap_readable(evloop_t *loop, int fd, void *arg)
+{
+    pcap_dispatch_once((pcap_loop_t *)arg);
+    return;
+}
+#endif
+
+#if HAVE_AF_PACKET_RING
+static void
+afpacket_readable(evloop_t *loop, int fd, void *arg)
+{
+    pcap_loop_t    *pl = (pcap_loop_t *)arg;
+    int             res;
+
+    res = afpacket_dispatch(pl->ring, pl->ring_blocks,
+            (pcap_handler)&process_packet, (unsigned char *)pl->opts);
+    if(res > 0)
+        pcap_count_packets(pl, res);
+    return;
+}
+#endif
+
+static void
+pcap_timer(evloop_t *loop, int fd, void *arg)
+{
+    pcap_loop_t    *pl = (pcap_loop_t *)arg;
+
+    pcap_check_tcp_server(pl->opts);
+    pcap_housekeeping(pl);
+    return;
+}
+
+/* Wait on the capture descriptor instead of polling it.  Packets are
+ * handled as soon as they arrive, and the housekeeping (along with signal
+ * checks) runs on a timer every PCAP_LOOP_SLEEP microseconds.  Returns -1
+ * if the event loop could not be set up.
+*/
+static int
+pcap_event_loop(pcap_loop_t *pl, const int fd, evloop_cb_t readable_cb,
+        const int useconds)
+{
+    evloop_t   *loop;
+
+    if((loop = evloop_new()) == NULL)
+        return -1;
+
+    if(evloop_add_fd(loop, fd, readable_cb, pl) != 0
+            || evloop_add_timer(loop, useconds > PCAP_MIN_TIMER_USECS
+                ? useconds : PCAP_MIN_TIMER_USECS, 1, pcap_timer, pl) < 0)
+    {
+        evloop_free(loop);
+        return -1;
+    }
+
+    log_msg(LOG_INFO, "Starting fwknopd main event loop.");
+
+    while(! pl->done)
+    {
+        if(sig_do_stop(pl->opts))
+        {
+            log_msg(LOG_INFO, "Gracefully leaving the fwknopd event loop.");
+            break;
+        }
+
+        if(pl->pending_break)
+        {
+            pcap_dispatch_once(pl);
+            continue;
+        }
+
+        if(evloop_run_once(loop, -1) < 0)
+        {
+            log_msg(LOG_ERR, "[*] Event loop error: %s", strerror(errno));
+            break;
+        }
+    }
+
+    evloop_free(loop);
+    return 0;
+}
+
+#if HAVE_AF_PACKET_RING
+/* Capture from an AF_PACKET ring rather than through libpcap.
+*/
+static int
+afpacket_capture(pcap_loop_t *pl, const int useconds,
+        const int max_sniff_bytes, const int promisc)
+{
+    fko_srv_options_t  *opts = pl->opts;
+    char                errstr[256] = {0};
+    unsigned int        packets, drops;
+    int                 is_err;
+
+    pl->ring_blocks = strtol_wrapper(opts->config[CONF_AF_PACKET_RING_BLOCKS],
+            1, RCHK_MAX_AF_PACKET_RING_BLOCKS, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid AF_PACKET_RING_BLOCKS");
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    log_msg(LOG_INFO, "Sniffing interface: %s (AF_PACKET ring, %d blocks)",
+        opts->config[CONF_PCAP_INTF], pl->ring_blocks);
+
+    pl->ring = afpacket_open(opts->config[CONF_PCAP_INTF], max_sniff_bytes,
+            promisc, opts->pcap_any_direction == 0, pl->ring_blocks,
+            pl->filter, errstr, sizeof(errstr));
+    if(pl->ring == NULL)
+    {
+        log_msg(LOG_ERR, "[*] AF_PACKET capture error: %s", errstr);
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    if (pl->filter[0] != '\0')
+        log_msg(LOG_INFO, "PCAP filter is: '%s'", pl->filter);
+
+    /* Frames always carry an Ethernet header
+    */
+    opts->data_link_offset = 14;
+
+    if(set_sig_handlers() > 0)
+        log_msg(LOG_ERR, "Errors encountered when setting signal handlers.");
+
+    if(pcap_event_loop(pl, afpacket_fd(pl->ring), afpacket_readable, useconds) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Could not set up the capture event loop");
+        afpacket_close(pl->ring);
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    if(afpacket_stats(pl->ring, &packets, &drops) == 0)
+        log_msg(LOG_INFO, "AF_PACKET ring: %u packets received, %u dropped by the kernel",
+            packets, drops);
+
+    afpacket_close(pl->ring);
+    return(0);
+}
+#endif
+
 /* The pcap capture routine.
 */
 int
 pcap_capture(fko_srv_options_t *opts)
 {
     pcap_t              *pcap;
+    pcap_loop_t         pl;
     char                errstr[PCAP_ERRBUF_SIZE] = {0};
     struct bpf_program  fp;
-    int                 res;
-    int                 pcap_errcnt = 0;
-    int                 pending_break = 0;
     int                 promisc = 0;
     int                 set_direction = 1;
     int                 pcap_file_mode = 0;
-    int                 status;
     int                 useconds;
-    int                 rules_chk_threshold;
-    int                 pcap_dispatch_count;
     int                 max_sniff_bytes;
     int                 is_err;
-    int                 chk_rm_all = 0;
-    pid_t               child_pid;
 
-#if FIREWALL_IPFW
-    time_t              now;
-#endif
+    /* Kept until the next (re)start
+    */
+    static char        *bl_filter = NULL;
+
+    memset(&pl, 0x0, sizeof(pl));
+    pl.opts = opts;
+
+    /* With BLACKLIST_KERNEL_FILTER the blacklisted sources are left out by
+     * the capture filter too.  A reloaded BLACKLIST only applies here
+     * after a restart.
+    */
+    free(bl_filter);
+    bl_filter = blacklist_pcap_filter(opts, opts->config[CONF_PCAP_FILTER]);
+    pl.filter = bl_filter != NULL ? bl_filter : opts->config[CONF_PCAP_FILTER];
 
     useconds = strtol_wrapper(opts->config[CONF_PCAP_LOOP_SLEEP],
             0, RCHK_MAX_PCAP_LOOP_SLEEP, NO_EXIT_UPON_ERR, &is_err);
@@ -93,7 +443,7 @@ pcap_capture(fko_srv_options_t *opts)
         clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
     }
 
-    rules_chk_threshold = strtol_wrapper(opts->config[CONF_RULES_CHECK_THRESHOLD],
+    pl.rules_chk_threshold = strtol_wrapper(opts->config[CONF_RULES_CHECK_THRESHOLD],
             0, RCHK_MAX_RULES_CHECK_THRESHOLD, NO_EXIT_UPON_ERR, &is_err);
     if(is_err != FKO_SUCCESS)
     {
@@ -110,6 +460,17 @@ pcap_capture(fko_srv_options_t *opts)
             && opts->config[CONF_PCAP_FILE][0] != '\0')
         pcap_file_mode = 1;
 
+    if(pcap_file_mode == 0
+            && strncasecmp(opts->config[CONF_ENABLE_AF_PACKET_RING], "Y", 1) == 0)
+    {
+#if HAVE_AF_PACKET_RING
+        return afpacket_capture(&pl, useconds, max_sniff_bytes, promisc);
+#else
+        log_msg(LOG_WARNING,
+            "[*] ENABLE_AF_PACKET_RING is not supported on this system, using libpcap.");
+#endif
+    }
+
     if(pcap_file_mode == 1) {
         log_msg(LOG_INFO, "Reading pcap file: %s",
             opts->config[CONF_PCAP_FILE]);
@@ -128,9 +489,31 @@ pcap_capture(fko_srv_options_t *opts)
         log_msg(LOG_INFO, "Sniffing interface: %s",
             opts->config[CONF_PCAP_INTF]);
 
+#if HAVE_PCAP_SET_IMMEDIATE_MODE
+        /* Immediate mode hands each packet over as soon as it arrives
+         * rather than when the capture buffer fills or times out.
+        */
+        pcap = pcap_create(opts->config[CONF_PCAP_INTF], errstr);
+
+        if(pcap != NULL)
+        {
+            pcap_set_snaplen(pcap, max_sniff_bytes);
+            pcap_set_promisc(pcap, promisc);
+            pcap_set_timeout(pcap, 100);
+            pcap_set_immediate_mode(pcap, 1);
+
+            if(pcap_activate(pcap) < 0)
+            {
+                strlcpy(errstr, pcap_geterr(pcap), sizeof(errstr));
+                pcap_close(pcap);
+                pcap = NULL;
+            }
+        }
+#else
         pcap = pcap_open_live(opts->config[CONF_PCAP_INTF],
             max_sniff_bytes, promisc, 100, errstr
         );
+#endif
 
         if(pcap == NULL)
         {
@@ -138,12 +521,11 @@ pcap_capture(fko_srv_options_t *opts)
             clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
         }
     }
-
     /* Set pcap filters, if any.
     */
-    if (opts->config[CONF_PCAP_FILTER][0] != '\0')
+    if (pl.filter[0] != '\0')
     {
-        if(pcap_compile(pcap, &fp, opts->config[CONF_PCAP_FILTER], 1, 0) == -1)
+        if(pcap_compile(pcap, &fp, pl.filter, 1, 0) == -1)
         {
             log_msg(LOG_ERR, "[*] Error compiling pcap filter: %s",
                 pcap_geterr(pcap)
@@ -159,7 +541,7 @@ pcap_capture(fko_srv_options_t *opts)
             clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
         }
 
-        log_msg(LOG_INFO, "PCAP filter is: '%s'", opts->config[CONF_PCAP_FILTER]);
+        log_msg(LOG_INFO, "PCAP filter is: '%s'", pl.filter);
 
         pcap_freecode(&fp);
     }
@@ -213,7 +595,7 @@ pcap_capture(fko_srv_options_t *opts)
         clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
     }
 
-    pcap_dispatch_count = strtol_wrapper(opts->config[CONF_PCAP_DISPATCH_COUNT],
+    pl.pcap_dispatch_count = strtol_wrapper(opts->config[CONF_PCAP_DISPATCH_COUNT],
             0, RCHK_MAX_PCAP_DISPATCH_COUNT, NO_EXIT_UPON_ERR, &is_err);
     if(is_err != FKO_SUCCESS)
     {
@@ -228,148 +610,38 @@ pcap_capture(fko_srv_options_t *opts)
     if(set_sig_handlers() > 0)
         log_msg(LOG_ERR, "Errors encountered when setting signal handlers.");
 
+    pl.pcap = pcap;
+
+#if EVLOOP_EPOLL
+    if(pcap_file_mode == 0 && DEF_PCAP_NONBLOCK
+            && pcap_get_selectable_fd(pcap) >= 0
+            && pcap_event_loop(&pl, pcap_get_selectable_fd(pcap),
+                pcap_readable, useconds) == 0)
+    {
+        pcap_close(pcap);
+        return(0);
+    }
+#endif
+
     log_msg(LOG_INFO, "Starting fwknopd main event loop.");
 
     /* Jump into our home-grown packet cature loop.
     */
     while(1)
     {
-        /* If we got a SIGCHLD and it was the tcp server, then handle it here.
-        */
-        if(got_sigchld)
-        {
-            if(opts->tcp_server_pid > 0)
-            {
-                child_pid = waitpid(0, &status, WNOHANG);
-
-                if(child_pid == opts->tcp_server_pid)
-                {
-                    if(WIFSIGNALED(status))
-                        log_msg(LOG_WARNING, "TCP server got signal: %i",  WTERMSIG(status));
-
-                    log_msg(LOG_WARNING,
-                        "TCP server exited with status of %i. Attempting restart.",
-                        WEXITSTATUS(status)
-                    );
-
-                    opts->tcp_server_pid = 0;
-
-                    /* Attempt to restart tcp server ? */
-                    usleep(1000000);
-                    run_tcp_server(opts);
-                }
-            }
-
-            got_sigchld = 0;
-        }
+        pcap_check_tcp_server(opts);
 
         if(sig_do_stop(opts))
         {
             pcap_breakloop(pcap);
-            pending_break = 1;
+            pl.pending_break = 1;
         }
 
-        res = pcap_dispatch(pcap, pcap_dispatch_count,
-            (pcap_handler)&process_packet, (unsigned char *)opts);
-
-        /* Count processed packets
-        */
-        if(res > 0)
-        {
-            if(opts->foreground == 1 && opts->verbose > 2)
-                log_msg(LOG_DEBUG, "pcap_dispatch() processed: %d packets", res);
-
-            /* Count the set of processed packets (pcap_dispatch() return
-             * value) - we use this as a comparison for --packet-limit regardless
-             * of SPA packet validity at this point.
-            */
-            opts->packet_ctr += res;
-            if (opts->packet_ctr_limit && opts->packet_ctr >= opts->packet_ctr_limit)
-            {
-                log_msg(LOG_WARNING,
-                    "* Incoming packet count limit of %i reached",
-                    opts->packet_ctr_limit
-                );
-
-                pcap_breakloop(pcap);
-                pending_break = 1;
-            }
-        }
-        /* If there was an error, complain and go on (to an extent before
-         * giving up).
-        */
-        else if(res == -1)
-        {
-            if((strncasecmp(opts->config[CONF_EXIT_AT_INTF_DOWN], "Y", 1) == 0)
-                    && errno == ENETDOWN)
-            {
-                log_msg(LOG_ERR, "[*] Fatal error from pcap_dispatch: %s",
-                    pcap_geterr(pcap)
-                );
-                clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
-            }
-            else
-            {
-                log_msg(LOG_ERR, "[*] Error from pcap_dispatch: %s",
-                    pcap_geterr(pcap)
-                );
-            }
-
-            if(pcap_errcnt++ > MAX_PCAP_ERRORS_BEFORE_BAIL)
-            {
-                log_msg(LOG_ERR, "[*] %i consecutive pcap errors.  Giving up",
-                    pcap_errcnt
-                );
-                clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
-            }
-        }
-        else if(pending_break == 1 || res == -2)
-        {
-            /* pcap_breakloop was called, so we bail. */
-            log_msg(LOG_INFO, "Gracefully leaving the fwknopd event loop.");
+        pcap_dispatch_once(&pl);
+        if(pl.done)
             break;
-        }
-        else
-            pcap_errcnt = 0;
 
-        if(!opts->test)
-        {
-            if(opts->enable_fw)
-            {
-                /* Check for any expired firewall rules and deal with them.
-                */
-                if(rules_chk_threshold > 0)
-                {
-                    opts->check_rules_ctr++;
-                    if ((opts->check_rules_ctr % rules_chk_threshold) == 0)
-                    {
-                        chk_rm_all = 1;
-                        opts->check_rules_ctr = 0;
-                    }
-                }
-                check_firewall_rules(opts, chk_rm_all);
-                chk_rm_all = 0;
-            }
-
-            /* See if any CMD_CYCLE_CLOSE commands need to be executed.
-            */
-            cmd_cycle_close(opts);
-        }
-
-#if FIREWALL_IPFW
-        /* Purge expired rules that no longer have any corresponding
-         * dynamic rules.
-        */
-        if(opts->fw_config->total_rules > 0)
-        {
-            time(&now);
-            if(opts->fw_config->last_purge < (now - opts->fw_config->purge_interval))
-            {
-                ipfw_purge_expired_rules(opts);
-                opts->fw_config->last_purge = now;
-            }
-        }
-#endif
+        pcap_housekeeping(&pl);
 
         usleep(useconds);
     }
@@ -47,6 +47,11 @@
     #define DEF_PCAP_NONBLOCK 1
 #endif
 
+/* Shortest housekeeping interval (in microseconds) when waiting on the
+ * pcap descriptor in the event loop, since PCAP_LOOP_SLEEP may be zero.
+*/
+#define PCAP_MIN_TIMER_USECS        1000
+
 /* Prototypes
 */
 int pcap_capture(fko_srv_options_t *opts);
@@ -0,0 +1,368 @@
+/*
+ *****************************************************************************
+ *
+ * File:    rate_limit.c
+ *
+ * Purpose: Token bucket rate limiting of incoming SPA packets by source
+ *          address and SDP Client ID, ahead of replay checks and
+ *          decryption.  The buckets are kept in a fixed size table of
+ *          small sets; a new key takes the place of the least recently
+ *          seen one in its set, so memory use does not depend on how
+ *          many sources an attacker sprays from.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "rate_limit.h"
+#include "log_msg.h"
+#include "fwknopd_errors.h"
+#include "utils.h"
+#include <time.h>
+
+#ifdef HAVE_C_UNIT_TESTS
+  #include "cunit_common.h"
+  DECLARE_TEST_SUITE(rate_limit, "Rate limit test suite");
+#endif
+
+/* A set is one cache line, holding its buckets and the lock for them
+*/
+#define RATE_LIMIT_SET_SIZE 64
+#define RATE_LIMIT_WAYS     3
+
+/* Tokens are counted in thousandths of a packet, refilled every ms
+*/
+#define RATE_LIMIT_TOKEN    1000
+
+typedef struct rate_bucket
+{
+    uint64_t    key;        /* kind << 32 | key, 0 for a free bucket */
+    uint32_t    tokens;
+    uint32_t    last_ms;
+} rate_bucket_t;
+
+typedef struct rate_set
+{
+    rate_bucket_t   b[RATE_LIMIT_WAYS];
+    unsigned char   lock;
+    unsigned char   pad[RATE_LIMIT_SET_SIZE
+                        - RATE_LIMIT_WAYS * sizeof(rate_bucket_t) - 1];
+} rate_set_t;
+
+struct rate_limit
+{
+    rate_set_t     *sets;
+    uint32_t        set_mask;
+    uint32_t        rate;       /* packets per second */
+    uint32_t        max_tokens;
+
+    uint64_t        passed;
+    uint64_t        shed[RATE_LIMIT_KINDS];
+    uint64_t        evictions;
+};
+
+static void
+free_rate_limit(struct rate_limit *rl)
+{
+    if(rl == NULL)
+        return;
+
+    free(rl->sets);
+    free(rl);
+}
+
+static struct rate_limit *
+rate_limit_new(const uint32_t rate, const uint32_t burst, const uint32_t table_size)
+{
+    struct rate_limit  *rl = NULL;
+    uint32_t            nb_sets = 1;
+
+    while(nb_sets * RATE_LIMIT_WAYS < table_size)
+        nb_sets <<= 1;
+
+    if((rl = calloc(1, sizeof(struct rate_limit))) == NULL)
+        return NULL;
+
+    if(posix_memalign((void **)&rl->sets, RATE_LIMIT_SET_SIZE,
+                nb_sets * sizeof(rate_set_t)) != 0)
+    {
+        free(rl);
+        return NULL;
+    }
+    memset(rl->sets, 0x0, nb_sets * sizeof(rate_set_t));
+
+    rl->set_mask   = nb_sets - 1;
+    rl->rate       = rate;
+    rl->max_tokens = burst * RATE_LIMIT_TOKEN;
+
+    return rl;
+}
+
+/* Set up the limiter from SPA_RATE_LIMIT, SPA_RATE_BURST and
+ * SPA_RATE_TABLE_SIZE.  opts->rate_limit stays NULL when there is no limit.
+*/
+int
+rate_limit_init(fko_srv_options_t *opts)
+{
+    int     rate, burst, table_size, is_err;
+
+    rate_limit_free(opts);
+
+    rate = strtol_wrapper(opts->config[CONF_SPA_RATE_LIMIT],
+            0, RCHK_MAX_SPA_RATE_LIMIT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid SPA_RATE_LIMIT");
+        return FWKNOPD_ERROR_BAD_CONFIG;
+    }
+
+    if(rate == 0)
+        return FWKNOPD_SUCCESS;
+
+    burst = strtol_wrapper(opts->config[CONF_SPA_RATE_BURST],
+            1, RCHK_MAX_SPA_RATE_BURST, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid SPA_RATE_BURST");
+        return FWKNOPD_ERROR_BAD_CONFIG;
+    }
+
+    table_size = strtol_wrapper(opts->config[CONF_SPA_RATE_TABLE_SIZE],
+            64, RCHK_MAX_SPA_RATE_TABLE_SIZE, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid SPA_RATE_TABLE_SIZE");
+        return FWKNOPD_ERROR_BAD_CONFIG;
+    }
+
+    if((opts->rate_limit = rate_limit_new(rate, burst, table_size)) == NULL)
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+
+    log_msg(LOG_INFO, "Limiting SPA packets to %d/s (burst %d) per source, %u buckets",
+            rate, burst, (opts->rate_limit->set_mask + 1) * RATE_LIMIT_WAYS);
+
+    return FWKNOPD_SUCCESS;
+}
+
+/* Take a token from the bucket for key, creating it (full) if needed.
+ * Returns 1 if there was one.
+*/
+static int
+rate_limit_take(struct rate_limit *rl, const uint64_t key, const uint32_t now_ms)
+{
+    rate_set_t     *set;
+    rate_bucket_t  *b = NULL, *victim = NULL;
+    uint64_t        tokens;
+    uint32_t        idx;
+    int             i, ok = 0;
+
+    idx  = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & rl->set_mask;
+    set  = &rl->sets[idx];
+
+    while(__atomic_test_and_set(&set->lock, __ATOMIC_ACQUIRE))
+        ;
+
+    for(i = 0; i < RATE_LIMIT_WAYS; i++)
+    {
+        if(set->b[i].key == key)
+        {
+            b = &set->b[i];
+            break;
+        }
+
+        // a free bucket, or else the one idle the longest
+        if(victim == NULL || (victim->key != 0
+                && (set->b[i].key == 0
+                    || now_ms - set->b[i].last_ms > now_ms - victim->last_ms)))
+            victim = &set->b[i];
+    }
+
+    if(b == NULL)
+    {
+        if(victim->key != 0)
+            __atomic_add_fetch(&rl->evictions, 1, __ATOMIC_RELAXED);
+
+        b          = victim;
+        b->key     = key;
+        b->tokens  = rl->max_tokens;
+    }
+    else
+    {
+        tokens = b->tokens + (uint64_t)(now_ms - b->last_ms) * rl->rate;
+        b->tokens = tokens > rl->max_tokens ? rl->max_tokens : (uint32_t)tokens;
+    }
+
+    b->last_ms = now_ms;
+
+    if(b->tokens >= RATE_LIMIT_TOKEN)
+    {
+        b->tokens -= RATE_LIMIT_TOKEN;
+        ok = 1;
+    }
+
+    __atomic_clear(&set->lock, __ATOMIC_RELEASE);
+
+    return ok;
+}
+
+static int
+rate_limit_check_at(struct rate_limit *rl, const int kind, const uint32_t key,
+        const uint32_t now_ms)
+{
+    uint64_t    shed;
+
+    if(rate_limit_take(rl, ((uint64_t)kind << 32) | key, now_ms))
+    {
+        __atomic_add_fetch(&rl->passed, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    shed = __atomic_add_fetch(&rl->shed[kind], 1, __ATOMIC_RELAXED);
+    if(shed == 1 || (shed % 10000) == 0)
+        log_msg(LOG_WARNING, "SPA rate limit: %"PRIu64" packets over the %s limit dropped so far",
+                shed, kind == RATE_LIMIT_SDP_ID ? "SDP Client ID" : "source address");
+
+    return 0;
+}
+
+/* Return 1 if a packet for key (a source address in network byte order
+ * or an SDP Client ID) may go on to be processed, 0 if it is to be dropped.
+*/
+int
+rate_limit_check(fko_srv_options_t *opts, const int kind, const uint32_t key)
+{
+    struct timespec ts;
+
+    if(opts->rate_limit == NULL)
+        return 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return rate_limit_check_at(opts->rate_limit, kind, key,
+            (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000));
+}
+
+void
+rate_limit_dump(const fko_srv_options_t *opts)
+{
+    struct rate_limit *rl = opts->rate_limit;
+
+    if(rl == NULL)
+        return;
+
+    log_msg(LOG_INFO,
+        "SPA rate limit: %"PRIu64" packets passed, %"PRIu64" dropped by source, %"PRIu64" by SDP Client ID, %"PRIu64" buckets recycled",
+        __atomic_load_n(&rl->passed, __ATOMIC_RELAXED),
+        __atomic_load_n(&rl->shed[RATE_LIMIT_SRC_IP], __ATOMIC_RELAXED),
+        __atomic_load_n(&rl->shed[RATE_LIMIT_SDP_ID], __ATOMIC_RELAXED),
+        __atomic_load_n(&rl->evictions, __ATOMIC_RELAXED));
+}
+
+/* Only for use once all packet handling threads have stopped
+*/
+void
+rate_limit_free(fko_srv_options_t *opts)
+{
+    free_rate_limit(opts->rate_limit);
+    opts->rate_limit = NULL;
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+DECLARE_UTEST(token_buckets, "check token bucket refill and separate keys")
+{
+    struct rate_limit  *rl = rate_limit_new(2, 3, 64);
+    int                 i, passed = 0;
+
+    CU_ASSERT_FATAL(rl != NULL);
+
+    /* A burst of 3, then nothing until tokens come back at 2/s
+    */
+    for(i = 0; i < 5; i++)
+        passed += rate_limit_check_at(rl, RATE_LIMIT_SRC_IP, 0x0A000001, 1000);
+    CU_ASSERT(passed == 3);
+    CU_ASSERT(rl->shed[RATE_LIMIT_SRC_IP] == 2);
+
+    CU_ASSERT(rate_limit_check_at(rl, RATE_LIMIT_SRC_IP, 0x0A000001, 1400) == 0);
+    CU_ASSERT(rate_limit_check_at(rl, RATE_LIMIT_SRC_IP, 0x0A000001, 1500) == 1);
+    CU_ASSERT(rate_limit_check_at(rl, RATE_LIMIT_SRC_IP, 0x0A000001, 1500) == 0);
+
+    /* Other sources, and an SDP ID with the same value, are not affected
+    */
+    CU_ASSERT(rate_limit_check_at(rl, RATE_LIMIT_SRC_IP, 0x0A000002, 1500) == 1);
+    CU_ASSERT(rate_limit_check_at(rl, RATE_LIMIT_SDP_ID, 0x0A000001, 1500) == 1);
+
+    /* An idle source gets no more than a full burst back
+    */
+    passed = 0;
+    for(i = 0; i < 5; i++)
+        passed += rate_limit_check_at(rl, RATE_LIMIT_SRC_IP, 0x0A000001, 100000);
+    CU_ASSERT(passed == 3);
+
+    /* Millisecond counter wrap around
+    */
+    for(i = 0; i < 3; i++)
+        rate_limit_check_at(rl, RATE_LIMIT_SDP_ID, 7, 0xFFFFFF00);
+    CU_ASSERT(rate_limit_check_at(rl, RATE_LIMIT_SDP_ID, 7, 0xFFFFFF00) == 0);
+    CU_ASSERT(rate_limit_check_at(rl, RATE_LIMIT_SDP_ID, 7, 0x00000300) == 1);
+
+    free_rate_limit(rl);
+}
+
+DECLARE_UTEST(fixed_table, "check the bucket table stays bounded")
+{
+    struct rate_limit  *rl = rate_limit_new(1, 1, 64);
+    uint32_t            ip;
+
+    CU_ASSERT_FATAL(rl != NULL);
+    CU_ASSERT(sizeof(rate_set_t) == RATE_LIMIT_SET_SIZE);
+    CU_ASSERT(((uintptr_t)rl->sets % RATE_LIMIT_SET_SIZE) == 0);
+    CU_ASSERT(rl->set_mask + 1 == 32);
+
+    /* A busy source that keeps sending holds on to its bucket while a
+     * spray of new sources recycles the idle ones
+    */
+    CU_ASSERT(rate_limit_check_at(rl, RATE_LIMIT_SRC_IP, 1, 10) == 1);
+    for(ip = 100; ip < 10100; ip++)
+    {
+        CU_ASSERT(rate_limit_check_at(rl, RATE_LIMIT_SRC_IP, ip, 10 + ip) == 1);
+        if((ip % 8) == 0)
+            CU_ASSERT(rate_limit_check_at(rl, RATE_LIMIT_SRC_IP, 1, 10 + ip) == (ip % 1000 == 0));
+    }
+    CU_ASSERT(rl->evictions >= 10000 - 32 * RATE_LIMIT_WAYS);
+    CU_ASSERT(rl->shed[RATE_LIMIT_SRC_IP] > 0);
+
+    free_rate_limit(rl);
+}
+
+int register_ts_rate_limit(void)
+{
+    ts_init(&TEST_SUITE(rate_limit), TEST_SUITE_DESCR(rate_limit), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(rate_limit), UTEST_FCT(token_buckets), UTEST_DESCR(token_buckets));
+    ts_add_utest(&TEST_SUITE(rate_limit), UTEST_FCT(fixed_table), UTEST_DESCR(fixed_table));
+
+    return register_ts(&TEST_SUITE(rate_limit));
+}
+#endif /* HAVE_C_UNIT_TESTS */
+
+/***EOF***/
@@ -0,0 +1,55 @@
+/*
+ *****************************************************************************
+ *
+ * File:    rate_limit.h
+ *
+ * Purpose: Header file for rate_limit.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+/* What a rate limit bucket is keyed by
+*/
+enum {
+    RATE_LIMIT_SRC_IP = 1,
+    RATE_LIMIT_SDP_ID,
+    RATE_LIMIT_KINDS
+};
+
+/* Prototypes
+*/
+int rate_limit_init(fko_srv_options_t *opts);
+int rate_limit_check(fko_srv_options_t *opts, const int kind, const uint32_t key);
+void rate_limit_dump(const fko_srv_options_t *opts);
+void rate_limit_free(fko_srv_options_t *opts);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_rate_limit(void);
+#endif
+
+#endif /* RATE_LIMIT_H */
+
+/***EOF***/
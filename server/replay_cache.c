@@ -40,6 +40,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/mman.h>
 
 #if HAVE_LIBGDBM
   #include <gdbm.h>
@@ -76,8 +79,63 @@
 
 #include <fcntl.h>
 
+#ifdef HAVE_C_UNIT_TESTS
+  #include <sys/wait.h>
+  #include <sys/resource.h>
+  #include "cunit_common.h"
+  DECLARE_TEST_SUITE(replay_cache, "Replay cache test suite");
+#endif
+
 #define DATE_LEN 18
-#define MAX_DIGEST_SIZE 64
+
+/* Bounds on the number of entries in the in-memory digest cache ring
+*/
+#define DIGEST_CACHE_MIN_SIZE   1024
+#define DIGEST_CACHE_MAX_SIZE   0x1000000
+
+/* Serializes the replay checks made by the SPA pipeline worker threads
+*/
+static pthread_mutex_t replay_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#if ! USE_FILE_CACHE && ! defined(NO_DIGEST_CACHE)
+/* Bloom filter in front of the digest db: bits per expected entry and
+ * number of probes (~0.2% false positives when at capacity), and bounds
+ * on the filter size.
+*/
+#define DIGEST_BLOOM_BITS_PER_ENTRY 16
+#define DIGEST_BLOOM_HASHES         4
+#define DIGEST_BLOOM_MIN_BITS       (1 << 20)
+#define DIGEST_BLOOM_MAX_BITS       0x80000000U
+
+#ifdef HAVE_LIBGDBM
+  typedef GDBM_FILE digest_dbh_t;
+#else
+  typedef DBM      *digest_dbh_t;
+#endif
+
+/* Digests accepted but not yet written back to the db
+*/
+typedef struct digest_db_pending {
+    char                digest[MAX_DIGEST_SIZE+1];
+    digest_cache_info_t cache_info;
+} digest_db_pending_t;
+
+/* The long-lived digest db handle along with its bloom filter and
+ * write-back buffer.
+*/
+struct digest_db {
+    digest_dbh_t            rpdb;
+    unsigned char          *bloom;
+    uint32_t                bloom_mask;
+    unsigned int            bloom_count;
+    unsigned int            bloom_capacity;
+    digest_db_pending_t    *pending;
+    unsigned int            pending_count;
+    unsigned int            sync_records;
+    unsigned int            sync_interval;  /* milliseconds, zero disables */
+    struct timespec         first_pending;
+};
+#endif
 
 /* Rotate the digest file by simply renaming it.
 */
@@ -139,7 +197,7 @@ rotate_digest_cache_file(fko_srv_options_t *opts)
 }
 
 static void
-replay_warning(fko_srv_options_t *opts, digest_cache_info_t *digest_info)
+replay_warning(const spa_pkt_info_t *spa_pkt, digest_cache_info_t *digest_info)
 {
     char        src_ip[INET_ADDRSTRLEN+1] = {0};
     char        orig_src_ip[INET_ADDRSTRLEN+1] = {0};
@@ -151,7 +209,7 @@ replay_warning(fko_srv_options_t *opts, digest_cache_info_t *digest_info)
 
     /* Convert the IPs to a human readable form
     */
-    inet_ntop(AF_INET, &(opts->spa_pkt.packet_src_ip),
+    inet_ntop(AF_INET, &(spa_pkt->packet_src_ip),
         src_ip, INET_ADDRSTRLEN);
     inet_ntop(AF_INET, &(digest_info->src_ip), orig_src_ip, INET_ADDRSTRLEN);
 
@@ -189,8 +247,8 @@ replay_warning(fko_srv_options_t *opts, digest_cache_info_t *digest_info)
         "Replay count: %i",
 #endif
         src_ip,
-        opts->spa_pkt.packet_proto,
-        opts->spa_pkt.packet_dst_port,
+        spa_pkt->packet_proto,
+        spa_pkt->packet_dst_port,
         orig_src_ip,
         digest_info->proto,
         digest_info->dst_port,
@@ -207,506 +265,1458 @@ replay_warning(fko_srv_options_t *opts, digest_cache_info_t *digest_info)
     return;
 }
 
-#if USE_FILE_CACHE
-static int
-replay_file_cache_init(fko_srv_options_t *opts)
+/* Milliseconds elapsed since 'start' on the monotonic clock
+*/
+static long
+elapsed_ms(const struct timespec *start)
 {
-    FILE           *digest_file_ptr = NULL;
-    unsigned int    num_lines = 0, digest_ctr = 0;
-    char            line_buf[MAX_LINE_LEN]    = {0};
-    char            src_ip[INET_ADDRSTRLEN+1] = {0};
-    char            dst_ip[INET_ADDRSTRLEN+1] = {0};
-    long int        time_tmp;
-    int             digest_file_fd = -1;
-    char            digest_header[] = "# <digest> <proto> <src_ip> <src_port> <dst_ip> <dst_port> <time>\n";
-
-    struct digest_cache_list *digest_elm = NULL;
-
-    /* if the file exists, import the previous SPA digests into
-     * the cache list
-    */
-    if (access(opts->config[CONF_DIGEST_FILE], F_OK) == 0)
-    {
-        /* Check permissions
-        */
-        if (access(opts->config[CONF_DIGEST_FILE], R_OK|W_OK) != 0)
-        {
-            log_msg(LOG_WARNING, "Digest file '%s' exists but: '%s'",
-                opts->config[CONF_DIGEST_FILE], strerror(errno));
-            return(-1);
-        }
-    }
-    else
-    {
-        /* the file does not exist yet, so it will be created when the first
-         * successful SPA packet digest is written to disk
-        */
-        digest_file_fd = open(opts->config[CONF_DIGEST_FILE],
-                O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
-
-        if (digest_file_fd == -1)
-        {
-            log_msg(LOG_WARNING, "Could not create digest cache: %s: %s",
-                opts->config[CONF_DIGEST_FILE], strerror(errno));
-            return(-1);
-        }
-        else
-        {
-            if(write(digest_file_fd, digest_header, strlen(digest_header))
-                    != strlen(digest_header)) {
-                log_msg(LOG_WARNING,
-                    "Did not write expected number of bytes to digest cache: %s",
-                    opts->config[CONF_DIGEST_FILE]);
-            }
-            close(digest_file_fd);
+    struct timespec now;
 
-            return(0);
-        }
-    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    if(verify_file_perms_ownership(opts->config[CONF_DIGEST_FILE]) != 1)
-        return(-1);
+    return((now.tv_sec - start->tv_sec) * 1000
+            + (now.tv_nsec - start->tv_nsec) / 1000000);
+}
 
-    /* File exists, and we have access - create in-memory digest cache
-    */
-    if ((digest_file_ptr = fopen(opts->config[CONF_DIGEST_FILE], "r")) == NULL)
-    {
-        log_msg(LOG_WARNING, "Could not open digest cache: %s",
-            opts->config[CONF_DIGEST_FILE]);
-        return(-1);
-    }
+#if ! USE_FILE_CACHE && ! defined(NO_DIGEST_CACHE)
+/* Compute the two base hashes used for double hashing into the bloom
+ * filter (FNV-1a and one-at-a-time over the digest bytes).
+*/
+static void
+digest_bloom_hashes(const char *digest, size_t len, uint32_t *h1, uint32_t *h2)
+{
+    const unsigned char    *p = (const unsigned char *)digest;
+    uint32_t                a = 2166136261U, b = 0;
 
-    /* Line format:
-     * <digest> <proto> <src_ip> <src_port> <dst_ip> <dst_port> <time>
-     * Example:
-     * 7XgadOyqv0tF5xG8uhg2iIrheeNKglCWKmxQDgYP1dY 17 127.0.0.1 40305 127.0.0.1 62201 1313283481
-    */
-    while ((fgets(line_buf, MAX_LINE_LEN, digest_file_ptr)) != NULL)
+    while(len-- > 0)
     {
-        num_lines++;
-        line_buf[MAX_LINE_LEN-1] = '\0';
+        a ^= *p;
+        a *= 16777619U;
 
-        if(IS_EMPTY_LINE(line_buf[0]))
-            continue;
-
-        /* Initialize a digest cache list element, and add it into the list if
-         * valid.
-        */
-        if ((digest_elm = calloc(1, sizeof(struct digest_cache_list))) == NULL)
-        {
-            log_msg(LOG_ERR, "[*] Could not allocate digest list element");
-            continue;
-        }
-        if ((digest_elm->cache_info.digest = calloc(1, MAX_DIGEST_SIZE+1)) == NULL)
-        {
-            free(digest_elm);
-            log_msg(LOG_ERR, "[*] Could not allocate digest string");
-            continue;
-        }
-        src_ip[0] = '\0';
-        dst_ip[0] = '\0';
+        b += *p++;
+        b += (b << 10);
+        b ^= (b >> 6);
+    }
+    b += (b << 3);
+    b ^= (b >> 11);
+    b += (b << 15);
 
-        if(sscanf(line_buf, "%64s %hhu %16s %hu %16s %hu %ld",
-            digest_elm->cache_info.digest,  /* %64s, buffer size is MAX_DIGEST_SIZE+1 */
-            &(digest_elm->cache_info.proto),
-            src_ip,  /* %16s, buffer size is INET_ADDRSTRLEN+1 */
-            &(digest_elm->cache_info.src_port),
-            dst_ip,  /* %16s, buffer size is INET_ADDRSTRLEN+1 */
-            &(digest_elm->cache_info.dst_port),
-            &time_tmp) != 7)
-        {
-            log_msg(LOG_INFO,
-                "*Skipping invalid digest file entry in %s at line %i.\n - %s",
-                opts->config[CONF_DIGEST_FILE], num_lines, line_buf
-            );
-            free(digest_elm->cache_info.digest);
-            free(digest_elm);
-            continue;
-        }
-        digest_elm->cache_info.created = time_tmp;
+    *h1 = a;
+    *h2 = b | 1;
+    return;
+}
 
+static void
+digest_bloom_add(struct digest_db *db, const char *digest, size_t len)
+{
+    uint32_t    h1, h2, bit;
+    int         i;
 
-        if (inet_pton(AF_INET, src_ip, &(digest_elm->cache_info.src_ip)) != 1)
-        {
-            free(digest_elm->cache_info.digest);
-            free(digest_elm);
-            continue;
-        }
+    db->bloom_count++;
+    if(db->bloom == NULL)
+        return;
 
-        if (inet_pton(AF_INET, dst_ip, &(digest_elm->cache_info.dst_ip)) != 1)
-        {
-            free(digest_elm->cache_info.digest);
-            free(digest_elm);
-            continue;
-        }
+    digest_bloom_hashes(digest, len, &h1, &h2);
+    for(i=0; i < DIGEST_BLOOM_HASHES; i++)
+    {
+        bit = (h1 + i * h2) & db->bloom_mask;
+        db->bloom[bit >> 3] |= (1 << (bit & 7));
+    }
+    return;
+}
 
-        digest_elm->next   = opts->digest_cache;
-        opts->digest_cache = digest_elm;
-        digest_ctr++;
+/* Returns zero if the digest has definitely never been stored
+*/
+static int
+digest_bloom_check(struct digest_db *db, const char *digest, size_t len)
+{
+    uint32_t    h1, h2, bit;
+    int         i;
 
-        if(opts->verbose > 3)
-            log_msg(LOG_DEBUG,
-                "DIGEST FILE: %s, VALID LINE: %s",
-                opts->config[CONF_DIGEST_FILE], line_buf
-            );
+    if(db->bloom == NULL)
+        return(1);
 
+    digest_bloom_hashes(digest, len, &h1, &h2);
+    for(i=0; i < DIGEST_BLOOM_HASHES; i++)
+    {
+        bit = (h1 + i * h2) & db->bloom_mask;
+        if((db->bloom[bit >> 3] & (1 << (bit & 7))) == 0)
+            return(0);
     }
-
-    fclose(digest_file_ptr);
-
-    return(digest_ctr);
+    return(1);
 }
 
-#else /* USE_FILE_CACHE */
-
-/* Check for the existence of the replay dbm file, and create it if it does
- * not exist.  Returns the number of db entries or -1 on error.
+/* (Re)build the bloom filter from every key in the digest db, sized for
+ * at least 'capacity' entries.  Returns the number of keys or -1.
 */
 static int
-replay_db_cache_init(fko_srv_options_t *opts)
+digest_bloom_build(struct digest_db *db, unsigned int capacity)
 {
-#ifdef NO_DIGEST_CACHE
-    return(-1);
-#else
-
+    datum       db_key;
 #ifdef HAVE_LIBGDBM
-    GDBM_FILE   rpdb;
-#elif HAVE_LIBNDBM
-    DBM        *rpdb;
-    datum       db_ent;
+    datum       db_next_key;
 #endif
-
-    datum       db_key, db_next_key;
+    uint32_t    nbits = DIGEST_BLOOM_MIN_BITS;
     int         db_count = 0;
 
-#ifdef HAVE_LIBGDBM
-    rpdb = gdbm_open(
-        opts->config[CONF_DIGEST_DB_FILE], 512, GDBM_WRCREAT, S_IRUSR|S_IWUSR, 0
-    );
-#elif HAVE_LIBNDBM
-    rpdb = dbm_open(
-        opts->config[CONF_DIGEST_DB_FILE], O_RDWR|O_CREAT, S_IRUSR|S_IWUSR
-    );
-#endif
+    while(nbits / DIGEST_BLOOM_BITS_PER_ENTRY < capacity
+            && nbits < DIGEST_BLOOM_MAX_BITS)
+        nbits <<= 1;
 
-    if(!rpdb)
+    free(db->bloom);
+    if((db->bloom = calloc(1, nbits / 8)) == NULL)
     {
-        log_msg(LOG_ERR,
-            "Unable to open digest cache file: '%s': %s",
-            opts->config[CONF_DIGEST_DB_FILE],
-            MY_DBM_STRERROR(errno)
-        );
-
+        /* Without a filter every lookup simply goes to the db
+        */
+        db->bloom_capacity = UINT_MAX;
         return(-1);
     }
 
+    db->bloom_mask     = nbits - 1;
+    db->bloom_capacity = nbits / DIGEST_BLOOM_BITS_PER_ENTRY;
+    db->bloom_count    = 0;
+
 #ifdef HAVE_LIBGDBM
-    db_key = gdbm_firstkey(rpdb);
+    db_key = gdbm_firstkey(db->rpdb);
 
     while (db_key.dptr != NULL)
     {
+        digest_bloom_add(db, db_key.dptr, db_key.dsize);
         db_count++;
-        db_next_key = gdbm_nextkey(rpdb, db_key);
+        db_next_key = gdbm_nextkey(db->rpdb, db_key);
         free(db_key.dptr);
         db_key = db_next_key;
     }
 #elif HAVE_LIBNDBM
-    for (db_key = dbm_firstkey(rpdb); db_ent.dptr != NULL; db_key = dbm_nextkey(rpdb))
+    for (db_key = dbm_firstkey(db->rpdb); db_key.dptr != NULL; db_key = dbm_nextkey(db->rpdb))
+    {
+        digest_bloom_add(db, db_key.dptr, db_key.dsize);
         db_count++;
+    }
 #endif
 
-    MY_DBM_CLOSE(rpdb);
-
     return(db_count);
-#endif /* NO_DIGEST_CACHE */
 }
-#endif /* USE_FILE_CACHE */
 
-#if USE_FILE_CACHE
+/* Store every write-back entry in the digest db and sync it to disk
+*/
 static int
-is_replay_file_cache(fko_srv_options_t *opts, char *digest)
+digest_db_flush(fko_srv_options_t *opts)
 {
-    int         digest_len = 0;
+    struct digest_db   *db = opts->digest_db;
+    datum               db_key, db_ent;
+    unsigned int        i;
+    int                 res = SPA_MSG_SUCCESS;
 
-    struct digest_cache_list *digest_list_ptr = NULL;
+    if(db->pending_count == 0)
+        return(SPA_MSG_SUCCESS);
 
-    digest_len = strlen(digest);
+    for(i=0; i < db->pending_count; i++)
+    {
+        db_key.dptr  = db->pending[i].digest;
+        db_key.dsize = strlen(db->pending[i].digest);
+        db_ent.dptr  = (char *)&(db->pending[i].cache_info);
+        db_ent.dsize = sizeof(digest_cache_info_t);
 
-    /* Check the cache for the SPA packet digest
-    */
-    for (digest_list_ptr = opts->digest_cache;
-            digest_list_ptr != NULL;
-            digest_list_ptr = digest_list_ptr->next) {
+        if(MY_DBM_STORE(db->rpdb, db_key, db_ent, MY_DBM_REPLACE) != 0)
+        {
+            log_msg(LOG_WARNING, "Error adding entry digest_cache: %s",
+                MY_DBM_STRERROR(errno)
+            );
+            res = SPA_MSG_DIGEST_CACHE_ERROR;
+        }
+    }
+
+#ifdef HAVE_LIBGDBM
+    gdbm_sync(db->rpdb);
+#endif
 
-        if (constant_runtime_cmp(digest_list_ptr->cache_info.digest,
-                    digest, digest_len) == 0) {
+    db->pending_count = 0;
+    return(res);
+}
 
-            replay_warning(opts, &(digest_list_ptr->cache_info));
+static void
+digest_db_close(fko_srv_options_t *opts)
+{
+    struct digest_db   *db = opts->digest_db;
 
-            return(SPA_MSG_REPLAY);
-        }
+    if(db == NULL)
+        return;
+
+    if(db->rpdb)
+    {
+        digest_db_flush(opts);
+        MY_DBM_CLOSE(db->rpdb);
     }
-    return(SPA_MSG_SUCCESS);
+
+    free(db->bloom);
+    free(db->pending);
+    free(db);
+
+    opts->digest_db = NULL;
+    return;
 }
 
-static int
-add_replay_file_cache(fko_srv_options_t *opts, char *digest)
+/* Find a digest among the entries not yet written back
+*/
+static digest_cache_info_t *
+digest_db_pending_lookup(struct digest_db *db, const char *digest)
 {
-    FILE       *digest_file_ptr = NULL;
-    int         digest_len = 0;
-    char        src_ip[INET_ADDRSTRLEN+1] = {0};
-    char        dst_ip[INET_ADDRSTRLEN+1] = {0};
+    unsigned int    i;
 
-    struct digest_cache_list *digest_elm = NULL;
+    for(i=0; i < db->pending_count; i++)
+        if(strcmp(db->pending[i].digest, digest) == 0)
+            return(&(db->pending[i].cache_info));
 
-    digest_len = strlen(digest);
+    return(NULL);
+}
+#endif /* ! USE_FILE_CACHE && ! NO_DIGEST_CACHE */
 
-    if ((digest_elm = calloc(1, sizeof(struct digest_cache_list))) == NULL)
-    {
-        log_msg(LOG_WARNING, "Error calloc() returned NULL for digest cache element",
-            fko_errstr(SPA_MSG_ERROR));
+#if USE_FILE_CACHE
+/* Jenkins one-at-a-time hash over the digest string, perturbed with a
+ * per-process seed so that the bucket layout cannot be predicted by
+ * whoever is sending us SPA packets.
+*/
+static uint32_t
+digest_hash(const digest_cache_t *dc, const char *digest)
+{
+    uint32_t    hash = dc->seed;
 
-        return(SPA_MSG_ERROR);
-    }
-    if ((digest_elm->cache_info.digest = calloc(1, digest_len+1)) == NULL)
+    while(*digest != '\0')
     {
-        log_msg(LOG_WARNING, "Error calloc() returned NULL for digest cache string",
-            fko_errstr(SPA_MSG_ERROR));
-        free(digest_elm);
-        return(SPA_MSG_ERROR);
+        hash += (unsigned char)*digest++;
+        hash += (hash << 10);
+        hash ^= (hash >> 6);
     }
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    hash += (hash << 15);
 
-    strlcpy(digest_elm->cache_info.digest, digest, digest_len+1);
-    digest_elm->cache_info.proto    = opts->spa_pkt.packet_proto;
-    digest_elm->cache_info.src_ip   = opts->spa_pkt.packet_src_ip;
-    digest_elm->cache_info.dst_ip   = opts->spa_pkt.packet_dst_ip;
-    digest_elm->cache_info.src_port = opts->spa_pkt.packet_src_port;
-    digest_elm->cache_info.dst_port = opts->spa_pkt.packet_dst_port;
-    digest_elm->cache_info.created = time(NULL);
+    return(hash);
+}
 
-    /* First, add the digest at the head of the in-memory list
-    */
-    digest_elm->next = opts->digest_cache;
-    opts->digest_cache = digest_elm;
+static uint32_t
+digest_cache_seed(void)
+{
+    FILE           *rfd;
+    uint32_t        seed = 0;
 
-    /* Now, write the digest to disk
-    */
-    if ((digest_file_ptr = fopen(opts->config[CONF_DIGEST_FILE], "a")) == NULL)
+    if((rfd = fopen("/dev/urandom", "r")) != NULL)
     {
-        log_msg(LOG_WARNING, "Could not open digest cache: %s",
-            opts->config[CONF_DIGEST_FILE]);
-        return(SPA_MSG_DIGEST_CACHE_ERROR);
+        if(fread(&seed, sizeof(seed), 1, rfd) != 1)
+            seed = 0;
+        fclose(rfd);
     }
 
-    inet_ntop(AF_INET, &(digest_elm->cache_info.src_ip),
-        src_ip, INET_ADDRSTRLEN);
-    inet_ntop(AF_INET, &(digest_elm->cache_info.dst_ip),
-        dst_ip, INET_ADDRSTRLEN);
-    fprintf(digest_file_ptr, "%s %d %s %d %s %d %d\n",
-        digest,
-        digest_elm->cache_info.proto,
-        src_ip,
-        (int) digest_elm->cache_info.src_port,
-        dst_ip,
-        digest_elm->cache_info.dst_port,
-        (int) digest_elm->cache_info.created);
-
-    fclose(digest_file_ptr);
+    /* Fall back to something that at least differs across restarts
+    */
+    if(seed == 0)
+        seed = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
 
-    return(SPA_MSG_SUCCESS);
+    return(seed);
 }
-#endif /* USE_FILE_CACHE */
 
-#if !USE_FILE_CACHE
-static int
-is_replay_dbm_cache(fko_srv_options_t *opts, char *digest)
+/* Add ring slot 'pos' to the index
+*/
+static void
+digest_index_insert(digest_cache_t *dc, unsigned int pos)
 {
-#ifdef NO_DIGEST_CACHE
-    return 0;
-#else
-
-#ifdef HAVE_LIBGDBM
-    GDBM_FILE   rpdb;
-#elif HAVE_LIBNDBM
-    DBM        *rpdb;
-#endif
-    datum       db_key, db_ent;
-
-    int         digest_len, res = SPA_MSG_SUCCESS;
+    unsigned int    mask = dc->index_size - 1;
+    unsigned int    i    = dc->ring[pos].hash & mask;
 
-    digest_len = strlen(digest);
+    while(dc->index[i] != 0)
+        i = (i + 1) & mask;
 
-    db_key.dptr = digest;
-    db_key.dsize = digest_len;
+    dc->index[i] = pos + 1;
+    return;
+}
 
-    /* Check the db for the key
-    */
-#ifdef HAVE_LIBGDBM
-    rpdb = gdbm_open(
-         opts->config[CONF_DIGEST_DB_FILE], 512, GDBM_WRCREAT, S_IRUSR|S_IWUSR, 0
-    );
-#elif HAVE_LIBNDBM
-    rpdb = dbm_open(opts->config[CONF_DIGEST_DB_FILE], O_RDWR, 0);
-#endif
+/* Remove ring slot 'pos' from the index.  Linear probing without
+ * tombstones, so the entries that follow the hole are shifted back into
+ * it whenever their home bucket allows.
+*/
+static void
+digest_index_remove(digest_cache_t *dc, unsigned int pos)
+{
+    unsigned int    mask = dc->index_size - 1;
+    unsigned int    i    = dc->ring[pos].hash & mask;
+    unsigned int    j, home;
 
-    if(!rpdb)
+    while(dc->index[i] != pos + 1)
     {
-        log_msg(LOG_WARNING, "Error opening digest_cache: '%s': %s",
-            opts->config[CONF_DIGEST_DB_FILE],
-            MY_DBM_STRERROR(errno)
-        );
-
-        return(SPA_MSG_DIGEST_CACHE_ERROR);
+        if(dc->index[i] == 0)
+            return;
+        i = (i + 1) & mask;
     }
 
-    db_ent = MY_DBM_FETCH(rpdb, db_key);
-
-    /* If the datum is not null, we have a match.  Otherwise, we add
-    * this entry to the cache.
-    */
-    if(db_ent.dptr != NULL)
+    j = i;
+    while(1)
     {
-        replay_warning(opts, (digest_cache_info_t *)db_ent.dptr);
+        j = (j + 1) & mask;
+        if(dc->index[j] == 0)
+            break;
 
-        /* Save it back to the digest cache
+        home = dc->ring[dc->index[j] - 1].hash & mask;
+
+        /* Leave the entry at j alone if its home bucket lies cyclically
+         * within (i, j].
         */
-        if(MY_DBM_STORE(rpdb, db_key, db_ent, MY_DBM_REPLACE) != 0)
-            log_msg(LOG_WARNING, "Error updating entry in digest_cache: '%s': %s",
-                opts->config[CONF_DIGEST_DB_FILE],
-                MY_DBM_STRERROR(errno)
-            );
+        if(i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
 
-#ifdef HAVE_LIBGDBM
-        free(db_ent.dptr);
-#endif
-        res = SPA_MSG_REPLAY;
+        dc->index[i] = dc->index[j];
+        i = j;
     }
+    dc->index[i] = 0;
+    return;
+}
+
+/* Reallocate the ring to hold 'new_size' entries (a power of two no
+ * smaller than the current count), compacting live entries to the front
+ * and rebuilding the index around them.
+*/
+static int
+digest_cache_resize(digest_cache_t *dc, unsigned int new_size)
+{
+    digest_cache_entry_t   *ring  = NULL;
+    unsigned int           *index = NULL;
+    unsigned int            i;
+
+    if(new_size < dc->count)
+        return(-1);
+
+    if((ring = calloc(new_size, sizeof(digest_cache_entry_t))) == NULL)
+        return(-1);
+
+    if((index = calloc(new_size * 2, sizeof(unsigned int))) == NULL)
+    {
+        free(ring);
+        return(-1);
+    }
+
+    for(i=0; i < dc->count; i++)
+        ring[i] = dc->ring[(dc->ring_head + i) & (dc->ring_size - 1)];
+
+    free(dc->ring);
+    free(dc->index);
+
+    dc->ring       = ring;
+    dc->ring_size  = new_size;
+    dc->ring_head  = 0;
+    dc->index      = index;
+    dc->index_size = new_size * 2;
+
+    for(i=0; i < dc->count; i++)
+        digest_index_insert(dc, i);
+
+    return(0);
+}
+
+static digest_cache_t *
+digest_cache_new(unsigned int size_hint, time_t max_age)
+{
+    digest_cache_t *dc = NULL;
+    unsigned int    size = DIGEST_CACHE_MIN_SIZE;
+
+    while(size < size_hint && size < DIGEST_CACHE_MAX_SIZE)
+        size <<= 1;
+
+    if((dc = calloc(1, sizeof(digest_cache_t))) == NULL)
+        return(NULL);
+
+    dc->seed      = digest_cache_seed();
+    dc->max_age   = max_age;
+    dc->writer.fd = -1;
+
+    if(digest_cache_resize(dc, size) != 0)
+    {
+        free(dc);
+        return(NULL);
+    }
+    return(dc);
+}
+
+static void
+digest_cache_free(digest_cache_t *dc)
+{
+    if(dc == NULL)
+        return;
+
+    free(dc->ring);
+    free(dc->index);
+    free(dc);
+    return;
+}
+
+static digest_cache_entry_t *
+digest_cache_lookup(digest_cache_t *dc, const char *digest)
+{
+    unsigned int            mask = dc->index_size - 1;
+    size_t                  digest_len = strlen(digest);
+    uint32_t                hash;
+    unsigned int            i;
+    digest_cache_entry_t   *e;
+
+    if(digest_len > MAX_DIGEST_SIZE)
+        return(NULL);
+
+    hash = digest_hash(dc, digest);
+
+    for(i = hash & mask; dc->index[i] != 0; i = (i + 1) & mask)
+    {
+        e = &(dc->ring[dc->index[i] - 1]);
+
+        if(e->hash == hash
+                && e->digest[digest_len] == '\0'
+                && constant_runtime_cmp(e->digest, digest, digest_len) == 0)
+            return(e);
+    }
+    return(NULL);
+}
+
+/* Append a new entry at the tail of the ring, growing it if it is full.
+ * The caller fills in everything but the digest and hash.
+*/
+static digest_cache_entry_t *
+digest_cache_add(digest_cache_t *dc, const char *digest)
+{
+    digest_cache_entry_t   *e;
+    unsigned int            pos;
+
+    if(strlen(digest) > MAX_DIGEST_SIZE)
+        return(NULL);
+
+    if(dc->count == dc->ring_size)
+    {
+        if(dc->ring_size >= DIGEST_CACHE_MAX_SIZE
+                || digest_cache_resize(dc, dc->ring_size << 1) != 0)
+            return(NULL);
+    }
+
+    pos = (dc->ring_head + dc->count) & (dc->ring_size - 1);
+    e   = &(dc->ring[pos]);
+
+    memset(e, 0x0, sizeof(*e));
+    strlcpy(e->digest, digest, sizeof(e->digest));
+    e->hash = digest_hash(dc, digest);
+
+    digest_index_insert(dc, pos);
+    dc->count++;
+
+    return(e);
+}
+
+/* Evict entries from the head of the ring that are too old to pass the
+ * SPA packet age check anyway.  Returns the number of entries removed.
+*/
+static unsigned int
+digest_cache_expire(digest_cache_t *dc, time_t now)
+{
+    unsigned int    removed = 0, new_size;
+
+    if(dc->max_age <= 0)
+        return(0);
+
+    while(dc->count > 0
+            && now - dc->ring[dc->ring_head].cache_info.created > dc->max_age)
+    {
+        digest_index_remove(dc, dc->ring_head);
+        dc->ring_head = (dc->ring_head + 1) & (dc->ring_size - 1);
+        dc->count--;
+        removed++;
+    }
+
+    /* Give memory back once the cache is mostly empty, leaving enough
+     * headroom that it does not immediately have to grow again.
+    */
+    new_size = dc->ring_size;
+    while(new_size > DIGEST_CACHE_MIN_SIZE && dc->count < new_size / 8)
+        new_size >>= 1;
+
+    if(new_size != dc->ring_size)
+        digest_cache_resize(dc, new_size);
+
+    return(removed);
+}
+
+/* Open the digest file for appending and size the record buffer according
+ * to DIGEST_SYNC_RECORDS/DIGEST_SYNC_INTERVAL.
+*/
+static int
+digest_writer_open(fko_srv_options_t *opts)
+{
+    digest_writer_t    *w = &(opts->digest_cache->writer);
+    int                 is_err;
+
+    w->sync_records = strtol_wrapper(opts->config[CONF_DIGEST_SYNC_RECORDS],
+            1, RCHK_MAX_DIGEST_SYNC_RECORDS, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+        w->sync_records = 1;
+
+    w->sync_interval = strtol_wrapper(opts->config[CONF_DIGEST_SYNC_INTERVAL],
+            0, RCHK_MAX_DIGEST_SYNC_INTERVAL, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+        w->sync_interval = 0;
+
+    w->buf_size = w->sync_records * sizeof(digest_file_rec_t);
+    if((w->buf = calloc(1, w->buf_size)) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Could not allocate digest file buffer");
+        return(-1);
+    }
+
+    w->fd = open(opts->config[CONF_DIGEST_FILE], O_WRONLY|O_APPEND);
+    if(w->fd < 0)
+    {
+        log_msg(LOG_WARNING, "Could not open digest cache: %s: %s",
+            opts->config[CONF_DIGEST_FILE], strerror(errno));
+        return(-1);
+    }
+
+    /* Any partial record was truncated when the file was loaded
+    */
+    if((w->good_off = lseek(w->fd, 0, SEEK_END)) < 0)
+    {
+        log_msg(LOG_WARNING, "Could not seek digest cache: %s: %s",
+            opts->config[CONF_DIGEST_FILE], strerror(errno));
+        close(w->fd);
+        w->fd = -1;
+        return(-1);
+    }
+    return(0);
+}
+
+/* Write out and fsync() every pending record as one group.  If the write
+ * fails part way, the file is truncated back to the end of the last whole
+ * group so that it never holds a torn record, and the group stays in the
+ * buffer to be retried by the next flush.  Should the truncation fail too,
+ * the writer is shut off rather than append records at a misaligned
+ * offset; the partial record is then dropped when the file is next loaded.
+ * Either way the digests remain in the in-memory cache.
+*/
+static int
+digest_writer_flush(fko_srv_options_t *opts)
+{
+    digest_writer_t    *w = &(opts->digest_cache->writer);
+    size_t              off = 0;
+    ssize_t             res;
+    int                 rv = SPA_MSG_SUCCESS;
+
+    if(w->pending == 0)
+        return(SPA_MSG_SUCCESS);
+
+    while(off < w->buf_len)
+    {
+        res = write(w->fd, w->buf + off, w->buf_len - off);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            log_msg(LOG_WARNING, "Error writing to digest cache: %s: %s",
+                opts->config[CONF_DIGEST_FILE], strerror(errno));
+            rv = SPA_MSG_DIGEST_CACHE_ERROR;
+            break;
+        }
+        off += res;
+    }
+
+    if(rv != SPA_MSG_SUCCESS)
+    {
+        if(off == 0)
+            return(rv);
+
+        if(ftruncate(w->fd, w->good_off) == 0)
+            return(rv);
+
+        log_msg(LOG_ERR, "Could not truncate digest cache: %s: %s, "
+            "no longer writing digests to it",
+            opts->config[CONF_DIGEST_FILE], strerror(errno));
+        close(w->fd);
+        w->fd      = -1;
+        w->buf_len = 0;
+        w->pending = 0;
+        return(rv);
+    }
+
+    w->good_off += w->buf_len;
+    w->buf_len   = 0;
+    w->pending   = 0;
+
+    if(fsync(w->fd) != 0)
+    {
+        log_msg(LOG_WARNING, "Error syncing digest cache: %s: %s",
+            opts->config[CONF_DIGEST_FILE], strerror(errno));
+        rv = SPA_MSG_DIGEST_CACHE_ERROR;
+    }
+
+    return(rv);
+}
+
+static void
+digest_writer_close(fko_srv_options_t *opts)
+{
+    digest_writer_t    *w = &(opts->digest_cache->writer);
+
+    if(w->fd >= 0)
+    {
+        digest_writer_flush(opts);
+        close(w->fd);
+        w->fd = -1;
+    }
+
+    if(w->buf != NULL)
+    {
+        free(w->buf);
+        w->buf = NULL;
+    }
+    return;
+}
+
+/* How long a digest has to be remembered.  A packet whose timestamp is
+ * up to MAX_SPA_PACKET_AGE seconds in the future is accepted, and a replay
+ * of it keeps passing the age check for another MAX_SPA_PACKET_AGE seconds
+ * after that, so twice the configured age is the minimum safe window.
+ * With packet aging disabled nothing can be evicted.
+*/
+static time_t
+replay_window(fko_srv_options_t *opts)
+{
+    int         is_err;
+    time_t      age;
+
+    if(strncasecmp(opts->config[CONF_ENABLE_SPA_PACKET_AGING], "Y", 1) != 0)
+        return(0);
+
+    age = strtol_wrapper(opts->config[CONF_MAX_SPA_PACKET_AGE],
+            0, RCHK_MAX_SPA_PACKET_AGE, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+        return(0);
+
+    return(age * 2);
+}
+
+/* FNV-1a over the first 'len' bytes of a header or record, used to catch
+ * torn or corrupted writes.
+*/
+static uint32_t
+digest_file_checksum(const void *data, size_t len)
+{
+    const unsigned char    *p = data;
+    uint32_t                hash = 2166136261U;
+
+    while(len-- > 0)
+    {
+        hash ^= *p++;
+        hash *= 16777619U;
+    }
+    return(hash);
+}
+
+static void
+digest_file_hdr_init(digest_file_hdr_t *hdr)
+{
+    memset(hdr, 0x0, sizeof(*hdr));
+    memcpy(hdr->magic, DIGEST_FILE_MAGIC, sizeof(hdr->magic));
+    hdr->version    = DIGEST_FILE_VERSION;
+    hdr->byte_order = DIGEST_FILE_BYTE_ORDER;
+    hdr->record_len = sizeof(digest_file_rec_t);
+    hdr->checksum   = digest_file_checksum(hdr,
+            offsetof(digest_file_hdr_t, checksum));
+    return;
+}
+
+static void
+digest_file_rec_init(digest_file_rec_t *rec, const digest_cache_entry_t *e)
+{
+    memset(rec, 0x0, sizeof(*rec));
+    memcpy(rec->digest, e->digest, strlen(e->digest));
+    rec->src_ip   = e->cache_info.src_ip;
+    rec->dst_ip   = e->cache_info.dst_ip;
+    rec->created  = e->cache_info.created;
+    rec->src_port = e->cache_info.src_port;
+    rec->dst_port = e->cache_info.dst_port;
+    rec->proto    = e->cache_info.proto;
+    rec->checksum = digest_file_checksum(rec,
+            offsetof(digest_file_rec_t, checksum));
+    return;
+}
+
+/* Add one valid record to the cache unless it has aged out or is a
+ * duplicate.  Returns 1 if the record was added.
+*/
+static int
+digest_cache_load_entry(digest_cache_t *dc, const char *digest,
+        const digest_cache_info_t *cache_info, time_t now)
+{
+    digest_cache_entry_t   *e;
+
+    /* Digests that have aged out of the replay window can never match
+     * a packet that would pass the age check, so don't load them.
+    */
+    if(dc->max_age > 0 && now - cache_info->created > dc->max_age)
+        return(0);
+
+    if(digest_cache_lookup(dc, digest) != NULL)
+        return(0);
+
+    if((e = digest_cache_add(dc, digest)) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Could not add digest cache entry");
+        return(0);
+    }
+    e->cache_info = *cache_info;
+
+    return(1);
+}
+
+/* Load a binary digest file.  The file is mapped read-only and each
+ * record is copied straight into the (presized) cache ring.  A partial
+ * record at the end, left behind by a crash in the middle of a write, is
+ * truncated away so that later appends stay aligned.  Returns the number
+ * of digests loaded or -1 if the file is not a usable binary digest file.
+*/
+static int
+digest_binary_file_load(fko_srv_options_t *opts, int fd, off_t file_size)
+{
+    const digest_file_hdr_t    *hdr;
+    const digest_file_rec_t    *rec;
+    digest_file_hdr_t           expected;
+    digest_cache_info_t         cache_info;
+    char                        digest[MAX_DIGEST_SIZE+1];
+    unsigned char              *map = NULL;
+    size_t                      num_recs, i;
+    off_t                       tail;
+    unsigned int                digest_ctr = 0, bad_recs = 0;
+    time_t                      now = time(NULL);
+
+    map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED)
+    {
+        log_msg(LOG_WARNING, "Could not mmap digest cache: %s: %s",
+            opts->config[CONF_DIGEST_FILE], strerror(errno));
+        return(-1);
+    }
+
+    hdr = (const digest_file_hdr_t *)map;
+    digest_file_hdr_init(&expected);
+
+    if(hdr->version != expected.version
+            || hdr->byte_order != expected.byte_order
+            || hdr->record_len != expected.record_len
+            || hdr->checksum != expected.checksum)
+    {
+        log_msg(LOG_WARNING,
+            "Digest cache: %s has an unsupported version or was written on a different platform",
+            opts->config[CONF_DIGEST_FILE]);
+        munmap(map, file_size);
+        return(-1);
+    }
+
+    num_recs = (file_size - sizeof(digest_file_hdr_t)) / sizeof(digest_file_rec_t);
+    tail     = sizeof(digest_file_hdr_t) + num_recs * sizeof(digest_file_rec_t);
+
+    /* Presize the ring so that loading never has to grow it
+    */
+    if(num_recs > opts->digest_cache->ring_size)
+    {
+        i = opts->digest_cache->ring_size;
+        while(i < num_recs && i < DIGEST_CACHE_MAX_SIZE)
+            i <<= 1;
+        digest_cache_resize(opts->digest_cache, i);
+    }
+
+    rec = (const digest_file_rec_t *)(map + sizeof(digest_file_hdr_t));
+    for(i=0; i < num_recs; i++, rec++)
+    {
+        if(rec->checksum != digest_file_checksum(rec,
+                    offsetof(digest_file_rec_t, checksum)))
+        {
+            bad_recs++;
+            continue;
+        }
+
+        memcpy(digest, rec->digest, MAX_DIGEST_SIZE);
+        digest[MAX_DIGEST_SIZE] = '\0';
+
+        memset(&cache_info, 0x0, sizeof(cache_info));
+        cache_info.src_ip   = rec->src_ip;
+        cache_info.dst_ip   = rec->dst_ip;
+        cache_info.created  = rec->created;
+        cache_info.src_port = rec->src_port;
+        cache_info.dst_port = rec->dst_port;
+        cache_info.proto    = rec->proto;
+
+        digest_ctr += digest_cache_load_entry(opts->digest_cache,
+                digest, &cache_info, now);
+    }
+
+    munmap(map, file_size);
+
+    if(bad_recs > 0)
+        log_msg(LOG_WARNING, "Skipped %u corrupt records in digest cache: %s",
+            bad_recs, opts->config[CONF_DIGEST_FILE]);
+
+    if(tail != file_size)
+    {
+        log_msg(LOG_WARNING, "Truncating partial record at the end of digest cache: %s",
+            opts->config[CONF_DIGEST_FILE]);
+        if(truncate(opts->config[CONF_DIGEST_FILE], tail) != 0)
+        {
+            log_msg(LOG_WARNING, "Could not truncate digest cache: %s: %s",
+                opts->config[CONF_DIGEST_FILE], strerror(errno));
+            return(-1);
+        }
+    }
+
+    return(digest_ctr);
+}
+
+/* Load a digest file in the original text format:
+ *
+ * <digest> <proto> <src_ip> <src_port> <dst_ip> <dst_port> <time>
+ * Example:
+ * 7XgadOyqv0tF5xG8uhg2iIrheeNKglCWKmxQDgYP1dY 17 127.0.0.1 40305 127.0.0.1 62201 1313283481
+*/
+static int
+digest_text_file_load(fko_srv_options_t *opts, FILE *digest_file_ptr)
+{
+    unsigned int    num_lines = 0, digest_ctr = 0;
+    char            line_buf[MAX_LINE_LEN]    = {0};
+    char            src_ip[INET_ADDRSTRLEN+1] = {0};
+    char            dst_ip[INET_ADDRSTRLEN+1] = {0};
+    char            digest[MAX_DIGEST_SIZE+1] = {0};
+    long int        time_tmp;
+    time_t          now = time(NULL);
+
+    digest_cache_info_t     cache_info;
+
+    while ((fgets(line_buf, MAX_LINE_LEN, digest_file_ptr)) != NULL)
+    {
+        num_lines++;
+        line_buf[MAX_LINE_LEN-1] = '\0';
+
+        if(IS_EMPTY_LINE(line_buf[0]))
+            continue;
+
+        memset(&cache_info, 0x0, sizeof(cache_info));
+        digest[0] = '\0';
+        src_ip[0] = '\0';
+        dst_ip[0] = '\0';
+
+        if(sscanf(line_buf, "%64s %hhu %16s %hu %16s %hu %ld",
+            digest,  /* %64s, buffer size is MAX_DIGEST_SIZE+1 */
+            &(cache_info.proto),
+            src_ip,  /* %16s, buffer size is INET_ADDRSTRLEN+1 */
+            &(cache_info.src_port),
+            dst_ip,  /* %16s, buffer size is INET_ADDRSTRLEN+1 */
+            &(cache_info.dst_port),
+            &time_tmp) != 7)
+        {
+            log_msg(LOG_INFO,
+                "*Skipping invalid digest file entry in %s at line %i.\n - %s",
+                opts->config[CONF_DIGEST_FILE], num_lines, line_buf
+            );
+            continue;
+        }
+        cache_info.created = time_tmp;
+
+        if (inet_pton(AF_INET, src_ip, &(cache_info.src_ip)) != 1)
+            continue;
+
+        if (inet_pton(AF_INET, dst_ip, &(cache_info.dst_ip)) != 1)
+            continue;
+
+        digest_ctr += digest_cache_load_entry(opts->digest_cache,
+                digest, &cache_info, now);
+
+        if(opts->verbose > 3)
+            log_msg(LOG_DEBUG,
+                "DIGEST FILE: %s, VALID LINE: %s",
+                opts->config[CONF_DIGEST_FILE], line_buf
+            );
+    }
+
+    return(digest_ctr);
+}
+
+/* Write a fresh binary digest file holding everything in the cache.  The
+ * file is written under a temporary name, synced and then renamed into
+ * place so that a crash leaves either the old or the new file.
+*/
+static int
+digest_binary_file_write(fko_srv_options_t *opts)
+{
+    digest_cache_t     *dc = opts->digest_cache;
+    digest_file_hdr_t   hdr;
+    digest_file_rec_t   rec;
+    char               *tmp_file = NULL;
+    size_t              tmp_len;
+    unsigned int        i;
+    int                 fd, rv = 0;
+    FILE               *fp = NULL;
+
+    tmp_len = strlen(opts->config[CONF_DIGEST_FILE]) + 5;
+    if((tmp_file = calloc(1, tmp_len)) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Could not allocate digest file name");
+        return(-1);
+    }
+    strlcpy(tmp_file, opts->config[CONF_DIGEST_FILE], tmp_len);
+    strlcat(tmp_file, ".tmp", tmp_len);
+
+    fd = open(tmp_file, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if(fd < 0 || (fp = fdopen(fd, "w")) == NULL)
+    {
+        log_msg(LOG_WARNING, "Could not create digest cache: %s: %s",
+            tmp_file, strerror(errno));
+        if(fd >= 0)
+            close(fd);
+        free(tmp_file);
+        return(-1);
+    }
+
+    digest_file_hdr_init(&hdr);
+    if(fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        rv = -1;
+
+    for(i=0; rv == 0 && i < dc->count; i++)
+    {
+        digest_file_rec_init(&rec,
+                &(dc->ring[(dc->ring_head + i) & (dc->ring_size - 1)]));
+        if(fwrite(&rec, sizeof(rec), 1, fp) != 1)
+            rv = -1;
+    }
+
+    if(fflush(fp) != 0 || fsync(fd) != 0)
+        rv = -1;
+
+    fclose(fp);
+
+    if(rv == 0 && rename(tmp_file, opts->config[CONF_DIGEST_FILE]) != 0)
+        rv = -1;
+
+    if(rv != 0)
+    {
+        log_msg(LOG_WARNING, "Could not write digest cache: %s: %s",
+            opts->config[CONF_DIGEST_FILE], strerror(errno));
+        unlink(tmp_file);
+    }
+
+    free(tmp_file);
+    return(rv);
+}
+
+/* Copy the text format digest file to dst, for when it cannot be linked.
+*/
+static int
+digest_text_file_copy(const char * const src, const char * const dst)
+{
+    char    buf[4096];
+    ssize_t n = 0;
+    int     in, out, rv = 0;
+
+    if((in = open(src, O_RDONLY)) < 0)
+        return(-1);
+
+    if((out = open(dst, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR)) < 0)
+    {
+        close(in);
+        return(-1);
+    }
+
+    while(rv == 0 && (n = read(in, buf, sizeof(buf))) > 0)
+        if(write(out, buf, n) != n)
+            rv = -1;
+
+    if(n < 0 || fsync(out) != 0)
+        rv = -1;
+
+    close(in);
+    if(close(out) != 0)
+        rv = -1;
+
+    if(rv != 0)
+        unlink(dst);
+
+    return(rv);
+}
+
+/* One-shot import of a text format digest file.  The original file is
+ * kept alongside as '<DIGEST_FILE>-text', and is left in place (with an
+ * error) if that cannot be done.
+*/
+static int
+digest_text_file_convert(fko_srv_options_t *opts)
+{
+    FILE           *digest_file_ptr = NULL;
+    char           *text_file = NULL;
+    size_t          text_len;
+    int             digest_ctr;
+
+    if ((digest_file_ptr = fopen(opts->config[CONF_DIGEST_FILE], "r")) == NULL)
+    {
+        log_msg(LOG_WARNING, "Could not open digest cache: %s",
+            opts->config[CONF_DIGEST_FILE]);
+        return(-1);
+    }
+
+    digest_ctr = digest_text_file_load(opts, digest_file_ptr);
+    fclose(digest_file_ptr);
+
+    text_len = strlen(opts->config[CONF_DIGEST_FILE]) + 6;
+    if((text_file = calloc(1, text_len)) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Could not allocate digest file name");
+        return(-1);
+    }
+    strlcpy(text_file, opts->config[CONF_DIGEST_FILE], text_len);
+    strlcat(text_file, "-text", text_len);
+
+    if(link(opts->config[CONF_DIGEST_FILE], text_file) != 0
+            && digest_text_file_copy(opts->config[CONF_DIGEST_FILE], text_file) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Could not keep text digest cache as %s: %s",
+            text_file, strerror(errno));
+        free(text_file);
+        return(-1);
+    }
+    free(text_file);
+
+    if(digest_binary_file_write(opts) != 0)
+        return(-1);
+
+    log_msg(LOG_INFO, "Converted digest cache %s to binary format (%d entries)",
+        opts->config[CONF_DIGEST_FILE], digest_ctr);
+
+    return(digest_ctr);
+}
+
+static int
+replay_file_cache_init(fko_srv_options_t *opts)
+{
+    struct stat     st;
+    int             digest_ctr = 0, fd = -1;
+    char            magic[sizeof(((digest_file_hdr_t *)0)->magic)];
+
+    free_replay_list(opts);
+
+    if((opts->digest_cache = digest_cache_new(0, replay_window(opts))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Could not allocate digest cache");
+        return(-1);
+    }
+
+    /* if the file exists, import the previous SPA digests into
+     * the cache
+    */
+    if (access(opts->config[CONF_DIGEST_FILE], F_OK) == 0)
+    {
+        /* Check permissions
+        */
+        if (access(opts->config[CONF_DIGEST_FILE], R_OK|W_OK) != 0)
+        {
+            log_msg(LOG_WARNING, "Digest file '%s' exists but: '%s'",
+                opts->config[CONF_DIGEST_FILE], strerror(errno));
+            return(-1);
+        }
+    }
+    else
+    {
+        /* the file does not exist yet, so create it with just a header
+        */
+        if(digest_binary_file_write(opts) != 0)
+            return(-1);
+
+        return(digest_writer_open(opts) == 0 ? 0 : -1);
+    }
+
+    if(verify_file_perms_ownership(opts->config[CONF_DIGEST_FILE]) != 1)
+        return(-1);
+
+    if((fd = open(opts->config[CONF_DIGEST_FILE], O_RDONLY)) < 0
+            || fstat(fd, &st) != 0)
+    {
+        log_msg(LOG_WARNING, "Could not open digest cache: %s",
+            opts->config[CONF_DIGEST_FILE]);
+        if(fd >= 0)
+            close(fd);
+        return(-1);
+    }
+
+    if(st.st_size >= (off_t)sizeof(digest_file_hdr_t)
+            && read(fd, magic, sizeof(magic)) == sizeof(magic)
+            && memcmp(magic, DIGEST_FILE_MAGIC, sizeof(magic)) == 0)
+    {
+        digest_ctr = digest_binary_file_load(opts, fd, st.st_size);
+        close(fd);
+    }
+    else
+    {
+        close(fd);
+        digest_ctr = digest_text_file_convert(opts);
+    }
+
+    if(digest_ctr < 0)
+        return(-1);
+
+    if(digest_writer_open(opts) != 0)
+        return(-1);
+
+    return(digest_ctr);
+}
+
+#else /* USE_FILE_CACHE */
+
+/* Open the replay dbm file (creating it if it does not exist) and keep
+ * the handle for the life of the process.  Returns the number of db
+ * entries or -1 on error.
+*/
+static int
+replay_db_cache_init(fko_srv_options_t *opts)
+{
+#ifdef NO_DIGEST_CACHE
+    return(-1);
+#else
+
+    struct digest_db   *db = NULL;
+    int                 is_err, db_count;
+
+    free_replay_list(opts);
+
+    if((db = calloc(1, sizeof(struct digest_db))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Could not allocate digest cache");
+        return(-1);
+    }
+    opts->digest_db = db;
+
+    db->sync_records = strtol_wrapper(opts->config[CONF_DIGEST_SYNC_RECORDS],
+            1, RCHK_MAX_DIGEST_SYNC_RECORDS, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+        db->sync_records = 1;
+
+    db->sync_interval = strtol_wrapper(opts->config[CONF_DIGEST_SYNC_INTERVAL],
+            0, RCHK_MAX_DIGEST_SYNC_INTERVAL, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+        db->sync_interval = 0;
+
+    if((db->pending = calloc(db->sync_records, sizeof(*db->pending))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Could not allocate digest cache");
+        digest_db_close(opts);
+        return(-1);
+    }
+
+#ifdef HAVE_LIBGDBM
+    db->rpdb = gdbm_open(
+        opts->config[CONF_DIGEST_DB_FILE], 512, GDBM_WRCREAT, S_IRUSR|S_IWUSR, 0
+    );
+#elif HAVE_LIBNDBM
+    db->rpdb = dbm_open(
+        opts->config[CONF_DIGEST_DB_FILE], O_RDWR|O_CREAT, S_IRUSR|S_IWUSR
+    );
+#endif
+
+    if(!db->rpdb)
+    {
+        log_msg(LOG_ERR,
+            "Unable to open digest cache file: '%s': %s",
+            opts->config[CONF_DIGEST_DB_FILE],
+            MY_DBM_STRERROR(errno)
+        );
+
+        digest_db_close(opts);
+        return(-1);
+    }
+
+    /* The one pass over the keys builds the bloom filter and counts them
+    */
+    db_count = digest_bloom_build(db, 0);
+    if(db->bloom_count > db->bloom_capacity)
+        db_count = digest_bloom_build(db, db->bloom_count * 2);
+
+    if(db_count < 0)
+        log_msg(LOG_WARNING, "Could not allocate digest cache bloom filter");
+
+    return(db->bloom_count);
+#endif /* NO_DIGEST_CACHE */
+}
+#endif /* USE_FILE_CACHE */
+
+#if USE_FILE_CACHE
+static int
+is_replay_file_cache(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt,
+        char *digest)
+{
+    digest_cache_entry_t *digest_elm = NULL;
+
+    if(opts->digest_cache == NULL)
+        return(SPA_MSG_SUCCESS);
+
+    digest_cache_expire(opts->digest_cache, time(NULL));
+
+    /* Check the cache for the SPA packet digest
+    */
+    if((digest_elm = digest_cache_lookup(opts->digest_cache, digest)) != NULL)
+    {
+        replay_warning(spa_pkt, &(digest_elm->cache_info));
+
+        return(SPA_MSG_REPLAY);
+    }
+    return(SPA_MSG_SUCCESS);
+}
+
+static int
+add_replay_file_cache(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt,
+        char *digest)
+{
+    digest_writer_t    *w = NULL;
+
+    digest_cache_entry_t *digest_elm = NULL;
+
+    if(opts->digest_cache == NULL)
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+
+    if(strlen(digest) > MAX_DIGEST_SIZE)
+    {
+        log_msg(LOG_WARNING, "Digest too long for digest cache");
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+    }
+
+    /* Refuse to add a digest that is already there (another worker thread
+     * may have accepted the same packet since is_replay() was called).
+    */
+    if(digest_cache_lookup(opts->digest_cache, digest) != NULL)
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+
+    /* First, add the digest at the tail of the in-memory cache
+    */
+    if((digest_elm = digest_cache_add(opts->digest_cache, digest)) == NULL)
+    {
+        log_msg(LOG_WARNING, "Error adding digest to the in-memory digest cache");
+        return(SPA_MSG_ERROR);
+    }
+
+    digest_elm->cache_info.proto    = spa_pkt->packet_proto;
+    digest_elm->cache_info.src_ip   = spa_pkt->packet_src_ip;
+    digest_elm->cache_info.dst_ip   = spa_pkt->packet_dst_ip;
+    digest_elm->cache_info.src_port = spa_pkt->packet_src_port;
+    digest_elm->cache_info.dst_port = spa_pkt->packet_dst_port;
+    digest_elm->cache_info.created  = time(NULL);
+
+    /* Now, queue the digest for the disk
+    */
+    w = &(opts->digest_cache->writer);
+    if(w->fd < 0)
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+
+    /* A group left over from a failed flush gets another try first
+    */
+    if(w->buf_len + sizeof(digest_file_rec_t) > w->buf_size
+            && digest_writer_flush(opts) != SPA_MSG_SUCCESS
+            && (w->fd < 0 || w->buf_len + sizeof(digest_file_rec_t) > w->buf_size))
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+
+    digest_file_rec_init((digest_file_rec_t *)(w->buf + w->buf_len), digest_elm);
 
-    MY_DBM_CLOSE(rpdb);
-
-    return(res);
-#endif /* NO_DIGEST_CACHE */
+    if(w->pending == 0)
+        clock_gettime(CLOCK_MONOTONIC, &(w->first_pending));
+
+    w->buf_len += sizeof(digest_file_rec_t);
+    w->pending++;
+
+    if(w->pending >= w->sync_records
+            || (w->sync_interval > 0
+                && elapsed_ms(&(w->first_pending)) >= w->sync_interval))
+        return(digest_writer_flush(opts));
+
+    return(SPA_MSG_SUCCESS);
 }
+#endif /* USE_FILE_CACHE */
 
+#if !USE_FILE_CACHE
 static int
-add_replay_dbm_cache(fko_srv_options_t *opts, char *digest)
+is_replay_dbm_cache(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt,
+        char *digest)
 {
 #ifdef NO_DIGEST_CACHE
     return 0;
 #else
 
-#ifdef HAVE_LIBGDBM
-    GDBM_FILE   rpdb;
-#elif HAVE_LIBNDBM
-    DBM        *rpdb;
-#endif
-    datum       db_key, db_ent;
+    struct digest_db       *db = opts->digest_db;
+    digest_cache_info_t    *pending_info;
+    digest_cache_info_t     dc_info;
+    datum                   db_key, db_ent;
 
     int         digest_len, res = SPA_MSG_SUCCESS;
 
-    digest_cache_info_t dc_info;
+    if(db == NULL)
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
 
     digest_len = strlen(digest);
 
+    /* Most digests are new, and the bloom filter says so without
+     * touching the db.
+    */
+    if(! digest_bloom_check(db, digest, digest_len))
+        return(SPA_MSG_SUCCESS);
+
+    if((pending_info = digest_db_pending_lookup(db, digest)) != NULL)
+    {
+        replay_warning(spa_pkt, pending_info);
+        return(SPA_MSG_REPLAY);
+    }
+
     db_key.dptr = digest;
     db_key.dsize = digest_len;
 
-    /* Check the db for the key
+    db_ent = MY_DBM_FETCH(db->rpdb, db_key);
+
+    /* If the datum is not null, we have a match.  Otherwise, we add
+    * this entry to the cache.
     */
+    if(db_ent.dptr != NULL)
+    {
+        memset(&dc_info, 0x0, sizeof(dc_info));
+        memcpy(&dc_info, db_ent.dptr,
+            db_ent.dsize < sizeof(dc_info) ? db_ent.dsize : sizeof(dc_info));
+
 #ifdef HAVE_LIBGDBM
-    rpdb = gdbm_open(
-         opts->config[CONF_DIGEST_DB_FILE], 512, GDBM_WRCREAT, S_IRUSR|S_IWUSR, 0
-    );
-#elif HAVE_LIBNDBM
-    rpdb = dbm_open(opts->config[CONF_DIGEST_DB_FILE], O_RDWR, 0);
+        free(db_ent.dptr);
 #endif
+        replay_warning(spa_pkt, &dc_info);
 
-    if(!rpdb)
-    {
-        log_msg(LOG_WARNING, "Error opening digest_cache: '%s': %s",
-            opts->config[CONF_DIGEST_DB_FILE],
-            MY_DBM_STRERROR(errno)
-        );
+        /* Save it back to the digest cache
+        */
+        db_ent.dptr  = (char *)&dc_info;
+        db_ent.dsize = sizeof(dc_info);
 
-        return(SPA_MSG_DIGEST_CACHE_ERROR);
+        if(MY_DBM_STORE(db->rpdb, db_key, db_ent, MY_DBM_REPLACE) != 0)
+            log_msg(LOG_WARNING, "Error updating entry in digest_cache: '%s': %s",
+                opts->config[CONF_DIGEST_DB_FILE],
+                MY_DBM_STRERROR(errno)
+            );
+
+        res = SPA_MSG_REPLAY;
     }
 
-    db_ent = MY_DBM_FETCH(rpdb, db_key);
+    return(res);
+#endif /* NO_DIGEST_CACHE */
+}
+
+static int
+add_replay_dbm_cache(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt,
+        char *digest)
+{
+#ifdef NO_DIGEST_CACHE
+    return 0;
+#else
+
+    struct digest_db   *db = opts->digest_db;
+    datum               db_key, db_ent;
+    int                 digest_len, res = SPA_MSG_SUCCESS;
+
+    digest_cache_info_t *dc_info;
+
+    if(db == NULL)
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+
+    digest_len = strlen(digest);
+    if(digest_len > MAX_DIGEST_SIZE)
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
 
-    /* If the datum is null, we have a new entry.
+    /* Refuse to add a digest that is already there
     */
-    if(db_ent.dptr == NULL)
+    if(digest_bloom_check(db, digest, digest_len))
     {
-        /* This is a new SPA packet that needs to be added to the cache.
-        */
-        dc_info.src_ip   = opts->spa_pkt.packet_src_ip;
-        dc_info.dst_ip   = opts->spa_pkt.packet_dst_ip;
-        dc_info.src_port = opts->spa_pkt.packet_src_port;
-        dc_info.dst_port = opts->spa_pkt.packet_dst_port;
-        dc_info.proto    = opts->spa_pkt.packet_proto;
-        dc_info.created  = time(NULL);
-        dc_info.first_replay = dc_info.last_replay = dc_info.replay_count = 0;
-
-        db_ent.dsize    = sizeof(digest_cache_info_t);
-        db_ent.dptr     = (char*)&(dc_info);
-
-        if(MY_DBM_STORE(rpdb, db_key, db_ent, MY_DBM_INSERT) != 0)
-        {
-            log_msg(LOG_WARNING, "Error adding entry digest_cache: %s",
-                MY_DBM_STRERROR(errno)
-            );
+        if(digest_db_pending_lookup(db, digest) != NULL)
+            return(SPA_MSG_DIGEST_CACHE_ERROR);
 
-            res = SPA_MSG_DIGEST_CACHE_ERROR;
-        }
+        db_key.dptr = digest;
+        db_key.dsize = digest_len;
 
-        res = SPA_MSG_SUCCESS;
+        db_ent = MY_DBM_FETCH(db->rpdb, db_key);
+        if(db_ent.dptr != NULL)
+        {
+#ifdef HAVE_LIBGDBM
+            free(db_ent.dptr);
+#endif
+            return(SPA_MSG_DIGEST_CACHE_ERROR);
+        }
     }
-    else
-        res = SPA_MSG_DIGEST_CACHE_ERROR;
 
-    MY_DBM_CLOSE(rpdb);
+    /* This is a new SPA packet that needs to be added to the cache.  It
+     * is queued and written back with the next group.
+    */
+    if(db->pending_count == 0)
+        clock_gettime(CLOCK_MONOTONIC, &(db->first_pending));
+
+    strlcpy(db->pending[db->pending_count].digest, digest, MAX_DIGEST_SIZE+1);
+    dc_info = &(db->pending[db->pending_count].cache_info);
+
+    memset(dc_info, 0x0, sizeof(*dc_info));
+    dc_info->src_ip   = spa_pkt->packet_src_ip;
+    dc_info->dst_ip   = spa_pkt->packet_dst_ip;
+    dc_info->src_port = spa_pkt->packet_src_port;
+    dc_info->dst_port = spa_pkt->packet_dst_port;
+    dc_info->proto    = spa_pkt->packet_proto;
+    dc_info->created  = time(NULL);
+    dc_info->first_replay = dc_info->last_replay = dc_info->replay_count = 0;
+
+    db->pending_count++;
+    digest_bloom_add(db, digest, digest_len);
+
+    if(db->pending_count >= db->sync_records
+            || (db->sync_interval > 0
+                && elapsed_ms(&(db->first_pending)) >= db->sync_interval))
+        res = digest_db_flush(opts);
+
+    /* Keep the false positive rate down as the db grows
+    */
+    if(db->bloom_count > db->bloom_capacity)
+    {
+        digest_db_flush(opts);
+        if(digest_bloom_build(db, db->bloom_count * 2) < 0)
+            log_msg(LOG_WARNING, "Could not allocate digest cache bloom filter");
+    }
 
     return(res);
 #endif /* NO_DIGEST_CACHE */
 }
 #endif /* USE_FILE_CACHE */
 
-#if USE_FILE_CACHE
-/* Free replay list memory
+/* Free replay list memory (and write out anything still buffered)
 */
 void
 free_replay_list(fko_srv_options_t *opts)
 {
-    struct digest_cache_list *digest_list_ptr = NULL, *digest_tmp = NULL;
-
 #ifdef NO_DIGEST_CACHE
     return;
-#endif
+#else
 
 #if AFL_FUZZING
     if(opts->afl_fuzzing)
         return;
 #endif
 
-    if (opts->digest_cache == NULL)
-        return;
+    pthread_mutex_lock(&replay_cache_mutex);
 
-    digest_list_ptr = opts->digest_cache;
-    while (digest_list_ptr != NULL)
+#if USE_FILE_CACHE
+    if (opts->digest_cache != NULL)
     {
-        digest_tmp = digest_list_ptr->next;
-        if (digest_list_ptr->cache_info.digest != NULL
-                && digest_list_ptr->cache_info.digest[0] != '\0')
-        {
-            free(digest_list_ptr->cache_info.digest);
-        }
-        free(digest_list_ptr);
-        digest_list_ptr = digest_tmp;
+        digest_writer_close(opts);
+        digest_cache_free(opts->digest_cache);
+        opts->digest_cache = NULL;
     }
+#else
+    digest_db_close(opts);
+#endif
+
+    pthread_mutex_unlock(&replay_cache_mutex);
 
     return;
+#endif /* NO_DIGEST_CACHE */
 }
-#endif
 
 int
 replay_cache_init(fko_srv_options_t *opts)
@@ -730,11 +1740,12 @@ replay_cache_init(fko_srv_options_t *opts)
 }
 
 int
-add_replay(fko_srv_options_t *opts, char *digest)
+add_replay(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt, char *digest)
 {
 #ifdef NO_DIGEST_CACHE
     return(-1);
 #else
+    int     res;
 
     if(digest == NULL)
     {
@@ -742,30 +1753,570 @@ add_replay(fko_srv_options_t *opts, char *digest)
         return(SPA_MSG_DIGEST_CACHE_ERROR);
     }
 
+    pthread_mutex_lock(&replay_cache_mutex);
 #if USE_FILE_CACHE
-    return add_replay_file_cache(opts, digest);
+    res = add_replay_file_cache(opts, spa_pkt, digest);
 #else
-    return add_replay_dbm_cache(opts, digest);
+    res = add_replay_dbm_cache(opts, spa_pkt, digest);
 #endif
+    pthread_mutex_unlock(&replay_cache_mutex);
+
+    return(res);
 #endif /* NO_DIGEST_CACHE */
 }
 
+/* Write out any buffered digests whose DIGEST_SYNC_INTERVAL has expired.
+ * This is called periodically from the packet acquisition loops so that
+ * digests do not linger in the buffer while no new packets arrive.
+*/
+void
+replay_cache_sync(fko_srv_options_t *opts)
+{
+#if USE_FILE_CACHE
+    digest_writer_t    *w;
+
+    pthread_mutex_lock(&replay_cache_mutex);
+    if(opts->digest_cache != NULL)
+    {
+        w = &(opts->digest_cache->writer);
+        if(w->pending > 0 && w->sync_interval > 0
+                && elapsed_ms(&(w->first_pending)) >= w->sync_interval)
+            digest_writer_flush(opts);
+    }
+    pthread_mutex_unlock(&replay_cache_mutex);
+#elif ! defined(NO_DIGEST_CACHE)
+    struct digest_db   *db;
+
+    pthread_mutex_lock(&replay_cache_mutex);
+    db = opts->digest_db;
+    if(db != NULL && db->pending_count > 0 && db->sync_interval > 0
+            && elapsed_ms(&(db->first_pending)) >= db->sync_interval)
+        digest_db_flush(opts);
+    pthread_mutex_unlock(&replay_cache_mutex);
+#endif
+    return;
+}
+
 /* Take an fko context, pull the digest and use it as the key to check the
  * replay db (digest cache).
 */
 int
-is_replay(fko_srv_options_t *opts, char *digest)
+is_replay(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt, char *digest)
 {
 #ifdef NO_DIGEST_CACHE
     return(-1);
 #else
+    int     res;
 
+    pthread_mutex_lock(&replay_cache_mutex);
 #if USE_FILE_CACHE
-    return is_replay_file_cache(opts, digest);
+    res = is_replay_file_cache(opts, spa_pkt, digest);
 #else
-    return is_replay_dbm_cache(opts, digest);
+    res = is_replay_dbm_cache(opts, spa_pkt, digest);
 #endif
+    pthread_mutex_unlock(&replay_cache_mutex);
+
+    return(res);
 #endif /* NO_DIGEST_CACHE */
 }
 
+#ifdef HAVE_C_UNIT_TESTS
+
+#if USE_FILE_CACHE
+static void
+utest_digest_str(char *buf, size_t len, unsigned int n)
+{
+    snprintf(buf, len, "utestdigest%08uXgadOyqv0tF5xG8uhg2iIrheeNKglCWKmxQ", n);
+    return;
+}
+
+DECLARE_UTEST(digest_cache_add_lookup, "check digest cache add and lookup")
+{
+    digest_cache_t         *dc = NULL;
+    digest_cache_entry_t   *e  = NULL;
+    char                    digest[MAX_DIGEST_SIZE+1];
+    unsigned int            i, found = 0;
+
+    dc = digest_cache_new(0, 0);
+    CU_ASSERT_FATAL(dc != NULL);
+
+    /* Force the ring to grow a couple of times
+    */
+    for(i=0; i < DIGEST_CACHE_MIN_SIZE * 3; i++)
+    {
+        utest_digest_str(digest, sizeof(digest), i);
+        e = digest_cache_add(dc, digest);
+        if(e != NULL)
+            e->cache_info.created = i;
+    }
+    CU_ASSERT(dc->count == DIGEST_CACHE_MIN_SIZE * 3);
+    CU_ASSERT(dc->ring_size == DIGEST_CACHE_MIN_SIZE * 4);
+
+    for(i=0; i < DIGEST_CACHE_MIN_SIZE * 3; i++)
+    {
+        utest_digest_str(digest, sizeof(digest), i);
+        e = digest_cache_lookup(dc, digest);
+        if(e != NULL && e->cache_info.created == i)
+            found++;
+    }
+    CU_ASSERT(found == DIGEST_CACHE_MIN_SIZE * 3);
+
+    /* Neither a missing digest nor a prefix of a present one matches
+    */
+    utest_digest_str(digest, sizeof(digest), DIGEST_CACHE_MIN_SIZE * 3);
+    CU_ASSERT(digest_cache_lookup(dc, digest) == NULL);
+    utest_digest_str(digest, sizeof(digest), 1);
+    digest[strlen(digest)-1] = '\0';
+    CU_ASSERT(digest_cache_lookup(dc, digest) == NULL);
+
+    digest_cache_free(dc);
+}
+
+DECLARE_UTEST(digest_cache_expire, "check digest cache time based eviction")
+{
+    digest_cache_t         *dc = NULL;
+    digest_cache_entry_t   *e  = NULL;
+    char                    digest[MAX_DIGEST_SIZE+1];
+    unsigned int            i, nb = DIGEST_CACHE_MIN_SIZE * 8;
+    unsigned int            found = 0, stale = 0;
+
+    dc = digest_cache_new(0, 100);
+    CU_ASSERT_FATAL(dc != NULL);
+
+    for(i=0; i < nb; i++)
+    {
+        utest_digest_str(digest, sizeof(digest), i);
+        e = digest_cache_add(dc, digest);
+        if(e != NULL)
+            e->cache_info.created = 1000 + i;
+    }
+    CU_ASSERT(dc->count == nb);
+
+    /* Nothing is older than max_age yet
+    */
+    CU_ASSERT(digest_cache_expire(dc, 1000 + 100) == 0);
+
+    /* Evicts everything created more than 100 seconds ago, i.e. all but
+     * the youngest 100, and shrinks the ring back down.
+    */
+    CU_ASSERT(digest_cache_expire(dc, 1000 + nb) == nb - 100);
+    CU_ASSERT(dc->count == 100);
+    CU_ASSERT(dc->ring_size == DIGEST_CACHE_MIN_SIZE);
+
+    /* Every survivor must still be reachable through the index after the
+     * backward shift deletions
+    */
+    for(i=0; i < nb; i++)
+    {
+        utest_digest_str(digest, sizeof(digest), i);
+        e = digest_cache_lookup(dc, digest);
+        if(e == NULL)
+            continue;
+        if(i < nb - 100)
+            stale++;
+        else
+            found++;
+    }
+    CU_ASSERT(stale == 0);
+    CU_ASSERT(found == 100);
+
+    digest_cache_free(dc);
+}
+
+DECLARE_UTEST(digest_cache_wraparound, "check digest cache ring wraparound")
+{
+    digest_cache_t         *dc = NULL;
+    digest_cache_entry_t   *e  = NULL;
+    char                    digest[MAX_DIGEST_SIZE+1];
+    unsigned int            i, missing = 0;
+
+    dc = digest_cache_new(0, 10);
+    CU_ASSERT_FATAL(dc != NULL);
+
+    /* Keep roughly half a ring live while the head walks around it
+     * several times, so the ring never needs to grow.
+    */
+    for(i=0; i < DIGEST_CACHE_MIN_SIZE * 4; i++)
+    {
+        utest_digest_str(digest, sizeof(digest), i);
+        e = digest_cache_add(dc, digest);
+        if(e == NULL)
+            missing++;
+        else
+            e->cache_info.created = i / 50;
+        digest_cache_expire(dc, i / 50);
+
+        utest_digest_str(digest, sizeof(digest), i);
+        if(digest_cache_lookup(dc, digest) == NULL)
+            missing++;
+    }
+    CU_ASSERT(missing == 0);
+    CU_ASSERT(dc->ring_size == DIGEST_CACHE_MIN_SIZE);
+    CU_ASSERT(dc->count <= 11 * 50);
+
+    digest_cache_free(dc);
+}
+
+/* Build just enough of an fko_srv_options_t to drive the digest file
+*/
+static fko_srv_options_t *
+utest_opts_new(const char *digest_file, const char *sync_records,
+        const char *sync_interval)
+{
+    fko_srv_options_t *opts = calloc(1, sizeof(fko_srv_options_t));
+
+    if(opts == NULL)
+        return(NULL);
+
+    opts->config[CONF_DIGEST_FILE]              = strdup(digest_file);
+    opts->config[CONF_ENABLE_SPA_PACKET_AGING]  = strdup("N");
+    opts->config[CONF_MAX_SPA_PACKET_AGE]       = strdup(DEF_MAX_SPA_PACKET_AGE);
+    opts->config[CONF_DIGEST_SYNC_RECORDS]      = strdup(sync_records);
+    opts->config[CONF_DIGEST_SYNC_INTERVAL]     = strdup(sync_interval);
+
+    return(opts);
+}
+
+static void
+utest_opts_free(fko_srv_options_t *opts)
+{
+    int i;
+
+    free_replay_list(opts);
+    for(i=0; i < NUMBER_OF_CONFIG_ENTRIES; i++)
+        free(opts->config[i]);
+    free(opts);
+    return;
+}
+
+static int
+utest_add_digests(fko_srv_options_t *opts, unsigned int from, unsigned int to)
+{
+    char            digest[MAX_DIGEST_SIZE+1];
+    unsigned int    i;
+
+    for(i=from; i < to; i++)
+    {
+        utest_digest_str(digest, sizeof(digest), i);
+        if(add_replay(opts, &(opts->spa_pkt), digest) != SPA_MSG_SUCCESS)
+            return(-1);
+    }
+    return(0);
+}
+
+/* Reload the digest file and count how many of digests [0, nb) made it
+ * to disk, checking that they form a prefix of what was accepted.
+*/
+static unsigned int
+utest_count_persisted(const char *digest_file, unsigned int nb)
+{
+    fko_srv_options_t  *opts = utest_opts_new(digest_file, "1", "0");
+    char                digest[MAX_DIGEST_SIZE+1];
+    unsigned int        i, persisted = 0;
+
+    if(opts == NULL || replay_cache_init(opts) < 0)
+        return(0);
+
+    for(i=0; i < nb; i++)
+    {
+        utest_digest_str(digest, sizeof(digest), i);
+        if(digest_cache_lookup(opts->digest_cache, digest) == NULL)
+            break;
+        persisted++;
+    }
+    utest_opts_free(opts);
+
+    return(persisted);
+}
+
+/* Run 'fn' in a child process that is SIGKILLed afterwards without any
+ * chance to flush, then report how many digests survived.
+*/
+static unsigned int
+utest_crash_and_count(void (*fn)(const char *), unsigned int nb)
+{
+    char            tmp_dir[] = "/tmp/fwknopd_utest.XXXXXX";
+    char            digest_file[MAX_PATH_LEN];
+    pid_t           pid;
+    int             status = 0;
+    unsigned int    persisted = 0;
+
+    if(mkdtemp(tmp_dir) == NULL)
+        return(0);
+    snprintf(digest_file, sizeof(digest_file), "%s/digest.cache", tmp_dir);
+
+    pid = fork();
+    if(pid == 0)
+    {
+        fn(digest_file);
+        kill(getpid(), SIGKILL);
+        _exit(EXIT_FAILURE);
+    }
+    else if(pid > 0)
+    {
+        waitpid(pid, &status, 0);
+        if(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL)
+            persisted = utest_count_persisted(digest_file, nb);
+    }
+
+    unlink(digest_file);
+    rmdir(tmp_dir);
+
+    return(persisted);
+}
+
+static void
+utest_crash_by_records(const char *digest_file)
+{
+    fko_srv_options_t *opts = utest_opts_new(digest_file, "4", "0");
+
+    if(opts == NULL || replay_cache_init(opts) < 0)
+        return;
+
+    /* Two full groups of four are committed, two are still buffered
+    */
+    utest_add_digests(opts, 0, 10);
+    return;
+}
+
+static void
+utest_crash_by_interval(const char *digest_file)
+{
+    fko_srv_options_t *opts = utest_opts_new(digest_file, "1000", "20");
+
+    if(opts == NULL || replay_cache_init(opts) < 0)
+        return;
+
+    /* Committed by the periodic sync
+    */
+    utest_add_digests(opts, 0, 3);
+    usleep(40000);
+    replay_cache_sync(opts);
+
+    /* Committed along with the next digest added once the interval has
+     * passed
+    */
+    utest_add_digests(opts, 3, 5);
+    usleep(40000);
+    utest_add_digests(opts, 5, 6);
+
+    /* Still buffered
+    */
+    utest_add_digests(opts, 6, 8);
+    return;
+}
+
+DECLARE_UTEST(digest_file_crash_records, "check digests lost at crash are bounded by DIGEST_SYNC_RECORDS")
+{
+    CU_ASSERT(utest_crash_and_count(utest_crash_by_records, 10) == 8);
+}
+
+DECLARE_UTEST(digest_file_crash_interval, "check digests lost at crash are bounded by DIGEST_SYNC_INTERVAL")
+{
+    CU_ASSERT(utest_crash_and_count(utest_crash_by_interval, 8) == 6);
+}
+
+DECLARE_UTEST(digest_file_clean_exit, "check buffered digests are written out at exit")
+{
+    char                tmp_dir[] = "/tmp/fwknopd_utest.XXXXXX";
+    char                digest_file[MAX_PATH_LEN];
+    fko_srv_options_t  *opts = NULL;
+
+    CU_ASSERT_FATAL(mkdtemp(tmp_dir) != NULL);
+    snprintf(digest_file, sizeof(digest_file), "%s/digest.cache", tmp_dir);
+
+    opts = utest_opts_new(digest_file, "1000", "0");
+    CU_ASSERT_FATAL(opts != NULL);
+    CU_ASSERT(replay_cache_init(opts) == 0);
+    CU_ASSERT(utest_add_digests(opts, 0, 5) == 0);
+    utest_opts_free(opts);
+
+    CU_ASSERT(utest_count_persisted(digest_file, 5) == 5);
+
+    unlink(digest_file);
+    rmdir(tmp_dir);
+}
+
+DECLARE_UTEST(digest_file_convert_text, "check import of a text digest file")
+{
+    char                tmp_dir[] = "/tmp/fwknopd_utest.XXXXXX";
+    char                digest_file[MAX_PATH_LEN];
+    char                text_file[MAX_PATH_LEN];
+    char                magic[sizeof(DIGEST_FILE_MAGIC)-1];
+    char                digest[MAX_DIGEST_SIZE+1];
+    fko_srv_options_t  *opts = NULL;
+    FILE               *fp = NULL;
+    unsigned int        i;
+
+    CU_ASSERT_FATAL(mkdtemp(tmp_dir) != NULL);
+    snprintf(digest_file, sizeof(digest_file), "%s/digest.cache", tmp_dir);
+    snprintf(text_file, sizeof(text_file), "%s-text", digest_file);
+
+    fp = fopen(digest_file, "w");
+    CU_ASSERT_FATAL(fp != NULL);
+    fprintf(fp, "# <digest> <proto> <src_ip> <src_port> <dst_ip> <dst_port> <time>\n");
+    for(i=0; i < 3; i++)
+    {
+        utest_digest_str(digest, sizeof(digest), i);
+        fprintf(fp, "%s 17 127.0.0.1 4030%u 127.0.0.1 62201 1313283481\n", digest, i);
+    }
+    fprintf(fp, "cXzry4ouzEAymxSRaUqTcRNniIMRCXOn7OhNMps0Bag 17\n");
+    fclose(fp);
+    chmod(digest_file, S_IRUSR|S_IWUSR);
+
+    /* The text file is not replaced when it cannot be kept
+    */
+    CU_ASSERT_FATAL(mkdir(text_file, S_IRWXU) == 0);
+    opts = utest_opts_new(digest_file, "1", "0");
+    CU_ASSERT_FATAL(opts != NULL);
+    CU_ASSERT(replay_cache_init(opts) == -1);
+    utest_opts_free(opts);
+
+    fp = fopen(digest_file, "r");
+    CU_ASSERT_FATAL(fp != NULL);
+    CU_ASSERT(fread(magic, sizeof(magic), 1, fp) == 1
+            && memcmp(magic, "# <diges", sizeof(magic)) == 0);
+    fclose(fp);
+    rmdir(text_file);
+
+    opts = utest_opts_new(digest_file, "1", "0");
+    CU_ASSERT_FATAL(opts != NULL);
+    CU_ASSERT(replay_cache_init(opts) == 3);
+    utest_opts_free(opts);
+
+    /* The file is now binary and the text original is kept
+    */
+    fp = fopen(digest_file, "r");
+    CU_ASSERT_FATAL(fp != NULL);
+    CU_ASSERT(fread(magic, sizeof(magic), 1, fp) == 1
+            && memcmp(magic, DIGEST_FILE_MAGIC, sizeof(magic)) == 0);
+    fclose(fp);
+    CU_ASSERT(access(text_file, F_OK) == 0);
+
+    CU_ASSERT(utest_count_persisted(digest_file, 3) == 3);
+
+    unlink(text_file);
+    unlink(digest_file);
+    rmdir(tmp_dir);
+}
+
+DECLARE_UTEST(digest_file_torn_tail, "check recovery from corrupt and partial records")
+{
+    char                tmp_dir[] = "/tmp/fwknopd_utest.XXXXXX";
+    char                digest_file[MAX_PATH_LEN];
+    char                digest[MAX_DIGEST_SIZE+1];
+    fko_srv_options_t  *opts = NULL;
+    struct stat         st;
+    FILE               *fp = NULL;
+
+    CU_ASSERT_FATAL(mkdtemp(tmp_dir) != NULL);
+    snprintf(digest_file, sizeof(digest_file), "%s/digest.cache", tmp_dir);
+
+    opts = utest_opts_new(digest_file, "1", "0");
+    CU_ASSERT_FATAL(opts != NULL);
+    CU_ASSERT(replay_cache_init(opts) == 0);
+    CU_ASSERT(utest_add_digests(opts, 0, 3) == 0);
+    utest_opts_free(opts);
+
+    /* Flip a byte in the second record and leave half a record behind
+    */
+    fp = fopen(digest_file, "r+");
+    CU_ASSERT_FATAL(fp != NULL);
+    fseek(fp, sizeof(digest_file_hdr_t) + sizeof(digest_file_rec_t) + 5, SEEK_SET);
+    fputc('#', fp);
+    fseek(fp, 0, SEEK_END);
+    fwrite("partial record", 14, 1, fp);
+    fclose(fp);
+
+    opts = utest_opts_new(digest_file, "1", "0");
+    CU_ASSERT_FATAL(opts != NULL);
+    CU_ASSERT(replay_cache_init(opts) == 2);
+    utest_digest_str(digest, sizeof(digest), 1);
+    CU_ASSERT(digest_cache_lookup(opts->digest_cache, digest) == NULL);
+    utest_digest_str(digest, sizeof(digest), 2);
+    CU_ASSERT(digest_cache_lookup(opts->digest_cache, digest) != NULL);
+
+    /* New records are appended on a record boundary
+    */
+    CU_ASSERT(utest_add_digests(opts, 3, 4) == 0);
+    utest_opts_free(opts);
+
+    CU_ASSERT(stat(digest_file, &st) == 0
+            && st.st_size == sizeof(digest_file_hdr_t) + 4 * sizeof(digest_file_rec_t));
+
+    opts = utest_opts_new(digest_file, "1", "0");
+    CU_ASSERT_FATAL(opts != NULL);
+    CU_ASSERT(replay_cache_init(opts) == 3);
+    utest_opts_free(opts);
+
+    unlink(digest_file);
+    rmdir(tmp_dir);
+}
+
+DECLARE_UTEST(digest_file_short_write, "check a group torn by a short write is retried")
+{
+    char                tmp_dir[] = "/tmp/fwknopd_utest.XXXXXX";
+    char                digest_file[MAX_PATH_LEN];
+    fko_srv_options_t  *opts = NULL;
+    struct rlimit       rl, rl_orig;
+    struct stat         st;
+    const off_t         group_end = sizeof(digest_file_hdr_t)
+                                    + 4 * sizeof(digest_file_rec_t);
+
+    CU_ASSERT_FATAL(mkdtemp(tmp_dir) != NULL);
+    snprintf(digest_file, sizeof(digest_file), "%s/digest.cache", tmp_dir);
+
+    opts = utest_opts_new(digest_file, "4", "0");
+    CU_ASSERT_FATAL(opts != NULL);
+    CU_ASSERT(replay_cache_init(opts) == 0);
+    CU_ASSERT(utest_add_digests(opts, 0, 7) == 0);
+
+    /* Let the disk fill up half way through the second record of the
+     * next group
+    */
+    CU_ASSERT_FATAL(getrlimit(RLIMIT_FSIZE, &rl_orig) == 0);
+    rl = rl_orig;
+    rl.rlim_cur = group_end + sizeof(digest_file_rec_t) * 3 / 2;
+    signal(SIGXFSZ, SIG_IGN);
+    CU_ASSERT_FATAL(setrlimit(RLIMIT_FSIZE, &rl) == 0);
+
+    CU_ASSERT(utest_add_digests(opts, 7, 8) != 0);
+    CU_ASSERT(stat(digest_file, &st) == 0 && st.st_size == group_end);
+    CU_ASSERT(opts->digest_cache->writer.pending == 4);
+
+    /* Once there is room again the group goes out ahead of the next digest
+    */
+    CU_ASSERT_FATAL(setrlimit(RLIMIT_FSIZE, &rl_orig) == 0);
+    signal(SIGXFSZ, SIG_DFL);
+    CU_ASSERT(utest_add_digests(opts, 8, 9) == 0);
+    CU_ASSERT(stat(digest_file, &st) == 0
+            && st.st_size == group_end + 4 * sizeof(digest_file_rec_t));
+    utest_opts_free(opts);
+
+    CU_ASSERT(utest_count_persisted(digest_file, 9) == 9);
+
+    unlink(digest_file);
+    rmdir(tmp_dir);
+}
+#endif /* USE_FILE_CACHE */
+
+int register_ts_replay_cache(void)
+{
+    ts_init(&TEST_SUITE(replay_cache), TEST_SUITE_DESCR(replay_cache), NULL, NULL);
+#if USE_FILE_CACHE
+    ts_add_utest(&TEST_SUITE(replay_cache), UTEST_FCT(digest_cache_add_lookup), UTEST_DESCR(digest_cache_add_lookup));
+    ts_add_utest(&TEST_SUITE(replay_cache), UTEST_FCT(digest_cache_expire), UTEST_DESCR(digest_cache_expire));
+    ts_add_utest(&TEST_SUITE(replay_cache), UTEST_FCT(digest_cache_wraparound), UTEST_DESCR(digest_cache_wraparound));
+    ts_add_utest(&TEST_SUITE(replay_cache), UTEST_FCT(digest_file_crash_records), UTEST_DESCR(digest_file_crash_records));
+    ts_add_utest(&TEST_SUITE(replay_cache), UTEST_FCT(digest_file_crash_interval), UTEST_DESCR(digest_file_crash_interval));
+    ts_add_utest(&TEST_SUITE(replay_cache), UTEST_FCT(digest_file_clean_exit), UTEST_DESCR(digest_file_clean_exit));
+    ts_add_utest(&TEST_SUITE(replay_cache), UTEST_FCT(digest_file_convert_text), UTEST_DESCR(digest_file_convert_text));
+    ts_add_utest(&TEST_SUITE(replay_cache), UTEST_FCT(digest_file_torn_tail), UTEST_DESCR(digest_file_torn_tail));
+    ts_add_utest(&TEST_SUITE(replay_cache), UTEST_FCT(digest_file_short_write), UTEST_DESCR(digest_file_short_write));
+#endif
+
+    return register_ts(&TEST_SUITE(replay_cache));
+}
+#endif /* HAVE_C_UNIT_TESTS */
+
 /***EOF***/
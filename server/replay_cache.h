@@ -34,6 +34,8 @@
 #include "fwknopd_common.h"
 #include "fko.h"
 
+#define MAX_DIGEST_SIZE 64
+
 typedef struct digest_cache_info {
     unsigned int    src_ip;
     unsigned int    dst_ip;
@@ -50,19 +52,88 @@ typedef struct digest_cache_info {
 } digest_cache_info_t;
 
 #if USE_FILE_CACHE
-struct digest_cache_list {
+/* In-memory digest cache entry.  Entries are stored by value in a ring
+ * ordered by creation time, so the digest lives inline rather than behind
+ * the cache_info.digest pointer.
+*/
+typedef struct digest_cache_entry {
     digest_cache_info_t cache_info;
-    struct digest_cache_list *next;
-};
+    uint32_t            hash;
+    char                digest[MAX_DIGEST_SIZE+1];
+} digest_cache_entry_t;
+
+/* Binary digest file layout: a header followed by fixed size records,
+ * each carrying its own checksum so that a torn write at the end of the
+ * file can be detected.  Fields are in host byte order; byte_order in the
+ * header keeps a file from being read on a platform that disagrees.
+*/
+#define DIGEST_FILE_MAGIC       "FWKNOPDC"
+#define DIGEST_FILE_VERSION     1
+#define DIGEST_FILE_BYTE_ORDER  0x01020304
+
+typedef struct digest_file_hdr {
+    char                magic[8];
+    uint32_t            version;
+    uint32_t            byte_order;
+    uint32_t            record_len;
+    uint32_t            checksum;       /* over the fields above */
+} digest_file_hdr_t;
+
+typedef struct digest_file_rec {
+    char                digest[MAX_DIGEST_SIZE];  /* NUL padded */
+    uint32_t            src_ip;
+    uint32_t            dst_ip;
+    int64_t             created;
+    uint16_t            src_port;
+    uint16_t            dst_port;
+    uint8_t             proto;
+    uint8_t             reserved[7];
+    uint32_t            checksum;       /* over the fields above */
+} digest_file_rec_t;
+
+/* Buffered writer for appending digests to the digest file.  Records are
+ * written and fsync()'d as a group once sync_records of them are pending,
+ * or once the oldest pending record is sync_interval milliseconds old.
+*/
+typedef struct digest_writer {
+    int                 fd;
+    char               *buf;
+    size_t              buf_len;
+    size_t              buf_size;
+    unsigned int        pending;
+    off_t               good_off;       /* file size after the last whole group */
+    unsigned int        sync_records;
+    unsigned int        sync_interval;  /* milliseconds, zero disables */
+    struct timespec     first_pending;
+} digest_writer_t;
+
+/* The in-memory digest cache: an open-addressing (linear probing) index
+ * keyed by the raw SPA digest, pointing into the creation-ordered ring.
+ * Entries older than max_age seconds are evicted from the head of the ring.
+*/
+typedef struct digest_cache {
+    digest_cache_entry_t   *ring;
+    unsigned int            ring_size;  /* power of two */
+    unsigned int            ring_head;
+    unsigned int            count;
+    unsigned int           *index;      /* ring slot + 1, zero when empty */
+    unsigned int            index_size; /* power of two, twice ring_size */
+    uint32_t                seed;
+    time_t                  max_age;    /* zero disables eviction */
+    digest_writer_t         writer;
+} digest_cache_t;
 #endif
 
 /* Prototypes
 */
 int replay_cache_init(fko_srv_options_t *opts);
-int is_replay(fko_srv_options_t *opts, char *digest);
-int add_replay(fko_srv_options_t *opts, char *digest);
-#ifdef USE_FILE_CACHE
+int is_replay(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt, char *digest);
+int add_replay(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt, char *digest);
+void replay_cache_sync(fko_srv_options_t *opts);
 void free_replay_list(fko_srv_options_t *opts);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_replay_cache(void);
 #endif
 
 #endif  /* REPLAY_CACHE_H */
@@ -14,6 +14,11 @@
 #include "bstrlib.h"
 #include "service.h"
 
+#ifdef HAVE_C_UNIT_TESTS
+  #include "cunit_common.h"
+  DECLARE_TEST_SUITE(service, "Service table test suite");
+#endif
+
 
 #define MAX_REVERSE_SERVICE_KEY_LEN  MAX_PORT_STR_LEN + MAX_IPV4_STR_LEN + MAX_PORT_STR_LEN + 2
 
@@ -26,7 +31,6 @@
 
 static void destroy_service_hash_node_cb(hash_table_node_t *node)
 {
-    if(node->key != NULL) bdestroy((bstring)(node->key));
     if(node->data != NULL)
     {
         //free_service_data((service_data_t*)(node->data));
@@ -96,8 +100,8 @@ int create_service_table(fko_srv_options_t *opts)
         return FWKNOPD_ERROR_BAD_CONFIG;
     }
 
-    opts->service_hash_tbl = hash_table_create(hash_table_len,
-            NULL, NULL, destroy_service_hash_node_cb);
+    opts->service_hash_tbl = hash_table_create_int(hash_table_len,
+            destroy_service_hash_node_cb);
 
     if(opts->service_hash_tbl == NULL)
     {
@@ -339,16 +343,31 @@ cleanup:
 
 
 
-// modify table
-static int modify_service_table(fko_srv_options_t *opts, int service_array_len, json_object *jdata)
+static int service_data_equal(service_data_t *a, service_data_t *b)
+{
+    return a->proto == b->proto
+        && a->port == b->port
+        && a->nat_port == b->nat_port
+        && strncmp(a->nat_ip_str, b->nat_ip_str, MAX_IPV4_STR_LEN) == 0;
+}
+
+
+static void destroy_seen_service_node_cb(hash_table_node_t *node)
+{
+    // data belongs to the service table
+}
+
+
+// modify table, leaving entries that did not change alone
+static int modify_service_table(fko_srv_options_t *opts, hash_table_t *seen,
+        int service_array_len, json_object *jdata, ctrl_delta_stats_t *delta)
 {
     int rv = FWKNOPD_SUCCESS;
     int idx = 0;
     int nodes = 0;
     json_object *jservice = NULL;
-    bstring key = NULL;
     service_data_t *new_service = NULL;
-    char id[SDP_MAX_SERVICE_ID_STR_LEN + 1] = {0};
+    service_data_t *old_service = NULL;
 
     // walk through the access array
     for(idx = 0; idx < service_array_len; idx++)
@@ -366,26 +385,48 @@ static int modify_service_table(fko_srv_options_t *opts, int service_array_len,
             continue;
         }
 
-        // convert the service id integer to a bstring
-        snprintf(id, SDP_MAX_SERVICE_ID_STR_LEN, "%"PRIu32, new_service->service_id);
-        key = bfromcstr(id);
+        old_service = hash_table_get_int(opts->service_hash_tbl, new_service->service_id);
 
-        if( hash_table_set(opts->service_hash_tbl, key, new_service) != FKO_SUCCESS )
+        if(old_service != NULL && service_data_equal(old_service, new_service))
         {
-            log_msg(LOG_ERR,
-                "Fatal error creating service hash table node"
-            );
-            bdestroy(key);
             free(new_service);
-            return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+            new_service = old_service;
+            delta->unchanged++;
         }
+        else
+        {
+            // the old reverse lookup key no longer applies
+            if(old_service != NULL)
+                modify_reverse_service_table(opts, 1, old_service);
+
+            if( hash_table_set_int(opts->service_hash_tbl, new_service->service_id, new_service) != FKO_SUCCESS )
+            {
+                log_msg(LOG_ERR,
+                    "Fatal error creating service hash table node"
+                );
+                free(new_service);
+                return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+            }
+
+            if( modify_reverse_service_table(opts, 0, new_service) != FWKNOPD_SUCCESS )
+            {
+                return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+            }
 
-        if( modify_reverse_service_table(opts, 0, new_service) != FWKNOPD_SUCCESS )
+            if(old_service != NULL)
+                delta->changed++;
+            else
+                delta->added++;
+
+            log_msg(LOG_NOTICE, "Added service entry for Service ID %"PRIu32, new_service->service_id);
+        }
+
+        if(seen != NULL && hash_table_set_int(seen, new_service->service_id, new_service) != FKO_SUCCESS)
         {
+            log_msg(LOG_ERR, "Fatal memory error tracking refreshed services");
             return FWKNOPD_ERROR_MEMORY_ALLOCATION;
         }
 
-        log_msg(LOG_NOTICE, "Added service entry for Service ID %"PRIu32, new_service->service_id);
         nodes++;
     }
 
@@ -402,14 +443,40 @@ static int modify_service_table(fko_srv_options_t *opts, int service_array_len,
 }
 
 
-static void remove_service_data_nodes(fko_srv_options_t *opts, int service_array_len, json_object *jdata)
+typedef struct service_sweep
+{
+    fko_srv_options_t   *opts;
+    hash_table_t        *seen;
+    ctrl_delta_stats_t  *delta;
+} service_sweep_t;
+
+// drop the services a refresh did not mention
+static int traverse_sweep_services_cb(hash_table_node_t *node, void *arg)
+{
+    service_sweep_t *sweep = (service_sweep_t *)arg;
+    service_data_t *service_data = (service_data_t *)(node->data);
+
+    if(hash_table_get_int(sweep->seen, node->int_key) != NULL)
+        return 0;
+
+    modify_reverse_service_table(sweep->opts, 1, service_data);
+    log_msg(LOG_NOTICE, "Removed service entry for Service ID %"PRIu32, node->int_key);
+
+    // safe while traversing, the table does not rehash meanwhile
+    hash_table_delete_int(sweep->opts->service_hash_tbl, node->int_key);
+    sweep->delta->removed++;
+
+    return 0;
+}
+
+
+static void remove_service_data_nodes(fko_srv_options_t *opts, int service_array_len,
+        json_object *jdata, ctrl_delta_stats_t *delta)
 {
     int rv = FKO_SUCCESS;
     int idx;
     int service_id = 0;
     json_object *jentry = NULL;
-    bstring key = NULL;
-    char id[SDP_MAX_SERVICE_ID_STR_LEN + 1] = {0};
     service_data_t *service_data = NULL;
 
     // walk through the access array
@@ -422,12 +489,8 @@ static void remove_service_data_nodes(fko_srv_options_t *opts, int service_array
             continue;
         }
 
-        // convert the service id integer to a bstring
-        snprintf(id, SDP_MAX_SERVICE_ID_STR_LEN, "%d", service_id);
-        key = bfromcstr(id);
-
         // first get the data in order to find and delete the reverse lookup node
-        if((service_data = hash_table_get(opts->service_hash_tbl, key)) == NULL)
+        if((service_data = hash_table_get_int(opts->service_hash_tbl, (uint32_t)service_id)) == NULL)
         {
             log_msg(LOG_WARNING, "Did not find hash table node with service ID %d to remove. Continuing.", service_id);
             continue;
@@ -437,27 +500,30 @@ static void remove_service_data_nodes(fko_srv_options_t *opts, int service_array
             modify_reverse_service_table(opts, 1, service_data);
         }
 
-        if( hash_table_delete(opts->service_hash_tbl, key) != FKO_SUCCESS )
+        if( hash_table_delete_int(opts->service_hash_tbl, (uint32_t)service_id) != FKO_SUCCESS )
         {
             log_msg(LOG_WARNING, "Did not find hash table node with service ID %d to remove. Continuing.", service_id);
         }
         else
         {
             log_msg(LOG_NOTICE, "Removed access stanza for service ID %d from service list.", service_id);
+            delta->removed++;
         }
-
-        bdestroy(key);
     }
 }
 
 
 /* Take a json data array from a controller message
- * Alter/recreate the hash table based on the action
+ * Alter the hash table based on the action.  A refresh only touches
+ * the entries that were added, changed or dropped.
  */
 int process_service_msg(fko_srv_options_t *opts, int action, json_object *jdata)
 {
     int rv = FWKNOPD_SUCCESS;
     int service_array_len = 0;
+    hash_table_t *seen = NULL;
+    ctrl_delta_stats_t delta;
+    service_sweep_t sweep;
 
     if(jdata == NULL || json_object_get_type(jdata) == json_type_null)
     {
@@ -474,6 +540,7 @@ int process_service_msg(fko_srv_options_t *opts, int action, json_object *jdata)
 
     log_msg(LOG_DEBUG, "jdata contains %d objects", service_array_len);
 
+    memset(&delta, 0x0, sizeof(delta));
 
     // lock the hash table mutex
     if(pthread_mutex_lock(&(opts->service_hash_tbl_mutex)))
@@ -493,21 +560,8 @@ int process_service_msg(fko_srv_options_t *opts, int action, json_object *jdata)
             return FWKNOPD_ERROR_UNTIMELY_MSG;
         }
 
-        remove_service_data_nodes(opts, service_array_len, jdata);
-        pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
-
-        return FWKNOPD_SUCCESS;
-    }
-
-    // if this is service data refresh, destroy the hash table
-    if(action == CTRL_ACTION_SERVICE_REFRESH)
-    {
-        if(opts->service_hash_tbl != NULL)
-        {
-            // destroy the table
-            hash_table_destroy(opts->service_hash_tbl);
-            opts->service_hash_tbl = NULL;
-        }
+        remove_service_data_nodes(opts, service_array_len, jdata, &delta);
+        goto done;
     }
 
     // create the hash table if necessary
@@ -521,16 +575,46 @@ int process_service_msg(fko_srv_options_t *opts, int action, json_object *jdata)
         }
     }
 
+    // a refresh remembers which services it saw so the rest can be dropped
+    if(action == CTRL_ACTION_SERVICE_REFRESH)
+    {
+        if((seen = hash_table_create_int(service_array_len,
+                        destroy_seen_service_node_cb)) == NULL)
+        {
+            pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
+            log_msg(LOG_ERR, "Fatal memory error tracking refreshed services");
+            return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+        }
+    }
+
     // control message is either REFRESH or UPDATE
     // in either case, use data array to modify the table
-    if((rv = modify_service_table(opts, service_array_len, jdata)) != FWKNOPD_SUCCESS)
+    if((rv = modify_service_table(opts, seen, service_array_len, jdata, &delta)) != FWKNOPD_SUCCESS)
     {
         log_msg(LOG_ERR, "modify_service_table was unsuccessful");
     }
+    else if(seen != NULL)
+    {
+        sweep.opts  = opts;
+        sweep.seen  = seen;
+        sweep.delta = &delta;
+        hash_table_traverse(opts->service_hash_tbl, traverse_sweep_services_cb, &sweep);
+    }
+
+    if(seen != NULL)
+        hash_table_destroy(seen);
+
+done:
+    opts->service_last_delta = delta;
 
     // release lock on the table
     pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
 
+    log_msg(LOG_INFO, "Service %s: %u added, %u changed, %u removed, %u unchanged",
+            action == CTRL_ACTION_SERVICE_REFRESH ? "refresh"
+                : (action == CTRL_ACTION_SERVICE_REMOVE ? "removal" : "update"),
+            delta.added, delta.changed, delta.removed, delta.unchanged);
+
     return rv;
 }
 
@@ -539,31 +623,25 @@ int process_service_msg(fko_srv_options_t *opts, int action, json_object *jdata)
 int get_service_data(fko_srv_options_t *opts, uint32_t service_id, service_data_t**r_service_data)
 {
     int rv = FWKNOPD_SUCCESS;
-    bstring key = NULL;
     service_data_t *service_data = NULL;
     service_data_t *copy_service_data = NULL;
-    char id[SDP_MAX_SERVICE_ID_STR_LEN + 1] = {0};
-
-    // convert the service id integer to a bstring
-    snprintf(id, SDP_MAX_SERVICE_ID_STR_LEN, "%"PRIu32, service_id);
-    key = bfromcstr(id);
 
     // lock the hash table mutex
     if(pthread_mutex_lock(&(opts->service_hash_tbl_mutex)))
     {
         log_msg(LOG_ERR, "Service table mutex lock error.");
-        bdestroy(key);
         *r_service_data = NULL;
         return FWKNOPD_ERROR_BAD_SERVICE_DATA;
     }
 
-    service_data = hash_table_get(opts->service_hash_tbl, key);
-
-    pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
-    bdestroy(key);
+    // the entry may be replaced by a refresh as soon as the lock is gone,
+    // so it is copied first
+    service_data = hash_table_get_int(opts->service_hash_tbl, service_id);
 
     if( service_data == NULL )
     {
+        pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
+
         log_msg(LOG_WARNING,
             "Did not find service hash table node for service id %"PRIu32,
             service_id
@@ -575,6 +653,7 @@ int get_service_data(fko_srv_options_t *opts, uint32_t service_id, service_data_
     {
         if((copy_service_data = calloc(1, sizeof(service_data_t))) == NULL)
         {
+            pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
             log_msg(LOG_ERR, "Fatal memory error creating service_data_t object");
             return FWKNOPD_ERROR_MEMORY_ALLOCATION;
         }
@@ -585,6 +664,8 @@ int get_service_data(fko_srv_options_t *opts, uint32_t service_id, service_data_
         copy_service_data->nat_port   = service_data->nat_port;
         strncpy(copy_service_data->nat_ip_str, service_data->nat_ip_str, MAX_IPV4_STR_LEN);
 
+        pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
+
         *r_service_data = copy_service_data;
     }
 
@@ -768,9 +849,10 @@ int get_service_id_by_details(fko_srv_options_t *opts, char *protocol, int port,
         goto cleanup;
     }
 
+    *r_id = *id;
+
     pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
 
-    *r_id = *id;
     bdestroy(key);
     return rv;
 
@@ -826,6 +908,12 @@ void dump_service_list(fko_srv_options_t *opts)
 
         hash_table_traverse(opts->service_hash_tbl, traverse_dump_service_cb, dest);
 
+        fprintf(dest,
+            "Last controller service message: "
+            "%u added, %u changed, %u removed, %u unchanged\n\n",
+            opts->service_last_delta.added, opts->service_last_delta.changed,
+            opts->service_last_delta.removed, opts->service_last_delta.unchanged);
+
         pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
     }
 
@@ -839,3 +927,65 @@ void dump_service_list(fko_srv_options_t *opts)
 
 }  // END dump_service_list
 
+#ifdef HAVE_C_UNIT_TESTS
+
+/* A refresh only touches the services that changed
+*/
+DECLARE_UTEST(service_refresh_delta, "check incremental service refreshes")
+{
+    static fko_srv_options_t    opts;
+    json_object                *jdata = NULL;
+    service_data_t             *svc = NULL;
+    uint32_t                    id = 0;
+
+    memset(&opts, 0x00, sizeof(opts));
+    opts.config[CONF_SERVICE_HASH_TABLE_LENGTH] = "10";
+    pthread_mutex_init(&(opts.service_hash_tbl_mutex), NULL);
+
+    jdata = json_tokener_parse("["
+        "{\"service_id\":1,\"proto\":\"tcp\",\"port\":22,\"nat_ip\":\"\",\"nat_port\":0},"
+        "{\"service_id\":2,\"proto\":\"tcp\",\"port\":80,\"nat_ip\":\"\",\"nat_port\":0},"
+        "{\"service_id\":3,\"proto\":\"udp\",\"port\":53,\"nat_ip\":\"\",\"nat_port\":0}]");
+    CU_ASSERT_FATAL(jdata != NULL);
+    CU_ASSERT(process_service_msg(&opts, CTRL_ACTION_SERVICE_REFRESH, jdata) == FWKNOPD_SUCCESS);
+    CU_ASSERT(opts.service_last_delta.added == 3);
+    json_object_put(jdata);
+
+    svc = hash_table_get_int(opts.service_hash_tbl, 1);
+
+    /* 1 unchanged, 2 moves to another port, 3 is dropped and 4 is new
+    */
+    jdata = json_tokener_parse("["
+        "{\"service_id\":1,\"proto\":\"tcp\",\"port\":22,\"nat_ip\":\"\",\"nat_port\":0},"
+        "{\"service_id\":2,\"proto\":\"tcp\",\"port\":8080,\"nat_ip\":\"\",\"nat_port\":0},"
+        "{\"service_id\":4,\"proto\":\"tcp\",\"port\":443,\"nat_ip\":\"\",\"nat_port\":0}]");
+    CU_ASSERT_FATAL(jdata != NULL);
+    CU_ASSERT(process_service_msg(&opts, CTRL_ACTION_SERVICE_REFRESH, jdata) == FWKNOPD_SUCCESS);
+    json_object_put(jdata);
+
+    CU_ASSERT(opts.service_last_delta.added == 1);
+    CU_ASSERT(opts.service_last_delta.changed == 1);
+    CU_ASSERT(opts.service_last_delta.removed == 1);
+    CU_ASSERT(opts.service_last_delta.unchanged == 1);
+
+    CU_ASSERT(hash_table_get_int(opts.service_hash_tbl, 1) == svc);
+    CU_ASSERT(hash_table_get_int(opts.service_hash_tbl, 3) == NULL);
+
+    /* The reverse lookups follow along
+    */
+    CU_ASSERT(get_service_id_by_details(&opts, "tcp", 8080, "", 0, &id) == FWKNOPD_SUCCESS && id == 2);
+    CU_ASSERT(get_service_id_by_details(&opts, "tcp", 80, "", 0, &id) != FWKNOPD_SUCCESS);
+    CU_ASSERT(get_service_id_by_details(&opts, "udp", 53, "", 0, &id) != FWKNOPD_SUCCESS);
+    CU_ASSERT(get_service_id_by_details(&opts, "tcp", 443, "", 0, &id) == FWKNOPD_SUCCESS && id == 4);
+
+    destroy_service_table(&opts);
+}
+
+int register_ts_service(void)
+{
+    ts_init(&TEST_SUITE(service), TEST_SUITE_DESCR(service), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(service), UTEST_FCT(service_refresh_delta), UTEST_DESCR(service_refresh_delta));
+
+    return register_ts(&TEST_SUITE(service));
+}
+#endif /* HAVE_C_UNIT_TESTS */
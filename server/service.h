@@ -20,4 +20,8 @@ int get_service_data_list(fko_srv_options_t *opts, char *service_str, service_da
 int get_service_id_by_details(fko_srv_options_t *opts, char *protocol, int port, char *nat_ip, int nat_port, uint32_t *r_id);
 void dump_service_list(fko_srv_options_t *opts);
 
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_service(void);
+#endif
+
 #endif /* SERVICE_H_ */
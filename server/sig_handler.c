@@ -34,6 +34,10 @@
 #include "service.h"
 #include "access.h"
 #include "config_init.h"
+#include "blacklist.h"
+#include "rate_limit.h"
+#include "spa_stage.h"
+#include "fwknopd_errors.h"
 
 #if HAVE_SYS_WAIT_H
   #include <sys/wait.h>
@@ -170,12 +174,15 @@ sig_do_stop(fko_srv_options_t * const opts)
             dump_config(opts);
             dump_service_list(opts);
             dump_access_list(opts);
+            rate_limit_dump(opts);
+            spa_stage_dump(opts);
         }
         else if(got_sigusr2)
         {
-            /* Not doing anything with this yet.
-            */
+            log_msg(LOG_INFO, "Got SIGUSR2. Reloading BLACKLIST...");
             got_sigusr2 = 0;
+            if(blacklist_load(opts) != FWKNOPD_SUCCESS)
+                log_msg(LOG_ERR, "[*] BLACKLIST reload failed, keeping the current list");
             got_signal = 0;
         }
         else
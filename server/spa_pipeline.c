@@ -0,0 +1,874 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_pipeline.c
+ *
+ * Purpose: Multi-threaded SPA processing for fwknopd.  The capture (or UDP
+ *          server) loop hands each packet to a bounded ring, a pool of
+ *          worker threads decodes and authorizes them, and a single
+ *          actuator thread makes all of the firewall changes.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "spa_pipeline.h"
+#include "incoming_spa.h"
+#include "fw_util.h"
+#include "cmd_cycle.h"
+#include "replay_cache.h"
+#include "service.h"
+#include "access.h"
+#include "log_msg.h"
+#include "fwknopd_errors.h"
+
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+
+#ifdef HAVE_C_UNIT_TESTS
+  #include "cunit_common.h"
+  DECLARE_TEST_SUITE(spa_pipeline, "SPA pipeline test suite");
+#endif
+
+/* One slot of the packet ring.  The sequence number says whose turn it is:
+ * seq == pos means the slot is free for the producer claiming position
+ * pos, seq == pos+1 means it holds a packet for the consumer claiming pos.
+*/
+typedef struct spa_slot
+{
+    unsigned long   seq;
+    spa_pkt_info_t  pkt;
+} spa_slot_t;
+
+/* An accepted SPA request waiting for the actuator thread.  The strings in
+ * spa_data_t point into the worker's fko context, so they are copied.
+*/
+typedef struct spa_grant
+{
+    struct spa_grant   *next;
+    acc_stanza_t       *acc;
+    int                 acc_held;   /* holds a reference on acc */
+    int                 stanza_num;
+    spa_data_t          spadat;
+} spa_grant_t;
+
+struct spa_pipeline
+{
+    fko_srv_options_t  *opts;
+
+    /* Bounded lock-free packet ring.  head and tail only ever grow, the
+     * slot is picked with ring_mask.
+    */
+    spa_slot_t         *ring;
+    unsigned long       ring_mask;
+    unsigned long       head;
+    unsigned long       tail;
+    unsigned int        dropped;
+
+    /* Workers with nothing to do sleep on work_cond
+    */
+    pthread_t          *workers;
+    int                 nb_workers;
+    int                 idle_workers;
+    int                 stopping;
+    pthread_mutex_t     work_mutex;
+    pthread_cond_t      work_cond;
+
+    /* Grants queued for the actuator
+    */
+    pthread_t           actuator;
+    int                 actuator_started;
+    int                 actuator_stopping;
+    spa_grant_t        *grant_head;
+    spa_grant_t        *grant_tail;
+    pthread_mutex_t     grant_mutex;
+    pthread_cond_t      grant_cond;
+
+    int                 rules_chk_threshold;
+    struct timespec     last_housekeeping;
+};
+
+static size_t
+spa_pkt_copy_len(const spa_pkt_info_t *spa_pkt)
+{
+    return(offsetof(spa_pkt_info_t, packet_data) + spa_pkt->packet_data_len + 1);
+}
+
+/* Claim the next free slot and copy the packet in.  Returns 0 if the ring
+ * is full.
+*/
+static int
+spa_ring_push(struct spa_pipeline *pl, const spa_pkt_info_t *spa_pkt)
+{
+    spa_slot_t     *slot;
+    unsigned long   pos, seq;
+    long            diff;
+
+    pos = __atomic_load_n(&pl->head, __ATOMIC_RELAXED);
+    for(;;)
+    {
+        slot = &(pl->ring[pos & pl->ring_mask]);
+        seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (long)seq - (long)pos;
+
+        if(diff == 0)
+        {
+            if(__atomic_compare_exchange_n(&pl->head, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if(diff < 0)
+            return(0);
+        else
+            pos = __atomic_load_n(&pl->head, __ATOMIC_RELAXED);
+    }
+
+    memcpy(&slot->pkt, spa_pkt, spa_pkt_copy_len(spa_pkt));
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return(1);
+}
+
+/* Take the oldest packet off the ring.  Returns 0 if it is empty.
+*/
+static int
+spa_ring_pop(struct spa_pipeline *pl, spa_pkt_info_t *spa_pkt)
+{
+    spa_slot_t     *slot;
+    unsigned long   pos, seq;
+    long            diff;
+
+    pos = __atomic_load_n(&pl->tail, __ATOMIC_RELAXED);
+    for(;;)
+    {
+        slot = &(pl->ring[pos & pl->ring_mask]);
+        seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (long)seq - (long)(pos + 1);
+
+        if(diff == 0)
+        {
+            if(__atomic_compare_exchange_n(&pl->tail, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if(diff < 0)
+            return(0);
+        else
+            pos = __atomic_load_n(&pl->tail, __ATOMIC_RELAXED);
+    }
+
+    memcpy(spa_pkt, &slot->pkt, spa_pkt_copy_len(&slot->pkt));
+    __atomic_store_n(&slot->seq, pos + pl->ring_mask + 1, __ATOMIC_RELEASE);
+
+    return(1);
+}
+
+static int
+spa_ring_empty(struct spa_pipeline *pl)
+{
+    unsigned long   pos = __atomic_load_n(&pl->tail, __ATOMIC_ACQUIRE);
+    spa_slot_t     *slot = &(pl->ring[pos & pl->ring_mask]);
+
+    return(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1);
+}
+
+static void
+spa_wait_deadline(struct timespec *ts, long ms)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec  += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if(ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static void *
+spa_worker_thread(void *arg)
+{
+    struct spa_pipeline    *pl = (struct spa_pipeline *)arg;
+    spa_pkt_info_t          spa_pkts[SPA_DIGEST_BATCH];
+    struct timespec         deadline;
+    int                     stop, n;
+
+    /* Whatever is waiting on the ring (up to SPA_DIGEST_BATCH packets) is
+     * taken at once so that the replay digests can be computed together.
+    */
+    for(;;)
+    {
+        for(n=0; n < SPA_DIGEST_BATCH; n++)
+            if(! spa_ring_pop(pl, &spa_pkts[n]))
+                break;
+
+        if(n > 0)
+        {
+            process_spa_packets(pl->opts, spa_pkts, n);
+            continue;
+        }
+
+        /* Advertise that we are idle before looking at the ring again so
+         * that spa_pipeline_submit() cannot miss us.
+        */
+        pthread_mutex_lock(&pl->work_mutex);
+        __atomic_add_fetch(&pl->idle_workers, 1, __ATOMIC_SEQ_CST);
+
+        if(! pl->stopping && spa_ring_empty(pl))
+        {
+            spa_wait_deadline(&deadline, 100);
+            pthread_cond_timedwait(&pl->work_cond, &pl->work_mutex, &deadline);
+        }
+
+        __atomic_sub_fetch(&pl->idle_workers, 1, __ATOMIC_SEQ_CST);
+        stop = pl->stopping;
+        pthread_mutex_unlock(&pl->work_mutex);
+
+        /* Packets already on the ring are processed before we go
+        */
+        if(stop && spa_ring_empty(pl))
+            break;
+    }
+
+    return NULL;
+}
+
+static void
+spa_grant_free(spa_grant_t *grant)
+{
+    free(grant->spadat.username);
+    free(grant->spadat.version);
+    free(grant->spadat.spa_message);
+    free(grant->spadat.nat_access);
+    free(grant->spadat.server_auth);
+
+    if(grant->spadat.service_data_list != NULL)
+        free_service_data_list(grant->spadat.service_data_list);
+
+    if(grant->acc_held)
+        acc_stanza_release(grant->acc);
+
+    free(grant);
+}
+
+static int
+spa_grant_strdup(char **dst, const char *src)
+{
+    if(src == NULL)
+    {
+        *dst = NULL;
+        return(1);
+    }
+    return((*dst = strdup(src)) != NULL);
+}
+
+static spa_grant_t *
+spa_grant_new(acc_stanza_t *acc, spa_data_t *spadat, const int stanza_num)
+{
+    spa_grant_t    *grant = NULL;
+    spa_data_t     *gdat;
+    int             ok;
+
+    if((grant = calloc(1, sizeof(spa_grant_t))) == NULL)
+        return NULL;
+
+    /* The worker found the stanza under acc_table_read_lock(), which is
+     * dropped long before the actuator gets to the grant.  Keep the
+     * stanza alive in case its table is replaced and reclaimed meanwhile.
+    */
+    grant->acc        = acc;
+    grant->acc_held   = acc_stanza_hold(acc);
+    grant->stanza_num = stanza_num;
+
+    gdat = &(grant->spadat);
+    memcpy(gdat, spadat, sizeof(spa_data_t));
+
+    ok  = spa_grant_strdup(&gdat->username, spadat->username);
+    ok &= spa_grant_strdup(&gdat->version, spadat->version);
+    ok &= spa_grant_strdup(&gdat->spa_message, spadat->spa_message);
+    ok &= spa_grant_strdup(&gdat->nat_access, spadat->nat_access);
+    ok &= spa_grant_strdup(&gdat->server_auth, spadat->server_auth);
+
+    /* use_src_ip points at one of the address buffers in the struct itself
+    */
+    if(spadat->use_src_ip == spadat->pkt_source_ip)
+        gdat->use_src_ip = gdat->pkt_source_ip;
+    else if(spadat->use_src_ip == spadat->spa_message_src_ip)
+        gdat->use_src_ip = gdat->spa_message_src_ip;
+    else
+        gdat->use_src_ip = NULL;
+
+    /* The service list now belongs to the grant
+    */
+    gdat->service_data_list = NULL;
+
+    if(! ok)
+    {
+        spa_grant_free(grant);
+        return NULL;
+    }
+
+    gdat->service_data_list   = spadat->service_data_list;
+    spadat->service_data_list = NULL;
+
+    return grant;
+}
+
+/* Expired rules and CMD_CYCLE_CLOSE commands are handled here instead of
+ * in the capture loop so that only this thread changes the firewall.
+*/
+static void
+spa_pipeline_housekeeping(struct spa_pipeline *pl)
+{
+    fko_srv_options_t  *opts = pl->opts;
+    int                 chk_rm_all = 0;
+#if FIREWALL_IPFW
+    time_t              now;
+#endif
+
+    if(opts->test)
+        return;
+
+    if(opts->enable_fw)
+    {
+        if(pl->rules_chk_threshold > 0)
+        {
+            opts->check_rules_ctr++;
+            if ((opts->check_rules_ctr % pl->rules_chk_threshold) == 0)
+            {
+                chk_rm_all = 1;
+                opts->check_rules_ctr = 0;
+            }
+        }
+        check_firewall_rules(opts, chk_rm_all);
+    }
+
+    cmd_cycle_close(opts);
+
+    replay_cache_sync(opts);
+
+#if FIREWALL_IPFW
+    if(opts->fw_config->total_rules > 0)
+    {
+        time(&now);
+        if(opts->fw_config->last_purge < (now - opts->fw_config->purge_interval))
+        {
+            ipfw_purge_expired_rules(opts);
+            opts->fw_config->last_purge = now;
+        }
+    }
+#endif
+
+    return;
+}
+
+static long
+spa_elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return((now.tv_sec - start->tv_sec) * 1000
+            + (now.tv_nsec - start->tv_nsec) / 1000000);
+}
+
+static void *
+spa_actuator_thread(void *arg)
+{
+    struct spa_pipeline    *pl = (struct spa_pipeline *)arg;
+    spa_grant_t            *grant, *next;
+    struct timespec         deadline;
+    int                     stop;
+
+    for(;;)
+    {
+        pthread_mutex_lock(&pl->grant_mutex);
+        if(pl->grant_head == NULL && ! pl->actuator_stopping)
+        {
+            spa_wait_deadline(&deadline, SPA_PIPELINE_HOUSEKEEPING_MS);
+            pthread_cond_timedwait(&pl->grant_cond, &pl->grant_mutex, &deadline);
+        }
+        grant = pl->grant_head;
+        pl->grant_head = pl->grant_tail = NULL;
+        stop = pl->actuator_stopping;
+        pthread_mutex_unlock(&pl->grant_mutex);
+
+#if FIREWALL_IPTABLES
+        /* Everything queued since the last pass goes into the firewall
+         * with one iptables-restore
+        */
+        ipt_txn_begin();
+#endif
+        for(; grant != NULL; grant = next)
+        {
+            next = grant->next;
+            actuate_spa_request(pl->opts, grant->acc,
+                    &(grant->spadat), grant->stanza_num);
+            spa_grant_free(grant);
+        }
+#if FIREWALL_IPTABLES
+        ipt_txn_commit(pl->opts);
+#endif
+
+        if(spa_elapsed_ms(&pl->last_housekeeping) >= SPA_PIPELINE_HOUSEKEEPING_MS)
+        {
+            spa_pipeline_housekeeping(pl);
+            clock_gettime(CLOCK_MONOTONIC, &pl->last_housekeeping);
+        }
+
+        /* The workers are gone by the time we are told to stop, so nothing
+         * can be queued after the list we just ran.
+        */
+        if(stop)
+            break;
+    }
+
+    return NULL;
+}
+
+/* Returns 1 if we are running on one of the pipeline threads (in which
+ * case it can not be joined from here).
+*/
+static int
+spa_pipeline_thread_self(struct spa_pipeline *pl)
+{
+    pthread_t   self = pthread_self();
+    int         i;
+
+    if(pl->actuator_started && pthread_equal(self, pl->actuator))
+        return(1);
+
+    for(i=0; i < pl->nb_workers; i++)
+        if(pthread_equal(self, pl->workers[i]))
+            return(1);
+
+    return(0);
+}
+
+static void
+spa_pipeline_free(struct spa_pipeline *pl)
+{
+    spa_grant_t    *grant, *next;
+
+    for(grant = pl->grant_head; grant != NULL; grant = next)
+    {
+        next = grant->next;
+        spa_grant_free(grant);
+    }
+
+    pthread_mutex_destroy(&pl->work_mutex);
+    pthread_cond_destroy(&pl->work_cond);
+    pthread_mutex_destroy(&pl->grant_mutex);
+    pthread_cond_destroy(&pl->grant_cond);
+
+    free(pl->workers);
+    free(pl->ring);
+    free(pl);
+}
+
+static struct spa_pipeline *
+spa_pipeline_new(fko_srv_options_t *opts, unsigned long queue_size,
+        int nb_workers)
+{
+    struct spa_pipeline    *pl = NULL;
+    unsigned long           size = SPA_PIPELINE_MIN_QUEUE, i;
+
+    while(size < queue_size)
+        size <<= 1;
+
+    if((pl = calloc(1, sizeof(struct spa_pipeline))) == NULL)
+        return NULL;
+
+    pl->ring    = calloc(size, sizeof(spa_slot_t));
+    pl->workers = calloc(nb_workers > 0 ? nb_workers : 1, sizeof(pthread_t));
+
+    pthread_mutex_init(&pl->work_mutex, NULL);
+    pthread_cond_init(&pl->work_cond, NULL);
+    pthread_mutex_init(&pl->grant_mutex, NULL);
+    pthread_cond_init(&pl->grant_cond, NULL);
+
+    if(pl->ring == NULL || pl->workers == NULL)
+    {
+        spa_pipeline_free(pl);
+        return NULL;
+    }
+
+    pl->opts      = opts;
+    pl->ring_mask = size - 1;
+    for(i=0; i < size; i++)
+        pl->ring[i].seq = i;
+
+    clock_gettime(CLOCK_MONOTONIC, &pl->last_housekeeping);
+
+    return pl;
+}
+
+/* Start the worker pool and the actuator thread if SPA_WORKER_THREADS is
+ * set.  nb_capture_threads is the number of threads that will be handing
+ * packets in; with more than one the actuator is started even without
+ * workers so that the firewall is still only changed from one thread.
+ * Otherwise nothing is started and packets keep being processed on the
+ * capture thread.
+*/
+int
+spa_pipeline_start(fko_srv_options_t *opts, const int nb_capture_threads)
+{
+    struct spa_pipeline    *pl = NULL;
+    int                     nb_workers, queue_size, is_err, i;
+
+    if(opts->spa_pipeline != NULL)
+        return 0;
+
+    nb_workers = strtol_wrapper(opts->config[CONF_SPA_WORKER_THREADS],
+            0, RCHK_MAX_SPA_WORKER_THREADS, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid SPA_WORKER_THREADS");
+        return -1;
+    }
+
+    if(nb_workers == 0 && nb_capture_threads < 2)
+        return 0;
+
+    queue_size = strtol_wrapper(opts->config[CONF_SPA_QUEUE_SIZE],
+            SPA_PIPELINE_MIN_QUEUE, RCHK_MAX_SPA_QUEUE_SIZE, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid SPA_QUEUE_SIZE");
+        return -1;
+    }
+
+    /* The ring is not used without workers
+    */
+    if(nb_workers == 0)
+        queue_size = SPA_PIPELINE_MIN_QUEUE;
+
+    if((pl = spa_pipeline_new(opts, queue_size, nb_workers)) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Could not allocate the SPA pipeline");
+        return -1;
+    }
+
+    pl->rules_chk_threshold = strtol_wrapper(opts->config[CONF_RULES_CHECK_THRESHOLD],
+            0, RCHK_MAX_RULES_CHECK_THRESHOLD, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid RULES_CHECK_THRESHOLD");
+        spa_pipeline_free(pl);
+        return -1;
+    }
+
+    opts->spa_pipeline = pl;
+
+    if(pthread_create(&pl->actuator, NULL, spa_actuator_thread, pl) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Could not start the SPA actuator thread");
+        spa_pipeline_stop(opts);
+        return -1;
+    }
+    pl->actuator_started = 1;
+
+    for(i=0; i < nb_workers; i++)
+    {
+        if(pthread_create(&(pl->workers[i]), NULL, spa_worker_thread, pl) != 0)
+        {
+            log_msg(LOG_ERR, "[*] Could not start SPA worker thread %d", i);
+            spa_pipeline_stop(opts);
+            return -1;
+        }
+        pl->nb_workers++;
+    }
+
+    if(pl->nb_workers > 0)
+        log_msg(LOG_INFO, "Started %d SPA worker threads (%lu packet slots)",
+                pl->nb_workers, pl->ring_mask + 1);
+    else
+        log_msg(LOG_INFO, "Started the SPA actuator thread for %d capture threads",
+                nb_capture_threads);
+
+    return 0;
+}
+
+/* Queue a copy of a captured packet for the workers.  Returns 1 if it was
+ * queued, 0 if the ring was full and the packet was dropped, and -1 if
+ * there are no workers (the caller processes the packet itself).
+*/
+int
+spa_pipeline_submit(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt)
+{
+    struct spa_pipeline    *pl = opts->spa_pipeline;
+    unsigned int            dropped;
+
+    if(pl == NULL || pl->nb_workers == 0)
+        return -1;
+
+    if(spa_pkt->packet_data_len > MAX_SPA_PACKET_LEN)
+        return 0;
+
+    if(! spa_ring_push(pl, spa_pkt))
+    {
+        dropped = __atomic_add_fetch(&pl->dropped, 1, __ATOMIC_RELAXED);
+        if(dropped == 1 || (dropped % 1000) == 0)
+            log_msg(LOG_WARNING,
+                "SPA packet queue full, %u packets dropped so far", dropped);
+        return 0;
+    }
+
+    /* Pairs with the idle_workers increment in spa_worker_thread()
+    */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&pl->idle_workers, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&pl->work_mutex);
+        pthread_cond_signal(&pl->work_cond);
+        pthread_mutex_unlock(&pl->work_mutex);
+    }
+
+    return 1;
+}
+
+/* Called by a worker for an accepted SPA request.  The request is copied
+ * and carried out later by the actuator thread.  Returns 1 if it was
+ * queued.
+*/
+int
+spa_pipeline_actuate(fko_srv_options_t *opts, acc_stanza_t *acc,
+        spa_data_t *spadat, const int stanza_num)
+{
+    struct spa_pipeline    *pl = opts->spa_pipeline;
+    spa_grant_t            *grant = NULL;
+
+    if((grant = spa_grant_new(acc, spadat, stanza_num)) == NULL)
+    {
+        log_msg(LOG_ERR, "[%s] (stanza #%d) Could not queue SPA request",
+            spadat->pkt_source_ip, stanza_num);
+        return 0;
+    }
+
+    pthread_mutex_lock(&pl->grant_mutex);
+    if(pl->grant_tail != NULL)
+        pl->grant_tail->next = grant;
+    else
+        pl->grant_head = grant;
+    pl->grant_tail = grant;
+    pthread_cond_signal(&pl->grant_cond);
+    pthread_mutex_unlock(&pl->grant_mutex);
+
+    return 1;
+}
+
+/* Let the workers finish whatever is on the ring, then let the actuator
+ * finish whatever they queued, and tear everything down.
+*/
+void
+spa_pipeline_stop(fko_srv_options_t *opts)
+{
+    struct spa_pipeline    *pl = opts->spa_pipeline;
+    unsigned int            dropped;
+    int                     i;
+
+    if(pl == NULL || spa_pipeline_thread_self(pl))
+        return;
+
+    pthread_mutex_lock(&pl->work_mutex);
+    pl->stopping = 1;
+    pthread_cond_broadcast(&pl->work_cond);
+    pthread_mutex_unlock(&pl->work_mutex);
+
+    for(i=0; i < pl->nb_workers; i++)
+        pthread_join(pl->workers[i], NULL);
+
+    if(pl->actuator_started)
+    {
+        pthread_mutex_lock(&pl->grant_mutex);
+        pl->actuator_stopping = 1;
+        pthread_cond_signal(&pl->grant_cond);
+        pthread_mutex_unlock(&pl->grant_mutex);
+
+        pthread_join(pl->actuator, NULL);
+    }
+
+    if((dropped = __atomic_load_n(&pl->dropped, __ATOMIC_RELAXED)) > 0)
+        log_msg(LOG_WARNING, "SPA packet queue dropped %u packets", dropped);
+
+    opts->spa_pipeline = NULL;
+    spa_pipeline_free(pl);
+
+    return;
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+#define UTEST_PRODUCERS     4
+#define UTEST_PKTS          20000
+
+static void
+utest_pkt_init(spa_pkt_info_t *spa_pkt, unsigned int n)
+{
+    memset(spa_pkt, 0x0, sizeof(*spa_pkt));
+    spa_pkt->packet_src_ip   = n;
+    spa_pkt->packet_data_len = snprintf((char *)spa_pkt->packet_data,
+            MAX_SPA_PACKET_LEN, "pkt-%u", n);
+}
+
+static void *
+utest_producer(void *arg)
+{
+    struct spa_pipeline    *pl = (struct spa_pipeline *)arg;
+    spa_pkt_info_t          spa_pkt;
+    unsigned int            i;
+
+    for(i=0; i < UTEST_PKTS; i++)
+    {
+        utest_pkt_init(&spa_pkt, i);
+        while(! spa_ring_push(pl, &spa_pkt))
+            sched_yield();
+    }
+    return NULL;
+}
+
+DECLARE_UTEST(ring_order_and_full, "packet ring keeps order and reports full")
+{
+    struct spa_pipeline    *pl = NULL;
+    spa_pkt_info_t          in, out;
+    unsigned int            i, n, bad = 0;
+
+    pl = spa_pipeline_new(NULL, SPA_PIPELINE_MIN_QUEUE, 0);
+    CU_ASSERT_FATAL(pl != NULL);
+
+    CU_ASSERT(spa_ring_empty(pl));
+    CU_ASSERT(spa_ring_pop(pl, &out) == 0);
+
+    /* Go around the ring a few times
+    */
+    for(n=0; n < 4; n++)
+    {
+        for(i=0; i < SPA_PIPELINE_MIN_QUEUE; i++)
+        {
+            utest_pkt_init(&in, n * 100 + i);
+            CU_ASSERT(spa_ring_push(pl, &in) == 1);
+        }
+        CU_ASSERT(spa_ring_push(pl, &in) == 0);
+
+        for(i=0; i < SPA_PIPELINE_MIN_QUEUE; i++)
+        {
+            utest_pkt_init(&in, n * 100 + i);
+            if(spa_ring_pop(pl, &out) != 1
+                    || out.packet_src_ip != in.packet_src_ip
+                    || out.packet_data_len != in.packet_data_len
+                    || strcmp((char *)out.packet_data, (char *)in.packet_data) != 0)
+                bad++;
+        }
+        CU_ASSERT(spa_ring_empty(pl));
+    }
+    CU_ASSERT(bad == 0);
+
+    spa_pipeline_free(pl);
+}
+
+DECLARE_UTEST(ring_concurrent, "packet ring loses nothing with concurrent producers")
+{
+    struct spa_pipeline    *pl = NULL;
+    pthread_t               producers[UTEST_PRODUCERS];
+    spa_pkt_info_t          out;
+    unsigned int           *seen = NULL, i, total = 0, bad = 0;
+
+    pl = spa_pipeline_new(NULL, 64, 0);
+    CU_ASSERT_FATAL(pl != NULL);
+
+    seen = calloc(UTEST_PKTS, sizeof(unsigned int));
+    CU_ASSERT_FATAL(seen != NULL);
+
+    for(i=0; i < UTEST_PRODUCERS; i++)
+        CU_ASSERT_FATAL(pthread_create(&producers[i], NULL, utest_producer, pl) == 0);
+
+    while(total < UTEST_PRODUCERS * UTEST_PKTS)
+    {
+        if(! spa_ring_pop(pl, &out))
+        {
+            sched_yield();
+            continue;
+        }
+        if(out.packet_src_ip >= UTEST_PKTS)
+            bad++;
+        else
+            seen[out.packet_src_ip]++;
+        total++;
+    }
+
+    for(i=0; i < UTEST_PRODUCERS; i++)
+        pthread_join(producers[i], NULL);
+
+    CU_ASSERT(total == UTEST_PRODUCERS * UTEST_PKTS);
+    for(i=0; i < UTEST_PKTS; i++)
+        if(seen[i] != UTEST_PRODUCERS)
+            bad++;
+    CU_ASSERT(bad == 0);
+    CU_ASSERT(spa_ring_empty(pl));
+
+    free(seen);
+    spa_pipeline_free(pl);
+}
+
+DECLARE_UTEST(grant_holds_stanza, "queued grant keeps its access stanza alive")
+{
+    acc_stanza_t   *acc = NULL;
+    spa_grant_t    *grant = NULL;
+    spa_data_t      spadat;
+
+    memset(&spadat, 0x00, sizeof(spadat));
+    acc = calloc(1, sizeof(acc_stanza_t));
+    CU_ASSERT_FATAL(acc != NULL);
+
+    /* Not counted by any table: nothing to hold
+    */
+    grant = spa_grant_new(acc, &spadat, 1);
+    CU_ASSERT_FATAL(grant != NULL);
+    CU_ASSERT(grant->acc_held == 0 && acc->refs == 0);
+    spa_grant_free(grant);
+
+    /* Held by one table; the grant outlives the table's reference
+    */
+    acc->refs = 1;
+    grant = spa_grant_new(acc, &spadat, 1);
+    CU_ASSERT_FATAL(grant != NULL);
+    CU_ASSERT(grant->acc_held == 1 && acc->refs == 2);
+    acc_stanza_release(acc);
+    CU_ASSERT(acc->refs == 1);
+    spa_grant_free(grant);
+}
+
+int register_ts_spa_pipeline(void)
+{
+    ts_init(&TEST_SUITE(spa_pipeline), TEST_SUITE_DESCR(spa_pipeline), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(spa_pipeline), UTEST_FCT(ring_order_and_full), UTEST_DESCR(ring_order_and_full));
+    ts_add_utest(&TEST_SUITE(spa_pipeline), UTEST_FCT(ring_concurrent), UTEST_DESCR(ring_concurrent));
+    ts_add_utest(&TEST_SUITE(spa_pipeline), UTEST_FCT(grant_holds_stanza), UTEST_DESCR(grant_holds_stanza));
+
+    return register_ts(&TEST_SUITE(spa_pipeline));
+}
+#endif /* HAVE_C_UNIT_TESTS */
+
+/***EOF***/
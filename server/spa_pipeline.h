@@ -0,0 +1,58 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_pipeline.h
+ *
+ * Purpose: Header file for spa_pipeline.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef SPA_PIPELINE_H
+#define SPA_PIPELINE_H
+
+/* Smallest packet ring we will allocate (sizes are rounded up to a power
+ * of two).
+*/
+#define SPA_PIPELINE_MIN_QUEUE          16
+
+/* How often (in milliseconds) the actuator thread checks for expired
+ * firewall rules and CMD_CYCLE_CLOSE commands.
+*/
+#define SPA_PIPELINE_HOUSEKEEPING_MS    500
+
+/* Prototypes
+*/
+int spa_pipeline_start(fko_srv_options_t *opts, const int nb_capture_threads);
+int spa_pipeline_submit(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt);
+int spa_pipeline_actuate(fko_srv_options_t *opts, acc_stanza_t *acc,
+        spa_data_t *spadat, const int stanza_num);
+void spa_pipeline_stop(fko_srv_options_t *opts);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_spa_pipeline(void);
+#endif
+
+#endif  /* SPA_PIPELINE_H */
+
+/***EOF***/
@@ -0,0 +1,314 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_stage.c
+ *
+ * Purpose: Staged filtering of incoming SPA packets.  Each stage is timed
+ *          and counted separately so it can be seen where packets are
+ *          dropped and where the CPU time goes (SIGUSR1 dumps it all).
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "spa_stage.h"
+#include "log_msg.h"
+#include "fwknopd_errors.h"
+#include <time.h>
+
+#ifdef HAVE_C_UNIT_TESTS
+  #include "cunit_common.h"
+  DECLARE_TEST_SUITE(spa_stage, "SPA filter stage test suite");
+#endif
+
+/* The first histogram bucket covers everything under 2^SPA_STAGE_HIST_SHIFT
+ * nanoseconds
+*/
+#define SPA_STAGE_HIST_SHIFT    7
+
+typedef struct spa_stage_stats
+{
+    uint64_t    passed;
+    uint64_t    rejected;
+    uint64_t    ns;
+    uint64_t    hist[SPA_STAGE_HIST_BUCKETS];
+} spa_stage_stats_t;
+
+struct spa_stages
+{
+    spa_stage_stats_t   stage[SPA_STAGES];
+};
+
+static const char *spa_stage_names[SPA_STAGES] = {
+    "blacklist",
+    "source rate limit",
+    "precheck",
+    "access lookup",
+    "SDP ID rate limit",
+    "digest",
+    "replay check",
+    "auth"
+};
+
+static int
+hist_bucket(const uint64_t ns)
+{
+    int     b;
+
+    if(ns < (1 << SPA_STAGE_HIST_SHIFT))
+        return 0;
+
+    b = 63 - __builtin_clzll(ns) - SPA_STAGE_HIST_SHIFT + 1;
+
+    return b < SPA_STAGE_HIST_BUCKETS ? b : SPA_STAGE_HIST_BUCKETS - 1;
+}
+
+/* Monotonic time in ns, only meaningful as a difference
+*/
+uint64_t
+spa_stage_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Count one packet through stage id.  Called from every packet handling
+ * thread, so the counters are only ever bumped atomically.
+*/
+void
+spa_stage_record(fko_srv_options_t *opts, const int id,
+        const int passed, const uint64_t ns)
+{
+    spa_stage_stats_t  *st;
+
+    if(opts->spa_stages == NULL || id < 0 || id >= SPA_STAGES)
+        return;
+
+    st = &opts->spa_stages->stage[id];
+
+    __atomic_add_fetch(passed ? &st->passed : &st->rejected, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->hist[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+/* Run arg through the stages in order, stopping at the first one that
+ * drops it.  Returns 1 if the packet made it through all of them.
+*/
+int
+spa_stage_run(fko_srv_options_t *opts, const spa_stage_t *stages,
+        const int nb_stages, void *arg)
+{
+    uint64_t    start, now;
+    int         i, res;
+
+    if(opts->spa_stages == NULL)
+    {
+        for(i = 0; i < nb_stages; i++)
+            if(! stages[i].run(opts, arg))
+                return 0;
+        return 1;
+    }
+
+    start = spa_stage_now();
+    for(i = 0; i < nb_stages; i++)
+    {
+        res = stages[i].run(opts, arg);
+        now = spa_stage_now();
+
+        spa_stage_record(opts, stages[i].id, res, now - start);
+        if(! res)
+            return 0;
+
+        start = now;
+    }
+
+    return 1;
+}
+
+int
+spa_stage_init(fko_srv_options_t *opts)
+{
+    spa_stage_free(opts);
+
+    if((opts->spa_stages = calloc(1, sizeof(struct spa_stages))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Fatal memory allocation error setting up SPA stage counters");
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+    }
+
+    return FWKNOPD_SUCCESS;
+}
+
+/* Log the per stage counters, and the latency histogram of every stage
+ * that saw any packets
+*/
+void
+spa_stage_dump(const fko_srv_options_t *opts)
+{
+    spa_stage_stats_t  *st;
+    char                hist[SPA_STAGE_HIST_BUCKETS * 24];
+    uint64_t            passed, rejected, count;
+    int                 i, b, len;
+
+    if(opts->spa_stages == NULL)
+        return;
+
+    for(i = 0; i < SPA_STAGES; i++)
+    {
+        st       = &opts->spa_stages->stage[i];
+        passed   = __atomic_load_n(&st->passed, __ATOMIC_RELAXED);
+        rejected = __atomic_load_n(&st->rejected, __ATOMIC_RELAXED);
+
+        if(passed + rejected == 0)
+            continue;
+
+        hist[0] = '\0';
+        for(b = 0, len = 0; b < SPA_STAGE_HIST_BUCKETS; b++)
+        {
+            if((count = __atomic_load_n(&st->hist[b], __ATOMIC_RELAXED)) == 0)
+                continue;
+            len += snprintf(hist + len, sizeof(hist) - len, " %s%"PRIu64"ns:%"PRIu64,
+                    b == SPA_STAGE_HIST_BUCKETS - 1 ? ">=" : "<",
+                    (uint64_t)1 << (SPA_STAGE_HIST_SHIFT + b
+                        - (b == SPA_STAGE_HIST_BUCKETS - 1)),
+                    count);
+        }
+
+        log_msg(LOG_INFO,
+            "SPA stage %s: %"PRIu64" passed, %"PRIu64" rejected, %"PRIu64"ns average,%s",
+            spa_stage_names[i], passed, rejected,
+            __atomic_load_n(&st->ns, __ATOMIC_RELAXED) / (passed + rejected), hist);
+    }
+}
+
+/* Only for use once all packet handling threads have stopped
+*/
+void
+spa_stage_free(fko_srv_options_t *opts)
+{
+    free(opts->spa_stages);
+    opts->spa_stages = NULL;
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+static int test_stage_calls;
+
+static int
+test_stage_pass(fko_srv_options_t *opts, void *arg)
+{
+    test_stage_calls++;
+    return 1;
+}
+
+static int
+test_stage_drop_odd(fko_srv_options_t *opts, void *arg)
+{
+    test_stage_calls++;
+    return (*(int *)arg % 2) == 0;
+}
+
+DECLARE_UTEST(stage_order, "check stages stop at the first rejection")
+{
+    fko_srv_options_t   opts;
+    const spa_stage_t   stages[] = {
+        { SPA_STAGE_PRECHECK,       test_stage_pass },
+        { SPA_STAGE_ACCESS_LOOKUP,  test_stage_drop_odd },
+        { SPA_STAGE_REPLAY,         test_stage_pass }
+    };
+    int                 i;
+
+    memset(&opts, 0, sizeof(opts));
+    CU_ASSERT_FATAL(spa_stage_init(&opts) == FWKNOPD_SUCCESS);
+
+    test_stage_calls = 0;
+    for(i = 0; i < 10; i++)
+        CU_ASSERT(spa_stage_run(&opts, stages, 3, &i) == (i % 2 == 0));
+
+    /* Rejected packets never reach the replay stage
+    */
+    CU_ASSERT(test_stage_calls == 10 + 10 + 5);
+    CU_ASSERT(opts.spa_stages->stage[SPA_STAGE_PRECHECK].passed == 10);
+    CU_ASSERT(opts.spa_stages->stage[SPA_STAGE_ACCESS_LOOKUP].passed == 5);
+    CU_ASSERT(opts.spa_stages->stage[SPA_STAGE_ACCESS_LOOKUP].rejected == 5);
+    CU_ASSERT(opts.spa_stages->stage[SPA_STAGE_REPLAY].passed == 5);
+    CU_ASSERT(opts.spa_stages->stage[SPA_STAGE_REPLAY].rejected == 0);
+    CU_ASSERT(opts.spa_stages->stage[SPA_STAGE_AUTH].passed == 0);
+
+    spa_stage_dump(&opts);
+    spa_stage_free(&opts);
+
+    /* Without counters the stages still run
+    */
+    test_stage_calls = 0;
+    i = 1;
+    CU_ASSERT(spa_stage_run(&opts, stages, 3, &i) == 0);
+    CU_ASSERT(test_stage_calls == 2);
+}
+
+DECLARE_UTEST(stage_histogram, "check latency histogram buckets")
+{
+    fko_srv_options_t   opts;
+    spa_stage_stats_t  *st;
+
+    memset(&opts, 0, sizeof(opts));
+    CU_ASSERT_FATAL(spa_stage_init(&opts) == FWKNOPD_SUCCESS);
+    st = &opts.spa_stages->stage[SPA_STAGE_AUTH];
+
+    CU_ASSERT(hist_bucket(0) == 0);
+    CU_ASSERT(hist_bucket(127) == 0);
+    CU_ASSERT(hist_bucket(128) == 1);
+    CU_ASSERT(hist_bucket(255) == 1);
+    CU_ASSERT(hist_bucket(256) == 2);
+    CU_ASSERT(hist_bucket((uint64_t)1 << 40) == SPA_STAGE_HIST_BUCKETS - 1);
+
+    spa_stage_record(&opts, SPA_STAGE_AUTH, 1, 100);
+    spa_stage_record(&opts, SPA_STAGE_AUTH, 0, 300);
+    spa_stage_record(&opts, SPA_STAGE_AUTH, 1, 1000000000);
+    spa_stage_record(&opts, SPA_STAGES, 1, 100);
+
+    CU_ASSERT(st->passed == 2);
+    CU_ASSERT(st->rejected == 1);
+    CU_ASSERT(st->ns == 1000000400);
+    CU_ASSERT(st->hist[0] == 1);
+    CU_ASSERT(st->hist[2] == 1);
+    CU_ASSERT(st->hist[SPA_STAGE_HIST_BUCKETS - 1] == 1);
+
+    spa_stage_dump(&opts);
+    spa_stage_free(&opts);
+}
+
+int register_ts_spa_stage(void)
+{
+    ts_init(&TEST_SUITE(spa_stage), TEST_SUITE_DESCR(spa_stage), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(spa_stage), UTEST_FCT(stage_order), UTEST_DESCR(stage_order));
+    ts_add_utest(&TEST_SUITE(spa_stage), UTEST_FCT(stage_histogram), UTEST_DESCR(stage_histogram));
+
+    return register_ts(&TEST_SUITE(spa_stage));
+}
+#endif /* HAVE_C_UNIT_TESTS */
+
+/***EOF***/
@@ -0,0 +1,80 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_stage.h
+ *
+ * Purpose: Header file for spa_stage.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef SPA_STAGE_H
+#define SPA_STAGE_H
+
+/* The SPA filter stages, in the order a packet goes through them.  The
+ * cheap rejections all come before the digest, HMAC and decryption work.
+*/
+enum {
+    SPA_STAGE_BLACKLIST = 0,    /* BLACKLIST match */
+    SPA_STAGE_SRC_RATE,         /* Per source rate limit */
+    SPA_STAGE_PRECHECK,         /* Length, base64 and SDP Client ID decoding */
+    SPA_STAGE_ACCESS_LOOKUP,    /* Unknown SDP Client ID or source */
+    SPA_STAGE_SDP_RATE,         /* Per SDP Client ID rate limit */
+    SPA_STAGE_DIGEST,           /* Batched replay digests, never rejects */
+    SPA_STAGE_REPLAY,           /* Replay cache lookup */
+    SPA_STAGE_AUTH,             /* HMAC, decryption and access checks */
+    SPA_STAGES
+};
+
+/* Latency histogram buckets are powers of two, the first one holds
+ * everything under 128ns and the last everything over 2ms or so.
+*/
+#define SPA_STAGE_HIST_BUCKETS  16
+
+/* A stage returns 1 to pass the packet on, 0 to drop it.  arg is
+ * whatever the stage table was written for.
+*/
+typedef struct spa_stage
+{
+    int     id;
+    int   (*run)(fko_srv_options_t *opts, void *arg);
+} spa_stage_t;
+
+/* Prototypes
+*/
+int spa_stage_init(fko_srv_options_t *opts);
+int spa_stage_run(fko_srv_options_t *opts, const spa_stage_t *stages,
+        const int nb_stages, void *arg);
+uint64_t spa_stage_now(void);
+void spa_stage_record(fko_srv_options_t *opts, const int id,
+        const int passed, const uint64_t ns);
+void spa_stage_dump(const fko_srv_options_t *opts);
+void spa_stage_free(fko_srv_options_t *opts);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_spa_stage(void);
+#endif
+
+#endif /* SPA_STAGE_H */
+
+/***EOF***/
@@ -33,6 +33,7 @@
 #include "tcp_server.h"
 #include "log_msg.h"
 #include "utils.h"
+#include "event_loop.h"
 #include <errno.h>
 
 #if HAVE_SYS_SOCKET_H
@@ -46,7 +47,162 @@
 #endif
 
 #include <fcntl.h>
-#include <sys/select.h>
+
+/* An accepted connection waiting for the client's packet
+*/
+typedef struct tcp_conn
+{
+    struct tcp_server  *srv;
+    int                 fd;
+    int                 timer_id;
+} tcp_conn_t;
+
+typedef struct tcp_server
+{
+    fko_srv_options_t  *opts;
+    evloop_t           *loop;
+    tcp_conn_t          conns[TCPSERV_MAX_CONNS];
+#if !CODE_COVERAGE
+    pid_t               ppid;
+#endif
+    int                 stop;
+    int                 rv;
+} tcp_server_t;
+
+static tcp_conn_t *
+tcp_conn_find(tcp_server_t *srv, const int fd)
+{
+    int     i;
+
+    for(i=0; i < TCPSERV_MAX_CONNS; i++)
+        if(srv->conns[i].fd == fd)
+            return &srv->conns[i];
+    return NULL;
+}
+
+static void
+tcp_conn_close(tcp_server_t *srv, tcp_conn_t *conn)
+{
+    evloop_del_fd(srv->loop, conn->fd);
+    evloop_del_timer(srv->loop, conn->timer_id);
+
+    shutdown(conn->fd, SHUT_RDWR);
+    close(conn->fd);
+
+    conn->fd       = -1;
+    conn->timer_id = -1;
+
+#if CODE_COVERAGE
+    srv->stop = 1;
+#endif
+    return;
+}
+
+/* The client has sent its packet (which the capture side has seen by now)
+ * or gone away, so there is no reason to keep the connection.
+*/
+static void
+tcp_conn_readable(evloop_t *loop, int fd, void *arg)
+{
+    tcp_conn_t     *conn = (tcp_conn_t *)arg;
+
+    tcp_conn_close(conn->srv, conn);
+    return;
+}
+
+/* The client did not send anything in time
+*/
+static void
+tcp_conn_expired(evloop_t *loop, int fd, void *arg)
+{
+    tcp_conn_t     *conn = (tcp_conn_t *)arg;
+
+    tcp_conn_close(conn->srv, conn);
+    return;
+}
+
+/* Accept whatever connections are pending and give each one a short
+ * window in which to send its request.
+*/
+static void
+tcp_server_accept(evloop_t *loop, int fd, void *arg)
+{
+    tcp_server_t       *srv = (tcp_server_t *)arg;
+    tcp_conn_t         *conn;
+    struct sockaddr_in  caddr;
+    socklen_t           clen;
+    char                sipbuf[MAX_IPV4_STR_LEN] = {0};
+    int                 c_sock, flags;
+
+    while(1)
+    {
+        clen = sizeof(caddr);
+
+        if((c_sock = accept(fd, (struct sockaddr *) &caddr, &clen)) < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+
+            log_msg(LOG_ERR, "run_tcp_server: accept() failed: %s",
+                strerror(errno));
+            srv->rv   = -1;
+            srv->stop = 1;
+            break;
+        }
+
+        if(srv->opts->verbose)
+        {
+            memset(sipbuf, 0x0, MAX_IPV4_STR_LEN);
+            inet_ntop(AF_INET, &(caddr.sin_addr.s_addr), sipbuf, MAX_IPV4_STR_LEN);
+            log_msg(LOG_INFO, "tcp_server: Got TCP connection from %s.", sipbuf);
+        }
+
+        /* If too many connections are already waiting, this one gets
+         * dropped straight away.
+        */
+        if((conn = tcp_conn_find(srv, -1)) == NULL)
+        {
+            shutdown(c_sock, SHUT_RDWR);
+            close(c_sock);
+            continue;
+        }
+
+        if((flags = fcntl(c_sock, F_GETFL, 0)) >= 0)
+            fcntl(c_sock, F_SETFL, flags | O_NONBLOCK);
+
+        conn->fd       = c_sock;
+        conn->timer_id = evloop_add_timer(loop, TCPSERV_CONN_TIMEOUT, 0,
+                tcp_conn_expired, conn);
+
+        if(conn->timer_id < 0 || evloop_add_fd(loop, c_sock, tcp_conn_readable, conn) != 0)
+            tcp_conn_close(srv, conn);
+
+#if CODE_COVERAGE
+        /* The listening socket is blocking in this mode
+        */
+        break;
+#endif
+    }
+    return;
+}
+
+#if !CODE_COVERAGE
+/* Check that our parent is still there by simply using kill(ppid, 0) and
+ * checking the return value.
+*/
+static void
+tcp_server_check_parent(evloop_t *loop, int fd, void *arg)
+{
+    tcp_server_t   *srv = (tcp_server_t *)arg;
+
+    if(kill(srv->ppid, 0) != 0 && errno == ESRCH)
+    {
+        srv->rv   = -1;
+        srv->stop = 1;
+    }
+    return;
+}
+#endif
 
 /* Fork off and run a "dummy" TCP server. The return value is the PID of
  * the child process or -1 if there is a fork error.
@@ -57,12 +213,10 @@ run_tcp_server(fko_srv_options_t *opts)
 #if !CODE_COVERAGE
     pid_t               pid, ppid;
 #endif
-    int                 s_sock, c_sock, sfd_flags, clen, selval;
-    int                 reuse_addr = 1, is_err, rv=1;
-    fd_set              sfd_set;
-    struct sockaddr_in  saddr, caddr;
-    struct timeval      tv;
-    char                sipbuf[MAX_IPV4_STR_LEN] = {0};
+    tcp_server_t        srv;
+    int                 s_sock, sfd_flags, i;
+    int                 reuse_addr = 1, is_err;
+    struct sockaddr_in  saddr;
 
     unsigned short      port;
 
@@ -158,10 +312,11 @@ run_tcp_server(fko_srv_options_t *opts)
         return -1;
     }
 
-    /* Mark the socket so it will listen for incoming connections
-     * (but only one at a time)
+    /* Mark the socket so it will listen for incoming connections.  They
+     * are accepted as soon as they arrive, so the backlog only has to
+     * cover a burst.
     */
-    if (listen(s_sock, 1) < 0)
+    if (listen(s_sock, TCPSERV_MAX_CONNS) < 0)
     {
         log_msg(LOG_ERR, "run_tcp_server: listen() failed: %s",
             strerror(errno));
@@ -169,88 +324,57 @@ run_tcp_server(fko_srv_options_t *opts)
         return -1;
     }
 
-    FD_ZERO(&sfd_set);
-
-    /* Now loop and accept and drop connections after the first packet or a
-     * short timeout.
-    */
-    while(1)
+    memset(&srv, 0x0, sizeof(srv));
+    srv.opts = opts;
+    srv.rv   = 1;
+    for(i=0; i < TCPSERV_MAX_CONNS; i++)
     {
-        clen = sizeof(caddr);
-
-        /* Initialize and setup the socket for select.
-        */
-        FD_SET(s_sock, &sfd_set);
-
-        /* Set our select timeout to 200 ms.
-        */
-        tv.tv_sec = 0;
-        tv.tv_usec = 200000;
-
-        selval = select(s_sock+1, &sfd_set, NULL, NULL, &tv);
+        srv.conns[i].srv      = &srv;
+        srv.conns[i].fd       = -1;
+        srv.conns[i].timer_id = -1;
+    }
 
-        if(selval == -1)
-        {
-            /* Select error - so kill the child and bail.
-            */
-            log_msg(LOG_ERR, "run_tcp_server: select error socket: %s",
-                strerror(errno));
-            rv = -1;
-            break;
-        }
+    if((srv.loop = evloop_new()) == NULL
+            || evloop_add_fd(srv.loop, s_sock, tcp_server_accept, &srv) != 0)
+    {
+        log_msg(LOG_ERR, "run_tcp_server: could not set up the event loop");
+        evloop_free(srv.loop);
+        close(s_sock);
+        return -1;
+    }
 
 #if !CODE_COVERAGE
-        if(selval == 0)
-        {
-            /* Timeout - So we check to make sure our parent is still there by simply
-             *           using kill(ppid, 0) and checking the return value.
-            */
-            if(kill(ppid, 0) != 0 && errno == ESRCH)
-            {
-                rv = -1;
-                break;
-            }
-            continue;
-        }
+    srv.ppid = ppid;
+    if(evloop_add_timer(srv.loop, TCPSERV_PARENT_CHECK, 1,
+                tcp_server_check_parent, &srv) < 0)
+    {
+        evloop_free(srv.loop);
+        close(s_sock);
+        return -1;
+    }
 #endif
 
-        if(! FD_ISSET(s_sock, &sfd_set))
-            continue;
-
-        /* Wait for a client to connect
-        */
-        if((c_sock = accept(s_sock, (struct sockaddr *) &caddr, (socklen_t *)&clen)) < 0)
+    /* Now loop and accept connections, dropping each one after its first
+     * packet or a short timeout.
+    */
+    while(! srv.stop)
+    {
+        if(evloop_run_once(srv.loop, -1) < 0)
         {
-            log_msg(LOG_ERR, "run_tcp_server: accept() failed: %s",
+            log_msg(LOG_ERR, "run_tcp_server: event loop error: %s",
                 strerror(errno));
-            rv = -1;
+            srv.rv = -1;
             break;
         }
+    }
 
-        if(opts->verbose)
-        {
-            memset(sipbuf, 0x0, MAX_IPV4_STR_LEN);
-            inet_ntop(AF_INET, &(caddr.sin_addr.s_addr), sipbuf, MAX_IPV4_STR_LEN);
-            log_msg(LOG_INFO, "tcp_server: Got TCP connection from %s.", sipbuf);
-        }
-
-        /* Though hacky and clunky, we just sleep for a second then
-         * close the socket.  No need to read or write anything.  This
-         * just gives the client a sufficient window to send their
-         * request on this socket. In any case the socket is closed
-         * after that time.
-        */
-        usleep(1000000);
-        shutdown(c_sock, SHUT_RDWR);
-        close(c_sock);
-
-#if CODE_COVERAGE
-        break;
-#endif
-    } /* infinite while loop */
+    for(i=0; i < TCPSERV_MAX_CONNS; i++)
+        if(srv.conns[i].fd >= 0)
+            tcp_conn_close(&srv, &srv.conns[i]);
+    evloop_free(srv.loop);
 
     close(s_sock);
-    return rv;
+    return srv.rv;
 }
 
 /***EOF***/
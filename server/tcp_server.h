@@ -31,6 +31,13 @@
 #ifndef TCP_SERVER_H
 #define TCP_SERVER_H
 
+/* Connections held open at once, how long each one is given to send its
+ * packet, and how often we check that the parent is still around.
+*/
+#define TCPSERV_MAX_CONNS           64
+#define TCPSERV_CONN_TIMEOUT        1000000     /* microseconds */
+#define TCPSERV_PARENT_CHECK        200000      /* microseconds */
+
 /* Function prototypes
 */
 int run_tcp_server(fko_srv_options_t *opts);
@@ -31,9 +31,13 @@
 #include "fwknopd_common.h"
 #include "sig_handler.h"
 #include "incoming_spa.h"
+#include "spa_pipeline.h"
+#include "event_loop.h"
 #include "log_msg.h"
 #include "fw_util.h"
 #include "cmd_cycle.h"
+#include "replay_cache.h"
+#include "blacklist.h"
 #include "utils.h"
 #include <errno.h>
 
@@ -48,49 +52,58 @@
 #endif
 
 #include <fcntl.h>
-#include <sys/select.h>
 
-int
-run_udp_server(fko_srv_options_t *opts)
+typedef struct udp_server udp_server_t;
+
+/* One listening socket along with the buffers that a batch of datagrams
+ * is read into.  With UDPSERV_SOCKETS > 1 every socket but the first gets
+ * its own thread.
+*/
+typedef struct udp_sock
 {
-    int                 s_sock, sfd_flags, selval, pkt_len;
-    int                 is_err, s_timeout, rv=1, chk_rm_all=0;
+    udp_server_t       *srv;
+    int                 fd;
+    spa_pkt_info_t     *pkts;
+#if HAVE_RECVMMSG
+    struct mmsghdr     *msgs;
+    struct iovec       *iovs;
+#endif
+    struct sockaddr_in *caddrs;
+    evloop_t           *loop;
+    int                 error;
+    pthread_t           thread;
+    int                 started;
+} udp_sock_t;
+
+struct udp_server
+{
+    fko_srv_options_t  *opts;
+    struct sockaddr_in  saddr;
+    int                 batch_size;
+    int                 s_timeout;          /* microseconds */
     int                 rules_chk_threshold;
-    fd_set              sfd_set;
-    struct sockaddr_in  saddr, caddr;
-    struct timeval      tv;
-    char                sipbuf[MAX_IPV4_STR_LEN] = {0};
-    char                dgram_msg[MAX_SPA_PACKET_LEN+1] = {0};
-    unsigned short      port;
-    socklen_t           clen;
+    int                 chk_rm_all;
+    int                 stop;
+    udp_sock_t         *socks;
+    int                 nb_socks;
+    uint32_t            blacklist_gen;      /* BLACKLIST the socket filters hold */
+};
 
-    port = strtol_wrapper(opts->config[CONF_UDPSERV_PORT],
-            1, MAX_PORT, NO_EXIT_UPON_ERR, &is_err);
-    if(is_err != FKO_SUCCESS)
-    {
-        log_msg(LOG_ERR, "[*] Invalid max UDPSERV_PORT value.");
-        return -1;
-    }
-    s_timeout = strtol_wrapper(opts->config[CONF_UDPSERV_SELECT_TIMEOUT],
-            1, RCHK_MAX_UDPSERV_SELECT_TIMEOUT, NO_EXIT_UPON_ERR, &is_err);
-    if(is_err != FKO_SUCCESS)
-    {
-        log_msg(LOG_ERR, "[*] Invalid max UDPSERV_SELECT_TIMEOUT value.");
-        return -1;
-    }
-    rules_chk_threshold = strtol_wrapper(opts->config[CONF_RULES_CHECK_THRESHOLD],
-            0, RCHK_MAX_RULES_CHECK_THRESHOLD, NO_EXIT_UPON_ERR, &is_err);
-    if(is_err != FKO_SUCCESS)
-    {
-        log_msg(LOG_ERR, "[*] invalid RULES_CHECK_THRESHOLD");
-        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
-    }
+static void udp_sock_readable(evloop_t *loop, int fd, void *arg);
 
-    log_msg(LOG_INFO, "Kicking off UDP server to listen on port %i.", port);
+static int
+udp_sock_open(udp_server_t *srv, udp_sock_t *us)
+{
+    int     sfd_flags;
+#ifdef SO_REUSEPORT
+    int     reuse_port = 1;
+#endif
+
+    us->srv = srv;
 
     /* Now, let's make a UDP server
     */
-    if ((s_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    if ((us->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
     {
         log_msg(LOG_ERR, "run_udp_server: socket() failed: %s",
             strerror(errno));
@@ -100,171 +113,482 @@ run_udp_server(fko_srv_options_t *opts)
     /* Make our main socket non-blocking so we don't have to be stuck on
      * listening for incoming datagrams.
     */
-    if((sfd_flags = fcntl(s_sock, F_GETFL, 0)) < 0)
+    if((sfd_flags = fcntl(us->fd, F_GETFL, 0)) < 0)
     {
         log_msg(LOG_ERR, "run_udp_server: fcntl F_GETFL error: %s",
             strerror(errno));
-        close(s_sock);
         return -1;
     }
 
     sfd_flags |= O_NONBLOCK;
 
-    if(fcntl(s_sock, F_SETFL, sfd_flags) < 0)
+    if(fcntl(us->fd, F_SETFL, sfd_flags) < 0)
     {
         log_msg(LOG_ERR, "run_udp_server: fcntl F_SETFL error setting O_NONBLOCK: %s",
             strerror(errno));
-        close(s_sock);
         return -1;
     }
 
-    /* Construct local address structure */
-    memset(&saddr, 0x0, sizeof(saddr));
-    saddr.sin_family      = AF_INET;           /* Internet address family */
-    saddr.sin_addr.s_addr = htonl(INADDR_ANY); /* Any incoming interface */
-    saddr.sin_port        = htons(port);       /* Local port */
+    /* Several sockets share the port, and the kernel spreads the incoming
+     * datagrams across them by source address and port.
+    */
+    if(srv->nb_socks > 1)
+    {
+#ifdef SO_REUSEPORT
+        if(setsockopt(us->fd, SOL_SOCKET, SO_REUSEPORT,
+                    &reuse_port, sizeof(reuse_port)) == -1)
+        {
+            log_msg(LOG_ERR, "run_udp_server: setsockopt SO_REUSEPORT error: %s",
+                strerror(errno));
+            return -1;
+        }
+#else
+        log_msg(LOG_ERR, "run_udp_server: UDPSERV_SOCKETS > 1 needs SO_REUSEPORT");
+        return -1;
+#endif
+    }
+
+    /* Have the kernel drop blacklisted sources, before any datagram
+     * can be queued.  blacklist_match() still catches them otherwise.
+    */
+    blacklist_attach_socket_filter(srv->opts, us->fd);
 
     /* Bind to the local address */
-    if (bind(s_sock, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
+    if (bind(us->fd, (struct sockaddr *) &srv->saddr, sizeof(srv->saddr)) < 0)
     {
         log_msg(LOG_ERR, "run_udp_server: bind() failed: %s",
             strerror(errno));
-        close(s_sock);
         return -1;
     }
 
-    /* Initialize our signal handlers. You can check the return value for
-     * the number of signals that were *not* set.  Those that were not set
-     * will be listed in the log/stderr output.
+    us->pkts   = calloc(srv->batch_size, sizeof(spa_pkt_info_t));
+    us->caddrs = calloc(srv->batch_size, sizeof(struct sockaddr_in));
+#if HAVE_RECVMMSG
+    us->msgs   = calloc(srv->batch_size, sizeof(struct mmsghdr));
+    us->iovs   = calloc(srv->batch_size, sizeof(struct iovec));
+#endif
+    /* Whatever was allocated is freed by udp_sock_close()
     */
-    if(set_sig_handlers() > 0)
-        log_msg(LOG_ERR, "Errors encountered when setting signal handlers.");
+    if(us->pkts == NULL || us->caddrs == NULL
+#if HAVE_RECVMMSG
+            || us->msgs == NULL || us->iovs == NULL
+#endif
+            )
+    {
+        log_msg(LOG_ERR, "run_udp_server: could not allocate receive buffers");
+        return -1;
+    }
 
-    FD_ZERO(&sfd_set);
+    if((us->loop = evloop_new()) == NULL
+            || evloop_add_fd(us->loop, us->fd, udp_sock_readable, us) != 0)
+    {
+        log_msg(LOG_ERR, "run_udp_server: could not set up the event loop");
+        return -1;
+    }
 
-    /* Now loop and receive SPA packets
+    return 0;
+}
+
+static void
+udp_sock_close(udp_sock_t *us)
+{
+    evloop_free(us->loop);
+    us->loop = NULL;
+
+    if(us->fd >= 0)
+        close(us->fd);
+    us->fd = -1;
+
+    free(us->pkts);
+    free(us->caddrs);
+#if HAVE_RECVMMSG
+    free(us->msgs);
+    free(us->iovs);
+#endif
+    return;
+}
+
+/* Read up to max datagrams straight into us->pkts.  Returns the number
+ * read, 0 if there was nothing to read, or -1 on error.
+*/
+static int
+udp_sock_read(udp_sock_t *us, int max)
+{
+#if HAVE_RECVMMSG
+    int         i, n;
+
+    for(i=0; i < max; i++)
+    {
+        us->iovs[i].iov_base = us->pkts[i].packet_data;
+        us->iovs[i].iov_len  = MAX_SPA_PACKET_LEN;
+
+        memset(&us->msgs[i].msg_hdr, 0x0, sizeof(struct msghdr));
+        us->msgs[i].msg_hdr.msg_name    = &us->caddrs[i];
+        us->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        us->msgs[i].msg_hdr.msg_iov     = &us->iovs[i];
+        us->msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
+
+    if((n = recvmmsg(us->fd, us->msgs, max, MSG_DONTWAIT, NULL)) < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+    for(i=0; i < n; i++)
+        us->pkts[i].packet_data_len = us->msgs[i].msg_len;
+#else
+    socklen_t   clen;
+    ssize_t     pkt_len;
+    int         n;
+
+    for(n=0; n < max; n++)
+    {
+        clen = sizeof(struct sockaddr_in);
+        pkt_len = recvfrom(us->fd, us->pkts[n].packet_data, MAX_SPA_PACKET_LEN,
+                0, (struct sockaddr *)&us->caddrs[n], &clen);
+        if(pkt_len < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            return (n > 0) ? n : -1;
+        }
+        us->pkts[n].packet_data_len = pkt_len;
+    }
+#endif
+
+    return n;
+}
+
+/* Returns 1 once the --packet-limit count has been reached
+*/
+static int
+udp_packet_limit_reached(const fko_srv_options_t *opts)
+{
+    return(opts->packet_ctr_limit
+            && __atomic_load_n(&opts->packet_ctr, __ATOMIC_RELAXED) >= opts->packet_ctr_limit);
+}
+
+/* Read one batch of datagrams from the socket and hand them off for SPA
+ * processing.
+*/
+static int
+udp_sock_process(udp_sock_t *us)
+{
+    fko_srv_options_t  *opts = us->srv->opts;
+    spa_pkt_info_t     *spa_pkt;
+    char                sipbuf[MAX_IPV4_STR_LEN] = {0};
+    int                 i, n, max = us->srv->batch_size;
+    unsigned int        ctr;
+
+    /* Do not read more than --packet-limit allows
     */
-    while(1)
+    if(opts->packet_ctr_limit)
+    {
+        ctr = __atomic_load_n(&opts->packet_ctr, __ATOMIC_RELAXED);
+        if(ctr >= opts->packet_ctr_limit)
+            return 0;
+        if(opts->packet_ctr_limit - ctr < (unsigned int)max)
+            max = opts->packet_ctr_limit - ctr;
+    }
+
+    if((n = udp_sock_read(us, max)) < 0)
+    {
+        log_msg(LOG_ERR, "run_udp_server: recv error: %s", strerror(errno));
+        return -1;
+    }
+
+    for(i=0; i < n; i++)
     {
-        if(sig_do_stop(opts))
+        spa_pkt = &us->pkts[i];
+
+        if(spa_pkt->packet_data_len > 0)
         {
+            spa_pkt->packet_data[spa_pkt->packet_data_len] = 0x0;
+
             if(opts->verbose)
-                log_msg(LOG_INFO,
-                        "udp_server: terminating signal received, will stop.");
-            break;
+            {
+                memset(sipbuf, 0x0, MAX_IPV4_STR_LEN);
+                inet_ntop(AF_INET, &(us->caddrs[i].sin_addr.s_addr), sipbuf, MAX_IPV4_STR_LEN);
+                log_msg(LOG_INFO, "udp_server: Got UDP datagram (%d bytes) from: %s",
+                        spa_pkt->packet_data_len, sipbuf);
+            }
+
+            spa_pkt->packet_proto    = IPPROTO_UDP;
+            spa_pkt->packet_src_ip   = us->caddrs[i].sin_addr.s_addr;
+            spa_pkt->packet_dst_ip   = us->srv->saddr.sin_addr.s_addr;
+            spa_pkt->packet_src_port = ntohs(us->caddrs[i].sin_port);
+            spa_pkt->packet_dst_port = ntohs(us->srv->saddr.sin_port);
+            spa_pkt->sdp_id          = 0;
+
+            handle_spa_packet(opts, spa_pkt);
         }
 
-        if(!opts->test)
+        ctr = __atomic_add_fetch(&opts->packet_ctr, 1, __ATOMIC_RELAXED);
+        if(opts->foreground == 1 && opts->verbose > 2)
+            log_msg(LOG_DEBUG, "run_udp_server() processed: %d packets", ctr);
+    }
+
+    return n;
+}
+
+static void
+udp_sock_readable(evloop_t *loop, int fd, void *arg)
+{
+    udp_sock_t     *us = (udp_sock_t *)arg;
+
+    if(udp_sock_process(us) < 0)
+        us->error = 1;
+    return;
+}
+
+/* Expired rules, CMD_CYCLE_CLOSE commands and buffered digests are dealt
+ * with every UDPSERV_SELECT_TIMEOUT rather than after every datagram.
+*/
+static void
+udp_server_housekeeping(evloop_t *loop, int fd, void *arg)
+{
+    udp_server_t       *srv = (udp_server_t *)arg;
+    fko_srv_options_t  *opts = srv->opts;
+
+    /* With SPA_WORKER_THREADS set, this is done by the pipeline's
+     * actuator thread.
+    */
+    if(!opts->test && opts->spa_pipeline == NULL)
+    {
+        /* Check for any expired firewall rules and deal with them.
+        */
+        if(opts->enable_fw)
         {
-            /* Check for any expired firewall rules and deal with them.
-            */
-            if(opts->enable_fw)
+            if(srv->rules_chk_threshold > 0)
             {
-                if(rules_chk_threshold > 0)
+                opts->check_rules_ctr++;
+                if ((opts->check_rules_ctr % srv->rules_chk_threshold) == 0)
                 {
-                    opts->check_rules_ctr++;
-                    if ((opts->check_rules_ctr % rules_chk_threshold) == 0)
-                    {
-                        chk_rm_all = 1;
-                        opts->check_rules_ctr = 0;
-                    }
+                    srv->chk_rm_all = 1;
+                    opts->check_rules_ctr = 0;
                 }
-                check_firewall_rules(opts, chk_rm_all);
-                chk_rm_all = 0;
             }
-
-            /* See if any CMD_CYCLE_CLOSE commands need to be executed.
-            */
-            cmd_cycle_close(opts);
+            check_firewall_rules(opts, srv->chk_rm_all);
+            srv->chk_rm_all = 0;
         }
 
-        /* Initialize and setup the socket for select.
+        /* See if any CMD_CYCLE_CLOSE commands need to be executed.
         */
-        FD_SET(s_sock, &sfd_set);
+        cmd_cycle_close(opts);
 
-        /* Set our select timeout to (500ms by default).
+        /* Write out digests that have been buffered for too long.
         */
-        tv.tv_sec = 0;
-        tv.tv_usec = s_timeout;
+        replay_cache_sync(opts);
+    }
 
-        selval = select(s_sock+1, &sfd_set, NULL, NULL, &tv);
+    return;
+}
 
-        if(selval == -1)
+/* Install a reloaded BLACKLIST on every socket
+*/
+static void
+udp_server_refilter(udp_server_t *srv)
+{
+    int     i;
+
+    srv->blacklist_gen = __atomic_load_n(&srv->opts->blacklist_gen, __ATOMIC_ACQUIRE);
+
+    for(i=0; i < srv->nb_socks; i++)
+        blacklist_attach_socket_filter(srv->opts, srv->socks[i].fd);
+}
+
+/* Receive loop for one socket.  The first socket is served by the main
+ * thread, which also watches for signals and runs the housekeeping timer;
+ * the others stop when it sets srv->stop and wakes them up.
+*/
+static int
+udp_sock_loop(udp_sock_t *us, const int is_main)
+{
+    udp_server_t       *srv = us->srv;
+    fko_srv_options_t  *opts = srv->opts;
+    int                 rv = 1;
+
+    while(1)
+    {
+        if(is_main)
         {
-            if(errno == EINTR)
+            if(sig_do_stop(opts))
             {
-                /* restart loop but only after we check for a terminating
-                 * signal above in sig_do_stop()
-                */
-                continue;
-            }
-            else
-            {
-                log_msg(LOG_ERR, "run_udp_server: select error socket: %s",
-                    strerror(errno));
-                rv = -1;
+                if(opts->verbose)
+                    log_msg(LOG_INFO,
+                            "udp_server: terminating signal received, will stop.");
                 break;
             }
-        }
 
-        if(selval == 0)
-            continue;
+            if(srv->blacklist_gen != __atomic_load_n(&opts->blacklist_gen, __ATOMIC_ACQUIRE))
+                udp_server_refilter(srv);
+        }
+        else if(__atomic_load_n(&srv->stop, __ATOMIC_ACQUIRE))
+            break;
 
-        if(! FD_ISSET(s_sock, &sfd_set))
-            continue;
+        if(udp_packet_limit_reached(opts))
+        {
+            if(is_main)
+                log_msg(LOG_WARNING,
+                    "* Incoming packet count limit of %i reached",
+                    opts->packet_ctr_limit
+                );
+            break;
+        }
 
-        /* If we make it here then there is a datagram to process
+        /* Sleep until there are datagrams to process, the housekeeping
+         * timer fires, or a signal (or wakeup) interrupts the wait.
         */
-        clen = sizeof(caddr);
-
-        pkt_len = recvfrom(s_sock, dgram_msg, MAX_SPA_PACKET_LEN,
-                0, (struct sockaddr *)&caddr, &clen);
+        if(evloop_run_once(us->loop, -1) < 0)
+        {
+            log_msg(LOG_ERR, "run_udp_server: event loop error: %s",
+                strerror(errno));
+            rv = -1;
+            break;
+        }
 
-        if(pkt_len > 0 && pkt_len <= MAX_SPA_PACKET_LEN)
+        if(us->error)
         {
-            dgram_msg[pkt_len] = 0x0;
+            rv = -1;
+            break;
+        }
 
-            if(opts->verbose)
-            {
-                memset(sipbuf, 0x0, MAX_IPV4_STR_LEN);
-                inet_ntop(AF_INET, &(caddr.sin_addr.s_addr), sipbuf, MAX_IPV4_STR_LEN);
-                log_msg(LOG_INFO, "udp_server: Got UDP datagram (%d bytes) from: %s",
-                        pkt_len, sipbuf);
-            }
+    } /* infinite while loop */
+
+    return rv;
+}
+
+static void *
+udp_sock_thread(void *arg)
+{
+    udp_sock_loop((udp_sock_t *)arg, 0);
+    return NULL;
+}
+
+int
+run_udp_server(fko_srv_options_t *opts)
+{
+    udp_server_t        srv;
+    int                 is_err, i, rv=1;
+    unsigned short      port;
 
-            /* Copy the packet for SPA processing
-            */
-            strlcpy((char *)opts->spa_pkt.packet_data, dgram_msg, pkt_len+1);
-            opts->spa_pkt.packet_data_len = pkt_len;
-            opts->spa_pkt.packet_proto    = IPPROTO_UDP;
-            opts->spa_pkt.packet_src_ip   = caddr.sin_addr.s_addr;
-            opts->spa_pkt.packet_dst_ip   = saddr.sin_addr.s_addr;
-            opts->spa_pkt.packet_src_port = ntohs(caddr.sin_port);
-            opts->spa_pkt.packet_dst_port = ntohs(saddr.sin_port);
-            opts->spa_pkt.sdp_id   = 0;
-
-            incoming_spa(opts);
+    memset(&srv, 0x0, sizeof(srv));
+    srv.opts = opts;
+
+    port = strtol_wrapper(opts->config[CONF_UDPSERV_PORT],
+            1, MAX_PORT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid max UDPSERV_PORT value.");
+        return -1;
+    }
+    srv.s_timeout = strtol_wrapper(opts->config[CONF_UDPSERV_SELECT_TIMEOUT],
+            1, RCHK_MAX_UDPSERV_SELECT_TIMEOUT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid max UDPSERV_SELECT_TIMEOUT value.");
+        return -1;
+    }
+    srv.batch_size = strtol_wrapper(opts->config[CONF_UDPSERV_BATCH_SIZE],
+            1, RCHK_MAX_UDPSERV_BATCH_SIZE, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid UDPSERV_BATCH_SIZE value.");
+        return -1;
+    }
+    srv.nb_socks = strtol_wrapper(opts->config[CONF_UDPSERV_SOCKETS],
+            1, RCHK_MAX_UDPSERV_SOCKETS, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid UDPSERV_SOCKETS value.");
+        return -1;
+    }
+    srv.rules_chk_threshold = strtol_wrapper(opts->config[CONF_RULES_CHECK_THRESHOLD],
+            0, RCHK_MAX_RULES_CHECK_THRESHOLD, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid RULES_CHECK_THRESHOLD");
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    log_msg(LOG_INFO, "Kicking off UDP server to listen on port %i.", port);
+
+    /* Construct local address structure */
+    srv.saddr.sin_family      = AF_INET;           /* Internet address family */
+    srv.saddr.sin_addr.s_addr = htonl(INADDR_ANY); /* Any incoming interface */
+    srv.saddr.sin_port        = htons(port);       /* Local port */
+
+    if((srv.socks = calloc(srv.nb_socks, sizeof(udp_sock_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "run_udp_server: calloc() failed");
+        return -1;
+    }
+    for(i=0; i < srv.nb_socks; i++)
+        srv.socks[i].fd = -1;
+
+    srv.blacklist_gen = opts->blacklist_gen;
+
+    for(i=0; i < srv.nb_socks; i++)
+    {
+        if(udp_sock_open(&srv, &srv.socks[i]) < 0)
+        {
+            rv = -1;
+            goto cleanup;
         }
+    }
 
-        memset(dgram_msg, 0x0, sizeof(dgram_msg));
+    /* Every socket beyond the first is served by its own thread, and the
+     * firewall changes then go through the pipeline's actuator thread.
+    */
+    if(spa_pipeline_start(opts, srv.nb_socks) != 0)
+    {
+        rv = -1;
+        goto cleanup;
+    }
 
-        opts->packet_ctr += 1;
-        if(opts->foreground == 1 && opts->verbose > 2)
-            log_msg(LOG_DEBUG, "run_udp_server() processed: %d packets",
-                    opts->packet_ctr);
+    /* Initialize our signal handlers. You can check the return value for
+     * the number of signals that were *not* set.  Those that were not set
+     * will be listed in the log/stderr output.
+    */
+    if(set_sig_handlers() > 0)
+        log_msg(LOG_ERR, "Errors encountered when setting signal handlers.");
 
-        if (opts->packet_ctr_limit && opts->packet_ctr >= opts->packet_ctr_limit)
+    for(i=1; i < srv.nb_socks; i++)
+    {
+        if(pthread_create(&srv.socks[i].thread, NULL, udp_sock_thread, &srv.socks[i]) != 0)
         {
-            log_msg(LOG_WARNING,
-                "* Incoming packet count limit of %i reached",
-                opts->packet_ctr_limit
-            );
-            break;
+            log_msg(LOG_ERR, "run_udp_server: could not start thread for socket %d", i);
+            rv = -1;
+            goto cleanup;
         }
+        srv.socks[i].started = 1;
+    }
 
-    } /* infinite while loop */
+    /* Expired rules and the like are checked every UDPSERV_SELECT_TIMEOUT,
+     * which also bounds how long a signal can go unnoticed.
+    */
+    if(evloop_add_timer(srv.socks[0].loop, srv.s_timeout, 1,
+                udp_server_housekeeping, &srv) < 0)
+    {
+        rv = -1;
+        goto cleanup;
+    }
+
+    /* Now loop and receive SPA packets
+    */
+    rv = udp_sock_loop(&srv.socks[0], 1);
+
+cleanup:
+    __atomic_store_n(&srv.stop, 1, __ATOMIC_RELEASE);
+    for(i=0; i < srv.nb_socks; i++)
+        if(srv.socks[i].started)
+            evloop_wakeup(srv.socks[i].loop);
+    for(i=0; i < srv.nb_socks; i++)
+    {
+        if(srv.socks[i].started)
+            pthread_join(srv.socks[i].thread, NULL);
+        udp_sock_close(&srv.socks[i]);
+    }
+    free(srv.socks);
 
-    close(s_sock);
     return rv;
 }
 
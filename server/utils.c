@@ -33,6 +33,8 @@
 #include "fw_util.h"
 #include "cmd_cycle.h"
 #include "connection_tracker.h"
+#include "spa_pipeline.h"
+#include "incoming_spa.h"
 
 #include <stdarg.h>
 
@@ -373,14 +375,15 @@ clean_exit(fko_srv_options_t *opts, unsigned int fw_cleanup_flag, unsigned int e
     }
 #endif
 
+    spa_pipeline_stop(opts);
+    free_spa_ctx_arena();
+
     destroy_connection_tracker(opts);
 
     if(!opts->test && opts->enable_fw && (fw_cleanup_flag == FW_CLEANUP))
         fw_cleanup(opts);
 
-#if USE_FILE_CACHE
     free_replay_list(opts);
-#endif
 
     if(opts->ctrl_client != NULL)
     {
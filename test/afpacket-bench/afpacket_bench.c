@@ -0,0 +1,360 @@
+/*
+ * AF_PACKET ring vs. libpcap capture benchmark for fwknopd.
+ *
+ * The frames in a pcap file are replayed onto an interface (as fast as a
+ * child process can inject them with an AF_PACKET socket) while the parent
+ * captures them, first with pcap_open_live() + pcap_dispatch() the way
+ * pcap_capture() did, then with the TPACKET_V3 ring used for
+ * ENABLE_AF_PACKET_RING.  Both capture paths spend the same simulated
+ * per-packet processing cost (-c, in nanoseconds of busy work), so the
+ * difference in packets received and kernel drops shows what each one
+ * loses at a fixed CPU budget.
+ *
+ * Build fwknopd first (with libpcap); the benchmark links against its
+ * afpacket_ring object.  Must be run as root.  Frames are injected on -o
+ * (the capture interface by default) and captured on -i; injected frames
+ * only show up as incoming on the loopback interface or on the far end of
+ * a veth pair:
+ *
+ *   ip link add bench0 type veth peer name bench1
+ *   ip link set bench0 up; ip link set bench1 up
+ *   ./afpacket_bench -i bench1 -o bench0 -r spa.pcap -n 200 -c 2000
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+
+#include "fwknopd_common.h"
+#include "afpacket_ring.h"
+
+#if ! HAVE_AF_PACKET_RING
+  #error "This benchmark needs a libpcap build of fwknopd on Linux"
+#endif
+
+#define DEF_LOOPS       100
+#define DEF_COST_NS     1000
+#define DEF_BLOCKS      32
+#define DRAIN_MS        500
+
+typedef struct frame
+{
+    unsigned int    len;
+    unsigned char  *data;
+} frame_t;
+
+static frame_t         *frames;
+static unsigned int     nb_frames;
+static unsigned long    cost_ns;
+static unsigned long    received;
+static const char      *inject_intf;
+
+static double
+now_secs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* Stand-in for process_packet() + SPA processing: spin for cost_ns.
+*/
+static void
+bench_cb(unsigned char *user, const struct pcap_pkthdr *hdr,
+        const unsigned char *pkt)
+{
+    struct timespec start, cur;
+    long            elapsed;
+
+    received++;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do
+    {
+        clock_gettime(CLOCK_MONOTONIC, &cur);
+        elapsed = (cur.tv_sec - start.tv_sec) * 1000000000L
+            + (cur.tv_nsec - start.tv_nsec);
+    } while(elapsed < (long)cost_ns);
+    return;
+}
+
+static int
+load_frames(const char *file)
+{
+    char                errstr[PCAP_ERRBUF_SIZE] = {0};
+    struct pcap_pkthdr *hdr;
+    const unsigned char *data;
+    pcap_t             *pcap;
+    unsigned int        max = 0;
+
+    if((pcap = pcap_open_offline(file, errstr)) == NULL)
+    {
+        fprintf(stderr, "[-] pcap_open_offline(): %s\n", errstr);
+        return -1;
+    }
+    if(pcap_datalink(pcap) != DLT_EN10MB)
+    {
+        fprintf(stderr, "[-] %s is not an Ethernet capture\n", file);
+        pcap_close(pcap);
+        return -1;
+    }
+
+    while(pcap_next_ex(pcap, &hdr, &data) == 1)
+    {
+        if(nb_frames == max)
+        {
+            max = max ? max * 2 : 256;
+            if((frames = realloc(frames, max * sizeof(frame_t))) == NULL)
+                return -1;
+        }
+        frames[nb_frames].len  = hdr->caplen;
+        frames[nb_frames].data = malloc(hdr->caplen);
+        if(frames[nb_frames].data == NULL)
+            return -1;
+        memcpy(frames[nb_frames].data, data, hdr->caplen);
+        nb_frames++;
+    }
+    pcap_close(pcap);
+
+    return nb_frames > 0 ? 0 : -1;
+}
+
+/* Child process: inject every frame loops times, then exit.
+*/
+static void
+replay(const char *intf, const unsigned int loops)
+{
+    struct sockaddr_ll  sll;
+    unsigned int        i, j;
+    int                 s;
+
+    if((s = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0)
+    {
+        perror("socket");
+        _exit(EXIT_FAILURE);
+    }
+
+    memset(&sll, 0x0, sizeof(sll));
+    sll.sll_family  = AF_PACKET;
+    sll.sll_ifindex = if_nametoindex(intf);
+    sll.sll_halen   = ETH_ALEN;
+
+    for(i=0; i < loops; i++)
+        for(j=0; j < nb_frames; j++)
+            while(sendto(s, frames[j].data, frames[j].len, 0,
+                        (struct sockaddr *)&sll, sizeof(sll)) < 0
+                    && (errno == ENOBUFS || errno == EAGAIN))
+                ;
+
+    close(s);
+    _exit(EXIT_SUCCESS);
+}
+
+static pid_t
+start_replay(const char *intf, const unsigned int loops)
+{
+    pid_t   pid;
+
+    if((pid = fork()) == 0)
+        replay(inject_intf ? inject_intf : intf, loops);
+    return pid;
+}
+
+/* Capture until the sender has finished and the interface has been quiet
+ * for DRAIN_MS.
+*/
+static int
+sender_done(pid_t pid)
+{
+    int     status;
+
+    return waitpid(pid, &status, WNOHANG) == pid;
+}
+
+static void
+report(const char *name, const unsigned long sent, const unsigned int drops,
+        const double secs)
+{
+    printf("%-9s sent %9lu  received %9lu (%5.1f%%)  kernel drops %9u  %10.0f pkts/sec\n",
+        name, sent, received, sent ? 100.0 * received / sent : 0.0,
+        drops, secs > 0 ? received / secs : 0);
+    return;
+}
+
+static int
+run_pcap(const char *intf, const char *filter, const unsigned int loops)
+{
+    char                errstr[PCAP_ERRBUF_SIZE] = {0};
+    struct bpf_program  fp;
+    struct pcap_stat    ps;
+    struct pollfd       pfd;
+    pcap_t             *pcap;
+    double              start, quiet;
+    pid_t               pid;
+    int                 done = 0;
+
+    if((pcap = pcap_open_live(intf, 1500, 0, 100, errstr)) == NULL)
+    {
+        fprintf(stderr, "[-] pcap_open_live(): %s\n", errstr);
+        return -1;
+    }
+    if(filter != NULL)
+    {
+        if(pcap_compile(pcap, &fp, filter, 1, 0) == -1
+                || pcap_setfilter(pcap, &fp) == -1)
+        {
+            fprintf(stderr, "[-] pcap filter: %s\n", pcap_geterr(pcap));
+            return -1;
+        }
+        pcap_freecode(&fp);
+    }
+    pcap_setdirection(pcap, PCAP_D_IN);
+    pcap_setnonblock(pcap, 1, errstr);
+
+    pfd.fd     = pcap_get_selectable_fd(pcap);
+    pfd.events = POLLIN;
+
+    received = 0;
+    start = quiet = now_secs();
+    pid = start_replay(intf, loops);
+
+    while(1)
+    {
+        if(poll(&pfd, 1, 10) > 0)
+            if(pcap_dispatch(pcap, 100, bench_cb, NULL) > 0)
+                quiet = now_secs();
+        if(! done)
+            done = sender_done(pid);
+        if(done && now_secs() - quiet > DRAIN_MS / 1000.0)
+            break;
+    }
+
+    memset(&ps, 0x0, sizeof(ps));
+    pcap_stats(pcap, &ps);
+    report("pcap", (unsigned long)loops * nb_frames, ps.ps_drop,
+        quiet - start);
+    pcap_close(pcap);
+    return 0;
+}
+
+static int
+run_afpacket(const char *intf, const char *filter, const unsigned int loops,
+        const int blocks)
+{
+    afpacket_ring_t    *ring;
+    struct pollfd       pfd;
+    char                errstr[256] = {0};
+    unsigned int        packets = 0, drops = 0;
+    double              start, quiet;
+    pid_t               pid;
+    int                 done = 0;
+
+    if((ring = afpacket_open(intf, 1500, 0, 1, blocks, filter,
+                    errstr, sizeof(errstr))) == NULL)
+    {
+        fprintf(stderr, "[-] afpacket_open(): %s\n", errstr);
+        return -1;
+    }
+
+    pfd.fd     = afpacket_fd(ring);
+    pfd.events = POLLIN;
+
+    /* Reset the kernel counters
+    */
+    afpacket_stats(ring, &packets, &drops);
+
+    received = 0;
+    start = quiet = now_secs();
+    pid = start_replay(intf, loops);
+
+    while(1)
+    {
+        if(poll(&pfd, 1, 10) > 0)
+            if(afpacket_dispatch(ring, blocks, bench_cb, NULL) > 0)
+                quiet = now_secs();
+        if(! done)
+            done = sender_done(pid);
+        if(done && now_secs() - quiet > DRAIN_MS / 1000.0)
+            break;
+    }
+
+    afpacket_stats(ring, &packets, &drops);
+    report("af_packet", (unsigned long)loops * nb_frames, drops,
+        quiet - start);
+    afpacket_close(ring);
+    return 0;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+        "usage: %s -i intf [-o inject_intf] -r pcap_file [-f filter] [-n loops] [-c cost_ns] [-b blocks]\n",
+        prog);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char     *intf = NULL, *file = NULL, *filter = NULL;
+    unsigned int    loops = DEF_LOOPS;
+    int             blocks = DEF_BLOCKS, opt;
+
+    cost_ns = DEF_COST_NS;
+
+    while((opt = getopt(argc, argv, "i:o:r:f:n:c:b:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'i':
+                intf = optarg;
+                break;
+            case 'o':
+                inject_intf = optarg;
+                break;
+            case 'r':
+                file = optarg;
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            case 'n':
+                loops = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                cost_ns = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                blocks = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(intf == NULL || file == NULL || loops == 0 || blocks <= 0)
+        usage(argv[0]);
+
+    if(load_frames(file) != 0)
+        return(EXIT_FAILURE);
+
+    printf("Replaying %u frames x %u onto %s (capturing on %s), %lu ns per packet, filter: %s\n",
+        nb_frames, loops, inject_intf ? inject_intf : intf, intf, cost_ns,
+        filter ? filter : "(none)");
+
+    if(run_pcap(intf, filter, loops) != 0)
+        return(EXIT_FAILURE);
+    if(run_afpacket(intf, filter, loops, blocks) != 0)
+        return(EXIT_FAILURE);
+
+    return(EXIT_SUCCESS);
+}
@@ -0,0 +1,225 @@
+/*
+ * Per-packet cost of the base64 work fwknopd does on an incoming SPA
+ * packet, before and after the SSE2/AVX2 code:
+ *
+ *   preprocess - the MIN/MAX length checks, the base64 alphabet check and
+ *                the decoding of the SDP ID prefix in preprocess_spa_data()
+ *   decode     - b64_decode() of the rest of the packet, as done before
+ *                decryption
+ *
+ * The "before" columns run copies of the original scalar code (is_base64()
+ * with isalnum(), the strndup()+calloc() SDP ID round trip and the scalar
+ * b64_decode() loop); the "after" columns run check_base64() and
+ * b64_decode() from this tree.
+ *
+ *   make && ./b64_bench [-n packets]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "fko_common.h"
+#include "fko_util.h"
+#include "base64.h"
+
+#define DEF_PACKETS         1000000
+#define BENCH_MIN_DATA_SIZE 80      /* MIN_SPA_DATA_SIZE in fwknopd */
+#define BENCH_MAX_PKT_LEN   1500    /* MAX_SPA_PACKET_LEN in fwknopd */
+
+static const int pkt_lens[] = { 128, 256, 384, 512, 1024, 1400 };
+
+static const unsigned char old_map2[] =
+{
+    0x3e, 0xff, 0xff, 0xff, 0x3f, 0x34, 0x35, 0x36,
+    0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x01,
+    0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
+    0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11,
+    0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23,
+    0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b,
+    0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33
+};
+
+static int
+old_b64_decode(const char *in, unsigned char *out)
+{
+    int i, v = 0;
+    unsigned char *dst = out;
+
+    for (i = 0; in[i] && in[i] != '='; i++) {
+        unsigned int index= in[i]-43;
+
+        if (index>=(sizeof(old_map2)/sizeof(old_map2[0])) || old_map2[index] == 0xff)
+            return(-1);
+
+        v = (v << 6) + old_map2[index];
+
+        if (i & 3)
+            *dst++ = v >> (6 - 2 * (i & 3));
+    }
+    *dst = '\0';
+
+    return(dst - out);
+}
+
+static int
+old_is_base64(const unsigned char * const buf, const unsigned short int len)
+{
+    unsigned short int  i;
+
+    for(i=0; i<len; i++)
+        if(!(isalnum(buf[i]) || buf[i] == '/' || buf[i] == '+' || buf[i] == '='))
+            return 0;
+    return 1;
+}
+
+static uint32_t
+old_preprocess(const unsigned char *pkt, const int len)
+{
+    char       *decoded_sdp_id, *encoded_sdp_id;
+    uint32_t    sdp_id = 0;
+
+    if(len < BENCH_MIN_DATA_SIZE || len > BENCH_MAX_PKT_LEN)
+        return 0;
+    if(! old_is_base64(pkt, len))
+        return 0;
+
+    if((decoded_sdp_id = calloc(1, FKO_SDP_ID_SIZE*2)) == NULL)
+        return 0;
+    encoded_sdp_id = strndup((char *)pkt, B64_SDP_ID_STR_LEN);
+    if(1 > old_b64_decode(encoded_sdp_id, (unsigned char *)decoded_sdp_id))
+    {
+        free(encoded_sdp_id);
+        free(decoded_sdp_id);
+        return 0;
+    }
+    free(encoded_sdp_id);
+    memcpy(&sdp_id, decoded_sdp_id, FKO_SDP_ID_SIZE);
+    free(decoded_sdp_id);
+
+    return sdp_id;
+}
+
+static uint32_t
+new_preprocess(const unsigned char *pkt, const int len)
+{
+    char            encoded_sdp_id[B64_SDP_ID_STR_LEN+1];
+    unsigned char   decoded_sdp_id[FKO_SDP_ID_SIZE*2];
+    uint32_t        sdp_id = 0;
+
+    if(check_base64(pkt, len, BENCH_MIN_DATA_SIZE, BENCH_MAX_PKT_LEN) != B64_CHECK_OK)
+        return 0;
+
+    memcpy(encoded_sdp_id, pkt, B64_SDP_ID_STR_LEN);
+    encoded_sdp_id[B64_SDP_ID_STR_LEN] = '\0';
+    if(1 > b64_decode(encoded_sdp_id, decoded_sdp_id))
+        return 0;
+    memcpy(&sdp_id, decoded_sdp_id, FKO_SDP_ID_SIZE);
+
+    return sdp_id;
+}
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+/* Build a packet of len base64 characters that starts with an encoded
+ * SDP ID, like the ones the client sends.
+*/
+static void
+make_packet(char *pkt, const int len)
+{
+    unsigned char   raw[BENCH_MAX_PKT_LEN];
+    char            b64[BENCH_MAX_PKT_LEN*2];
+    uint32_t        sdp_id = 12345;
+    int             i;
+
+    for(i=0; i < (int)sizeof(raw); i++)
+        raw[i] = (unsigned char)(rand() & 0xff);
+    memcpy(raw, &sdp_id, sizeof(sdp_id));
+
+    b64_encode(raw, b64, sizeof(raw));
+    memcpy(pkt, b64, len);
+    pkt[len] = '\0';
+}
+
+int
+main(int argc, char **argv)
+{
+    char            pkt[BENCH_MAX_PKT_LEN+1];
+    unsigned char   out[BENCH_MAX_PKT_LEN];
+    unsigned long   packets = DEF_PACKETS, n, sum = 0;
+    double          start, pre_old, pre_new, dec_old, dec_new;
+    int             l, len, opt;
+
+    while((opt = getopt(argc, argv, "n:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n':
+                packets = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n packets]\n", argv[0]);
+                return(EXIT_FAILURE);
+        }
+    }
+    if(packets == 0)
+        packets = DEF_PACKETS;
+
+    printf("%6s  %24s  %24s\n", "", "preprocess ns/pkt", "decode ns/pkt");
+    printf("%6s  %11s %12s  %11s %12s\n", "bytes", "before", "after",
+        "before", "after");
+
+    for(l=0; l < (int)(sizeof(pkt_lens)/sizeof(pkt_lens[0])); l++)
+    {
+        len = pkt_lens[l];
+        make_packet(pkt, len);
+
+        if(old_preprocess((unsigned char *)pkt, len)
+                    != new_preprocess((unsigned char *)pkt, len)
+                || old_b64_decode(pkt + B64_SDP_ID_STR_LEN, out)
+                    != b64_decode(pkt + B64_SDP_ID_STR_LEN, out))
+        {
+            fprintf(stderr, "[-] results differ at %d bytes\n", len);
+            return(EXIT_FAILURE);
+        }
+
+        start = now_ns();
+        for(n=0; n < packets; n++)
+            sum += old_preprocess((unsigned char *)pkt, len);
+        pre_old = (now_ns() - start) / packets;
+
+        start = now_ns();
+        for(n=0; n < packets; n++)
+            sum += new_preprocess((unsigned char *)pkt, len);
+        pre_new = (now_ns() - start) / packets;
+
+        start = now_ns();
+        for(n=0; n < packets; n++)
+            sum += old_b64_decode(pkt + B64_SDP_ID_STR_LEN, out);
+        dec_old = (now_ns() - start) / packets;
+
+        start = now_ns();
+        for(n=0; n < packets; n++)
+            sum += b64_decode(pkt + B64_SDP_ID_STR_LEN, out);
+        dec_new = (now_ns() - start) / packets;
+
+        printf("%6d  %11.1f %12.1f  %11.1f %12.1f\n", len,
+            pre_old, pre_new, dec_old, dec_new);
+    }
+
+    /* Keep the compiler from dropping the loops
+    */
+    return(sum == 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,312 @@
+/*
+ * Replay (digest) cache benchmark for fwknopd.
+ *
+ * Runs N simulated SPA packets with unique digests through the replay
+ * cache (an is_replay() check followed by add_replay(), which is what
+ * fwknopd does for every accepted packet), followed by a smaller number of
+ * replayed digests.  The same workload is first run against a re-creation
+ * of the original per-packet strategy (open/close the digest file or dbm
+ * on every packet, linear scan for the file cache) so the two rates can be
+ * compared directly.
+ *
+ * Build fwknopd first; the benchmark links against its objects.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "fwknopd_common.h"
+#include "replay_cache.h"
+#include "log_msg.h"
+#include "fwknopd_errors.h"
+
+#if ! USE_FILE_CACHE
+  #if HAVE_LIBGDBM
+    #include <gdbm.h>
+  #elif HAVE_LIBNDBM
+    #include <ndbm.h>
+  #endif
+#endif
+
+#define DEF_PACKETS     20000
+#define DEF_BENCH_FILE  "/tmp/fwknopd_digest_bench.cache"
+
+static void
+make_digest(char *buf, size_t len, unsigned int n)
+{
+    snprintf(buf, len, "%08xBenchDigestOyqv0tF5xG8uhg2iIrheeNKglCWKmxQ", n);
+}
+
+static double
+now_secs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+report(const char *name, unsigned int pkts, double secs)
+{
+    printf("%-10s %8u packets in %8.3fs  %12.0f pkts/sec\n",
+        name, pkts, secs, secs > 0 ? pkts / secs : 0);
+}
+
+/* Re-creation of the original per-packet strategy
+*/
+#if USE_FILE_CACHE
+static int
+legacy_run(const char *file, unsigned int nb, unsigned int replays)
+{
+    char          **list = calloc(nb, sizeof(char *));
+    char            digest[MAX_DIGEST_SIZE+1];
+    unsigned int    i, j, count = 0, found;
+    FILE           *fp;
+
+    if(list == NULL)
+        return(-1);
+
+    for(i=0; i < nb + replays; i++)
+    {
+        make_digest(digest, sizeof(digest), i < nb ? i : i % nb);
+
+        found = 0;
+        for(j=0; j < count; j++)
+            if(constant_runtime_cmp(list[j], digest, strlen(digest)) == 0)
+            {
+                found = 1;
+                break;
+            }
+
+        if(found || i >= nb)
+            continue;
+
+        list[count++] = strdup(digest);
+
+        if((fp = fopen(file, "a")) == NULL)
+            return(-1);
+        fprintf(fp, "%s %d %s %d %s %d %d\n", digest, 17, "127.0.0.1",
+            40000, "127.0.0.1", 62201, (int)time(NULL));
+        fclose(fp);
+    }
+
+    for(j=0; j < count; j++)
+        free(list[j]);
+    free(list);
+
+    return(0);
+}
+#elif HAVE_LIBGDBM || HAVE_LIBNDBM
+static int
+legacy_run(const char *file, unsigned int nb, unsigned int replays)
+{
+#if HAVE_LIBGDBM
+    GDBM_FILE           rpdb;
+#else
+    DBM                *rpdb;
+#endif
+    datum               db_key, db_ent;
+    digest_cache_info_t dc_info;
+    char                digest[MAX_DIGEST_SIZE+1];
+    unsigned int        i;
+
+    for(i=0; i < nb + replays; i++)
+    {
+        make_digest(digest, sizeof(digest), i < nb ? i : i % nb);
+        db_key.dptr  = digest;
+        db_key.dsize = strlen(digest);
+
+        /* is_replay()
+        */
+#if HAVE_LIBGDBM
+        rpdb = gdbm_open((char *)file, 512, GDBM_WRCREAT, S_IRUSR|S_IWUSR, 0);
+#else
+        rpdb = dbm_open((char *)file, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+#endif
+        if(!rpdb)
+            return(-1);
+
+#if HAVE_LIBGDBM
+        db_ent = gdbm_fetch(rpdb, db_key);
+        free(db_ent.dptr);
+        gdbm_close(rpdb);
+#else
+        db_ent = dbm_fetch(rpdb, db_key);
+        dbm_close(rpdb);
+#endif
+        if(db_ent.dptr != NULL)
+            continue;
+
+        /* add_replay()
+        */
+#if HAVE_LIBGDBM
+        rpdb = gdbm_open((char *)file, 512, GDBM_WRCREAT, S_IRUSR|S_IWUSR, 0);
+#else
+        rpdb = dbm_open((char *)file, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+#endif
+        if(!rpdb)
+            return(-1);
+
+        memset(&dc_info, 0x0, sizeof(dc_info));
+        dc_info.created = time(NULL);
+        db_ent.dptr  = (char *)&dc_info;
+        db_ent.dsize = sizeof(dc_info);
+
+#if HAVE_LIBGDBM
+        gdbm_fetch(rpdb, db_key);
+        gdbm_store(rpdb, db_key, db_ent, GDBM_INSERT);
+        gdbm_close(rpdb);
+#else
+        dbm_fetch(rpdb, db_key);
+        dbm_store(rpdb, db_key, db_ent, DBM_INSERT);
+        dbm_close(rpdb);
+#endif
+    }
+    return(0);
+}
+#endif
+
+static int
+current_run(fko_srv_options_t *opts, unsigned int nb, unsigned int replays)
+{
+    char            digest[MAX_DIGEST_SIZE+1];
+    unsigned int    i, missed = 0;
+
+    if(replay_cache_init(opts) < 0)
+        return(-1);
+
+    for(i=0; i < nb; i++)
+    {
+        make_digest(digest, sizeof(digest), i);
+        if(is_replay(opts, &(opts->spa_pkt), digest) != SPA_MSG_SUCCESS
+                || add_replay(opts, &(opts->spa_pkt), digest) != SPA_MSG_SUCCESS)
+            return(-1);
+    }
+
+    for(i=0; i < replays; i++)
+    {
+        make_digest(digest, sizeof(digest), i % nb);
+        if(is_replay(opts, &(opts->spa_pkt), digest) != SPA_MSG_REPLAY)
+            missed++;
+    }
+
+    free_replay_list(opts);
+
+    if(missed > 0)
+    {
+        fprintf(stderr, "[-] %u replays not detected\n", missed);
+        return(-1);
+    }
+    return(0);
+}
+
+static void
+remove_bench_files(const char *file)
+{
+    char    path[MAX_PATH_LEN];
+
+    unlink(file);
+    snprintf(path, sizeof(path), "%s.pag", file);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s.dir", file);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s.db", file);
+    unlink(path);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+        "usage: %s [-n packets] [-s sync_records] [-f bench_file]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+    fko_srv_options_t  *opts = NULL;
+    const char         *file = DEF_BENCH_FILE;
+    const char         *sync_records = DEF_DIGEST_SYNC_RECORDS;
+    unsigned int        nb = DEF_PACKETS, replays;
+    double              start;
+    int                 opt, i;
+
+    while((opt = getopt(argc, argv, "n:s:f:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n':
+                nb = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                sync_records = optarg;
+                break;
+            case 'f':
+                file = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(nb == 0)
+        usage(argv[0]);
+
+    replays = nb / 10 > 0 ? nb / 10 : 1;
+
+    /* Replay warnings would otherwise dominate the run
+    */
+    log_set_verbosity(LOG_ERR);
+
+    printf("Digest cache: %s, %u new packets + %u replays, DIGEST_SYNC_RECORDS=%s\n",
+#if USE_FILE_CACHE
+        "file",
+#else
+        "dbm",
+#endif
+        nb, replays, sync_records);
+
+    remove_bench_files(file);
+    start = now_secs();
+    if(legacy_run(file, nb, replays) != 0)
+    {
+        fprintf(stderr, "[-] legacy run failed\n");
+        return(EXIT_FAILURE);
+    }
+    report("legacy", nb + replays, now_secs() - start);
+    remove_bench_files(file);
+
+    if((opts = calloc(1, sizeof(fko_srv_options_t))) == NULL)
+        return(EXIT_FAILURE);
+
+#if USE_FILE_CACHE
+    opts->config[CONF_DIGEST_FILE]          = strdup(file);
+#else
+    opts->config[CONF_DIGEST_DB_FILE]       = strdup(file);
+#endif
+    opts->config[CONF_ENABLE_SPA_PACKET_AGING]  = strdup(DEF_ENABLE_SPA_PACKET_AGING);
+    opts->config[CONF_MAX_SPA_PACKET_AGE]       = strdup(DEF_MAX_SPA_PACKET_AGE);
+    opts->config[CONF_DIGEST_SYNC_RECORDS]      = strdup(sync_records);
+    opts->config[CONF_DIGEST_SYNC_INTERVAL]     = strdup(DEF_DIGEST_SYNC_INTERVAL);
+
+    start = now_secs();
+    if(current_run(opts, nb, replays) != 0)
+    {
+        fprintf(stderr, "[-] current run failed\n");
+        return(EXIT_FAILURE);
+    }
+    report("current", nb + replays, now_secs() - start);
+    remove_bench_files(file);
+
+    for(i=0; i < NUMBER_OF_CONFIG_ENTRIES; i++)
+        free(opts->config[i]);
+    free(opts);
+
+    return(EXIT_SUCCESS);
+}
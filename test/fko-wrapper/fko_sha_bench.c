@@ -0,0 +1,187 @@
+/*
+ * SHA-2 backend benchmark.  Times SHA-256 and SHA-512 over single messages
+ * and over batches of messages (sha256_mb()/sha512_mb(), which is what
+ * fko_get_raw_spa_digests() uses) with every backend that is available on
+ * this machine.  The message sizes are those of typical SPA packets.  The
+ * digests of all backends are compared against the portable code as well.
+ *
+ * Run ./configure first; the benchmark is built from the libfko sources
+ * since the backend selection is not part of the public libfko API:
+ *
+ *   make sha_bench && ./fko_sha_bench [-n messages]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "sha2_accel.h"
+
+#define DEF_MESSAGES    200000
+#define BATCH           16
+#define MAX_MSG_LEN     1500
+
+static const int msg_lens[] = { 64, 180, 300, 600, MAX_MSG_LEN };
+
+static uint8_t msgs[BATCH][MAX_MSG_LEN];
+
+static double
+now_secs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+hash_one(uint8_t *out, const uint8_t *in, const size_t len, const int sha512)
+{
+    SHA256_CTX  ctx256;
+    SHA512_CTX  ctx512;
+
+    if(sha512)
+    {
+        SHA512_Init(&ctx512);
+        SHA512_Update(&ctx512, in, len);
+        SHA512_Final(out, &ctx512);
+    }
+    else
+    {
+        SHA256_Init(&ctx256);
+        SHA256_Update(&ctx256, in, len);
+        SHA256_Final(out, &ctx256);
+    }
+}
+
+/* Nanoseconds per message, hashed one at a time or BATCH at a time
+*/
+static double
+bench(const int len, const unsigned long messages, const int sha512,
+        const int batched)
+{
+    uint8_t         md[BATCH][SHA512_DIGEST_LEN], *out[BATCH];
+    const uint8_t  *in[BATCH];
+    size_t          lens[BATCH];
+    unsigned long   n;
+    double          start;
+    int             i;
+
+    for(i=0; i < BATCH; i++)
+    {
+        in[i]   = msgs[i];
+        out[i]  = md[i];
+        lens[i] = len;
+    }
+
+    start = now_secs();
+    for(n=0; n < messages; n += BATCH)
+    {
+        if(batched && sha512)
+            sha512_mb(out, in, lens, BATCH, SHA512_DIGEST_LEN);
+        else if(batched)
+            sha256_mb(out, in, lens, BATCH);
+        else
+            for(i=0; i < BATCH; i++)
+                hash_one(md[i], msgs[i], len, sha512);
+    }
+
+    return (now_secs() - start) * 1e9 / n;
+}
+
+static int
+check_backend(const int len)
+{
+    uint8_t         ref[BATCH][SHA512_DIGEST_LEN], md[BATCH][SHA512_DIGEST_LEN];
+    uint8_t        *out[BATCH];
+    const uint8_t  *in[BATCH];
+    size_t          lens[BATCH];
+    int             i, sha512, orig = sha2_backend(), res = 0;
+
+    for(i=0; i < BATCH; i++)
+    {
+        in[i]   = msgs[i];
+        out[i]  = md[i];
+        lens[i] = len;
+    }
+
+    for(sha512=0; sha512 < 2; sha512++)
+    {
+        sha2_set_backend(SHA2_BACKEND_BUILTIN);
+        for(i=0; i < BATCH; i++)
+            hash_one(ref[i], msgs[i], len, sha512);
+
+        sha2_set_backend(orig);
+        if(sha512)
+            sha512_mb(out, in, lens, BATCH, SHA512_DIGEST_LEN);
+        else
+            sha256_mb(out, in, lens, BATCH);
+        for(i=0; i < BATCH; i++)
+            if(memcmp(md[i], ref[i], sha512 ? SHA512_DIGEST_LEN : SHA256_DIGEST_LEN) != 0)
+                res = -1;
+
+        for(i=0; i < BATCH; i++)
+        {
+            hash_one(md[i], msgs[i], len, sha512);
+            if(memcmp(md[i], ref[i], sha512 ? SHA512_DIGEST_LEN : SHA256_DIGEST_LEN) != 0)
+                res = -1;
+        }
+    }
+
+    return res;
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned long   messages = DEF_MESSAGES;
+    int             b, l, i, opt, mismatch = 0;
+
+    while((opt = getopt(argc, argv, "n:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n':
+                messages = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n messages]\n", argv[0]);
+                return(EXIT_FAILURE);
+        }
+    }
+    if(messages == 0)
+        messages = DEF_MESSAGES;
+
+    for(i=0; i < BATCH; i++)
+        for(l=0; l < MAX_MSG_LEN; l++)
+            msgs[i][l] = (uint8_t)(i * 31 + l * 7 + 1);
+
+    printf("%-8s %6s %14s %14s %14s %14s\n", "backend", "bytes",
+        "sha256 ns/msg", "batched", "sha512 ns/msg", "batched");
+
+    for(b=SHA2_BACKEND_BUILTIN; b < SHA2_BACKEND_MAX; b++)
+    {
+        if(sha2_set_backend(b) != 0)
+            continue;
+
+        for(l=0; l < (int)(sizeof(msg_lens)/sizeof(msg_lens[0])); l++)
+        {
+            if(check_backend(msg_lens[l]) != 0)
+            {
+                fprintf(stderr, "[-] %s digests differ from builtin at %d bytes\n",
+                    sha2_backend_name(b), msg_lens[l]);
+                mismatch = 1;
+            }
+
+            printf("%-8s %6d %14.1f %14.1f %14.1f %14.1f\n",
+                sha2_backend_name(b), msg_lens[l],
+                bench(msg_lens[l], messages, 0, 0),
+                bench(msg_lens[l], messages, 0, 1),
+                bench(msg_lens[l], messages, 1, 0),
+                bench(msg_lens[l], messages, 1, 1));
+        }
+    }
+
+    return(mismatch ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,249 @@
+/*
+ * Hash table benchmark for fwknopd.
+ *
+ * Inserts N keys into a table created with the default length fwknopd
+ * uses for its access stanza and service tables, then looks every key up
+ * again.  Each run is made twice: once with growing disabled (max load 0,
+ * the behavior of the original fixed size table) and once with the
+ * default max load, so the insert and lookup rates, the slowest single
+ * insert (which shows the cost of a rehash step) and the resulting chain
+ * lengths can be compared.  Both integer (SDP ID) and bstring keys are
+ * covered.
+ *
+ * The inserts that start or finish a rehash are also timed in thread CPU
+ * time, which leaves out preemption, and the benchmark fails if any of
+ * them takes longer than BENCH_MAX_GROW_OP_US: growing must cost the same
+ * at 10^7 keys as at 10^3.
+ *
+ * Usage: hash_table_bench [max_keys]  (default 10^7, runs 10^3 .. max_keys)
+ *
+ * Build fwknopd first; the benchmark links against its objects.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __GLIBC__
+  #include <malloc.h>
+#endif
+
+#include "hash_table.h"
+#include "bstrlib.h"
+
+#define DEF_MAX_KEYS    10000000
+#define BENCH_TBL_LEN   100
+#define FIXED_MAX_KEYS  100000
+#define BENCH_MAX_GROW_OP_US    500
+
+static double
+now_secs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static double
+cpu_secs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* Give back the memory freed by the previous run before timing, so that
+ * malloc does not bill consolidating it to whichever insert comes first
+*/
+static void
+settle_heap(void)
+{
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+static void
+destroy_node_cb(hash_table_node_t *node)
+{
+    if(node->key != NULL)
+        bdestroy((bstring)node->key);
+}
+
+static void
+report(const char *name, uint32_t max_load, uint32_t nb,
+        double ins_secs, double max_ins, double max_grow, double get_secs,
+        hash_table_t *tbl)
+{
+    hash_table_stats_t  stats;
+    int                 i;
+
+    hash_table_get_stats(tbl, &stats);
+
+    printf("%-4s %-6s %9u keys  insert %8.1f ns/op (worst %9.1f us)"
+        "  lookup %8.1f ns/op  buckets %9u  longest chain %7u\n",
+        name, max_load ? "grow" : "fixed", nb,
+        ins_secs * 1e9 / nb, max_ins * 1e6, get_secs * 1e9 / nb,
+        stats.buckets, stats.max_chain);
+
+    if(max_load)
+        printf("     worst insert starting or finishing a rehash %.1f us cpu\n",
+            max_grow * 1e6);
+
+    printf("     chains:");
+    for(i=0; i < HASH_TABLE_CHAIN_HIST_LEN; i++)
+        printf(" %s%d:%u", i == HASH_TABLE_CHAIN_HIST_LEN-1 ? ">=" : "",
+            i, stats.chain_hist[i]);
+    printf("%s\n", stats.rehashing ? "  (rehash in progress)" : "");
+}
+
+static int
+check_grow(const char *name, uint32_t nb, double max_grow)
+{
+    if(max_grow * 1e6 <= BENCH_MAX_GROW_OP_US)
+        return(0);
+
+    fprintf(stderr, "%s, %u keys: growing took %.1f us in a single insert, over %d us\n",
+        name, nb, max_grow * 1e6, BENCH_MAX_GROW_OP_US);
+    return(-1);
+}
+
+static int
+run_int(uint32_t nb, uint32_t max_load)
+{
+    hash_table_t   *tbl = hash_table_create_int(BENCH_TBL_LEN, destroy_node_cb);
+    double          start, t, c, ins_secs, get_secs, max_ins = 0, max_grow = 0;
+    uint32_t        i, misses = 0;
+    void           *old_buckets;
+
+    if(tbl == NULL)
+        return(-1);
+
+    hash_table_set_max_load(tbl, max_load);
+    settle_heap();
+
+    start = now_secs();
+    for(i=1; i <= nb; i++)
+    {
+        old_buckets = tbl->old_buckets;
+        t = now_secs();
+        c = cpu_secs();
+        if(hash_table_set_int(tbl, i, (void *)(uintptr_t)i) != 0)
+            return(-1);
+        c = cpu_secs() - c;
+        t = now_secs() - t;
+        if(t > max_ins)
+            max_ins = t;
+        if(tbl->old_buckets != old_buckets && c > max_grow)
+            max_grow = c;
+    }
+    ins_secs = now_secs() - start;
+
+    start = now_secs();
+    for(i=1; i <= nb; i++)
+        if(hash_table_get_int(tbl, i) != (void *)(uintptr_t)i)
+            misses++;
+    get_secs = now_secs() - start;
+
+    report("int", max_load, nb, ins_secs, max_ins, max_grow, get_secs, tbl);
+    hash_table_destroy(tbl);
+
+    if(check_grow("int", nb, max_grow) != 0)
+        return(-1);
+
+    return(misses ? -1 : 0);
+}
+
+static int
+run_bstr(uint32_t nb, uint32_t max_load)
+{
+    hash_table_t   *tbl = hash_table_create(BENCH_TBL_LEN, NULL, NULL, destroy_node_cb);
+    bstring        *keys = calloc(nb, sizeof(bstring));
+    double          start, t, c, ins_secs, get_secs, max_ins = 0, max_grow = 0;
+    uint32_t        i, misses = 0;
+    void           *old_buckets;
+
+    if(tbl == NULL || keys == NULL)
+        return(-1);
+
+    hash_table_set_max_load(tbl, max_load);
+
+    /* Keys are created up front so only the table is timed
+    */
+    for(i=0; i < nb; i++)
+        if((keys[i] = bformat("%u", i + 1)) == NULL)
+            return(-1);
+    settle_heap();
+
+    start = now_secs();
+    for(i=0; i < nb; i++)
+    {
+        old_buckets = tbl->old_buckets;
+        t = now_secs();
+        c = cpu_secs();
+        if(hash_table_set(tbl, keys[i], keys[i]) != 0)
+            return(-1);
+        c = cpu_secs() - c;
+        t = now_secs() - t;
+        if(t > max_ins)
+            max_ins = t;
+        if(tbl->old_buckets != old_buckets && c > max_grow)
+            max_grow = c;
+    }
+    ins_secs = now_secs() - start;
+
+    start = now_secs();
+    for(i=0; i < nb; i++)
+        if(hash_table_get(tbl, keys[i]) != keys[i])
+            misses++;
+    get_secs = now_secs() - start;
+
+    report("bstr", max_load, nb, ins_secs, max_ins, max_grow, get_secs, tbl);
+
+    /* The table owns the keys now
+    */
+    hash_table_destroy(tbl);
+    free(keys);
+
+    if(check_grow("bstr", nb, max_grow) != 0)
+        return(-1);
+
+    return(misses ? -1 : 0);
+}
+
+int
+main(int argc, char **argv)
+{
+    uint32_t    max_keys = DEF_MAX_KEYS, nb;
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if(argc > 1)
+        max_keys = strtoul(argv[1], NULL, 10);
+
+    for(nb = 1000; nb <= max_keys; nb *= 10)
+    {
+        /* Fixed size tables degrade to long lists, past 10^5 keys they
+         * take minutes so only the growing tables are run
+        */
+        if(nb <= FIXED_MAX_KEYS && run_int(nb, 0) != 0)
+            goto fail;
+        if(run_int(nb, HASH_TABLE_DEFAULT_MAX_LOAD) != 0)
+            goto fail;
+        if(nb <= FIXED_MAX_KEYS && run_bstr(nb, 0) != 0)
+            goto fail;
+        if(run_bstr(nb, HASH_TABLE_DEFAULT_MAX_LOAD) != 0)
+            goto fail;
+        printf("\n");
+
+        if(nb > max_keys / 10)
+            break;
+    }
+
+    return(0);
+
+fail:
+    fprintf(stderr, "hash table benchmark failed\n");
+    return(1);
+}
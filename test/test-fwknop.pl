@@ -5647,7 +5647,17 @@ sub digest_cache_structure() {
 
     &run_cmd("file $default_digest_file", $cmd_out_tmp, $curr_test_file);
 
-    if (&file_find_regex([qr/ASCII/i], $MATCH_ALL,
+    my $magic = '';
+    if (open D0, "< $default_digest_file") {
+        read D0, $magic, 8;
+        close D0;
+    }
+
+    if ($magic eq 'FWKNOPDC') {
+        ### binary format: header followed by fixed size records
+        &write_test_file("[+] binary digest file format.\n",
+            $curr_test_file);
+    } elsif (&file_find_regex([qr/ASCII/i], $MATCH_ALL,
             $APPEND_RESULTS, $cmd_out_tmp)) {
 
         ### the format should be: